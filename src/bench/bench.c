@@ -0,0 +1,306 @@
+/*
+ * End to end throughput of the downloader against the stand-in server,
+ * over loopback, for every protocol, file size and part count asked for.
+ * The options after -- are passed to the stand-in to shape the network.
+ * Then scattered ranges are fetched from stand-ins answering a list of
+ * ranges each way a server may, every byte checked against the pattern.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "downloader.h"
+#include "harness.h"
+
+#define USAGE_STR "Usage: bench [-s SIZES] [-p PARTS] [-n RUNS] [-P http|ftp|both] [-t SECONDS] [-- STANDIN OPTIONS]\n" \
+                  "-s SIZES       file sizes, 1M,16M,128M by default\n"                    \
+                  "-p PARTS       part counts, 1,4,15 by default\n"                        \
+                  "-n RUNS        downloads of every size and part count, 5 by default\n"  \
+                  "-P PROTOCOLS   http, ftp or both, the default\n"                       \
+                  "-t SECONDS     longest a download may take, 300 by default\n"
+
+#define MAX_LIST_LEN       16
+#define MAX_RUNS           1000
+#define MB                 (1024.0 * 1024)
+#define GB                 (1024.0 * 1024 * 1024)
+#define RANGES_FILE        "4M"
+#define NUM_RANGES         6
+#define NUM_RANGE_MODES    4
+
+// two ranges closer than the merge gap, one over two periods, one from the end
+static const int range_spec[NUM_RANGES][2] = {
+	{ 0, 100 }, { 70000, 200000 }, { 270100, 5000 }, { 1048579, PATTERN_PERIOD * 2 + 7 },
+	{ 2097152, 1 }, { -4096, 4096 },
+};
+
+// how the stand-in answers a list of ranges, and its options for that
+static const char *range_modes[NUM_RANGE_MODES][3] = {
+	{ "multipart", "-m", NULL },    // multipart/byteranges
+	{ "merged",    "-M", NULL },    // one 206 over all of them
+	{ "single",    NULL, NULL },    // a 200 to If-Range, then a range a request
+	{ "whole",     "-n", "-v" },    // a 200 without validators, read from its start
+};
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond   = PTHREAD_COND_INITIALIZER;
+static int done;
+
+static void *_finished(void *arg)
+{
+	pthread_mutex_lock(&done_mutex);
+	done = 1;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_mutex);
+	return NULL;
+}
+
+static double _cpu_seconds()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// read and write syscalls of the whole process, what the kernel counts of them
+static long long _rw_syscalls()
+{
+	char line[128];
+	long long n, total = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "syscr: %lld", &n) == 1 || sscanf(line, "syscw: %lld", &n) == 1)
+			total += n;
+	}
+	fclose(fp);
+	return total;
+}
+
+// the len bytes of buf are the pattern's from off on
+static int _matches(const char *buf, long long off, int len)
+{
+	int n;
+	for (; len > 0; buf += n, off += n, len -= n)
+	{
+		n = len < PATTERN_PERIOD ? len : PATTERN_PERIOD;
+		if (memcmp(buf, pattern_at(off), n) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+// fetch range_spec from the stand-in on port, 1 if every buf and file_name hold the pattern
+static int _fetch_ranges(downloader *der, int port, const char *file_name)
+{
+	d_range_t ranges[NUM_RANGES];
+	char url[256], *file_buf;
+	int fd = -1, ok, i;
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s", port, RANGES_FILE);
+	for (i = 0; i < NUM_RANGES; i++)
+	{
+		ranges[i].offset = range_spec[i][0];
+		ranges[i].length = range_spec[i][1];
+		ranges[i].buf    = (char *)calloc(1, ranges[i].length);
+	}
+	ok = easy_downloader_fetch_ranges(der, url, ranges, NUM_RANGES, file_name) == 0 &&
+			(fd = open(file_name, O_RDONLY)) >= 0;
+	for (i = 0; i < NUM_RANGES; i++)
+	{
+		// a negative offset came back counted from the start
+		file_buf = ok ? (char *)malloc(ranges[i].length) : NULL;
+		ok = ok && ranges[i].buf && file_buf && _matches(ranges[i].buf, ranges[i].offset, ranges[i].length) &&
+				pread(fd, file_buf, ranges[i].length, ranges[i].offset) == ranges[i].length &&
+				_matches(file_buf, ranges[i].offset, ranges[i].length);
+		free(file_buf);
+		free(ranges[i].buf);
+	}
+	if (fd >= 0)
+		close(fd);
+	unlink(file_name);
+	return ok;
+}
+
+static int _parse_list(char *s, char items[MAX_LIST_LEN][16])
+{
+	char *tok, *save;
+	int n = 0;
+	for (tok = strtok_r(s, ",", &save); tok && n < MAX_LIST_LEN; tok = strtok_r(NULL, ",", &save))
+		snprintf(items[n++], 16, "%s", tok);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	char sizes_str[256] = "1M,16M,128M", parts_str[256] = "1,4,15";
+	char sizes[MAX_LIST_LEN][16], parts[MAX_LIST_LEN][16];
+	char scratch[] = "/tmp/edbench.XXXXXX";
+	char out_dir[PATH_MAX], self[PATH_MAX];
+	const char *protos[2];
+	double times[MAX_RUNS];
+	int nsizes, nparts, nprotos = 0, runs = 5, timeout = 300, opt, i, j, k, r;
+	int port = 20000 + getpid() % 20000;
+	downloader *der;
+	pid_t server;
+	FILE *report;
+
+	protos[nprotos++] = "http";
+	protos[nprotos++] = "ftp";
+	while ((opt = getopt(argc, argv, "s:p:n:P:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': snprintf(sizes_str, sizeof(sizes_str), "%s", optarg); break;
+			case 'p': snprintf(parts_str, sizeof(parts_str), "%s", optarg); break;
+			case 'n': runs    = atoi(optarg); break;
+			case 't': timeout = atoi(optarg); break;
+			case 'P':
+				nprotos = 0;
+				if (strcmp(optarg, "ftp") != 0)
+					protos[nprotos++] = "http";
+				if (strcmp(optarg, "http") != 0)
+					protos[nprotos++] = "ftp";
+				break;
+			default:
+				fprintf(stderr, USAGE_STR);
+				return EXIT_FAILURE;
+		}
+	}
+	nsizes = _parse_list(sizes_str, sizes);
+	nparts = _parse_list(parts_str, parts);
+	if (runs < 1 || runs > MAX_RUNS || nsizes == 0 || nparts == 0)
+	{
+		fprintf(stderr, USAGE_STR);
+		return EXIT_FAILURE;
+	}
+
+	// the downloader changes the working directory, the stand-ins started later need a full path
+	if (!realpath(argv[0], self) || (server = _start_standin(self, port, argv + optind, argc - optind)) < 0)
+		return EXIT_FAILURE;
+
+	// the downloader keeps its db and tmp files in the scratch home
+	if (!mkdtemp(scratch))
+	{
+		perror("bench: mkdtemp");
+		kill(server, SIGTERM);
+		return EXIT_FAILURE;
+	}
+	setenv("HOME", scratch, 1);
+	snprintf(out_dir, PATH_MAX, "%s/out", scratch);
+	mkdir(out_dir, S_IRWXU);
+
+	// the report keeps stdout, the downloader's chatter does not
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+	pattern_init();
+	if (!(der = easy_downloader_init()))
+	{
+		kill(server, SIGTERM);
+		return EXIT_FAILURE;
+	}
+	easy_downloader_set_log_level(der, D_LOG_WARN);
+
+	fprintf(report, "%-5s %8s %5s %6s %9s %9s %11s %8s %8s %8s\n", "proto", "size", "parts", "ok",
+			"MB/s", "cpu_s/GB", "rw_calls/MB", "p50_s", "p99_s", "max_s");
+	for (i = 0; i < nprotos; i++)
+	{
+		for (j = 0; j < nsizes; j++)
+		{
+			long long size = _parse_size(sizes[j]);
+			for (k = 0; k < nparts; k++)
+			{
+				char url[256], file_name[PATH_MAX];
+				double wall = 0, cpu, ok_bytes = 0;
+				long long calls;
+				int ok = 0;
+
+				snprintf(url, sizeof(url), "%s://127.0.0.1:%d/%s", protos[i], strcmp(protos[i], "http") == 0 ?
+						port : port + 1, sizes[j]);
+				snprintf(file_name, PATH_MAX, "%s/%s", out_dir, sizes[j]);
+				easy_downloader_set_max_parts(der, atoi(parts[k]));
+
+				cpu   = _cpu_seconds();
+				calls = _rw_syscalls();
+				for (r = 0; r < runs; r++)
+				{
+					struct timespec deadline;
+					double start = _now();
+
+					done = 0;
+					easy_downloader_add_task(der, url, out_dir, NULL, _finished, NULL);
+					clock_gettime(CLOCK_REALTIME, &deadline);
+					deadline.tv_sec += timeout;
+					pthread_mutex_lock(&done_mutex);
+					while (!done && pthread_cond_timedwait(&done_cond, &done_mutex, &deadline) != ETIMEDOUT)
+						;
+					pthread_mutex_unlock(&done_mutex);
+					if (!done)
+					{
+						fprintf(stderr, "bench: %s took more than %d seconds\n", url, timeout);
+						kill(server, SIGTERM);
+						return EXIT_FAILURE;
+					}
+					times[r] = _now() - start;
+					wall    += times[r];
+					if (_verify(file_name, size))
+					{
+						ok++;
+						ok_bytes += size;
+					}
+					unlink(file_name);
+				}
+				cpu   = _cpu_seconds() - cpu;
+				calls = _rw_syscalls() - calls;
+				qsort(times, runs, sizeof(double), _double_cmp);
+				fprintf(report, "%-5s %8s %5s %3d/%-2d %9.1f %9.2f %11.1f %8.3f %8.3f %8.3f\n", protos[i], sizes[j],
+						parts[k], ok, runs, ok_bytes / MB / wall, ok_bytes > 0 ? cpu / (ok_bytes / GB) : 0,
+						ok_bytes > 0 ? calls / (ok_bytes / MB) : 0, times[(runs - 1) / 2],
+						times[(runs * 99 + 99) / 100 - 1], times[runs - 1]);
+				fflush(report);
+			}
+		}
+	}
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+
+	fprintf(report, "\n%-9s %3s %8s\n", "ranges", "ok", "time_s");
+	for (i = 0; i < NUM_RANGE_MODES; i++)
+	{
+		char file_name[PATH_MAX];
+		char *opts[2];
+		double start;
+		int nopts = 0, ok, mode_port = port + 2 + i * 2;
+
+		if (range_modes[i][1])
+			opts[nopts++] = (char *)range_modes[i][1];
+		if (range_modes[i][2])
+			opts[nopts++] = (char *)range_modes[i][2];
+		if ((server = _start_standin(self, mode_port, opts, nopts)) < 0)
+			return EXIT_FAILURE;
+		snprintf(file_name, PATH_MAX, "%s/ranges", out_dir);
+		start = _now();
+		ok    = _fetch_ranges(der, mode_port, file_name);
+		fprintf(report, "%-9s %3s %8.3f\n", range_modes[i][0], ok ? "yes" : "no", _now() - start);
+		fflush(report);
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+
+	easy_downloader_destroy(der);
+	nftw(scratch, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * What the bench and the torture harness share: timing, sizes, checking a
+ * downloaded file against the pattern, and running the stand-in server.
+ */
+#ifndef __HARNESS_H__
+#define __HARNESS_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pattern.h"
+
+#define MAX_STANDIN_ARGS   64
+
+static double _now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long _parse_size(const char *s)
+{
+	char *end;
+	long long size = strtoll(s, &end, 10);
+	switch (*end)
+	{
+		case 'G': size <<= 10;    // fall through
+		case 'M': size <<= 10;    // fall through
+		case 'K': size <<= 10;
+	}
+	return size;
+}
+
+// the file holds the pattern, and nothing else
+static int _verify(const char *file_name, long long size)
+{
+	static char buf[PATTERN_PERIOD];
+	long long off = 0;
+	int fd, n;
+	struct stat sb;
+
+	if ((fd = open(file_name, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &sb) != 0 || sb.st_size != size)
+	{
+		close(fd);
+		return 0;
+	}
+	while (off < size && (n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		if (memcmp(buf, pattern_at(off), n) != 0)
+			break;
+		off += n;
+	}
+	close(fd);
+	return off == size;
+}
+
+static int _remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static int _double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int _connect_local(int port)
+{
+	struct sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int _wait_listening(int port)
+{
+	int i, fd;
+
+	for (i = 0; i < 200; i++)
+	{
+		if ((fd = _connect_local(port)) >= 0)
+		{
+			close(fd);
+			return 0;
+		}
+		usleep(10000);
+	}
+	return -1;
+}
+
+/*
+ * Run the stand-in next to argv0 on port for http and port + 1 for ftp,
+ * with the extra options, and wait for it to listen. Its pid, or -1.
+ */
+static pid_t _start_standin(const char *argv0, int port, char **opts, int nopts)
+{
+	char self[PATH_MAX], standin[PATH_MAX];
+	char http_port[8], ftp_port[8];
+	char *argv[MAX_STANDIN_ARGS];
+	int i, n = 0;
+	pid_t pid;
+
+	snprintf(self, PATH_MAX, "%s", argv0);
+	snprintf(standin, PATH_MAX, "%s/standin", dirname(self));
+	snprintf(http_port, sizeof(http_port), "%d", port);
+	snprintf(ftp_port, sizeof(ftp_port), "%d", port + 1);
+	argv[n++] = standin;
+	argv[n++] = "-p";
+	argv[n++] = http_port;
+	argv[n++] = "-f";
+	argv[n++] = ftp_port;
+	for (i = 0; i < nopts && n < MAX_STANDIN_ARGS - 1; i++)
+		argv[n++] = opts[i];
+	argv[n] = NULL;
+	if ((pid = fork()) == 0)
+	{
+		execv(standin, argv);
+		perror("exec standin");
+		_exit(EXIT_FAILURE);
+	}
+	if (pid < 0 || _wait_listening(port) != 0 || _wait_listening(port + 1) != 0)
+	{
+		fprintf(stderr, "the stand-in server did not start\n");
+		if (pid > 0)
+			kill(pid, SIGTERM);
+		return -1;
+	}
+	return pid;
+}
+
+// body bytes the stand-in on port has sent so far, -1 if it did not say
+static long long _standin_sent(int port)
+{
+	char buf[512], *body;
+	long long sent = -1;
+	int fd, len = 0, n;
+
+	if ((fd = _connect_local(port)) < 0)
+		return -1;
+	if (write(fd, "GET /stats HTTP/1.0\r\n\r\n", 23) == 23)
+	{
+		while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+			len += n;
+		buf[len] = '\0';
+		if ((body = strstr(buf, "\r\n\r\n")))
+			sscanf(body + 4, "%lld", &sent);
+	}
+	close(fd);
+	return sent;
+}
+
+#endif
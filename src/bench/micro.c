@@ -0,0 +1,475 @@
+/*
+ * Microbenchmarks of the disk and parsing hot spots: merging part files,
+ * with merge_files and the ways it could be done instead, writing a part
+ * through stdio at several buffer sizes, and parsing urls and headers.
+ * Every case is run a few times after a warm up, the median is reported,
+ * with the spread of the runs to tell a stable number from noise.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "downloader_imp.h"
+#include "harness.h"
+
+#define USAGE_STR "Usage: micro [-s SIZES] [-p PARTS] [-w SIZE] [-n RUNS] [-t SECONDS] [-d DIR] [-j FILE]\n" \
+                  "-s SIZES       merged file sizes, 16M,256M by default\n"                          \
+                  "-p PARTS       part counts, 1,4,15 by default\n"                                  \
+                  "-w SIZE        bytes written by a part writer, 64M by default\n"                 \
+                  "-n RUNS        timed runs of every case, 7 by default\n"                          \
+                  "-t SECONDS     shortest run of the parsing cases, 0.2 by default\n"               \
+                  "-d DIR         where the files go, /var/tmp by default\n"                         \
+                  "-j FILE        also write the results as json to FILE, - for stdout\n"
+
+#define MAX_LIST_LEN       16
+#define MAX_RUNS           100
+#define MAX_RESULTS        256
+#define COPY_BUFFER_LEN    (1024 * 1024)
+#define GB                 (1024.0 * 1024 * 1024)
+
+typedef struct _result
+{
+	char   name[64];
+	double ns_per_op;       // median of the runs
+	double gb_per_s;        // bytes per op at the median, 0 if it is not about bytes
+	double spread;          // (max - min) / median of the runs
+	int    runs;
+}result_t;
+
+// one timed run of ops operations, its seconds, < 0 if it failed
+typedef double (*run_fn)(void *ctx, long long ops);
+
+static result_t results[MAX_RESULTS];
+static int nresults;
+static FILE *table;         // stderr when the json goes to stdout
+static int runs = 7;
+static double min_run_time = 0.2;
+
+static int _parse_list(char *s, char items[MAX_LIST_LEN][16])
+{
+	char *tok, *save;
+	int n = 0;
+	for (tok = strtok_r(s, ",", &save); tok && n < MAX_LIST_LEN; tok = strtok_r(NULL, ",", &save))
+		snprintf(items[n++], 16, "%s", tok);
+	return n;
+}
+
+/*
+ * Run fn once to warm up, then runs times, of ops operations each. With
+ * ops 0 it is grown first until a run takes min_run_time.
+ */
+static int _measure(const char *name, long long bytes_per_op, run_fn fn, void *ctx, long long ops)
+{
+	double ns[MAX_RUNS], secs;
+	result_t *res;
+	int i;
+
+	if (ops == 0)
+	{
+		for (ops = 1; (secs = fn(ctx, ops)) >= 0 && secs < min_run_time; ops *= 2)
+			;
+	}
+	else
+		secs = fn(ctx, ops);
+	if (secs < 0)
+	{
+		fprintf(stderr, "micro: %s failed\n", name);
+		return -1;
+	}
+	for (i = 0; i < runs; i++)
+	{
+		if ((secs = fn(ctx, ops)) < 0)
+		{
+			fprintf(stderr, "micro: %s failed\n", name);
+			return -1;
+		}
+		ns[i] = secs * 1e9 / ops;
+	}
+	qsort(ns, runs, sizeof(double), _double_cmp);
+
+	if (nresults == MAX_RESULTS)
+		return -1;
+	res = &results[nresults++];
+	snprintf(res->name, sizeof(res->name), "%s", name);
+	res->ns_per_op = ns[runs / 2];
+	res->gb_per_s  = bytes_per_op > 0 ? bytes_per_op / res->ns_per_op * 1e9 / GB : 0;
+	res->spread    = (ns[runs - 1] - ns[0]) / res->ns_per_op;
+	res->runs      = runs;
+	fprintf(table, "%-36s %14.1f %8.3f %7.1f%%\n", res->name, res->ns_per_op, res->gb_per_s, res->spread * 100);
+	fflush(table);
+	return 0;
+}
+
+static int _write_pattern(int fd, long long off, long long len)
+{
+	int n;
+	while (len > 0)
+	{
+		n = len < PATTERN_PERIOD ? len : PATTERN_PERIOD;
+		if (write(fd, pattern_at(off), n) != n)
+			return -1;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* merging */
+
+typedef struct _merge_ctx
+{
+	char dst[PATH_MAX];
+	char srcs[MAX_PART_NUMBER][PATH_MAX];
+	int  lens[MAX_PART_NUMBER];
+	int  nsrcs;
+	long long size;
+	int  (*merge)(struct _merge_ctx *m);
+}merge_ctx_t;
+
+// the part files of the pattern and an empty destination, as a download leaves them
+static int _merge_setup(merge_ctx_t *m)
+{
+	long long off = 0;
+	int i, fd;
+
+	for (i = 0; i < m->nsrcs; i++)
+	{
+		m->lens[i] = i < m->nsrcs - 1 ? m->size / m->nsrcs : m->size - off;
+		if ((fd = open(m->srcs[i], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0 ||
+				_write_pattern(fd, off, m->lens[i]) != 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+		off += m->lens[i];
+	}
+	if ((fd = open(m->dst, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+		return -1;
+	close(fd);
+	return 0;
+}
+
+static int _merge_mmap(merge_ctx_t *m)
+{
+	int lens[MAX_PART_NUMBER];
+	memcpy(lens, m->lens, sizeof(lens));
+	return merge_files(m->dst, m->size, m->srcs, lens, m->nsrcs, NULL);
+}
+
+static int _merge_copy_file_range(merge_ctx_t *m)
+{
+	loff_t in, out = 0;
+	int i, src, dst;
+
+	if ((dst = open(m->dst, O_WRONLY)) < 0)
+		return -1;
+	for (i = 0; i < m->nsrcs; i++)
+	{
+		if ((src = open(m->srcs[i], O_RDONLY)) < 0)
+			break;
+		in = 0;
+		while (in < m->lens[i] && copy_file_range(src, &in, dst, &out, m->lens[i] - in, 0) > 0)
+			;
+		close(src);
+		if (in < m->lens[i])
+			break;
+		unlink(m->srcs[i]);
+	}
+	close(dst);
+	return i == m->nsrcs ? 0 : -1;
+}
+
+static int _merge_pwrite(merge_ctx_t *m)
+{
+	static char buf[COPY_BUFFER_LEN];
+	long long off = 0;
+	int i, src, dst, n;
+
+	if ((dst = open(m->dst, O_WRONLY)) < 0)
+		return -1;
+	for (i = 0; i < m->nsrcs; i++)
+	{
+		if ((src = open(m->srcs[i], O_RDONLY)) < 0)
+			break;
+		while ((n = read(src, buf, sizeof(buf))) > 0 && pwrite(dst, buf, n, off) == n)
+			off += n;
+		close(src);
+		if (n != 0)
+			break;
+		unlink(m->srcs[i]);
+	}
+	close(dst);
+	return i == m->nsrcs ? 0 : -1;
+}
+
+// setting up the part files is not timed, one op is one merge
+static double _merge_run(void *ctx, long long ops)
+{
+	merge_ctx_t *m = (merge_ctx_t *)ctx;
+	double start, secs = 0;
+	long long i;
+
+	for (i = 0; i < ops; i++)
+	{
+		if (_merge_setup(m) != 0)
+			return -1;
+		start = _now();
+		if (m->merge(m) != 0)
+			return -1;
+		secs += _now() - start;
+		if (!_verify(m->dst, m->size))
+			return -1;
+	}
+	return secs;
+}
+
+/* part writers */
+
+typedef struct _writer_ctx
+{
+	char file_name[PATH_MAX];
+	long long size;
+	int  chunk;             // bytes a read from the socket hands over
+	int  buffer;            // the stdio buffer, 0 for the default, < 0 for write(2) itself
+}writer_ctx_t;
+
+// a part's tmp file as the tmp sink writes it, fopen "a" and fwrite of every read
+static double _writer_run(void *ctx, long long ops)
+{
+	writer_ctx_t *w = (writer_ctx_t *)ctx;
+	char *vbuf = NULL;
+	double start, secs = 0;
+	long long i, off;
+	FILE *fp;
+	int fd, n;
+
+	for (i = 0; i < ops; i++)
+	{
+		unlink(w->file_name);
+		start = _now();
+		if (w->buffer < 0)
+		{
+			if ((fd = open(w->file_name, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) < 0)
+				return -1;
+			for (off = 0; off < w->size; off += n)
+			{
+				n = w->size - off < w->chunk ? w->size - off : w->chunk;
+				if (write(fd, pattern_at(off), n) != n)
+					break;
+			}
+			close(fd);
+		}
+		else
+		{
+			if (!(fp = fopen(w->file_name, "a")))
+				return -1;
+			if (w->buffer > 0 && (vbuf = malloc(w->buffer)))
+				setvbuf(fp, vbuf, _IOFBF, w->buffer);
+			for (off = 0; off < w->size; off += n)
+			{
+				n = w->size - off < w->chunk ? w->size - off : w->chunk;
+				if (fwrite(pattern_at(off), 1, n, fp) != n)
+					break;
+			}
+			fclose(fp);
+			free(vbuf);
+			vbuf = NULL;
+		}
+		secs += _now() - start;
+		if (off < w->size)
+			return -1;
+	}
+	unlink(w->file_name);
+	return secs;
+}
+
+/* parsing */
+
+static const char *sample_urls[] = {
+	"http://127.0.0.1:8080/64M",
+	"https://mirror.example.org/pub/linux/kernel/v6.x/linux-6.9.tar.xz",
+	"ftp://ftp.example.org:2121/pub/some/deep/directory/tree/archive-2025.01.01.tar.gz",
+	"http://cdn.example.com/a/b/c/file.bin?token=0123456789abcdef&expires=1735689600",
+};
+
+static const char sample_header[] =
+	"HTTP/1.1 206 Partial Content\r\n"
+	"Date: Wed, 01 Jan 2025 00:00:00 GMT\r\n"
+	"Server: Apache/2.4.62 (Unix)\r\n"
+	"Last-Modified: Wed, 01 Jan 2025 00:00:00 GMT\r\n"
+	"ETag: \"4000000-62a5b3c9d4e00\"\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Content-Length: 4194304\r\n"
+	"Cache-Control: max-age=86400\r\n"
+	"Content-Range: bytes 62914560-67108863/67108864\r\n"
+	"Keep-Alive: timeout=5, max=100\r\n"
+	"Connection: Keep-Alive\r\n"
+	"Content-Type: application/octet-stream\r\n"
+	"\r\n";
+
+static volatile int sink_value;
+
+static double _parse_url_run(void *ctx, long long ops)
+{
+	d_url_t d_url;
+	double start = _now();
+	long long i;
+	int n = sizeof(sample_urls) / sizeof(sample_urls[0]);
+
+	for (i = 0; i < ops; i++)
+	{
+		if (parse_url(sample_urls[i % n], &d_url) < 0)
+			return -1;
+		sink_value += d_url.proto;
+	}
+	return _now() - start;
+}
+
+// what a part request looks up in a response, one op is the four of them
+static double _header_run(void *ctx, long long ops)
+{
+	char value[256];
+	double start = _now();
+	long long i;
+
+	for (i = 0; i < ops; i++)
+	{
+		if (http_header_value(sample_header, "Content-Length", value, sizeof(value)) != 0 ||
+				http_header_value(sample_header, "Content-Range", value, sizeof(value)) != 0 ||
+				http_header_value(sample_header, "ETag", value, sizeof(value)) != 0 ||
+				http_header_value(sample_header, "Last-Modified", value, sizeof(value)) != 0)
+			return -1;
+		sink_value += value[0];
+	}
+	return _now() - start;
+}
+
+static void _write_json(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "{\n  \"benchmarks\": [\n");
+	for (i = 0; i < nresults; i++)
+		fprintf(fp, "    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"gb_per_s\": %.4f, \"spread\": %.4f, \"runs\": %d}%s\n",
+				results[i].name, results[i].ns_per_op, results[i].gb_per_s, results[i].spread, results[i].runs,
+				i < nresults - 1 ? "," : "");
+	fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char sizes_str[256] = "16M,256M", parts_str[256] = "1,4,15", write_str[16] = "64M";
+	char sizes[MAX_LIST_LEN][16], parts[MAX_LIST_LEN][16];
+	char dir_tmpl[PATH_MAX], name[64];
+	const char *dir = "/var/tmp", *json = NULL;
+	static const struct { const char *name; int (*merge)(merge_ctx_t *m); } merges[] = {
+		{ "mmap", _merge_mmap },
+		{ "copy_file_range", _merge_copy_file_range },
+		{ "pwrite", _merge_pwrite },
+	};
+	static const int chunks[]  = { 1024, 1024 * 16, 1024 * 128 };
+	static const int buffers[] = { -1, 0, 1024 * 64, 1024 * 1024 };
+	int nsizes, nparts, opt, i, j, k, failed = 0;
+	merge_ctx_t merge;
+	writer_ctx_t writer;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "s:p:w:n:t:d:j:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': snprintf(sizes_str, sizeof(sizes_str), "%s", optarg); break;
+			case 'p': snprintf(parts_str, sizeof(parts_str), "%s", optarg); break;
+			case 'w': snprintf(write_str, sizeof(write_str), "%s", optarg); break;
+			case 'n': runs         = atoi(optarg); break;
+			case 't': min_run_time = atof(optarg); break;
+			case 'd': dir          = optarg; break;
+			case 'j': json         = optarg; break;
+			default:
+				fprintf(stderr, USAGE_STR);
+				return EXIT_FAILURE;
+		}
+	}
+	nsizes = _parse_list(sizes_str, sizes);
+	nparts = _parse_list(parts_str, parts);
+	if (runs < 1 || runs > MAX_RUNS || nsizes == 0 || nparts == 0 || _parse_size(write_str) <= 0)
+	{
+		fprintf(stderr, USAGE_STR);
+		return EXIT_FAILURE;
+	}
+	snprintf(dir_tmpl, PATH_MAX, "%s/edmicro.XXXXXX", dir);
+	if (!mkdtemp(dir_tmpl))
+	{
+		perror("micro: mkdtemp");
+		return EXIT_FAILURE;
+	}
+	pattern_init();
+
+	table = json && strcmp(json, "-") == 0 ? stderr : stdout;
+	fprintf(table, "%-36s %14s %8s %8s\n", "case", "ns/op", "GB/s", "spread");
+	for (i = 0; i < nsizes; i++)
+	{
+		for (j = 0; j < nparts; j++)
+		{
+			memset(&merge, 0, sizeof(merge));
+			merge.size  = _parse_size(sizes[i]);
+			merge.nsrcs = atoi(parts[j]);
+			if (merge.nsrcs < 1 || merge.nsrcs > MAX_PART_NUMBER || merge.size < merge.nsrcs || merge.size > INT_MAX)
+				continue;
+			snprintf(merge.dst, PATH_MAX, "%s/merged", dir_tmpl);
+			for (k = 0; k < merge.nsrcs; k++)
+				snprintf(merge.srcs[k], PATH_MAX, "%s/._tmp_%d", dir_tmpl, k);
+			for (k = 0; k < sizeof(merges) / sizeof(merges[0]); k++)
+			{
+				merge.merge = merges[k].merge;
+				snprintf(name, sizeof(name), "merge/%s/%sx%s", merges[k].name, parts[j], sizes[i]);
+				failed |= _measure(name, merge.size, _merge_run, &merge, 1);
+			}
+			unlink(merge.dst);
+		}
+	}
+
+	memset(&writer, 0, sizeof(writer));
+	writer.size = _parse_size(write_str);
+	snprintf(writer.file_name, PATH_MAX, "%s/._tmp_0", dir_tmpl);
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+	{
+		for (j = 0; j < sizeof(buffers) / sizeof(buffers[0]); j++)
+		{
+			writer.chunk  = chunks[i];
+			writer.buffer = buffers[j];
+			if (buffers[j] < 0)
+				snprintf(name, sizeof(name), "write/%dK/write", chunks[i] / 1024);
+			else if (buffers[j] == 0)
+				snprintf(name, sizeof(name), "write/%dK/fwrite_default", chunks[i] / 1024);
+			else
+				snprintf(name, sizeof(name), "write/%dK/fwrite_%dK", chunks[i] / 1024, buffers[j] / 1024);
+			failed |= _measure(name, writer.size, _writer_run, &writer, 1);
+		}
+	}
+
+	failed |= _measure("parse/parse_url", 0, _parse_url_run, NULL, 0);
+	failed |= _measure("parse/http_header_value_x4", sizeof(sample_header) - 1, _header_run, NULL, 0);
+
+	rmdir(dir_tmpl);
+	if (json)
+	{
+		if (!(fp = strcmp(json, "-") == 0 ? stdout : fopen(json, "w")))
+		{
+			perror("micro: open json");
+			return EXIT_FAILURE;
+		}
+		_write_json(fp);
+		if (fp != stdout)
+			fclose(fp);
+	}
+	return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __BENCH_PATTERN_H__
+#define __BENCH_PATTERN_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The content of every file the stand-in serves: byte off is
+ * pattern[off % PATTERN_PERIOD]. The period is prime, so bytes which land
+ * at a wrong offset are told apart. pattern holds two periods, any run of
+ * up to PATTERN_PERIOD bytes is contiguous in it.
+ */
+#define PATTERN_PERIOD     65521
+
+static unsigned char pattern[PATTERN_PERIOD * 2];
+
+static void pattern_init()
+{
+	unsigned int x = 2463534242u;
+	int i;
+	for (i = 0; i < PATTERN_PERIOD; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		pattern[i] = pattern[i + PATTERN_PERIOD] = x;
+	}
+}
+
+// the bytes of [off, off + len), len <= PATTERN_PERIOD
+static const unsigned char *pattern_at(long long off)
+{
+	return pattern + off % PATTERN_PERIOD;
+}
+
+#endif
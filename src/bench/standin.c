@@ -0,0 +1,636 @@
+/*
+ * A local stand-in for the http and ftp servers the downloader talks to,
+ * serving files of any size made up of the bench pattern: GET /64M, or
+ * RETR /64M, is 64M of it. How it misbehaves is set on the command line.
+ * GET /stats answers the body bytes sent so far, over both protocols.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "pattern.h"
+
+#define USAGE_STR "Usage: standin [-p HTTP_PORT] [-f FTP_PORT] [options]\n"                        \
+                  "-b BYTES       bandwidth of each connection, bytes per second, 0 unlimited\n" \
+                  "-l MS          latency before every reply\n"                                  \
+                  "-n             no ranges: Range, REST and RANG are ignored or refused\n"      \
+                  "-2             answer a range with its bytes, but 200 instead of 206\n"       \
+                  "-m             answer a list of ranges with a multipart/byteranges body\n"    \
+                  "-M             answer a list of ranges with one range covering them all\n"    \
+                  "-v             no ETag or Last-Modified, nothing to validate a range with\n"  \
+                  "-c             chunked bodies for whole file responses\n"                     \
+                  "-R             redirect every path to /r/PATH first\n"                        \
+                  "-s N:MS        every Nth body stalls MS halfway\n"                            \
+                  "-x N           every Nth body is reset halfway\n"
+
+#define MAX_REQUEST_LEN    8192
+#define SEND_CHUNK_LEN     (1024 * 64)
+#define LAST_MODIFIED      "Wed, 01 Jan 2025 00:00:00 GMT"
+#define MDTM_STR           "20250101000000"
+#define MAX_RANGES         64
+#define BOUNDARY           "standin-byteranges"
+
+// what a list of ranges gets, the whole file by default
+#define LIST_WHOLE         0
+#define LIST_MULTIPART     1
+#define LIST_MERGED        2
+
+static long long bandwidth;
+static int latency_ms;
+static int no_ranges;
+static int wrong_status;
+static int list_reply;
+static int no_validators;
+static int chunked;
+static int redirect;
+static int stall_every, stall_ms;
+static int reset_every;
+
+static pthread_mutex_t body_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int bodies;
+static long long bytes_sent;
+
+static void _sleep_ms(int ms)
+{
+	struct timespec ts;
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+static double _now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int _send_all(int fd, const void *buf, int len)
+{
+	const char *p = buf;
+	int n;
+	while (len > 0)
+	{
+		if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p   += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int _reply(int fd, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int n;
+
+	if (latency_ms > 0)
+		_sleep_ms(latency_ms);
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	return _send_all(fd, buf, n);
+}
+
+// "/64M" or "/r/64M" is a file of 64M, -1 for anything else
+static long long _file_size(const char *path)
+{
+	char *end;
+	long long size;
+
+	if (strncmp(path, "/r/", 3) == 0)
+		path += 2;
+	if (path[0] != '/' || path[1] < '0' || path[1] > '9')
+		return -1;
+	size = strtoll(path + 1, &end, 10);
+	switch (*end)
+	{
+		case 'G': size <<= 10;    // fall through
+		case 'M': size <<= 10;    // fall through
+		case 'K': size <<= 10;
+			end++;
+	}
+	return *end ? -1 : size;
+}
+
+/*
+ * The bytes [beg, end] of a file, at the bandwidth, stalled or cut off
+ * halfway if this body is the one. With chunk set, each send is a chunk.
+ */
+static int _send_body(int fd, long long beg, long long end, int chunk)
+{
+	long long total = end - beg + 1, sent = 0, half = total / 2;
+	double start = _now();
+	int nth, stalled = 0, n;
+
+	pthread_mutex_lock(&body_mutex);
+	nth = ++bodies;
+	pthread_mutex_unlock(&body_mutex);
+
+	while (sent < total)
+	{
+		n = total - sent < SEND_CHUNK_LEN ? total - sent : SEND_CHUNK_LEN;
+		if (sent < half && sent + n > half)
+			n = half - sent;    // halfway falls between two sends
+		if (sent == half && sent > 0)
+		{
+			if (reset_every > 0 && nth % reset_every == 0)
+			{
+				struct linger lg = { 1, 0 };
+				setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+				return -1;    // closed with a RST by the caller
+			}
+			if (stall_every > 0 && nth % stall_every == 0 && !stalled)
+			{
+				_sleep_ms(stall_ms);
+				start += stall_ms / 1000.0;
+				stalled = 1;
+			}
+		}
+		if (chunk)
+		{
+			char size[32];
+			int len = snprintf(size, sizeof(size), "%x\r\n", n);
+			if (_send_all(fd, size, len) != 0)
+				return -1;
+		}
+		if (_send_all(fd, pattern_at(beg + sent), n) != 0 || (chunk && _send_all(fd, "\r\n", 2) != 0))
+			return -1;
+		sent += n;
+		__sync_fetch_and_add(&bytes_sent, n);
+
+		// ahead of the bandwidth, wait for it
+		if (bandwidth > 0)
+		{
+			double due = start + (double)sent / bandwidth - _now();
+			if (due > 0)
+				_sleep_ms(due * 1000);
+		}
+	}
+	return chunk ? _send_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+/*
+ * The ranges of a Range header value, "a-b", "a-" or "-n" each, cut to
+ * the file. Their count, 0 if one is not satisfiable, -1 if malformed.
+ */
+static int _parse_ranges(const char *value, long long size, long long *begs, long long *ends)
+{
+	const char *p = value;
+	long long beg, end;
+	int n = 0, len, more;
+
+	while (n < MAX_RANGES)
+	{
+		if (sscanf(p, "-%lld%n", &end, &len) == 1)
+		{
+			beg = end < size ? size - end : 0;
+			end = size - 1;
+		}
+		else if (sscanf(p, "%lld-%n", &beg, &len) != 1)
+			return -1;
+		else if (sscanf(p + len, "%lld%n", &end, &more) == 1)
+			len += more;
+		else
+			end = size - 1;
+		if (end >= size)
+			end = size - 1;
+		if (beg > end)
+			return 0;
+		begs[n]   = beg;
+		ends[n++] = end;
+		p += len;
+		if (*p != ',')
+			break;
+		p++;
+		while (*p == ' ')
+			p++;
+	}
+	return n;
+}
+
+/*
+ * A multipart/byteranges reply, each range a part with its own
+ * Content-Range, the Content-Length counted ahead from the part headers.
+ */
+static void _send_multipart(int fd, const char *method, long long size, long long *begs, long long *ends,
+		int nranges, const char *validators)
+{
+	char head[256];
+	long long length = 0;
+	int i, n;
+
+	for (i = 0; i < nranges; i++)
+		length += snprintf(head, sizeof(head), "\r\n--" BOUNDARY "\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				begs[i], ends[i], size) + ends[i] - begs[i] + 1;
+	length += strlen("\r\n--" BOUNDARY "--\r\n");
+	if (_reply(fd, "HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary=" BOUNDARY "\r\n"
+			"Content-Length: %lld\r\n%sAccept-Ranges: bytes\r\nConnection: close\r\n\r\n", length, validators) != 0 ||
+			strcmp(method, "HEAD") == 0)
+		return;
+	for (i = 0; i < nranges; i++)
+	{
+		n = snprintf(head, sizeof(head), "\r\n--" BOUNDARY "\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+				begs[i], ends[i], size);
+		if (_send_all(fd, head, n) != 0 || _send_body(fd, begs[i], ends[i], 0) != 0)
+			return;
+	}
+	_send_all(fd, "\r\n--" BOUNDARY "--\r\n", strlen("\r\n--" BOUNDARY "--\r\n"));
+}
+
+static void _http_serve(int fd, const char *host)
+{
+	char req[MAX_REQUEST_LEN + 1];
+	char method[16], path[1024], validators[128];
+	char *range;
+	long long size, beg, end, begs[MAX_RANGES], ends[MAX_RANGES];
+	int len = 0, n, nranges;
+
+	while (len < MAX_REQUEST_LEN && !memmem(req, len, "\r\n\r\n", 4))
+	{
+		if ((n = recv(fd, req + len, MAX_REQUEST_LEN - len, 0)) <= 0)
+			return;
+		len += n;
+	}
+	req[len] = '\0';
+	if (sscanf(req, "%15s %1023s", method, path) != 2)
+		return;
+	if (strcmp(path, "/stats") == 0)
+	{
+		char stats[32];
+		n = snprintf(stats, sizeof(stats), "%lld\n", __sync_fetch_and_add(&bytes_sent, 0));
+		_reply(fd, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s", n, stats);
+		return;
+	}
+	if ((size = _file_size(path)) < 0)
+	{
+		_reply(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		return;
+	}
+	if (redirect && strncmp(path, "/r/", 3) != 0)
+	{
+		_reply(fd, "HTTP/1.1 302 Found\r\nLocation: http://%s/r%s\r\nContent-Length: 0\r\n"
+				"Connection: close\r\n\r\n", host, path);
+		return;
+	}
+
+	if (no_validators)
+		validators[0] = '\0';
+	else
+		snprintf(validators, sizeof(validators), "ETag: \"%lld\"\r\nLast-Modified: %s\r\n", size, LAST_MODIFIED);
+
+	// a list of ranges is answered as list_reply says
+	beg = 0;
+	end = size - 1;
+	range = strcasestr(req, "\r\nRange: bytes=");
+	if (range && !no_ranges && size > 0)
+	{
+		range += strlen("\r\nRange: bytes=");
+		nranges = _parse_ranges(range, size, begs, ends);
+		if (nranges == 0)
+		{
+			_reply(fd, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+					"Content-Length: 0\r\nConnection: close\r\n\r\n", size);
+			return;
+		}
+		if (nranges < 0)
+			range = NULL;
+		else if (nranges > 1 && list_reply == LIST_MULTIPART)
+		{
+			_send_multipart(fd, method, size, begs, ends, nranges, validators);
+			return;
+		}
+		else if (nranges == 1 || list_reply == LIST_MERGED)
+		{
+			beg = begs[0];
+			end = ends[0];
+			for (n = 1; n < nranges; n++)
+			{
+				beg = begs[n] < beg ? begs[n] : beg;
+				end = ends[n] > end ? ends[n] : end;
+			}
+		}
+		else
+			range = NULL;
+	}
+	else
+		range = NULL;
+
+	if (range)
+		n = _reply(fd, "HTTP/1.1 %s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n"
+				"%sAccept-Ranges: bytes\r\nConnection: close\r\n\r\n",
+				wrong_status ? "200 OK" : "206 Partial Content", beg, end, size, end - beg + 1, validators);
+	else if (chunked)
+		n = _reply(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n%sConnection: close\r\n\r\n", validators);
+	else
+		n = _reply(fd, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n%s%sConnection: close\r\n\r\n",
+				size, validators, no_ranges ? "" : "Accept-Ranges: bytes\r\n");
+	if (n == 0 && strcmp(method, "HEAD") != 0 && end >= beg)
+		_send_body(fd, beg, end, !range && chunked);
+}
+
+// a passive data listener on the address the control connection came to
+static int _ftp_listen(int ctl, int *port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd;
+
+	if (getsockname(ctl, (struct sockaddr *)&addr, &len) != 0 || (fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	addr.sin_port = 0;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0 ||
+			getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+static int _ftp_line(int fd, char *line, int max)
+{
+	int len = 0;
+	char c;
+	while (len < max - 1)
+	{
+		if (recv(fd, &c, 1, 0) != 1)
+			return -1;
+		if (c == '\n')
+			break;
+		if (c != '\r')
+			line[len++] = c;
+	}
+	line[len] = '\0';
+	return len;
+}
+
+static void _ftp_serve(int fd)
+{
+	char line[1024], arg[1024];
+	long long rest = 0, rang_end = -1, size;
+	int data_fd = -1, port, aborted = 0;
+
+	if (_reply(fd, "220 standin ready\r\n") != 0)
+		return;
+	while (_ftp_line(fd, line, sizeof(line)) >= 0)
+	{
+		arg[0] = '\0';
+		sscanf(line, "%*s %1023[^\n]", arg);
+		if (strncasecmp(line, "USER", 4) == 0)
+			_reply(fd, "331 any password\r\n");
+		else if (strncasecmp(line, "PASS", 4) == 0)
+			_reply(fd, "230 logged in\r\n");
+		else if (strncasecmp(line, "FEAT", 4) == 0)
+			_reply(fd, "211-Features:\r\n SIZE\r\n MDTM\r\n EPSV\r\n%s211 End\r\n",
+					no_ranges ? "" : " REST STREAM\r\n RANG STREAM\r\n");
+		else if (strncasecmp(line, "TYPE", 4) == 0 || strncasecmp(line, "NOOP", 4) == 0)
+			_reply(fd, "200 ok\r\n");
+		else if (strncasecmp(line, "SYST", 4) == 0)
+			_reply(fd, "215 UNIX Type: L8\r\n");
+		else if (strncasecmp(line, "PWD", 3) == 0)
+			_reply(fd, "257 \"/\"\r\n");
+		else if (strncasecmp(line, "CWD", 3) == 0)
+			_reply(fd, "250 ok\r\n");
+		else if (strncasecmp(line, "SIZE", 4) == 0)
+		{
+			if ((size = _file_size(arg)) < 0)
+				_reply(fd, "550 no such file\r\n");
+			else
+				_reply(fd, "213 %lld\r\n", size);
+		}
+		else if (strncasecmp(line, "MDTM", 4) == 0)
+			_reply(fd, _file_size(arg) < 0 ? "550 no such file\r\n" : "213 " MDTM_STR "\r\n");
+		else if (strncasecmp(line, "REST", 4) == 0 && !no_ranges)
+		{
+			rest = atoll(arg);
+			_reply(fd, "350 restarting at %lld\r\n", rest);
+		}
+		else if (strncasecmp(line, "RANG", 4) == 0 && !no_ranges)
+		{
+			sscanf(arg, "%lld %lld", &rest, &rang_end);
+			_reply(fd, "350 restarting at %lld, ending at %lld\r\n", rest, rang_end);
+		}
+		else if (strncasecmp(line, "EPSV", 4) == 0 || strncasecmp(line, "PASV", 4) == 0)
+		{
+			if (data_fd >= 0)
+				close(data_fd);
+			if ((data_fd = _ftp_listen(fd, &port)) < 0)
+				_reply(fd, "425 no data connection\r\n");
+			else if (toupper(line[0]) == 'E')
+				_reply(fd, "229 Entering Extended Passive Mode (|||%d|)\r\n", port);
+			else
+				_reply(fd, "227 Entering Passive Mode (127,0,0,1,%d,%d)\r\n", port >> 8, port & 0xff);
+		}
+		else if (strncasecmp(line, "RETR", 4) == 0)
+		{
+			int conn;
+			long long end;
+			if ((size = _file_size(arg)) < 0 || data_fd < 0 || rest > size)
+			{
+				_reply(fd, "550 can't send %s\r\n", arg);
+				continue;
+			}
+			end = rang_end >= 0 && rang_end < size ? rang_end : size - 1;
+			_reply(fd, "150 sending %lld bytes\r\n", end - rest + 1);
+			if ((conn = accept(data_fd, NULL, NULL)) < 0)
+			{
+				_reply(fd, "425 no data connection\r\n");
+				continue;
+			}
+			close(data_fd);
+			data_fd = -1;
+			if (end < rest || _send_body(conn, rest, end, 0) == 0)
+			{
+				close(conn);
+				_reply(fd, "226 transfer complete\r\n");
+			}
+			else
+			{
+				close(conn);
+				_reply(fd, "426 transfer aborted\r\n");
+				aborted = 1;
+			}
+			rest     = 0;
+			rang_end = -1;
+		}
+		else if (strncasecmp(line, "ABOR", 4) == 0)
+		{
+			_reply(fd, aborted ? "226 abort done\r\n" : "225 nothing to abort\r\n");
+			aborted = 0;
+		}
+		else if (strncasecmp(line, "QUIT", 4) == 0)
+		{
+			_reply(fd, "221 bye\r\n");
+			break;
+		}
+		else
+			_reply(fd, "502 not implemented\r\n");
+	}
+	if (data_fd >= 0)
+		close(data_fd);
+}
+
+typedef struct _client
+{
+	int   fd;
+	int   ftp;
+	char  host[64];    // host:port the client reached
+}client_t;
+
+static void *_client_entry(void *arg)
+{
+	client_t *c = arg;
+	int one = 1;
+
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (c->ftp)
+		_ftp_serve(c->fd);
+	else
+		_http_serve(c->fd, c->host);
+	close(c->fd);
+	free(c);
+	return NULL;
+}
+
+static int _listen(int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
+	{
+		perror("standin: listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+typedef struct _server
+{
+	int   fd;
+	int   ftp;
+	int   port;
+}server_t;
+
+static void *_server_entry(void *arg)
+{
+	server_t *s = arg;
+	pthread_t tid;
+	client_t *c;
+	int fd;
+
+	while (1)
+	{
+		if ((fd = accept(s->fd, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("standin: accept");
+			return NULL;
+		}
+		if (!(c = malloc(sizeof(client_t))))
+		{
+			close(fd);
+			continue;
+		}
+		c->fd  = fd;
+		c->ftp = s->ftp;
+		snprintf(c->host, sizeof(c->host), "127.0.0.1:%d", s->port);
+		if (pthread_create(&tid, NULL, _client_entry, c) != 0)
+		{
+			close(fd);
+			free(c);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	server_t servers[2];
+	pthread_t tids[2];
+	int http_port = 0, ftp_port = 0, nservers = 0, opt, i;
+
+	while ((opt = getopt(argc, argv, "p:f:b:l:n2mMvcRs:x:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': http_port  = atoi(optarg); break;
+			case 'f': ftp_port   = atoi(optarg); break;
+			case 'b': bandwidth  = atoll(optarg); break;
+			case 'l': latency_ms = atoi(optarg); break;
+			case 'n': no_ranges  = 1; break;
+			case '2': wrong_status = 1; break;
+			case 'm': list_reply = LIST_MULTIPART; break;
+			case 'M': list_reply = LIST_MERGED; break;
+			case 'v': no_validators = 1; break;
+			case 'c': chunked    = 1; break;
+			case 'R': redirect   = 1; break;
+			case 's':
+				if (sscanf(optarg, "%d:%d", &stall_every, &stall_ms) != 2)
+					goto USAGE;
+				break;
+			case 'x': reset_every = atoi(optarg); break;
+			default:
+				goto USAGE;
+		}
+	}
+	if (!http_port && !ftp_port)
+		goto USAGE;
+
+	signal(SIGPIPE, SIG_IGN);
+	pattern_init();
+	if (http_port)
+	{
+		servers[nservers].ftp  = 0;
+		servers[nservers].port = http_port;
+		if ((servers[nservers++].fd = _listen(http_port)) < 0)
+			return EXIT_FAILURE;
+	}
+	if (ftp_port)
+	{
+		servers[nservers].ftp  = 1;
+		servers[nservers].port = ftp_port;
+		if ((servers[nservers++].fd = _listen(ftp_port)) < 0)
+			return EXIT_FAILURE;
+	}
+	for (i = 0; i < nservers; i++)
+		pthread_create(&tids[i], NULL, _server_entry, &servers[i]);
+	for (i = 0; i < nservers; i++)
+		pthread_join(tids[i], NULL);
+	return EXIT_FAILURE;
+USAGE:
+	fprintf(stderr, USAGE_STR);
+	return EXIT_FAILURE;
+}
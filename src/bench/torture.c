@@ -0,0 +1,350 @@
+/*
+ * Crash and resume torture of the breakpoint and recovery path. Every round
+ * downloads a file from the stand-in server in a child process which is
+ * killed by SIGKILL, then recovers it in a fresh process with
+ * easy_downloader_recover_task and checks the file byte for byte.
+ *
+ * The kill comes at a random moment of the transfer, or at a crash point of
+ * a -DCRASH_POINTS build: a part checkpoint, between the tmp dir mkdir and
+ * the db insert, after a part is merged, or once the merge is done but the
+ * breakpoint is not deleted yet. Bytes the stand-in sent beyond the file
+ * length are the ones recovery fetched again.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "downloader.h"
+#include "utils.h"
+#include "status.h"
+#include "harness.h"
+
+#define USAGE_STR "Usage: torture [-s SIZE] [-p PARTS] [-n KILLS] [-k POINTS] [-P http|ftp] [-t SECONDS] [-r SEED]" \
+                  " [-- STANDIN OPTIONS]\n"                                                                      \
+                  "-s SIZE        file size, 64M by default\n"                                                   \
+                  "-p PARTS       most parts of the file, 4 by default\n"                                        \
+                  "-n KILLS       kills at every point, 10 by default\n"                                         \
+                  "-k POINTS      where to kill, of transfer,checkpoint,insert,merge,merged, all by default\n"  \
+                  "-P PROTOCOL    http, the default, or ftp\n"                                                   \
+                  "-t SECONDS     longest a download or a recovery may take, 120 by default\n"                  \
+                  "-r SEED        seed of the kill points, the time by default\n"
+
+#define MAX_POINTS         8
+#define MAX_KILLS          1000
+#define MB                 (1024.0 * 1024)
+
+// a part digest is saved every 4M of it, see PART_CHECKPOINT_LEN
+#define CHECKPOINT_LEN     (1024 * 1024 * 4)
+
+// how a round ended
+#define ROUND_RECOVERED    0
+#define ROUND_MISSED       1     // the download was done before the kill
+#define ROUND_LOST         2     // no breakpoint was left to recover
+#define ROUND_CORRUPT      3     // recovered, but the file is wrong
+#define ROUND_FAILED       4     // recovery gave up, the breakpoint is still there
+#define ROUND_HUNG         5     // the download or the recovery took too long
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond   = PTHREAD_COND_INITIALIZER;
+static int done;
+
+static void *_finished(void *arg)
+{
+	pthread_mutex_lock(&done_mutex);
+	done = 1;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_mutex);
+	return NULL;
+}
+
+static void _wait_finished()
+{
+	pthread_mutex_lock(&done_mutex);
+	while (!done)
+		pthread_cond_wait(&done_cond, &done_mutex);
+	pthread_mutex_unlock(&done_mutex);
+}
+
+// the child's exit status, -1 if it was still running at the deadline and is killed
+static int _wait_child(pid_t pid, double deadline)
+{
+	int status;
+
+	while (waitpid(pid, &status, WNOHANG) == 0)
+	{
+		if (_now() > deadline)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			return -1;
+		}
+		usleep(1000);
+	}
+	return status;
+}
+
+// in a child: download url into out_dir, killed at crash_at if it is not NULL
+static pid_t _start_download(const char *url, const char *out_dir, int parts, const char *crash_at)
+{
+	downloader *der;
+	pid_t pid;
+
+	if ((pid = fork()) != 0)
+		return pid;
+	if (crash_at)
+		setenv(CRASH_POINT_ENV, crash_at, 1);
+	freopen("/dev/null", "w", stdout);
+	if (!(der = easy_downloader_init()))
+		_exit(EXIT_FAILURE);
+	easy_downloader_set_log_level(der, D_LOG_WARN);
+	easy_downloader_set_max_parts(der, parts);
+	easy_downloader_add_task(der, url, out_dir, NULL, _finished, NULL);
+	_wait_finished();
+	_exit(0);
+}
+
+static int _has_breakpoint(downloader *der, const char *full_name)
+{
+	d_breakpoint_t bps[8];
+	int i, n = easy_downloader_get_breakpoints(der, bps, 8);
+
+	for (i = 0; i < n && strcmp(bps[i].file_name, full_name) != 0; i++)
+		;
+	return i < n;
+}
+
+/*
+ * In a child: recover file_name of out_dir if it has a breakpoint, and
+ * write how long that took to fd, and if the breakpoint is still there
+ * after it, or nothing if there was none.
+ */
+static pid_t _start_recovery(const char *out_dir, const char *file_name, int fd)
+{
+	char full_name[PATH_MAX];
+	downloader *der;
+	double start;
+	pid_t pid;
+
+	if ((pid = fork()) != 0)
+		return pid;
+	freopen("/dev/null", "w", stdout);
+	if (!(der = easy_downloader_init()))
+		_exit(EXIT_FAILURE);
+	easy_downloader_set_log_level(der, D_LOG_WARN);
+	snprintf(full_name, PATH_MAX, "%s/%s", out_dir, file_name);
+	if (_has_breakpoint(der, full_name))
+	{
+		start = _now();
+		easy_downloader_recover_task(der, file_name, _finished, NULL);
+		_wait_finished();
+		dprintf(fd, "%f %d\n", _now() - start, _has_breakpoint(der, full_name));
+	}
+	_exit(0);
+}
+
+// entries of dir but keep and the status file every downloader maps, what
+// a finished download should not leave behind
+static int _leftovers(const char *dir, const char *keep)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	int n = 0;
+
+	if (!d)
+		return 0;
+	while ((e = readdir(d)))
+	{
+		if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0 && strcmp(e->d_name, keep) != 0 &&
+				strcmp(e->d_name, STATUS_FILE_NAME) != 0)
+			n++;
+	}
+	closedir(d);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	char points_str[256] = "transfer,checkpoint,insert,merge,merged", size_str[16] = "64M";
+	char points[MAX_POINTS][16];
+	char scratch[] = "/tmp/edtorture.XXXXXX";
+	char url[256], home[PATH_MAX], out_dir[PATH_MAX], tmp_dir[PATH_MAX], file_name[PATH_MAX];
+	char *tok, *save;
+	const char *proto = "http";
+	double refetched[MAX_KILLS], recover_times[MAX_KILLS];
+	double full_time, start;
+	int parts = 4, kills = 10, timeout = 120, npoints = 0, opt, k, status;
+	int port = 20000 + getpid() % 20000;
+	unsigned int seed = time(NULL);
+	long long size;
+	pid_t server;
+	FILE *report;
+
+	while ((opt = getopt(argc, argv, "s:p:n:k:P:t:r:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': snprintf(size_str, sizeof(size_str), "%s", optarg); break;
+			case 'p': parts   = atoi(optarg); break;
+			case 'n': kills   = atoi(optarg); break;
+			case 't': timeout = atoi(optarg); break;
+			case 'r': seed    = strtoul(optarg, NULL, 10); break;
+			case 'P': proto   = strcmp(optarg, "ftp") == 0 ? "ftp" : "http"; break;
+			case 'k': snprintf(points_str, sizeof(points_str), "%s", optarg); break;
+			default:
+				fprintf(stderr, USAGE_STR);
+				return EXIT_FAILURE;
+		}
+	}
+	for (tok = strtok_r(points_str, ",", &save); tok && npoints < MAX_POINTS; tok = strtok_r(NULL, ",", &save))
+		snprintf(points[npoints++], 16, "%s", tok);
+	size = _parse_size(size_str);
+	if (kills < 1 || kills > MAX_KILLS || npoints == 0 || parts < 1 || size <= 0)
+	{
+		fprintf(stderr, USAGE_STR);
+		return EXIT_FAILURE;
+	}
+
+	if ((server = _start_standin(argv[0], port, argv + optind, argc - optind)) < 0)
+		return EXIT_FAILURE;
+	snprintf(url, sizeof(url), "%s://127.0.0.1:%d/%s", proto, strcmp(proto, "http") == 0 ? port : port + 1, size_str);
+
+	// the report keeps stdout, the downloader's chatter does not
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+	srandom(seed);
+	pattern_init();
+
+	// every round has a home of its own, the db and tmp files start empty
+	if (!mkdtemp(scratch))
+	{
+		perror("torture: mkdtemp");
+		kill(server, SIGTERM);
+		return EXIT_FAILURE;
+	}
+	snprintf(home, PATH_MAX, "%s/home", scratch);
+	snprintf(out_dir, PATH_MAX, "%s/out", scratch);
+	snprintf(tmp_dir, PATH_MAX, "%s/.easy_downloader", home);
+	snprintf(file_name, PATH_MAX, "%s/%s", out_dir, size_str);
+	setenv("HOME", home, 1);
+
+	// a download without a kill, how long the transfer takes
+	mkdir(home, S_IRWXU);
+	mkdir(out_dir, S_IRWXU);
+	start = _now();
+	status = _wait_child(_start_download(url, out_dir, parts, NULL), _now() + timeout);
+	full_time = _now() - start;
+	if (status != 0 || !_verify(file_name, size))
+	{
+		fprintf(stderr, "torture: %s does not download without a kill\n", url);
+		kill(server, SIGTERM);
+		nftw(scratch, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+		return EXIT_FAILURE;
+	}
+	nftw(home, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	nftw(out_dir, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	fprintf(report, "%s, %d parts, %.3f s without a kill, seed %u\n", url, parts, full_time, seed);
+	fprintf(report, "%-10s %5s %6s %9s %4s %6s %7s %4s %5s %10s %10s %8s %8s %8s\n", "point", "kills", "missed",
+			"recovered", "lost", "failed", "corrupt", "hung", "leaks", "refetch_MB", "max_MB", "p50_s", "p99_s", "max_s");
+	for (k = 0; k < npoints; k++)
+	{
+		int counts[ROUND_HUNG + 1] = { 0 }, leaks = 0, nrecovered = 0, r;
+		double refetch_sum = 0, refetch_max = 0;
+
+		for (r = 0; r < kills; r++)
+		{
+			char crash_at[32], result[64];
+			long long sent;
+			int round, pipe_fd[2], n, left = 0;
+			double secs;
+			pid_t child;
+
+			mkdir(home, S_IRWXU);
+			mkdir(out_dir, S_IRWXU);
+			sent = _standin_sent(port);
+
+			// the nth pass of the point, most points are passed once
+			if (strcmp(points[k], "checkpoint") == 0)
+				snprintf(crash_at, sizeof(crash_at), "%s:%ld", points[k], 1 + random() % (long)(size / CHECKPOINT_LEN + 1));
+			else if (strcmp(points[k], "merge") == 0)
+				snprintf(crash_at, sizeof(crash_at), "%s:%ld", points[k], 1 + random() % parts);
+			else
+				snprintf(crash_at, sizeof(crash_at), "%s:1", points[k]);
+
+			if (strcmp(points[k], "transfer") == 0)
+			{
+				child = _start_download(url, out_dir, parts, NULL);
+				usleep(full_time * 1e6 * random() / RAND_MAX);
+				kill(child, SIGKILL);
+			}
+			else
+				child = _start_download(url, out_dir, parts, crash_at);
+			status = _wait_child(child, _now() + timeout);
+
+			if (status == -1)
+				round = ROUND_HUNG;
+			else if (!WIFSIGNALED(status))
+				round = ROUND_MISSED;
+			else
+			{
+				pipe(pipe_fd);
+				child = _start_recovery(out_dir, size_str, pipe_fd[1]);
+				close(pipe_fd[1]);
+				status = _wait_child(child, _now() + timeout);
+				n = read(pipe_fd[0], result, sizeof(result) - 1);
+				close(pipe_fd[0]);
+				result[n > 0 ? n : 0] = '\0';
+
+				if (status == -1)
+					round = ROUND_HUNG;
+				else if (sscanf(result, "%lf %d", &secs, &left) != 2)
+					round = ROUND_LOST;
+				else if (left)
+					round = ROUND_FAILED;
+				else if (!_verify(file_name, size))
+					round = ROUND_CORRUPT;
+				else
+				{
+					round = ROUND_RECOVERED;
+					recover_times[nrecovered] = secs;
+					refetched[nrecovered] = (_standin_sent(port) - sent - size) / MB;
+					refetch_sum += refetched[nrecovered];
+					if (refetched[nrecovered] > refetch_max)
+						refetch_max = refetched[nrecovered];
+					nrecovered++;
+				}
+				// a tmp dir or a renamed copy is left over for good
+				leaks += _leftovers(tmp_dir, "downloader_db") + _leftovers(out_dir, size_str);
+			}
+			if (round != ROUND_RECOVERED && round != ROUND_MISSED)
+				fprintf(stderr, "torture: %s at %s\n", round == ROUND_LOST ? "lost" : round == ROUND_FAILED ?
+						"failed" : round == ROUND_CORRUPT ? "corrupt" : "hung", crash_at);
+			counts[round]++;
+			nftw(home, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+			nftw(out_dir, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+		}
+
+		qsort(recover_times, nrecovered, sizeof(double), _double_cmp);
+		fprintf(report, "%-10s %5d %6d %9d %4d %6d %7d %4d %5d %10.1f %10.1f %8.3f %8.3f %8.3f\n", points[k], kills,
+				counts[ROUND_MISSED], counts[ROUND_RECOVERED], counts[ROUND_LOST], counts[ROUND_FAILED], counts[ROUND_CORRUPT],
+				counts[ROUND_HUNG], leaks, nrecovered ? refetch_sum / nrecovered : 0, refetch_max,
+				nrecovered ? recover_times[(nrecovered - 1) / 2] : 0,
+				nrecovered ? recover_times[(nrecovered * 99 + 99) / 100 - 1] : 0,
+				nrecovered ? recover_times[nrecovered - 1] : 0);
+		fflush(report);
+	}
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	nftw(scratch, _remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include "downloader_imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#define CACHE_DIR           "cache"
+#define MAX_CACHE_KEY_LEN   (MAX_URL_LEN + MAX_VALIDATOR_LEN * 2 + 32)
+
+// a url key names the blob holding its content, blobs are named by their sha256
+#define SQL_CACHE_BY_KEY    "select b.sha256, b.length, b.mtime from d_cache_keys k, d_cache_blobs b " \
+                            "where k.key='%q' and k.sha256=b.sha256"
+#define SQL_CACHE_BY_DIGEST "select sha256, length, mtime from d_cache_blobs where sha256='%q'"
+#define SQL_CACHE_TOUCH     "update d_cache_blobs set last_used=%lld where sha256='%q'"
+#define SQL_CACHE_ADD_KEY   "insert or replace into d_cache_keys values ('%q', '%q')"
+#define SQL_CACHE_ADD_BLOB  "insert or replace into d_cache_blobs values ('%q', %d, %lld, %lld)"
+#define SQL_CACHE_SIZE      "select sum(length) from d_cache_blobs"
+#define SQL_CACHE_OLDEST    "select sha256 from d_cache_blobs order by last_used limit 1"
+#define SQL_CACHE_DROP      "delete from d_cache_keys where sha256='%q';" \
+                            "delete from d_cache_blobs where sha256='%q'"
+
+extern char download_tmp_path[PATH_MAX];
+
+// stores and evictions must not race a lookup handing out the blob
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void _blob_path(const char *sha256, char *path)
+{
+	snprintf(path, PATH_MAX, "%s%s/%s", download_tmp_path, CACHE_DIR, sha256);
+}
+
+static long long _mtime_ns(const struct stat *sb)
+{
+	return (long long)sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+}
+
+// only urls with a validator can be trusted to name the same content again
+static int _url_key(const char *url, const file_info_t *file, char *key)
+{
+	if (!file->etag[0] && !file->last_modified[0])
+		return ERR_FALSE;
+	snprintf(key, MAX_CACHE_KEY_LEN, "%s\n%d\n%s\n%s", url, file->length, file->etag, file->last_modified);
+	return 0;
+}
+
+static void _cache_drop(d_manager_t *dm, const char *sha256)
+{
+	char sql_buf[256];
+	char blob[PATH_MAX];
+
+	_blob_path(sha256, blob);
+	unlink(blob);
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_DROP, sha256, sha256);
+	db_execute(dm->db_key, sql_buf, NULL);
+	LOG_DEBUG("cache: evicted %s", sha256);
+}
+
+/*
+ * Look a blob up and open it while the lock keeps evictions out, the
+ * caller reads it through the fd, an eviction after that only takes its
+ * name. A blob whose size or mtime is not what was stored was changed
+ * behind the cache's back, it is dropped.
+ */
+static int _cache_lookup(d_manager_t *dm, const char *sql, const char *sha256, int *blob_fd)
+{
+	char **results;
+	char blob[PATH_MAX];
+	int row, col, fd = -1, ret = ERR_FALSE;
+	struct stat sb;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (sqlite3_get_table(dm->db_key, sql, &results, &row, &col, NULL) != SQLITE_OK)
+	{
+		pthread_mutex_unlock(&cache_mutex);
+		return ERR_DB_EXCUTE;
+	}
+	if (row == 1 && results[3] && results[4] && results[5])
+	{
+		_blob_path(results[3], blob);
+		if (sha256 && sha256[0] && strcasecmp(sha256, results[3]) != 0)
+			ret = ERR_FALSE;    // the caller expects other content
+		else if ((fd = open(blob, O_RDONLY)) >= 0 && fstat(fd, &sb) == 0 &&
+				sb.st_size == atoi(results[4]) && _mtime_ns(&sb) == atoll(results[5]))
+		{
+			char sql_buf[256];
+			sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_TOUCH, (long long)time(NULL), results[3]);
+			db_execute(dm->db_key, sql_buf, NULL);
+			*blob_fd = fd;
+			ret = 0;
+		}
+		else
+		{
+			if (fd >= 0)
+				close(fd);
+			_cache_drop(dm, results[3]);
+		}
+	}
+	sqlite3_free_table(results);
+	pthread_mutex_unlock(&cache_mutex);
+	return ret;
+}
+
+int cache_init(d_manager_t *dm)
+{
+	char dir[PATH_MAX];
+	snprintf(dir, PATH_MAX, "%s%s", download_tmp_path, CACHE_DIR);
+	if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST)
+		return ERR_IO_CREATE;
+	return 0;
+}
+
+int cache_find_digest(d_manager_t *dm, const char *sha256, int *blob_fd)
+{
+	char sql_buf[256];
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_BY_DIGEST, sha256);
+	return _cache_lookup(dm, sql_buf, sha256, blob_fd);
+}
+
+int cache_find_url(d_manager_t *dm, const char *url, const file_info_t *file, const char *sha256, int *blob_fd)
+{
+	char key[MAX_CACHE_KEY_LEN];
+	char sql_buf[MAX_CACHE_KEY_LEN + 256];
+
+	if (_url_key(url, file, key) != 0)
+		return ERR_FALSE;
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_BY_KEY, key);
+	return _cache_lookup(dm, sql_buf, sha256, blob_fd);
+}
+
+// least recently used blobs go until the cache fits its budget
+static void _cache_evict(d_manager_t *dm)
+{
+	char **results;
+	int row, col;
+
+	while (1)
+	{
+		long long size = 0;
+		if (sqlite3_get_table(dm->db_key, SQL_CACHE_SIZE, &results, &row, &col, NULL) != SQLITE_OK)
+			return;
+		if (row == 1 && results[1])
+			size = atoll(results[1]);
+		sqlite3_free_table(results);
+		if (size <= dm->cache_budget)
+			return;
+
+		if (sqlite3_get_table(dm->db_key, SQL_CACHE_OLDEST, &results, &row, &col, NULL) != SQLITE_OK)
+			return;
+		if (row == 1 && results[1])
+			_cache_drop(dm, results[1]);
+		sqlite3_free_table(results);
+		if (row != 1)
+			return;
+	}
+}
+
+void cache_store(d_manager_t *dm, const char *url, const file_info_t *file, const char *sha256, const char *file_name)
+{
+	char key[MAX_CACHE_KEY_LEN];
+	char sql_buf[MAX_CACHE_KEY_LEN + 256];
+	char blob[PATH_MAX], tmp[PATH_MAX];
+	char **results;
+	int row, col;
+	struct stat sb;
+
+	if (!sha256[0] || file->length > dm->cache_budget)
+		return;
+
+	pthread_mutex_lock(&cache_mutex);
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_BY_DIGEST, sha256);
+	if (sqlite3_get_table(dm->db_key, sql_buf, &results, &row, &col, NULL) != SQLITE_OK)
+		goto OUT;
+	sqlite3_free_table(results);
+
+	// the same content may already be cached under another url
+	if (row == 0)
+	{
+		_blob_path(sha256, blob);
+		snprintf(tmp, PATH_MAX, "%s.tmp", blob);
+		if (materialize_file(file_name, tmp) != 0 || rename(tmp, blob) != 0 || stat(blob, &sb) != 0)
+		{
+			unlink(tmp);
+			goto OUT;
+		}
+		sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_ADD_BLOB, sha256, file->length,
+				_mtime_ns(&sb), (long long)time(NULL));
+		if (db_execute(dm->db_key, sql_buf, NULL) != 0)
+		{
+			unlink(blob);
+			goto OUT;
+		}
+		LOG_DEBUG("cache: stored %s", sha256);
+	}
+	if (_url_key(url, file, key) == 0)
+	{
+		sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_CACHE_ADD_KEY, key, sha256);
+		db_execute(dm->db_key, sql_buf, NULL);
+	}
+	_cache_evict(dm);
+OUT:
+	pthread_mutex_unlock(&cache_mutex);
+}
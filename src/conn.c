@@ -0,0 +1,250 @@
+#include "conn.h"
+
+#include <pthread.h>
+#include <openssl/err.h>
+
+#define MAX_TLS_SESSIONS   64
+#define MAX_SESSION_KEY    (256 + 16)
+
+/*
+ * Client session cache keyed by "host:port". Every part of a task and
+ * every task to the same server resume the session of the first
+ * handshake instead of paying for a full one.
+ */
+typedef struct _tls_session
+{
+	char            key[MAX_SESSION_KEY];
+	SSL_SESSION     *sess;
+}tls_session_t;
+
+static SSL_CTX *tls_ctx;
+static int tls_refs;
+static int tls_key_index = -1;
+static pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static tls_session_t tls_sessions[MAX_TLS_SESSIONS];
+static int tls_next_slot;
+
+static tls_session_t *find_session(const char *key)
+{
+	int i;
+	for (i = 0; i < MAX_TLS_SESSIONS; i++)
+	{
+		if (tls_sessions[i].sess && strcmp(tls_sessions[i].key, key) == 0)
+			return &tls_sessions[i];
+	}
+	return NULL;
+}
+
+// called by openssl for every new session or TLS 1.3 ticket
+static int new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	const char *key = SSL_get_ex_data(ssl, tls_key_index);
+	tls_session_t *slot;
+
+	if (!key)
+		return 0;
+	pthread_mutex_lock(&tls_mutex);
+	if (!(slot = find_session(key)))
+	{
+		slot = &tls_sessions[tls_next_slot];
+		tls_next_slot = (tls_next_slot + 1) % MAX_TLS_SESSIONS;
+		strcpy(slot->key, key);
+	}
+	if (slot->sess)
+		SSL_SESSION_free(slot->sess);
+	slot->sess = sess;
+	pthread_mutex_unlock(&tls_mutex);
+	return 1;    // we keep the reference
+}
+
+int conn_tls_init(void)
+{
+	int ret = 0;
+	pthread_mutex_lock(&tls_mutex);
+	if (tls_refs++ == 0)
+	{
+		if (!(tls_ctx = SSL_CTX_new(TLS_client_method())))
+			ret = ERR_FALSE;
+		else
+		{
+			// SSL_CERT_FILE / SSL_CERT_DIR override the system store
+			SSL_CTX_set_default_verify_paths(tls_ctx);
+			SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+			SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+			SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(tls_ctx, new_session_cb);
+			SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+			// only asks the kernel to do the crypto: every read still goes through
+			// SSL_read, reading the socket directly needs the record type cmsg handling
+			SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+			if (tls_key_index < 0)
+				tls_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+		}
+	}
+	if (ret != 0)
+		tls_refs--;
+	pthread_mutex_unlock(&tls_mutex);
+	return ret;
+}
+
+void conn_tls_cleanup(void)
+{
+	int i;
+	pthread_mutex_lock(&tls_mutex);
+	if (--tls_refs == 0)
+	{
+		for (i = 0; i < MAX_TLS_SESSIONS; i++)
+		{
+			if (tls_sessions[i].sess)
+				SSL_SESSION_free(tls_sessions[i].sess);
+			tls_sessions[i].sess = NULL;
+		}
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+	}
+	pthread_mutex_unlock(&tls_mutex);
+}
+
+int conn_start_tls(d_conn_t *conn, const d_url_t *d_url, const d_conn_t *session_from)
+{
+	char *key;
+	SSL_SESSION *sess = NULL;
+	tls_session_t *slot;
+	long long start = TRACE_START();
+
+	if (!tls_ctx || !(conn->ssl = SSL_new(tls_ctx)))
+		return ERR_CONNECT;
+	key = (char *)malloc(MAX_SESSION_KEY);
+	snprintf(key, MAX_SESSION_KEY, "%s:%s", d_url->host, d_url->port);
+	SSL_set_ex_data(conn->ssl, tls_key_index, key);
+	SSL_set_fd(conn->ssl, conn->fd);
+	SSL_set_tlsext_host_name(conn->ssl, d_url->host);
+	SSL_set1_host(conn->ssl, d_url->host);
+
+	// ftps data connections must resume the session of their control connection
+	if (session_from && session_from->ssl)
+		sess = SSL_get1_session(session_from->ssl);
+	else
+	{
+		pthread_mutex_lock(&tls_mutex);
+		if ((slot = find_session(key)) && SSL_SESSION_is_resumable(slot->sess))
+		{
+			sess = slot->sess;
+			SSL_SESSION_up_ref(sess);
+		}
+		pthread_mutex_unlock(&tls_mutex);
+	}
+	if (sess)
+	{
+		SSL_set_session(conn->ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+
+	if (SSL_connect(conn->ssl) != 1)
+	{
+		unsigned long err = ERR_get_error();
+		LOG_ERROR("tls handshake with %s failed: %s", key,
+				err ? ERR_error_string(err, NULL) : "connection closed");
+		free(key);
+		SSL_free(conn->ssl);
+		conn->ssl = NULL;
+		return ERR_CONNECT;
+	}
+	TRACE_SPAN("tls", start, SSL_session_reused(conn->ssl));
+	LOG_DEBUG("tls session %s", SSL_session_reused(conn->ssl) ? "resumed" : "new");
+	return 0;
+}
+
+int conn_open(d_conn_t *conn, const d_url_t *d_url)
+{
+	conn->ssl = NULL;
+	if ((conn->fd = connect_server(d_url)) < 0)
+		return conn->fd;
+	if (d_url->proto == HTTPS && conn_start_tls(conn, d_url, NULL) != 0)
+	{
+		close(conn->fd);
+		conn->fd = -1;
+		return ERR_CONNECT;
+	}
+	return 0;
+}
+
+void conn_close(d_conn_t *conn)
+{
+	if (conn->ssl)
+	{
+		free(SSL_get_ex_data(conn->ssl, tls_key_index));
+		SSL_shutdown(conn->ssl);
+		SSL_free(conn->ssl);
+		conn->ssl = NULL;
+	}
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+}
+
+// map a failed SSL_read/SSL_peek to the read(2) contract
+static int tls_read_error(d_conn_t *conn, int ret)
+{
+	switch (SSL_get_error(conn->ssl, ret))
+	{
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EWOULDBLOCK;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0)
+				return 0;
+			return -1;
+		default:
+			errno = EIO;
+			return -1;
+	}
+}
+
+// same contract as read(2), EWOULDBLOCK when the socket has no full record yet
+int conn_read(d_conn_t *conn, char *buf, int n)
+{
+	int ret;
+	if (!conn->ssl)
+		return read(conn->fd, buf, n);
+	if ((ret = SSL_read(conn->ssl, buf, n)) > 0)
+		return ret;
+	return tls_read_error(conn, ret);
+}
+
+// like conn_read but the bytes stay queued for the next read
+int conn_peek(d_conn_t *conn, char *buf, int n)
+{
+	int ret;
+	if (!conn->ssl)
+		return recv(conn->fd, buf, n, MSG_PEEK);
+	if ((ret = SSL_peek(conn->ssl, buf, n)) > 0)
+		return ret;
+	return tls_read_error(conn, ret);
+}
+
+int conn_write_n(d_conn_t *conn, const char *buf, int n)
+{
+	int ntotal = n;
+	if (!conn->ssl)
+		return write_n_chars(conn->fd, buf, n);
+	while (n > 0)
+	{
+		int nwritten = SSL_write(conn->ssl, buf, n);
+		if (nwritten <= 0)
+			break;
+		n   -= nwritten;
+		buf += nwritten;
+	}
+	return ntotal - n;
+}
+
+int conn_pending(const d_conn_t *conn)
+{
+	return conn->ssl ? SSL_pending(conn->ssl) : 0;
+}
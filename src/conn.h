@@ -0,0 +1,30 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "utils.h"
+#include <openssl/ssl.h>
+
+// a connection to a server, plain or TLS
+typedef struct _download_conn
+{
+	int       fd;
+	SSL       *ssl;      // NULL for a plain connection
+}d_conn_t;
+
+// the TLS context and session cache are shared by every downloader
+int  conn_tls_init(void);
+void conn_tls_cleanup(void);
+
+// connect to d_url, https urls get the TLS handshake done
+int  conn_open(d_conn_t *conn, const d_url_t *d_url);
+// start TLS on an open connection, resuming the session of session_from if given
+int  conn_start_tls(d_conn_t *conn, const d_url_t *d_url, const d_conn_t *session_from);
+void conn_close(d_conn_t *conn);
+
+int  conn_read(d_conn_t *conn, char *buf, int n);
+int  conn_peek(d_conn_t *conn, char *buf, int n);
+int  conn_write_n(d_conn_t *conn, const char *buf, int n);
+// bytes already decrypted and buffered, select() on the fd does not see them
+int  conn_pending(const d_conn_t *conn);
+
+#endif
@@ -0,0 +1,258 @@
+#include "downloader_imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * A block index, published as URL.edidx next to the file, lists a weak
+ * rolling checksum and the first bytes of the sha256 of every full block:
+ *
+ *     edidx 1\n length N\n block B\n strong S\n sha256 HEX\n \n
+ *     then per block the weak sum, 4 bytes big endian, and S strong bytes
+ *
+ * The tail shorter than a block has no entry, it is always fetched.
+ */
+#define DELTA_MAGIC        "edidx 1"
+#define DELTA_MIN_BLOCK    4096
+#define DELTA_MAX_BLOCKS   (1 << 20)    // the block grows to keep the index small
+#define DELTA_STRONG_LEN   8            // a false match is caught by the file sha256
+
+// rsync's checksum, a in the low and b in the high 16 bits, both roll by a byte
+static unsigned int _weak_sum(const unsigned char *p, int len, unsigned int *pa, unsigned int *pb)
+{
+	unsigned int a = 0, b = 0;
+	int i;
+	for (i = 0; i < len; i++)
+	{
+		a += p[i];
+		b += (unsigned int)(len - i) * p[i];
+	}
+	*pa = a & 0xffff;
+	*pb = b & 0xffff;
+	return *pa | (*pb << 16);
+}
+
+int delta_write_index(const char *file_name, const char *index_name)
+{
+	char tmp_name[PATH_MAX];
+	char hex[SHA256_HEX_LEN + 1];
+	unsigned char md[SHA256_LEN];
+	unsigned char *buf, entry[4 + DELTA_STRONG_LEN];
+	unsigned int *weak = NULL, a, b;
+	unsigned char *strong = NULL;
+	sha256_ctx_t sha;
+	struct stat sb;
+	int fd, block, blocks, i, n, ret = ERR_IO_READ;
+	FILE *fp;
+
+	if ((fd = open(file_name, O_RDONLY)) < 0)
+		return ERR_IO_READ;
+	if (fstat(fd, &sb) != 0 || sb.st_size > INT_MAX)
+	{
+		close(fd);
+		return ERR_IO_READ;
+	}
+	for (block = DELTA_MIN_BLOCK; sb.st_size / block > DELTA_MAX_BLOCKS; block *= 2)
+		;
+	blocks = sb.st_size / block;
+	buf    = (unsigned char *)malloc(block);
+	weak   = (unsigned int *)malloc(sizeof(unsigned int) * (blocks + 1));
+	strong = (unsigned char *)malloc(DELTA_STRONG_LEN * (blocks + 1));
+	if (!buf || !weak || !strong || sha256_init(&sha) != 0)
+		goto OUT;
+
+	for (i = 0; ; i++)
+	{
+		if ((n = read_n_chars(fd, (char *)buf, block)) < 0)
+			break;
+		sha256_update(&sha, buf, n);
+		if (n < block)
+		{
+			ret = 0;
+			break;
+		}
+		weak[i] = _weak_sum(buf, block, &a, &b);
+		sha256_digest(buf, block, md);
+		memcpy(strong + i * DELTA_STRONG_LEN, md, DELTA_STRONG_LEN);
+	}
+	sha256_final_hex(&sha, hex);
+	if (ret != 0)
+		goto OUT;
+
+	// written aside, a half written index is never published
+	snprintf(tmp_name, PATH_MAX, "%s.tmp", index_name);
+	if (!(fp = fopen(tmp_name, "w")))
+	{
+		ret = ERR_IO_CREATE;
+		goto OUT;
+	}
+	fprintf(fp, "%s\nlength %d\nblock %d\nstrong %d\nsha256 %s\n\n", DELTA_MAGIC,
+			(int)sb.st_size, block, DELTA_STRONG_LEN, hex);
+	for (i = 0; i < blocks; i++)
+	{
+		entry[0] = weak[i] >> 24;
+		entry[1] = weak[i] >> 16;
+		entry[2] = weak[i] >> 8;
+		entry[3] = weak[i];
+		memcpy(entry + 4, strong + i * DELTA_STRONG_LEN, DELTA_STRONG_LEN);
+		fwrite(entry, 1, sizeof(entry), fp);
+	}
+	if (fclose(fp) != 0 || rename(tmp_name, index_name) != 0)
+	{
+		unlink(tmp_name);
+		ret = ERR_IO_WRITE;
+	}
+OUT:
+	free(buf);
+	free(weak);
+	free(strong);
+	close(fd);
+	return ret;
+}
+
+int delta_read_index(const char *index_name, delta_index_t *idx)
+{
+	char line[128];
+	unsigned char entry[4 + SHA256_LEN];
+	int i, entry_len;
+	FILE *fp;
+
+	memset(idx, 0, sizeof(*idx));
+	if (!(fp = fopen(index_name, "r")))
+		return ERR_IO_READ;
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, DELTA_MAGIC "\n", sizeof(DELTA_MAGIC)) != 0)
+		goto BAD;
+	while (fgets(line, sizeof(line), fp) && line[0] != '\n')
+	{
+		if (sscanf(line, "length %d", &idx->length) == 1 || sscanf(line, "block %d", &idx->block_size) == 1 ||
+				sscanf(line, "strong %d", &idx->strong_len) == 1 || sscanf(line, "sha256 %64s", idx->sha256) == 1)
+			continue;
+		// other keys are left for later versions
+	}
+	if (idx->length < 0 || idx->block_size < 512 || idx->strong_len < 4 || idx->strong_len > SHA256_LEN ||
+			strlen(idx->sha256) != SHA256_HEX_LEN)
+		goto BAD;
+
+	idx->blocks = idx->length / idx->block_size;
+	idx->weak   = (unsigned int *)malloc(sizeof(unsigned int) * (idx->blocks + 1));
+	idx->strong = (unsigned char *)malloc(idx->strong_len * (idx->blocks + 1));
+	if (!idx->weak || !idx->strong)
+		goto BAD;
+	entry_len = 4 + idx->strong_len;
+	for (i = 0; i < idx->blocks; i++)
+	{
+		if (fread(entry, 1, entry_len, fp) != entry_len)
+			goto BAD;
+		idx->weak[i] = (unsigned int)entry[0] << 24 | entry[1] << 16 | entry[2] << 8 | entry[3];
+		memcpy(idx->strong + i * idx->strong_len, entry + 4, idx->strong_len);
+	}
+	fclose(fp);
+	return 0;
+BAD:
+	LOG_ERROR("%s is not a block index", index_name);
+	fclose(fp);
+	delta_free_index(idx);
+	return ERR_FALSE;
+}
+
+void delta_free_index(delta_index_t *idx)
+{
+	free(idx->weak);
+	free(idx->strong);
+	idx->weak   = NULL;
+	idx->strong = NULL;
+}
+
+/*
+ * Slide a block sized window over base a byte at a time and look its weak
+ * sum up, the sha256 is only taken on a weak hit. A match skips the window
+ * ahead by a whole block.
+ */
+int delta_match(const delta_index_t *idx, const char *base, int *base_off)
+{
+	unsigned char md[SHA256_LEN];
+	const unsigned char *p;
+	unsigned int weak, a, b, mask;
+	int *head, *next;
+	int fd, bs = idx->block_size, i, found = 0;
+	int off, size;
+	struct stat sb;
+
+	for (i = 0; i < idx->blocks; i++)
+		base_off[i] = -1;
+	if (idx->blocks == 0 || (fd = open(base, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &sb) != 0 || sb.st_size < bs || sb.st_size > INT_MAX ||
+			(p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	size = sb.st_size;
+	madvise((void *)p, size, MADV_SEQUENTIAL);
+
+	// blocks chained by weak sum, in file order
+	for (mask = 1; mask < idx->blocks * 2; mask <<= 1)
+		;
+	head = (int *)malloc(sizeof(int) * mask--);
+	next = (int *)malloc(sizeof(int) * idx->blocks);
+	if (!head || !next)
+		goto OUT;
+	memset(head, -1, sizeof(int) * (mask + 1));
+	for (i = idx->blocks - 1; i >= 0; i--)
+	{
+		next[i] = head[idx->weak[i] & mask];
+		head[idx->weak[i] & mask] = i;
+	}
+
+	off  = 0;
+	weak = _weak_sum(p, bs, &a, &b);
+	while (1)
+	{
+		int matched = 0, hashed = 0;
+		for (i = head[weak & mask]; i >= 0; i = next[i])
+		{
+			if (idx->weak[i] != weak)
+				continue;
+			if (!hashed)
+			{
+				sha256_digest(p + off, bs, md);
+				hashed = 1;
+			}
+			if (memcmp(md, idx->strong + i * idx->strong_len, idx->strong_len) != 0)
+				continue;
+			matched = 1;
+			if (base_off[i] < 0)
+			{
+				base_off[i] = off;
+				found++;
+			}
+		}
+		if (matched)
+		{
+			if (off + 2 * bs > size)
+				break;
+			off += bs;
+			weak = _weak_sum(p + off, bs, &a, &b);
+			continue;
+		}
+		if (off + bs >= size)
+			break;
+		a = (a - p[off] + p[off + bs]) & 0xffff;
+		b = (b - (unsigned int)bs * p[off] + a) & 0xffff;
+		weak = a | (b << 16);
+		off++;
+	}
+OUT:
+	free(head);
+	free(next);
+	munmap((void *)p, size);
+	return found;
+}
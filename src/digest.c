@@ -0,0 +1,181 @@
+#include "digest.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CRC32C_POLY    0x82F63B78    // reversed Castagnoli polynomial
+
+static unsigned int crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static unsigned int (*crc32c_impl)(unsigned int, const unsigned char *, size_t);
+
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *buf, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *buf, size_t len)
+{
+	unsigned long long crc64 = crc;
+	while (len && ((size_t)buf & 7))
+	{
+		crc64 = __builtin_ia32_crc32qi((unsigned int)crc64, *buf++);
+		len--;
+	}
+	while (len >= 8)
+	{
+		crc64 = __builtin_ia32_crc32di(crc64, *(const unsigned long long *)buf);
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc64 = __builtin_ia32_crc32qi((unsigned int)crc64, *buf++);
+	return (unsigned int)crc64;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *buf, size_t len)
+{
+	while (len && ((size_t)buf & 7))
+	{
+		crc = __crc32cb(crc, *buf++);
+		len--;
+	}
+	while (len >= 8)
+	{
+		crc = __crc32cd(crc, *(const unsigned long long *)buf);
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32cb(crc, *buf++);
+	return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	unsigned int i, j, crc;
+	for (i = 0; i < 256; i++)
+	{
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_hw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_impl = crc32c_hw;
+#endif
+}
+
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_impl(~crc, (const unsigned char *)buf, len);
+}
+
+static unsigned int gf2_matrix_times(const unsigned int *mat, unsigned int vec)
+{
+	unsigned int sum = 0;
+	while (vec)
+	{
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(unsigned int *square, const unsigned int *mat)
+{
+	int n;
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// same method as zlib's crc32_combine, with the crc32c polynomial
+unsigned int crc32c_combine(unsigned int crc1, unsigned int crc2, size_t len2)
+{
+	unsigned int even[32], odd[32], row;
+	int n;
+
+	if (len2 == 0)
+		return crc1;
+
+	// operator for one zero bit in odd
+	odd[0] = CRC32C_POLY;
+	row = 1;
+	for (n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);    // two zero bits
+	gf2_matrix_square(odd, even);    // four zero bits
+
+	// apply len2 zeros to crc1, the first square puts the operator for one zero byte in even
+	do
+	{
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+// libcrypto picks the SHA-NI / AVX2 code path for the running cpu
+int sha256_init(sha256_ctx_t *sha)
+{
+	if (!(sha->ctx = EVP_MD_CTX_new()))
+		return -1;
+	if (EVP_DigestInit_ex(sha->ctx, EVP_sha256(), NULL) != 1)
+	{
+		EVP_MD_CTX_free(sha->ctx);
+		sha->ctx = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void sha256_update(sha256_ctx_t *sha, const void *buf, size_t len)
+{
+	EVP_DigestUpdate(sha->ctx, buf, len);
+}
+
+void sha256_final_hex(sha256_ctx_t *sha, char hex[SHA256_HEX_LEN + 1])
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len = 0, i;
+
+	EVP_DigestFinal_ex(sha->ctx, md, &md_len);
+	EVP_MD_CTX_free(sha->ctx);
+	sha->ctx = NULL;
+	for (i = 0; i < md_len; i++)
+		sprintf(hex + i * 2, "%02x", md[i]);
+	hex[md_len * 2] = '\0';
+}
+
+int sha256_digest(const void *buf, size_t len, unsigned char md[SHA256_LEN])
+{
+	return EVP_Digest(buf, len, md, NULL, EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
@@ -0,0 +1,28 @@
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#define SHA256_LEN         32
+#define SHA256_HEX_LEN     64
+#define CRC32C_HEX_LEN     8
+
+// crc32c, start with crc 0
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+// crc of A followed by B, from crc(A), crc(B) and the length of B
+unsigned int crc32c_combine(unsigned int crc1, unsigned int crc2, size_t len2);
+
+typedef struct _sha256_ctx
+{
+	EVP_MD_CTX    *ctx;
+}sha256_ctx_t;
+
+int sha256_init(sha256_ctx_t *sha);
+void sha256_update(sha256_ctx_t *sha, const void *buf, size_t len);
+// write the lower case hex digest to hex, and free the context
+void sha256_final_hex(sha256_ctx_t *sha, char hex[SHA256_HEX_LEN + 1]);
+// digest of one buffer
+int sha256_digest(const void *buf, size_t len, unsigned char md[SHA256_LEN]);
+
+#endif
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
 #include "downloader_imp.h"
+#include "conn.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,13 +17,14 @@
 #include <unistd.h>
 
 #include <sys/mman.h>
+#include <float.h>
+#include <time.h>
 
 #define TMP_DIR                    ".easy_downloader"
 #define TMP_FILE_SUFFIX_FMT        "._tmp_%d"
 #define DB_FILE_NAME               "downloader_db"
 
 
-#define MAX_PART_NUMBER    15
 #define MIN_PART_SIZE      (1024 * 256)     // 256K
 						
 // SQL syntax
@@ -33,43 +36,739 @@
 						  "tmp_file_name_fmt varchar(255), "             \
 						  "parts TINYINT, "                              \
 						  "average_len INT, "                            \
-						  "last_part_len INT)"                           \
-
-#define SQL_INSERT_VALUES  "insert into d_breakpoints values ("           \
-                           "'%s', '%s', '%s', '%d', '%s', %d, %d, %d)"              \
-
-#define SQL_QUERY_TABLE    "select * from d_breakpoints where file_name='%s'"
+						  "last_part_len INT, "                          \
+						  "etag varchar(255), "                          \
+						  "last_modified varchar(255), "                 \
+						  "expected_sha256 varchar(64), "                \
+						  "expected_crc32c varchar(8), "                 \
+						  "mirrors text);"                               \
+                          "create table if not exists d_parts ("         \
+                          "file_name varchar(255), "                     \
+						  "file_saved_path varchar(255), "               \
+						  "part_id TINYINT, "                            \
+						  "verified_len INT, "                           \
+						  "crc32c INT, "                                 \
+						  "primary key (file_name, file_saved_path, part_id));" \
+                          "create table if not exists d_listings ("      \
+                          "dir_url varchar(255), "                       \
+						  "name varchar(255), "                          \
+						  "size INT, "                                   \
+						  "modify varchar(128), "                        \
+						  "primary key (dir_url, name));"                \
+                          "create table if not exists d_cache_keys ("    \
+                          "key text primary key, "                       \
+						  "sha256 varchar(64));"                         \
+                          "create table if not exists d_cache_blobs ("   \
+                          "sha256 varchar(64) primary key, "             \
+						  "length INT, "                                 \
+						  "mtime INT, "                                  \
+						  "last_used INT)"                               \
+
+#define SQL_INSERT_VALUES  "insert into d_breakpoints (file_name, file_url, file_saved_path, file_length, "  \
+                           "tmp_file_name_fmt, parts, average_len, last_part_len, etag, last_modified, "    \
+                           "expected_sha256, expected_crc32c, mirrors) "                                    \
+                           "values ('%q', '%q', '%q', '%d', '%q', %d, %d, %d, '%q', '%q', '%q', '%q', '%q')" \
+
+#define SQL_UPDATE_FILE    "update d_breakpoints set file_url='%q', file_length=%d, parts=%d, average_len=%d, " \
+                           "last_part_len=%d, etag='%q', last_modified='%q', mirrors='%q' "                   \
+                           "where file_name='%q' and file_saved_path='%q'"                                    \
+
+#define SQL_QUERY_TABLE    "select file_name, file_url, file_saved_path, file_length, tmp_file_name_fmt, "    \
+                           "parts, average_len, last_part_len, etag, last_modified, expected_sha256, "        \
+                           "expected_crc32c, mirrors from d_breakpoints where file_name='%s'"
 
 #define SQL_QUERY_ALL      "select file_name, file_saved_path, file_length, tmp_file_name_fmt," \
                            " parts from d_breakpoints"                                           \
 
 #define SQL_DEL_FILE       "delete from d_breakpoints where file_name is '%s' and file_saved_path is '%s'"
 
+#define SQL_SAVE_PART      "insert or replace into d_parts values ('%q', '%q', %d, %d, %u)"
+#define SQL_QUERY_PART     "select verified_len, crc32c from d_parts where file_name='%q' " \
+                           "and file_saved_path='%q' and part_id=%d"
+#define SQL_DEL_PARTS      "delete from d_parts where file_name='%q' and file_saved_path='%q'"
+
+// save the digest of a part file at most every 4M, bytes after it are re-fetched on resume
+#define PART_CHECKPOINT_LEN    (1024 * 1024 * 4)
+
+#define MAX_REVALIDATE_TIMES   3
+
+#define SMALL_FILE_SIZE        (1024 * 64)     // smaller files skip the tmp files and the db
+
+#define MAX_FLIGHT_KEY_LEN     (MAX_URL_LEN + MAX_VALIDATOR_LEN * 2 + SHA256_HEX_LEN + CRC32C_HEX_LEN + 32)
+
+#define DELTA_INDEX_SUFFIX     ".edidx"
+#define DELTA_MERGE_GAP        (1024 * 64)     // fewer matched bytes between two fetched ranges are fetched too
+#define DELTA_COPY_LEN         (1024 * 1024)   // most bytes taken from the old copy in one read
+
+#define STREAM_WINDOW          (1024 * 1024 * 32)    // most bytes a part may get ahead of the stream
+
+#define RANGE_MERGE_GAP        (1024 * 16)     // ranges closer than this are fetched as one
+
+#define EXTRACT_SPOOL_FMT      "%sextract_XXXXXX"
+#define EXTRACT_PUNCH_LEN      (1024 * 1024 * 8)     // unpacked spool bytes freed at once
+
+#define MAX_MIRROR_FAILURES    3       // consecutive failures before a mirror is dropped
+#define MIRROR_REPORT_INTERVAL 1.0     // seconds between two rate samples of a part
+#define MIRROR_SLOW_FACTOR     4       // a part leaves a mirror this much slower than another
+
+#define OVERWRITE_TMP_FMT      "%s.part"       // a file to overwrite is downloaded as this first
+
+#define PROGRESS_INTERVAL_MS   200     // between two progress events while bytes arrive
+#define PROGRESS_SMOOTHING     0.3     // weight of the latest rate in the speed
+#define PROGRESS_FOLLOWERS     16      // follower callbacks copied on the stack, more are malloc'd
+#define MAX_MIRRORS_STR_LEN    (MAX_MIRROR_NUMBER * (MAX_URL_LEN + MAX_VALIDATOR_LEN * 2 + 3))
+
 char download_tmp_path[PATH_MAX];
 char file_saved_def_path[PATH_MAX];
+static int small_file_size = SMALL_FILE_SIZE;
+static int max_parts = MAX_PART_NUMBER;
+static int progress_interval = PROGRESS_INTERVAL_MS;
+static int progress_bytes = 0;
+static char trace_file[PATH_MAX];     // from TRACE_ENV, dumped at destroy
+static int task_ids;                  // the last task number given, for log records
+
+// downloads in progress, a task for the same object joins instead of fetching it again
+struct _d_flight
+{
+	char               key[MAX_FLIGHT_KEY_LEN];
+	char               file_path[PATH_MAX];   // the leader's file
+	d_task_t           *followers;
+	struct _d_flight   *next;
+};
+
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static d_flight_t *flights;
+
+static void download_task_init(d_task_t *d_task, d_callback finished, d_callback progress);
 
 #define ERR_RET_VAL        ((void*)(-1))
 
 
 
-static void *download_part_entry(void *arg)
+static void _save_part_digest(part_info_t *part)
+{
+	char sql_buf[PATH_MAX * 2 + 128];
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_SAVE_PART, part->file->filename,
+			part->d_task->file_saved_path, part->id, part->crc_len, part->crc);
+	db_execute(part->d_task->dm->db_key, sql_buf, NULL);
+	part->saved_len = part->crc_len;
+	CRASH_POINT("checkpoint");
+}
+
+// a part without a row is from an older version and is not verified on resume
+static void _init_part_digests(d_task_t *d_task, file_info_t *file, int parts)
+{
+	char sql_buf[PATH_MAX * 2 + 128];
+	int i;
+	for (i = 0; i < parts; i++)
+	{
+		sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_SAVE_PART, file->filename,
+				d_task->file_saved_path, i, 0, 0);
+		db_execute(d_task->dm->db_key, sql_buf, NULL);
+	}
+}
+
+static void _set_mirror_protocol(mirror_info_t *m)
+{
+	switch(protocol(m->url))
+	{
+		case HTTP:
+		case HTTPS:
+			m->request_file_info = http_request_file_info;
+			m->request_part_file = http_request_part_file;
+			break;
+		case FTP:
+		case FTPS:
+			m->request_file_info = ftp_request_file_info;
+			m->request_part_file = ftp_request_part_file;
+			break;
+	}
+}
+
+static void _reset_mirror(mirror_info_t *m)
+{
+	m->rate     = 0;
+	m->active   = 0;
+	m->failures = 0;
+	m->dropped  = 0;
+}
+
+/*
+ * Pick the source for the next attempt of a part. Mirrors nobody has
+ * measured yet are tried first, then the one with the best rate per
+ * connection shared by the parts already on it, so the parts spread over
+ * the mirrors in proportion to their throughput. probe is set if the
+ * caller has to probe the mirror first, no other part picks it meanwhile.
+ */
+static mirror_info_t *_mirror_acquire(d_task_t *d_task, int *probe)
+{
+	mirror_info_t *best = NULL;
+	double score, best_score = -1;
+	int i;
+
+	pthread_mutex_lock(d_task->mirror_mutex);
+	for (i = 0; i < d_task->nmirrors; i++)
+	{
+		mirror_info_t *m = &d_task->mirrors[i];
+		if (m->dropped || m->probe == MIRROR_PROBING)
+			continue;
+		if (m->rate == 0)
+			score = DBL_MAX / (m->active + 1);
+		else
+			score = m->rate / (m->active + 1);
+		if (score > best_score)
+		{
+			best = m;
+			best_score = score;
+		}
+	}
+	if (best)
+	{
+		best->active++;
+		if ((*probe = best->probe == MIRROR_UNPROBED))
+			best->probe = MIRROR_PROBING;
+	}
+	pthread_mutex_unlock(d_task->mirror_mutex);
+	return best;
+}
+
+// ask m for its copy of file, it is dropped for the task if it has none of the same length
+static int _mirror_probe(d_task_t *d_task, mirror_info_t *m, const file_info_t *file)
+{
+	char real_url[MAX_URL_LEN];
+	file_info_t info;
+	int ret;
+
+	if ((ret = m->request_file_info(m->url, &info, real_url)) == 0 && info.length != file->length)
+		ret = ERR_FALSE;
+	pthread_mutex_lock(d_task->mirror_mutex);
+	if (ret == 0)
+	{
+		m->info = info;
+		strcpy(m->url, real_url);
+	}
+	else
+	{
+		m->active--;
+		m->dropped = 1;
+	}
+	m->probe = MIRROR_PROBED;
+	pthread_mutex_unlock(d_task->mirror_mutex);
+	if (ret != 0)
+		LOG_WARN("mirror %s does not serve the same file, skip it", m->url);
+	return ret;
+}
+
+// fold the bytes got since the last report into the mirror rate
+static int _mirror_report(part_info_t *part, double now)
+{
+	d_task_t *d_task = part->d_task;
+	mirror_info_t *m = part->mirror;
+	double elapsed = now - part->report_time;
+	double rate, best = 0;
+	int i, ret = 0;
+
+	if (elapsed <= 0)
+		return 0;
+	rate = (part->crc_len - part->report_len) / elapsed;
+	part->report_time = now;
+	part->report_len  = part->crc_len;
+
+	pthread_mutex_lock(d_task->mirror_mutex);
+	m->rate = m->rate == 0 ? rate : m->rate * 0.7 + rate * 0.3;
+	if (now - part->attempt_start >= MIRROR_REPORT_INTERVAL)
+	{
+		for (i = 0; i < d_task->nmirrors; i++)
+		{
+			mirror_info_t *other = &d_task->mirrors[i];
+			if (other != m && !other->dropped && other->rate / (other->active + 1) > best)
+				best = other->rate / (other->active + 1);
+		}
+		// let a faster mirror go on with the rest of this part
+		if (rate * MIRROR_SLOW_FACTOR < best)
+			ret = ERR_SLOW_SOURCE;
+	}
+	pthread_mutex_unlock(d_task->mirror_mutex);
+	return ret;
+}
+
+static void _mirror_release(part_info_t *part, int ret)
+{
+	d_task_t *d_task = part->d_task;
+	mirror_info_t *m = part->mirror;
+
+	if (ret != ERR_SLOW_SOURCE)
+		_mirror_report(part, now_seconds());
+	pthread_mutex_lock(d_task->mirror_mutex);
+	m->active--;
+	if (ret == ERR_RES_CHANGED)
+		m->dropped = 1;
+	else if (ret == ERR_SLOW_SOURCE)
+		;   // not a failure, the rate already tells it is slow
+	else if (ret != 0 || part->crc_len == part->attempt_len)
+	{
+		if (++m->failures >= MAX_MIRROR_FAILURES)
+			m->dropped = 1;
+	}
+	else
+		m->failures = 0;
+	pthread_mutex_unlock(d_task->mirror_mutex);
+	part->mirror = NULL;
+}
+
+#define _streaming(d_task)   ((d_task)->stream_cb || (d_task)->stream_fd > 0 || (d_task)->untar)
+
+// the offsets keep counting after the consumer is gone, the download goes on
+static void _stream_out(d_task_t *d_task, const char *buf, int len)
 {
-	part_info_t *part = (part_info_t *)arg;
 	int ret = 0;
-	while (ret == 0 && part->end_pos - part->beg_pos + 1 > 0)
-		ret = part->d_task->request_part_file(part);
+	if (!d_task->stream_err)
+	{
+		if (d_task->untar)
+			ret = untar_write(d_task->untar, buf, len);
+		else if (d_task->stream_cb)
+			ret = d_task->stream_cb(d_task->stream_ctx, buf, len) < 0 ? ERR_IO_WRITE : 0;
+		else
+			ret = write_n_chars(d_task->stream_fd, buf, len) == len ? 0 : ERR_IO_WRITE;
+		if (ret != 0)
+		{
+			if (!d_task->untar)
+				LOG_WARN("stream closed, the download goes on");
+			__atomic_store_n(&d_task->stream_err, ret, __ATOMIC_RELEASE);
+		}
+	}
+	__atomic_store_n(&d_task->stream_off, d_task->stream_off + len, __ATOMIC_RELEASE);
+
+	// the spool only has to keep what is not unpacked yet
+	if (d_task->untar && d_task->stream_off - d_task->extract_punched >= EXTRACT_PUNCH_LEN)
+	{
+		fallocate(d_task->extract_sink.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				d_task->extract_punched, d_task->stream_off - d_task->extract_punched);
+		d_task->extract_punched = d_task->stream_off;
+	}
+}
+
+// deliver bytes [from, to) of an open file
+static int _stream_fd(d_task_t *d_task, int fd, int from, int to)
+{
+	char buf[1024 * 64];
+	int n;
+
+	while (from < to && (n = pread(fd, buf, to - from < sizeof(buf) ? to - from : sizeof(buf), from)) > 0)
+	{
+		_stream_out(d_task, buf, n);
+		from += n;
+	}
+	return from < to ? ERR_IO_READ : 0;
+}
+
+// deliver bytes [from, to) of a file on disk
+static int _stream_file(d_task_t *d_task, const char *file_name, int from, int to)
+{
+	int fd, ret;
+
+	if (from >= to)
+		return 0;
+	if ((fd = open(file_name, O_RDONLY)) < 0)
+		return ERR_IO_READ;
+	ret = _stream_fd(d_task, fd, from, to);
+	close(fd);
+	return ret;
+}
+
+// deliver bytes [from, to) of the file from the task's sink, memory or a seekable fd
+static int _stream_sink(d_task_t *d_task, int from, int to)
+{
+	d_sink_t *sink = d_task->sink;
+
+	if (sink->type == D_SINK_MEMORY)
+	{
+		if (from < to)
+			_stream_out(d_task, sink->buf + from, to - from);
+		return 0;
+	}
+	return _stream_fd(d_task, sink->fd, from, to);
+}
+
+// the bytes part saved so far are flushed, the stream may read them back
+static void _stream_publish(part_info_t *part)
+{
+	__atomic_store_n(&part->stream_len, part->crc_len, __ATOMIC_RELEASE);
+}
+
+/*
+ * Deliver what the parts published, in order, and move the head over the
+ * parts complete. One thread delivers at a time and outside stream_mutex,
+ * so the parts keep writing meanwhile; a part publishing while another
+ * delivers leaves its bytes to that one. buf holds the n bytes from just
+ * wrote at offset at, they go out without a read back if they are next.
+ */
+static void _stream_deliver(d_task_t *d_task, part_info_t *from, const char *buf, int n, int at)
+{
+	char tmp_file_name[PATH_MAX];
+	part_info_t *part;
+	int to, ret;
+
+	pthread_mutex_lock(d_task->stream_mutex);
+	if (d_task->stream_busy)
+	{
+		d_task->stream_again = 1;
+		pthread_mutex_unlock(d_task->stream_mutex);
+		return;
+	}
+	d_task->stream_busy = 1;
+	do
+	{
+		d_task->stream_again = 0;
+		while (d_task->stream_head < d_task->stream_nparts && !d_task->stream_err)
+		{
+			part = &d_task->stream_parts[d_task->stream_head];
+			to   = part->stream_start + __atomic_load_n(&part->stream_len, __ATOMIC_ACQUIRE);
+			ret  = 0;
+			pthread_mutex_unlock(d_task->stream_mutex);
+
+			if (part == from && buf && d_task->stream_off == at)
+				_stream_out(d_task, buf, n);
+			else if (to > d_task->stream_off && d_task->sink)
+				ret = _stream_sink(d_task, d_task->stream_off, to);
+			else if (to > d_task->stream_off)
+			{
+				if (!part->file_name)
+					snprintf(tmp_file_name, PATH_MAX, d_task->tmp_file_name_fmt, part->id);
+				ret = _stream_file(d_task, part->file_name ? part->file_name : tmp_file_name,
+						d_task->stream_off - part->stream_start, to - part->stream_start);
+			}
+
+			pthread_mutex_lock(d_task->stream_mutex);
+			pthread_cond_broadcast(d_task->stream_cond);
+			if (ret != 0)
+			{
+				LOG_ERROR("stream: can't read back part %d", part->id);
+				d_task->stream_err = ERR_IO_READ;
+			}
+			if (d_task->stream_off <= part->end_pos)
+				break;
+			__atomic_store_n(&d_task->stream_head, d_task->stream_head + 1, __ATOMIC_RELEASE);
+		}
+	} while (d_task->stream_again);
+	d_task->stream_busy = 0;
+	pthread_mutex_unlock(d_task->stream_mutex);
+}
+
+/*
+ * n bytes just saved by part at offset at. The head flushes and hands them
+ * on, the other parts go on without a lock unless they are too far ahead.
+ */
+static int _stream_part(part_info_t *part, part_sink_t *sink, const char *buf, int n, int at)
+{
+	d_task_t *d_task = part->d_task;
+	int head = __atomic_load_n(&d_task->stream_head, __ATOMIC_ACQUIRE);
+
+	if (head < d_task->stream_nparts && part == &d_task->stream_parts[head])
+	{
+		if (sink->flush(sink) != 0)
+			return ERR_IO_WRITE;
+		_stream_publish(part);
+		_stream_deliver(d_task, part, buf, n, at);
+	}
+	else if (part->beg_pos - __atomic_load_n(&d_task->stream_off, __ATOMIC_ACQUIRE) > STREAM_WINDOW)
+	{
+		pthread_mutex_lock(d_task->stream_mutex);
+		while (part->beg_pos - d_task->stream_off > STREAM_WINDOW && !d_task->stream_stalled && !d_task->stream_err)
+			pthread_cond_wait(d_task->stream_cond, d_task->stream_mutex);
+		pthread_mutex_unlock(d_task->stream_mutex);
+	}
+	return 0;
+}
+
+// start delivering parts live, or stop with parts NULL
+static void _stream_parts(d_task_t *d_task, part_info_t *parts, int nparts)
+{
+	int i;
+
+	if (!_streaming(d_task))
+		return;
+	for (i = 0; i < nparts; i++)
+	{
+		parts[i].stream_start = parts[i].beg_pos - parts[i].crc_len;
+		parts[i].stream_len   = parts[i].crc_len;
+	}
+	pthread_mutex_lock(d_task->stream_mutex);
+	d_task->stream_parts   = parts;
+	d_task->stream_nparts  = nparts;
+	d_task->stream_head    = 0;
+	d_task->stream_stalled = 0;
+	d_task->stream_busy    = 0;
+	d_task->stream_again   = 0;
+	pthread_mutex_unlock(d_task->stream_mutex);
+	if (parts)
+		_stream_deliver(d_task, NULL, NULL, 0, 0);
+}
+
+// the rest of a complete file, for a task not or not all streamed live
+static void _stream_finish(d_task_t *d_task, const char *file_name)
+{
+	struct stat sb;
+	if (!_streaming(d_task) || stat(file_name, &sb) != 0)
+		return;
+	pthread_mutex_lock(d_task->stream_mutex);
+	_stream_file(d_task, file_name, d_task->stream_off, sb.st_size);
+	pthread_mutex_unlock(d_task->stream_mutex);
+}
+
+// someone listens, the task's own callback or the tasks that joined it
+static int _progress_wanted(d_task_t *d_task)
+{
+	return d_task->progress_callback || (d_task->flight && d_task->flight->followers);
+}
+
+// a progress event and a status update if one is due, or any news if
+// force. The task's thread only
+static void _progress_emit(d_task_t *d_task, int force)
+{
+	d_part_progress_t parts[MAX_PART_NUMBER];
+	int errors[MAX_PART_NUMBER];
+	d_progress_t pt;
+	d_task_t *follower;
+	d_callback stack_cbs[PROGRESS_FOLLOWERS], *cbs = stack_cbs;
+	double now = now_seconds(), rate;
+	int len = __sync_add_and_fetch(&d_task->len_downloaded, 0), i, n = 0;
+
+	if (len == d_task->progress_sent || (!_progress_wanted(d_task) && d_task->status_slot < 0))
+		return;
+	if (!force && !(progress_interval > 0 && now - d_task->progress_time >= progress_interval / 1000.0) &&
+			!(progress_bytes > 0 && len - d_task->progress_sent >= progress_bytes))
+		return;
+	// a restarted download counts from 0 again
+	if (len > d_task->progress_sent && now > d_task->progress_time)
+	{
+		rate = (len - d_task->progress_sent) / (now - d_task->progress_time);
+		d_task->progress_speed = d_task->progress_speed > 0 ?
+			d_task->progress_speed * (1 - PROGRESS_SMOOTHING) + rate * PROGRESS_SMOOTHING : rate;
+	}
+	d_task->progress_sent = len;
+	d_task->progress_time = now;
+
+	pt.bytes_recv  = len;
+	pt.bytes_total = d_task->progress_total;
+	pt.speed       = d_task->progress_speed;
+	pt.eta         = pt.speed > 0 ? (pt.bytes_total - len) / pt.speed : -1;
+	pt.nparts      = d_task->progress_nparts;
+	pt.parts       = parts;
+	for (i = 0; i < pt.nparts; i++)
+	{
+		part_info_t *part = &d_task->progress_parts[i];
+		parts[i].offset     = part->progress_offset;
+		parts[i].length     = part->progress_len;
+		parts[i].bytes_recv = __atomic_load_n(&part->crc_len, __ATOMIC_RELAXED);
+		errors[i]           = part->last_error;
+	}
+	status_update(d_task->status_slot, &pt, errors);
+	if (d_task->progress_callback)
+		d_task->progress_callback(&pt);
+	// the tasks that joined see the leader's progress, their callbacks are
+	// copied out so none runs under flight_mutex
+	if (d_task->flight && d_task->flight->followers)
+	{
+		pthread_mutex_lock(&flight_mutex);
+		for (follower = d_task->flight ? d_task->flight->followers : NULL; follower; follower = follower->flight_next)
+			n += follower->progress_callback != NULL;
+		if (n > PROGRESS_FOLLOWERS && !(cbs = (d_callback *)malloc(n * sizeof(d_callback))))
+		{
+			cbs = stack_cbs;
+			n   = PROGRESS_FOLLOWERS;
+		}
+		for (i = 0, follower = d_task->flight ? d_task->flight->followers : NULL; follower && i < n;
+				follower = follower->flight_next)
+		{
+			if (follower->progress_callback)
+				cbs[i++] = follower->progress_callback;
+		}
+		pthread_mutex_unlock(&flight_mutex);
+		for (i = 0; i < n; i++)
+			cbs[i](&pt);
+		if (cbs != stack_cbs)
+			free(cbs);
+	}
+}
+
+// the parts reported in detail, all of them set up; NULL once they are
+// done. The first ones take a slot of the status file for the task
+static void _progress_parts(d_task_t *d_task, part_info_t *parts, int nparts)
+{
+	char file_name[PATH_MAX];
+	int i;
+
+	if (!parts)
+		_progress_emit(d_task, 1);
+	for (i = 0; i < nparts; i++)
+	{
+		parts[i].progress_offset = parts[i].beg_pos - parts[i].crc_len;
+		parts[i].progress_len    = parts[i].end_pos - parts[i].progress_offset + 1;
+		parts[i].last_error      = 0;
+	}
+	if (nparts > 0)
+		d_task->progress_total = parts[0].file->length;
+	if (nparts > 0 && d_task->status_slot < 0)
+	{
+		snprintf(file_name, PATH_MAX, "%s/%s", d_task->file_saved_path, parts[0].file->filename);
+		d_task->status_slot = status_begin(d_task->tmp_file_name_fmt[0] ? d_task->tmp_file_name_fmt : file_name,
+				file_name, parts[0].file->length);
+	}
+	d_task->progress_parts  = parts;
+	d_task->progress_nparts = nparts;
+}
+
+// wait for n parts running on the pool, the progress is reported meanwhile
+static void _wait_parts(d_task_t *d_task, int n)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(d_task->part_mutex);
+	while (d_task->parts_exit < n)
+	{
+		if (progress_interval <= 0)
+			pthread_cond_wait(d_task->part_cond, d_task->part_mutex);
+		else
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec  += progress_interval / 1000;
+			ts.tv_nsec += progress_interval % 1000 * 1000000L;
+			if (ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(d_task->part_cond, d_task->part_mutex, &ts);
+		}
+		pthread_mutex_unlock(d_task->part_mutex);
+		_progress_emit(d_task, 0);
+		pthread_mutex_lock(d_task->part_mutex);
+	}
+	pthread_mutex_unlock(d_task->part_mutex);
+}
+
+static int _retry_cause(int ret)
+{
+	switch (ret)
+	{
+		case ERR_CONNECT:      return RETRY_CONNECT;
+		case ERR_IO_READ:      return RETRY_READ;
+		case ERR_RES_CHANGED:  return RETRY_CHANGED;
+		case ERR_SLOW_SOURCE:  return RETRY_SLOW;
+	}
+	return RETRY_OTHER;
+}
+
+// download a part, moving between the mirrors until it is done or none is left
+static int _download_part(part_info_t *part)
+{
+	d_task_t *d_task = part->d_task;
+	mirror_info_t *m;
+	int ret = ERR_FALSE, attempts = 0, probe;
+	long long start;
+
+	TRACE_PART(part->id);
+	log_context(d_task->log_id, part->id);
+	while (part->end_pos - part->beg_pos + 1 > 0)
+	{
+		if (!(m = _mirror_acquire(d_task, &probe)))
+			break;
+		if (probe && _mirror_probe(d_task, m, part->file) != 0)
+			continue;
+		if (attempts++ > 0)
+		{
+			metrics_retry(_retry_cause(ret));
+			TRACE_MARK("retry", _retry_cause(ret));
+		}
+		part->mirror        = m;
+		part->src           = &m->info;
+		part->metric_host   = metrics_host(m->info.d_url.host);
+		log_host(m->info.d_url.host);
+		part->attempt_start = part->report_time = now_seconds();
+		part->attempt_len   = part->report_len  = part->crc_len;
+
+		start = TRACE_START();
+		ret = m->request_part_file(part);
+		part->last_error = ret;
+		TRACE_SPAN("part", start, part->crc_len - part->attempt_len);
+		_mirror_release(part, ret);
+		if (part->crc_len > part->attempt_len)
+		{
+			metrics_observe(HIST_PART_BYTES, part->crc_len - part->attempt_len);
+			metrics_observe(HIST_RANGE_RATE, (part->crc_len - part->attempt_len) /
+					(now_seconds() - part->attempt_start + DBL_EPSILON));
+		}
+
+		// the task url changed, the other mirrors are no better; the sibling
+		// parts see it at their next write and stop too
+		if (ret == ERR_RES_CHANGED && (m == &d_task->mirrors[0] || __atomic_load_n(&d_task->res_changed, __ATOMIC_ACQUIRE)))
+		{
+			__atomic_store_n(&d_task->res_changed, 1, __ATOMIC_RELEASE);
+			break;
+		}
+		if (ret == ERR_IO_WRITE || ret == -2)
+			break;
+	}
+	if (part->end_pos - part->beg_pos + 1 <= 0)
+		ret = 0;
 	part->finished = (ret == 0 ? 1 : 0);
+	TRACE_MARK(part->finished ? "part done" : "part failed", ret);
+
+	if (ret == ERR_RES_CHANGED)
+		__atomic_store_n(&d_task->res_changed, 1, __ATOMIC_RELEASE);
+	else if (part->crc_len != part->saved_len && !part->file_name && !d_task->sink)
+		_save_part_digest(part);
+	// its sink is closed, what it saved ahead of the head goes out once the head gets there
+	if (d_task->stream_parts)
+	{
+		_stream_publish(part);
+		_stream_deliver(d_task, NULL, NULL, 0, 0);
+	}
+	TRACE_PART(-1);
+	log_context(0, -1);
+	return ret;
+}
+
+static void *download_part_entry(void *arg)
+{
+	part_info_t *part = (part_info_t *)arg;
+	int ret = _download_part(part);
 
 	if (ret == -2)
+	{
+		log_flush();
 		exit(-1);     // can not continue;
+	}
+	// the parts ahead must not wait for a head which is not coming
+	if (!part->finished && part->d_task->stream_parts)
+	{
+		pthread_mutex_lock(part->d_task->stream_mutex);
+		part->d_task->stream_stalled = 1;
+		pthread_cond_broadcast(part->d_task->stream_cond);
+		pthread_mutex_unlock(part->d_task->stream_mutex);
+	}
+	return NULL;
+}
 
-	pthread_mutex_lock(part->d_task->part_mutex);
-	part->d_task->parts_exit++;
-	pthread_mutex_unlock(part->d_task->part_mutex);
-	pthread_cond_signal(part->d_task->part_cond);
+/*
+ * A part is counted out once the pool is done with its task_desc, the
+ * waiter may return and free the descs as soon as the last one is.
+ */
+static void download_part_over(void *arg)
+{
+	part_info_t *part = (part_info_t *)((task_desc *)arg)->arg;
+	d_task_t *d_task = part->d_task;
+
+	pthread_mutex_lock(d_task->part_mutex);
+	d_task->parts_exit++;
+	pthread_cond_signal(d_task->part_cond);
+	pthread_mutex_unlock(d_task->part_mutex);
 }
 
-static int merge_files(const char *dst_file, int dst_len, char src_files[MAX_PART_NUMBER][PATH_MAX], int *src_lens, int nsrcs)
+// sha, if not NULL, is updated with the merged bytes in file order
+int merge_files(const char *dst_file, int dst_len, char src_files[MAX_PART_NUMBER][PATH_MAX], int *src_lens, int nsrcs,
+		sha256_ctx_t *sha)
 {
 	int src_fd, dst_fd, i;
 	void *src_buf, *dst_buf;
@@ -106,12 +805,14 @@ static int merge_files(const char *dst_file, int dst_len, char src_files[MAX_PAR
 			src_mapped_len = src_lens[i] > file_buffer_limit ? file_buffer_limit : src_lens[i];
 			if ((src_buf = mmap(NULL, src_mapped_len, PROT_READ, MAP_SHARED, src_fd, src_offset)) == MAP_FAILED)
 			{
+				LOG_ERROR("mmap src failed: %s", strerror(errno));
 				munmap(dst_buf, dst_mapped_len);
 				close(dst_fd);
 				close(src_fd);
-				perror("mmap src failed:");
 				return ERR_MERGE_FILES;
 			}
+			if (sha)
+				sha256_update(sha, src_buf, src_mapped_len);
 
 			src_lens[i] -= src_mapped_len;
 			src_offset  += src_mapped_len;
@@ -126,11 +827,11 @@ static int merge_files(const char *dst_file, int dst_len, char src_files[MAX_PAR
 				dst_mapped_len = dst_len > file_buffer_limit ? file_buffer_limit : dst_len;
 				if ((dst_buf = mmap(NULL, dst_mapped_len, PROT_READ | PROT_WRITE, MAP_SHARED, dst_fd, dst_offset)) == MAP_FAILED)
 				{
+					LOG_ERROR("mmap dest failed: %s, part id is %d, dst_mapped_len is %d, dst_offset is %d",
+							strerror(errno), i, dst_mapped_len, dst_offset);
 					munmap(src_buf, src_mapped_len);
 					close(src_fd);
 					close(dst_fd);
-					perror("mmap dest failed:");
-					fprintf(stderr, "part id is %d, dst_mapped_len is %d, dst_offset is %d\n", i, dst_mapped_len, dst_offset); 
 					return ERR_MERGE_FILES;
 				}
 
@@ -147,13 +848,94 @@ static int merge_files(const char *dst_file, int dst_len, char src_files[MAX_PAR
 #ifndef DEBUG
 		unlink(src_files[i]);
 #endif
+		CRASH_POINT("merge");
 	}
 	munmap(dst_buf - dst_mem_beg_pos, dst_mapped_len);
 	close(dst_fd);
 	return 0;
 }
 
-static void *dispatch_part_download(d_task_t *d_task, file_info_t *file, 
+/*
+ * Check a part file left by a previous run against the digest saved for it.
+ * Only the verified prefix is kept, a part whose bytes do not match is
+ * fetched again from its beginning. Return the length kept.
+ */
+static int _verify_part_file(d_task_t *d_task, file_info_t *file, part_info_t *part,
+		const char *tmp_file_name, int size)
+{
+	char sql_buf[PATH_MAX * 2 + 128];
+	char buf[1024 * 64];
+	char **results;
+	int row, col;
+	int verified_len = -1, len = 0, fd, n;
+	unsigned int saved_crc = 0, crc = 0;
+
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_QUERY_PART, file->filename, d_task->file_saved_path, part->id);
+	if (sqlite3_get_table(d_task->dm->db_key, sql_buf, &results, &row, &col, NULL) == SQLITE_OK)
+	{
+		if (row == 1)
+		{
+			sscanf(results[col], "%d", &verified_len);
+			sscanf(results[col + 1], "%u", &saved_crc);
+		}
+		sqlite3_free_table(results);
+	}
+
+	if ((fd = open(tmp_file_name, O_RDWR)) < 0)
+		return ERR_OPEN_TMP_FILE;
+	if (verified_len < 0)   // saved by an older version, nothing to check against
+	{
+		verified_len = size;
+		saved_crc = 0;
+	}
+	else if (verified_len > size)
+		len = -1;
+
+	while (len >= 0 && len < verified_len)
+	{
+		n = verified_len - len > sizeof(buf) ? sizeof(buf) : verified_len - len;
+		if ((n = read(fd, buf, n)) <= 0)
+			break;
+		crc = crc32c_update(crc, buf, n);
+		len += n;
+	}
+	if (len != verified_len || (saved_crc && crc != saved_crc))
+	{
+		LOG_WARN("part %d of %s is corrupted, download it again", part->id, file->filename);
+		verified_len = 0;
+		crc = 0;
+	}
+	if (verified_len != size)
+		ftruncate(fd, verified_len);
+	close(fd);
+
+	part->crc       = crc;
+	part->crc_len   = verified_len;
+	part->saved_len = verified_len;
+	return verified_len;
+}
+
+// the whole file crc32c from the part crcs, no need to read the file again
+static int _check_crc32c(d_task_t *d_task, part_info_t *parts_info, int *part_lens, int parts)
+{
+	char hex[CRC32C_HEX_LEN + 1];
+	unsigned int crc = 0;
+	int i;
+
+	if (!d_task->expected_crc32c[0])
+		return 0;
+	for (i = 0; i < parts; i++)
+		crc = crc32c_combine(crc, parts_info[i].crc, part_lens[i]);
+	snprintf(hex, sizeof(hex), "%08x", crc);
+	if (strcasecmp(hex, d_task->expected_crc32c) != 0)
+	{
+		LOG_ERROR("crc32c mismatch, expected %s but got %s", d_task->expected_crc32c, hex);
+		return ERR_DIGEST;
+	}
+	return 0;
+}
+
+static int dispatch_part_download(d_task_t *d_task, file_info_t *file, 
 		int per_part_len, int last_part_len, int parts)
 {
 	int i;
@@ -166,12 +948,12 @@ static void *dispatch_part_download(d_task_t *d_task, file_info_t *file,
 	int part_downloaded_len = 0;
 	struct stat sb;
 	int ret;
-	char sql_buf[256];
+	char sql_buf[PATH_MAX * 2 + 128];
 
 	for (i = 0; i < parts; i++)
 	{
 		descs[i].arg = &parts_info[i];
-		descs[i].fire_task_over = NULL;
+		descs[i].fire_task_over = download_part_over;
 		parts_info[i].beg_pos = offset;
 		if (i == parts - 1 && last_part_len > 0)
 			offset += last_part_len;
@@ -181,158 +963,1124 @@ static void *dispatch_part_download(d_task_t *d_task, file_info_t *file,
 		parts_info[i].d_task  = d_task;
 		parts_info[i].file    = file;
 		parts_info[i].id      = i;
+		parts_info[i].crc       = 0;
+		parts_info[i].crc_len   = 0;
+		parts_info[i].saved_len = 0;
+		parts_info[i].mirror    = NULL;
+		parts_info[i].src       = NULL;
+		parts_info[i].file_name = NULL;
 		part_lens[i]          = parts_info[i].end_pos - parts_info[i].beg_pos + 1;
 
 		snprintf(tmp_files_name[i], PATH_MAX, d_task->tmp_file_name_fmt, i);
 		ret = stat(tmp_files_name[i], &sb);
 		if (ret != 0 && errno != ENOENT)
 		{
-			perror("stat file size failed:");
-			return;
+			LOG_ERROR("stat file size failed: %s", strerror(errno));
+			return ERR_FALSE;
 		}
 		if (ret == 0)
 		{
-			parts_info[i].beg_pos += sb.st_size;
-			d_task->len_downloaded += sb.st_size;
+			int verified_len = _verify_part_file(d_task, file, &parts_info[i], tmp_files_name[i], sb.st_size);
+			if (verified_len < 0)
+				return verified_len;
+			parts_info[i].beg_pos += verified_len;
+			d_task->len_downloaded += verified_len;
 		}
+	}
+
+	// every part is set up before the stream may move over it
+	_stream_parts(d_task, parts_info, parts);
+	_progress_parts(d_task, parts_info, parts);
+	for (i = 0; i < parts; i++)
+	{
 		if (parts_info[i].end_pos - parts_info[i].beg_pos + 1 > 0)
 			easy_thread_pool_add_task(d_task->dm->tp, download_part_entry, &descs[i]);
+		else
+		{
+			parts_info[i].finished = 1;
+			pthread_mutex_lock(d_task->part_mutex);
+			d_task->parts_exit++;
+			pthread_mutex_unlock(d_task->part_mutex);
+		}
+	}
+
+	_wait_parts(d_task, parts);
+
+	if (!d_task->res_changed && d_task->len_downloaded < file->length)
+	{
+		// one more try for each part left, with every mirror allowed again
+		for (i = 0; i < d_task->nmirrors; i++)
+		{
+			if (d_task->mirrors[i].failures >= MAX_MIRROR_FAILURES)
+				_reset_mirror(&d_task->mirrors[i]);
+		}
+		for (i = 0; i < parts && !d_task->res_changed; i++)
+		{
+			if (!parts_info[i].finished)
+				_download_part(&parts_info[i]);
+		}
+	}
+	_progress_parts(d_task, NULL, 0);
+	// the bytes got so far belong to another version of the file
+	if (d_task->res_changed)
+		return ERR_RES_CHANGED;
+
+	if (d_task->len_downloaded < file->length)
+	{
+		LOG_ERROR("download failed");
+		return ERR_FALSE;
+	}
+	else // save downloaded file
+	{
+		char file_full_path[PATH_MAX];
+		char sha256_hex[SHA256_HEX_LEN + 1];
+		sha256_ctx_t sha, *psha = NULL;
+		double merge_start;
+		long long span;
+		char *p;
+
+		// the cache files the content under its digest
+		if ((d_task->expected_sha256[0] || d_task->dm->cache_budget > 0) && sha256_init(&sha) == 0)
+			psha = &sha;
+		snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
+		merge_start = now_seconds();
+		span = TRACE_START();
+		if ((ret = _check_crc32c(d_task, parts_info, part_lens, parts)) == 0 &&
+				(ret = merge_files(file_full_path, file->length, tmp_files_name, part_lens, parts, psha)) < 0)
+			LOG_ERROR("merge files failed");
+		else if (ret == 0)
+			metrics_observe(HIST_MERGE, now_seconds() - merge_start);
+		TRACE_SPAN("merge", span, file->length);
+		if (psha)
+		{
+			sha256_final_hex(psha, sha256_hex);
+			if (ret == 0)
+				strcpy(d_task->sha256, sha256_hex);
+			if (ret == 0 && d_task->expected_sha256[0] && strcasecmp(sha256_hex, d_task->expected_sha256) != 0)
+			{
+				LOG_ERROR("sha256 mismatch, expected %s but got %s", d_task->expected_sha256, sha256_hex);
+				ret = ERR_DIGEST;
+			}
+		}
+		if (ret < 0)
+		{
+			unlink(file_full_path);
+			for (i = 0; i < parts; i++)
+				unlink(tmp_files_name[i]);
+		}
+		if(p = strrchr(tmp_files_name[0], '/'))
+		{
+			*++p = 0;
+			rmdir(tmp_files_name[0]);
+		}
+		CRASH_POINT("merged");
+		// delete file record from db
+		snprintf(sql_buf, sizeof(sql_buf), SQL_DEL_FILE, file->filename, d_task->file_saved_path);
+		db_execute(d_task->dm->db_key, sql_buf, NULL);
+		sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_DEL_PARTS, file->filename, d_task->file_saved_path);
+		db_execute(d_task->dm->db_key, sql_buf, NULL);
+	}
+	return ret;
+}
+
+static void _plan_parts(int length, int *parts, int *per_part_len, int *last_part_len)
+{
+	if (MIN_PART_SIZE * max_parts >= length)
+	{
+		*per_part_len = MIN_PART_SIZE;
+		*parts = length / MIN_PART_SIZE;
+		*last_part_len = length - *parts * MIN_PART_SIZE;
+		if (*last_part_len > 0)
+			(*parts)++;
+	}
+	else
+	{
+		*parts = max_parts;
+		*per_part_len = length / *parts;
+		*last_part_len = length - *parts * *per_part_len;
+		if (*last_part_len > 0)
+			*last_part_len += *per_part_len;
+	}
+}
+
+/*
+ * file is what the task url serves now. The other mirrors are probed the
+ * first time a part picks one, a task which never needs them never asks,
+ * and what a probe found holds until the file changes.
+ */
+static void _mirrors_for_file(d_task_t *d_task, file_info_t *file)
+{
+	int i;
+
+	d_task->mirrors[0].info  = *file;
+	d_task->mirrors[0].probe = MIRROR_PROBED;
+	_reset_mirror(&d_task->mirrors[0]);
+	for (i = 1; i < d_task->nmirrors; i++)
+	{
+		_reset_mirror(&d_task->mirrors[i]);
+		d_task->mirrors[i].probe = MIRROR_UNPROBED;
+	}
+}
+
+// mirrors other than the task url, one "url\tetag\tlast_modified" line each,
+// the validators are empty for a mirror not probed yet
+static void _mirrors_to_str(d_task_t *d_task, char *str, int max)
+{
+	int i, len = 0;
+	str[0] = '\0';
+	for (i = 1; i < d_task->nmirrors && len < max; i++)
+	{
+		mirror_info_t *m = &d_task->mirrors[i];
+		len += snprintf(str + len, max - len, "%s\t%s\t%s\n", m->url, m->info.etag, m->info.last_modified);
+	}
+}
+
+static void _mirrors_from_str(d_task_t *d_task, file_info_t *file, const char *str)
+{
+	char line[MAX_URL_LEN + MAX_VALIDATOR_LEN * 2 + 3];
+	const char *end;
+	char *f1, *f2;
+	int len;
+
+	d_task->mirrors[0].info  = *file;
+	d_task->mirrors[0].probe = MIRROR_PROBED;
+	d_task->nmirrors = 1;
+	while (str && *str && d_task->nmirrors < MAX_MIRROR_NUMBER)
+	{
+		mirror_info_t *m = &d_task->mirrors[d_task->nmirrors];
+		if (!(end = strchr(str, '\n')))
+			end = str + strlen(str);
+		len = end - str < sizeof(line) ? end - str : sizeof(line) - 1;
+		memcpy(line, str, len);
+		line[len] = '\0';
+		str = *end ? end + 1 : end;
+
+		if (!(f1 = strchr(line, '\t')) || !(f2 = strchr(f1 + 1, '\t')))
+			continue;
+		*f1++ = '\0';
+		*f2++ = '\0';
+		strncpy(m->url, line, MAX_URL_LEN);
+		m->url[MAX_URL_LEN - 1] = '\0';
+		if (parse_url(m->url, &m->info.d_url) < 0)
+			continue;
+		m->info.length = file->length;
+		strncpy(m->info.etag, f1, MAX_VALIDATOR_LEN);
+		m->info.etag[MAX_VALIDATOR_LEN - 1] = '\0';
+		strncpy(m->info.last_modified, f2, MAX_VALIDATOR_LEN);
+		m->info.last_modified[MAX_VALIDATOR_LEN - 1] = '\0';
+		// without validators If-Range can't tell its copy changed, it is probed again
+		m->probe = m->info.etag[0] || m->info.last_modified[0] ? MIRROR_PROBED : MIRROR_UNPROBED;
+		_set_mirror_protocol(m);
+		_reset_mirror(m);
+		d_task->nmirrors++;
+	}
+}
+
+/*
+ * A part found that the remote object no longer matches the validators
+ * the task was started with. Everything fetched so far is stale, but the
+ * task itself (its saved file name, tmp dir and db row) stays: fetch the
+ * new file info, drop the part files and plan the parts again. Every part
+ * thread has exited by now, dispatch_part_download waited for them after
+ * res_changed stopped them at their next write, so none writes a file
+ * being unlinked. The parts finished before are stale as well, no range of
+ * the new object is known to hold the same bytes.
+ */
+static int _restart_changed_task(d_task_t *d_task, file_info_t *file,
+		int *per_part_len, int *last_part_len, int *parts)
+{
+	file_info_t fresh;
+	char real_url[MAX_URL_LEN];
+	char tmp_file_name[PATH_MAX];
+	char mirrors_str[MAX_MIRRORS_STR_LEN];
+	char sql_buf[MAX_MIRRORS_STR_LEN + 2048];
+	int i, ret;
+
+	if ((ret = d_task->request_file_info(d_task->url, &fresh, real_url)) != 0)
+	{
+		if (ret == ERR_RES_NOT_FOUND)
+			LOG_ERROR("%s not found", d_task->url);
+		return ERR_REQUEST_FILE;
+	}
+
+	for (i = 0; i < *parts; i++)
+	{
+		snprintf(tmp_file_name, PATH_MAX, d_task->tmp_file_name_fmt, i);
+		unlink(tmp_file_name);
+	}
+
+	file->d_url  = fresh.d_url;
+	file->length = fresh.length;
+	strcpy(file->etag, fresh.etag);
+	strcpy(file->last_modified, fresh.last_modified);
+	_plan_parts(file->length, parts, per_part_len, last_part_len);
+	strcpy(d_task->mirrors[0].url, real_url);
+	_mirrors_for_file(d_task, file);
+	_mirrors_to_str(d_task, mirrors_str, sizeof(mirrors_str));
+
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_UPDATE_FILE, real_url, file->length, *parts,
+			*per_part_len, *last_part_len, file->etag, file->last_modified, mirrors_str,
+			file->filename, d_task->file_saved_path);
+	db_execute(d_task->dm->db_key, sql_buf, NULL);
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_DEL_PARTS, file->filename, d_task->file_saved_path);
+	db_execute(d_task->dm->db_key, sql_buf, NULL);
+	_init_part_digests(d_task, file, *parts);
+
+	d_task->len_downloaded = 0;
+	d_task->parts_exit     = 0;
+	d_task->res_changed    = 0;
+	return 0;
+}
+
+static int _download_parts(d_task_t *d_task, file_info_t *file,
+		int per_part_len, int last_part_len, int parts)
+{
+	int ret, times = 0;
+	while ((ret = dispatch_part_download(d_task, file, per_part_len, last_part_len, parts)) == ERR_RES_CHANGED)
+	{
+		_stream_parts(d_task, NULL, 0);
+		if (d_task->stream_off > 0)
+		{
+			LOG_ERROR("remote file changed after a part of it was streamed");
+			return ret;
+		}
+		if (times++ >= MAX_REVALIDATE_TIMES ||
+				_restart_changed_task(d_task, file, &per_part_len, &last_part_len, &parts) != 0)
+		{
+			LOG_ERROR("remote file keeps changing, give up");
+			break;
+		}
+	}
+	_stream_parts(d_task, NULL, 0);
+	return ret;
+}
+
+
+
+// crc, if not NULL, gets the crc32c of the file as well
+static int _sha256_file(const char *file_name, char *hex, unsigned int *crc)
+{
+	sha256_ctx_t sha;
+	char buf[1024 * 64];
+	int fd, n;
+
+	if ((fd = open(file_name, O_RDONLY)) < 0)
+		return ERR_IO_READ;
+	if (sha256_init(&sha) != 0)
+	{
+		close(fd);
+		return ERR_DIGEST;
+	}
+	if (crc)
+		*crc = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		sha256_update(&sha, buf, n);
+		if (crc)
+			*crc = crc32c_update(*crc, buf, n);
+	}
+	close(fd);
+	sha256_final_hex(&sha, hex);
+	return n < 0 ? ERR_IO_READ : 0;
+}
+
+// the body which came with the info, written as the part's bytes
+static int _write_small_body(d_task_t *d_task, part_info_t *part)
+{
+	part_sink_t sink;
+	int ret;
+
+	part->metric_host   = metrics_host(part->file->d_url.host);
+	part->attempt_start = part->report_time = now_seconds();
+	if ((ret = part_open_sink(part, &sink)) != 0)
+		return ret;
+	ret = part_write(part, &sink, d_task->small_body, d_task->small_body_len);
+	sink.close(&sink);
+	part->finished = (ret == 0);
+	return ret;
+}
+
+/*
+ * A file under small_file_size is one part written straight to its
+ * destination, no tmp dir, no db row and no merge. It is not resumable,
+ * an interrupted one is fetched again. Its body mostly came with the info
+ * request already, else it is fetched from the task url, the mirrors are
+ * not worth a request each.
+ */
+static int _download_small_file(d_task_t *d_task, file_info_t *file)
+{
+	char file_full_path[PATH_MAX];
+	char hex[SHA256_HEX_LEN + 1];
+	part_info_t part;
+	int ret, times = 0;
+
+	snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
+	while (1)
+	{
+		d_task->mirrors[0].info = *file;
+		_reset_mirror(&d_task->mirrors[0]);
+		d_task->nmirrors = 1;
+
+		memset(&part, 0, sizeof(part));
+		part.file      = file;
+		part.d_task    = d_task;
+		part.end_pos   = file->length - 1;
+		part.file_name = file_full_path;
+
+		_stream_parts(d_task, &part, 1);
+		_progress_parts(d_task, &part, 1);
+		if (d_task->small_body && d_task->small_body_len == file->length)
+			ret = _write_small_body(d_task, &part);
+		else
+			ret = _download_part(&part);
+		_progress_parts(d_task, NULL, 0);
+		_stream_parts(d_task, NULL, 0);
+		if (ret != ERR_RES_CHANGED || times++ >= MAX_REVALIDATE_TIMES || d_task->stream_off > 0)
+			break;
+		// the file changed between the info request and the transfer
+		d_task->len_downloaded = 0;
+		d_task->res_changed    = 0;
+		if (truncate(file_full_path, 0) != 0 ||
+				d_task->request_file_info(d_task->url, file, d_task->mirrors[0].url) != 0)
+			break;
+	}
+
+	if (ret == 0 && d_task->expected_crc32c[0])
+	{
+		snprintf(hex, sizeof(hex), "%08x", part.crc);
+		if (strcasecmp(hex, d_task->expected_crc32c) != 0)
+		{
+			LOG_ERROR("crc32c mismatch, expected %s but got %s", d_task->expected_crc32c, hex);
+			ret = ERR_DIGEST;
+		}
+	}
+	if (ret == 0 && (d_task->expected_sha256[0] || d_task->dm->cache_budget > 0) &&
+			(ret = _sha256_file(file_full_path, d_task->sha256, NULL)) == 0 &&
+			d_task->expected_sha256[0] && strcasecmp(d_task->sha256, d_task->expected_sha256) != 0)
+	{
+		LOG_ERROR("sha256 mismatch, expected %s but got %s", d_task->expected_sha256, d_task->sha256);
+		ret = ERR_DIGEST;
+	}
+	if (ret != 0)
+	{
+		LOG_ERROR("download failed");
+		unlink(file_full_path);
+	}
+	return ret;
+}
+
+static int _create_unique_file(d_task_t *d_task, file_info_t *pfile)
+{
+	// create unique downloading file
+	char file_full_path[PATH_MAX];
+	char *ptr, *ptr2;
+	int i;
+	snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, pfile->d_url.filename);
+	// the old copy stays until the new one is complete, the task end renames it over
+	if (d_task->overwrite)
+	{
+		int fd;
+		if (snprintf(d_task->overwrite_tmp, PATH_MAX, OVERWRITE_TMP_FMT, file_full_path) >= PATH_MAX)
+			return ERR_IO_CREATE;
+		if ((fd = open(d_task->overwrite_tmp, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+			return ERR_IO_CREATE;
+		close(fd);
+		strcpy(d_task->overwrite_path, file_full_path);
+		snprintf(pfile->filename, PATH_MAX, OVERWRITE_TMP_FMT, pfile->d_url.filename);
+		return 0;
+	}
+	ptr = strrchr(file_full_path, '.');
+	if (!ptr)
+		ptr = file_full_path + strlen(file_full_path);
+	ptr2 = strrchr(pfile->d_url.filename, '.');
+	i = 0;
+	while (1)
+	{
+		int ret = open(file_full_path, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (ret == -1 && errno == EEXIST)
+			sprintf(ptr, "(%d)%s", ++i, (ptr2 ? ptr2 : ""));
+		else if (ret == -1)
+			return ERR_IO_CREATE;
+		else
+		{
+			close(ret);
+			break;
+		}
+	}
+	if (ptr = strrchr(file_full_path, '/'))
+		strcpy(pfile->filename, ++ptr);
+	return 0;
+}
+
+
+// drop a reference, the last one fires the callbacks and frees the task
+static void _download_task_put(d_task_t *d_task)
+{
+	d_callback finished = d_task->finished_callback;
+	int refs;
+
+	pthread_mutex_lock(&flight_mutex);
+	refs = --d_task->refs;
+	pthread_mutex_unlock(&flight_mutex);
+	if (refs > 0)
+		return;
+
+	if (d_task->status == 0 && d_task->overwrite_path[0] && rename(d_task->overwrite_tmp, d_task->overwrite_path) != 0)
+		d_task->status = ERR_IO_WRITE;
+	metrics_task_done(d_task->status);
+	status_end(d_task->status_slot, d_task->status);
+	if (d_task->file_done)
+		d_task->file_done(d_task->file_done_ctx, d_task->status);
+	if (d_task->sink)
+		d_task->sink->status = d_task->status;
+	pthread_mutex_destroy(d_task->part_mutex);
+	pthread_mutex_destroy(d_task->mirror_mutex);
+	pthread_mutex_destroy(d_task->stream_mutex);
+	pthread_cond_destroy(d_task->part_cond);
+	pthread_cond_destroy(d_task->stream_cond);
+	free(d_task->part_cond);
+	free(d_task->part_mutex);
+	free(d_task->mirror_mutex);
+	free(d_task->stream_mutex);
+	free(d_task->stream_cond);
+	free(d_task->small_body);
+	free(d_task);
+
+	if (finished)
+		finished(NULL);
+}
+
+// the leader's file is complete, or failed; hand it to everyone who joined
+static void _flight_land(d_task_t *d_task)
+{
+	d_flight_t *flight = d_task->flight;
+	d_flight_t **pp;
+	d_task_t *follower, *next;
+
+	if (!flight)
+		return;
+	pthread_mutex_lock(&flight_mutex);
+	for (pp = &flights; *pp; pp = &(*pp)->next)
+	{
+		if (*pp == flight)
+		{
+			*pp = flight->next;
+			break;
+		}
+	}
+	follower = flight->followers;
+	flight->followers = NULL;
+	d_task->flight = NULL;
+	pthread_mutex_unlock(&flight_mutex);
+
+	for (; follower; follower = next)
+	{
+		next = follower->flight_next;
+		follower->flight = NULL;
+		if (d_task->status == 0)
+			follower->status = materialize_file(flight->file_path, follower->flight_file);
+		else
+			follower->status = d_task->status;
+		if (follower->status != 0)
+			unlink(follower->flight_file);
+		else
+			_stream_finish(follower, follower->flight_file);
+		LOG_DEBUG("single flight: %s delivered", follower->flight_file);
+		_download_task_put(follower);
+	}
+	free(flight);
+}
+
+/*
+ * Join the flight fetching the same object, keyed by the resolved url,
+ * its validators and the digests asked for. Returns 1 if d_task became
+ * a follower, its file is filled in when the leader lands.
+ */
+static int _flight_join(d_task_t *d_task, file_info_t *file, const char *real_url)
+{
+	char key[MAX_FLIGHT_KEY_LEN];
+	d_flight_t *flight;
+
+	snprintf(key, sizeof(key), "%s\n%d\n%s\n%s\n%s\n%s", real_url, file->length, file->etag,
+			file->last_modified, d_task->expected_sha256, d_task->expected_crc32c);
+	pthread_mutex_lock(&flight_mutex);
+	for (flight = flights; flight; flight = flight->next)
+	{
+		if (strcmp(flight->key, key) == 0)
+		{
+			snprintf(d_task->flight_file, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
+			d_task->flight      = flight;
+			d_task->flight_next = flight->followers;
+			d_task->refs++;    // the flight holds it until landing
+			flight->followers   = d_task;
+			pthread_mutex_unlock(&flight_mutex);
+			LOG_DEBUG("single flight: joined %s", real_url);
+			return 1;
+		}
+	}
+	if ((flight = (d_flight_t *)malloc(sizeof(d_flight_t))))
+	{
+		strcpy(flight->key, key);
+		snprintf(flight->file_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
+		flight->followers = NULL;
+		flight->next      = flights;
+		flights           = flight;
+		d_task->flight    = flight;
+	}
+	pthread_mutex_unlock(&flight_mutex);
+	return 0;
+}
+
+static int _download_file(d_task_t *d_task, file_info_t *file, const char *real_url)
+{
+	char mirrors_str[MAX_MIRRORS_STR_LEN];
+	char sql_buf[MAX_MIRRORS_STR_LEN + 2048];
+	char tmp_file_name_fmt[PATH_MAX];
+	int parts = 0, per_part_len = 0, last_part_len = 0;
+	int ret, i;
+	char *ptr;
+
+	_plan_parts(file->length, &parts, &per_part_len, &last_part_len);
+	// an encoded body is only decodable from its start
+	if (d_task->accept_encoding)
+	{
+		parts         = 1;
+		per_part_len  = file->length;
+		last_part_len = 0;
+	}
+	LOG_DEBUG("parts is %d", parts);
+
+	if (file->length < small_file_size)
+		return _download_small_file(d_task, file);
+
+	_mirrors_for_file(d_task, file);
+	_mirrors_to_str(d_task, mirrors_str, sizeof(mirrors_str));
+
+	// create unique tmp file dir
+	strcpy(tmp_file_name_fmt, file->filename);
+	// the dir name ends up in a format string
+	for (ptr = tmp_file_name_fmt; (ptr = strchr(ptr, '%')); )
+		*ptr = '_';
+	ptr = tmp_file_name_fmt + strlen(tmp_file_name_fmt);
+	i = 0;
+	while (1)
+	{
+		ret = mkdir(tmp_file_name_fmt, S_IRWXU);
+		if (ret != 0 && errno == EEXIST)
+			sprintf(ptr, "(%d)", ++i);
+		else if (ret != 0)
+			return ERR_IO_CREATE;
+		else
+			break;
+	}
+	snprintf(d_task->tmp_file_name_fmt, PATH_MAX, "%s/%s", tmp_file_name_fmt, TMP_FILE_SUFFIX_FMT); // filename.ext(n)/._tmp_%d
+	CRASH_POINT("insert");
+
+	// save this task to db file
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_INSERT_VALUES, file->filename,
+			real_url, d_task->file_saved_path, file->length, d_task->tmp_file_name_fmt, parts,
+			per_part_len, last_part_len, file->etag, file->last_modified,
+			d_task->expected_sha256, d_task->expected_crc32c, mirrors_str);
+
+	db_execute(d_task->dm->db_key, sql_buf, NULL);
+	_init_part_digests(d_task, file, parts);
+
+	return _download_parts(d_task, file, per_part_len, last_part_len, parts);
+}
+
+// Last-Modified or MDTM as a time, 0 if it is neither
+static time_t _validator_time(const char *s)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(s, "%a, %d %b %Y %H:%M:%S", &tm) && !strptime(s, "%Y%m%d%H%M%S", &tm))
+		return 0;
+	return timegm(&tm);
+}
+
+// fetch url whole into file_name, on a task of its own so d_task's progress is left alone
+static int _fetch_sidecar(d_task_t *d_task, const char *url, const char *file_name, file_info_t *info)
+{
+	d_task_t *side = (d_task_t *)malloc(sizeof(d_task_t));
+	file_info_t file;
+	part_info_t part;
+	int ret;
+
+	download_task_init(side, NULL, NULL);
+	side->dm = d_task->dm;
+	strcpy(side->url, url);
+	strcpy(side->mirrors[0].url, url);
+	_set_mirror_protocol(&side->mirrors[0]);
+	if ((ret = side->mirrors[0].request_file_info(url, &file, side->mirrors[0].url)) == 0)
+	{
+		_mirrors_for_file(side, &file);
+		memset(&part, 0, sizeof(part));
+		part.file      = &file;
+		part.d_task    = side;
+		part.end_pos   = file.length - 1;
+		part.file_name = file_name;
+		ret = _download_part(&part);
+		*info = file;
+	}
+	_download_task_put(side);
+	return ret;
+}
+
+/*
+ * Download parts set up by the caller on the pool and wait for them, the
+ * ones left get one more try. Nothing is saved for a resume.
+ */
+static int _run_parts(d_task_t *d_task, part_info_t *parts, int n)
+{
+	task_desc descs[MAX_PART_NUMBER];
+	int i, ret = 0;
+
+	d_task->parts_exit = 0;
+	_progress_parts(d_task, parts, n);
+	for (i = 0; i < n; i++)
+	{
+		descs[i].arg            = &parts[i];
+		descs[i].fire_task_over = download_part_over;
+		easy_thread_pool_add_task(d_task->dm->tp, download_part_entry, &descs[i]);
+	}
+	_wait_parts(d_task, n);
+
+	for (i = 0; i < n && !d_task->res_changed && ret == 0; i++)
+	{
+		if (!parts[i].finished && _download_part(&parts[i]) != 0)
+			ret = ERR_FALSE;
+	}
+	_progress_parts(d_task, NULL, 0);
+	if (ret == 0 && d_task->res_changed)
+		ret = ERR_RES_CHANGED;
+	return ret;
+}
+
+// the next bytes not in the old copy from *pos on, at most max_len of them
+static int _delta_next_range(const delta_index_t *idx, const int *base_off, int max_len,
+		int *pos, int *beg, int *end)
+{
+	int bs = idx->block_size;
+
+	while (*pos < idx->length && *pos / bs < idx->blocks && base_off[*pos / bs] >= 0)
+		*pos += bs;
+	if (*pos >= idx->length)
+		return 0;
+	*beg = *pos;
+	while (*pos < idx->length && *pos - *beg < max_len && (*pos / bs >= idx->blocks || base_off[*pos / bs] < 0))
+		*pos += bs;
+	if (*pos > idx->length)
+		*pos = idx->length;
+	*end = *pos - 1;
+	return 1;
+}
+
+// copy the blocks found in the old copy to their place, runs of them in one read
+static int _delta_copy_blocks(const delta_index_t *idx, const int *base_off, int base_fd, int out_fd)
+{
+	char *buf = (char *)malloc(DELTA_COPY_LEN > idx->block_size ? DELTA_COPY_LEN : idx->block_size);
+	int bs = idx->block_size, i, k, len, copied = 0;
+
+	if (!buf)
+		return ERR_FALSE;
+	for (i = 0; i < idx->blocks; i = k)
+	{
+		if (base_off[i] < 0)
+		{
+			k = i + 1;
+			continue;
+		}
+		for (k = i + 1; k < idx->blocks && base_off[k] == base_off[k - 1] + bs && (k - i + 1) * bs <= DELTA_COPY_LEN; k++)
+			;
+		len = (k - i) * bs;
+		if (pread(base_fd, buf, len, base_off[i]) != len || pwrite(out_fd, buf, len, (off_t)i * bs) != len)
+		{
+			free(buf);
+			return ERR_IO_WRITE;
+		}
+		copied += len;
+	}
+	free(buf);
+	return copied;
+}
+
+/*
+ * Rebuild the file from the blocks the old copy still has and fetch only
+ * the rest, as parts written in place through the usual mirrors. It is
+ * not resumable. A failure leaves the file empty for the full download.
+ */
+static int _download_delta(d_task_t *d_task, file_info_t *file, const char *real_url)
+{
+	char index_url[MAX_URL_LEN];
+	char index_name[] = "edidx_XXXXXX";    // in the tmp dir, the cwd
+	char file_full_path[PATH_MAX];
+	char hex[SHA256_HEX_LEN + 1];
+	part_info_t parts_info[MAX_PART_NUMBER];
+	delta_index_t idx;
+	file_info_t index_info;
+	unsigned int crc;
+	int *base_off = NULL;
+	int fd, base_fd = -1, out_fd = -1;
+	int i, k, n, merge, max_len, pos, beg, end, reused;
+	int ret = ERR_FALSE;
+
+	if (!d_task->delta_base[0] || file->length < small_file_size ||
+			snprintf(index_url, MAX_URL_LEN, "%s%s", real_url, DELTA_INDEX_SUFFIX) >= MAX_URL_LEN)
+		return ERR_FALSE;
+	if ((fd = mkstemp(index_name)) < 0)
+		return ERR_FALSE;
+	close(fd);
+	if ((ret = _fetch_sidecar(d_task, index_url, index_name, &index_info)) == 0)
+		ret = delta_read_index(index_name, &idx);
+	unlink(index_name);
+	if (ret != 0)
+	{
+		// an index is published by choice, its absence is no news
+		LOG_DEBUG("no block index at %s, fetch the whole file", index_url);
+		return ERR_FALSE;
+	}
+	// blocks taken from the old copy are only checked against the index
+	if (_validator_time(index_info.last_modified) < _validator_time(file->last_modified))
+	{
+		LOG_WARN("%s is older than the file, fetch the whole file", index_url);
+		delta_free_index(&idx);
+		return ERR_FALSE;
+	}
+	ret = ERR_FALSE;
+	if (idx.length != file->length || !(base_off = (int *)malloc(sizeof(int) * (idx.blocks + 1))) ||
+			delta_match(&idx, d_task->delta_base, base_off) == 0)
+		goto OUT;
+
+	// a short run of found blocks between two fetched ranges costs a request more than its bytes
+	merge = DELTA_MERGE_GAP / idx.block_size;
+	for (i = 0; i < idx.blocks; i = k)
+	{
+		for (k = i; k < idx.blocks && (base_off[k] >= 0) == (base_off[i] >= 0); k++)
+			;
+		if (base_off[i] >= 0 && k - i < merge && i > 0 && (k < idx.blocks || idx.length % idx.block_size))
+		{
+			for (n = i; n < k; n++)
+				base_off[n] = -1;
+		}
+	}
+
+	snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
+	if ((base_fd = open(d_task->delta_base, O_RDONLY)) < 0 || (out_fd = open(file_full_path, O_WRONLY)) < 0 ||
+			ftruncate(out_fd, file->length) != 0 ||
+			(reused = _delta_copy_blocks(&idx, base_off, base_fd, out_fd)) < 0)
+		goto OUT;
+	LOG_INFO("delta: %d of %d bytes taken from %s", reused, file->length, d_task->delta_base);
+	download_progress(d_task, reused, file->length);
+
+	_mirrors_for_file(d_task, file);
+	max_len = file->length / MAX_PART_NUMBER > MIN_PART_SIZE ? file->length / MAX_PART_NUMBER : MIN_PART_SIZE;
+	pos = 0;
+	while (1)
+	{
+		for (n = 0; n < MAX_PART_NUMBER && _delta_next_range(&idx, base_off, max_len, &pos, &beg, &end); n++)
+		{
+			memset(&parts_info[n], 0, sizeof(part_info_t));
+			parts_info[n].beg_pos   = beg;
+			parts_info[n].end_pos   = end;
+			parts_info[n].d_task    = d_task;
+			parts_info[n].file      = file;
+			parts_info[n].id        = n;
+			parts_info[n].file_name = file_full_path;
+		}
+		if (n == 0)
+			break;
+
+		if (_run_parts(d_task, parts_info, n) != 0)
+			goto OUT;
+	}
+
+	// a stale index or a weak match shows up here
+	if (_sha256_file(file_full_path, hex, &crc) != 0 || strcmp(hex, idx.sha256) != 0)
+	{
+		LOG_ERROR("delta: the rebuilt file does not match its index");
+		goto OUT;
+	}
+	strcpy(d_task->sha256, hex);
+	ret = 0;
+	if (d_task->expected_sha256[0] && strcasecmp(hex, d_task->expected_sha256) != 0)
+	{
+		LOG_ERROR("sha256 mismatch, expected %s but got %s", d_task->expected_sha256, hex);
+		ret = ERR_DIGEST;
+	}
+	snprintf(hex, sizeof(hex), "%08x", crc);
+	if (ret == 0 && d_task->expected_crc32c[0] && strcasecmp(hex, d_task->expected_crc32c) != 0)
+	{
+		LOG_ERROR("crc32c mismatch, expected %s but got %s", d_task->expected_crc32c, hex);
+		ret = ERR_DIGEST;
+	}
+OUT:
+	if (ret != 0)
+	{
+		if (out_fd >= 0)
+			ftruncate(out_fd, 0);
+		d_task->sha256[0]      = '\0';
+		d_task->len_downloaded = 0;
+		d_task->parts_exit     = 0;
+		d_task->res_changed    = 0;
+	}
+	if (base_fd >= 0)
+		close(base_fd);
+	if (out_fd >= 0)
+		close(out_fd);
+	free(base_off);
+	delta_free_index(&idx);
+	return ret;
+}
+
+/*
+ * Write the file to the caller's sink, as parallel parts at their offsets,
+ * or one part in order for an fd which can't seek. Only the crc32c of
+ * the parts can be checked on a sink which can't be read back.
+ */
+static int _download_to_sink(d_task_t *d_task, file_info_t *file)
+{
+	d_sink_t *sink = d_task->sink;
+	part_info_t parts_info[MAX_PART_NUMBER];
+	int parts = 1, per_part_len = file->length, last_part_len = 0;
+	int i, offset = 0, ret;
+
+	sink->length = file->length;
+	if (sink->type == D_SINK_MEMORY && sink->buf_len < file->length)
+	{
+		LOG_ERROR("the buffer of %d bytes can't take the file of %d", sink->buf_len, file->length);
+		return ERR_IO_WRITE;
+	}
+	if (d_task->expected_sha256[0] && sink->type != D_SINK_MEMORY && !d_task->sink_seekable)
+	{
+		LOG_ERROR("sha256 can't be checked on this sink");
+		return ERR_DIGEST;
+	}
+	if ((sink->type != D_SINK_FD || d_task->sink_seekable) && !d_task->accept_encoding)
+		_plan_parts(file->length, &parts, &per_part_len, &last_part_len);
+	_mirrors_for_file(d_task, file);
+
+	for (i = 0; i < parts; i++)
+	{
+		memset(&parts_info[i], 0, sizeof(part_info_t));
+		parts_info[i].beg_pos = offset;
+		offset += (i == parts - 1 && last_part_len > 0) ? last_part_len : per_part_len;
+		parts_info[i].end_pos = offset - 1;
+		parts_info[i].d_task  = d_task;
+		parts_info[i].file    = file;
+		parts_info[i].id      = i;
+	}
+	// a sink which can be read back streams, what the head part saved is read again
+	if (sink->type == D_SINK_MEMORY || d_task->sink_seekable)
+		_stream_parts(d_task, parts_info, parts);
+	ret = file->length > 0 ? _run_parts(d_task, parts_info, parts) : 0;
+	_stream_parts(d_task, NULL, 0);
+	if (ret != 0)
+		return ret;
+	if (_streaming(d_task) && (sink->type == D_SINK_MEMORY || d_task->sink_seekable))
+	{
+		pthread_mutex_lock(d_task->stream_mutex);
+		_stream_sink(d_task, d_task->stream_off, file->length);
+		pthread_mutex_unlock(d_task->stream_mutex);
 	}
 
-	pthread_mutex_lock(d_task->part_mutex);
-	while (d_task->parts_exit < parts)
-		pthread_cond_wait(d_task->part_cond, d_task->part_mutex);
-	pthread_mutex_unlock(d_task->part_mutex);
-
-	if (d_task->len_downloaded < file->length)
+	if (d_task->expected_crc32c[0])
 	{
+		int part_lens[MAX_PART_NUMBER];
 		for (i = 0; i < parts; i++)
-		{
-			if (!parts_info[i].finished)
-				d_task->request_part_file(&parts_info[i]);
-		}
+			part_lens[i] = parts_info[i].end_pos - (parts_info[i].beg_pos - parts_info[i].crc_len) + 1;
+		if ((ret = _check_crc32c(d_task, parts_info, part_lens, parts)) != 0)
+			return ret;
 	}
-
-	if (d_task->len_downloaded < file->length)
-		fprintf(stderr, "download failed\n");
-	else // save downloaded file
+	// an archive's digest is taken as it is unpacked, the spool is gone
+	if (d_task->expected_sha256[0] && !d_task->untar)
 	{
-		char file_full_path[PATH_MAX];
-		char *p;
-		snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
-		if(merge_files(file_full_path, file->length, tmp_files_name, part_lens, parts) < 0)
+		sha256_ctx_t sha;
+		char hex[SHA256_HEX_LEN + 1];
+		if (sha256_init(&sha) != 0)
+			return ERR_DIGEST;
+		if (sink->type == D_SINK_MEMORY)
+			sha256_update(&sha, sink->buf, file->length);
+		else
 		{
-			fprintf(stderr, "merge files failed\n");
-			unlink(file_full_path);
+			char buf[1024 * 64];
+			int n;
+			for (offset = 0; offset < file->length && (n = pread(sink->fd, buf, sizeof(buf), offset)) > 0; offset += n)
+				sha256_update(&sha, buf, n < file->length - offset ? n : file->length - offset);
 		}
-		if(p = strrchr(tmp_files_name[0], '/'))
+		sha256_final_hex(&sha, hex);
+		if (strcasecmp(hex, d_task->expected_sha256) != 0)
 		{
-			*++p = 0;
-			rmdir(tmp_files_name[0]);
+			LOG_ERROR("sha256 mismatch, expected %s but got %s", d_task->expected_sha256, hex);
+			return ERR_DIGEST;
 		}
-		// delete file record from db
-		snprintf(sql_buf, sizeof(sql_buf), SQL_DEL_FILE, file->filename, d_task->file_saved_path);
-		db_execute(d_task->dm->db_key, sql_buf, NULL);
 	}
+	return 0;
 }
 
-static int _create_unique_file(d_task_t *d_task, file_info_t *pfile)
+// unpack the archive as it streams in, the spool file takes the parts
+static int _extract_open(d_task_t *d_task)
 {
-	// create unique downloading file
-	char file_full_path[PATH_MAX];
-	char *ptr, *ptr2;
-	int i;
-	snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, pfile->d_url.filename);
-	ptr = strrchr(file_full_path, '.');
-	if (!ptr)
-		ptr = file_full_path + strlen(file_full_path);
-	ptr2 = strrchr(pfile->d_url.filename, '.');
-	i = 0;
-	while (1)
+	char spool[PATH_MAX];
+	int fd;
+
+	snprintf(spool, PATH_MAX, EXTRACT_SPOOL_FMT, download_tmp_path);
+	if ((fd = mkstemp(spool)) < 0)
+		return ERR_IO_CREATE;
+	unlink(spool);
+	if (!(d_task->untar = untar_open(d_task->extract_dir, d_task->extract_special)))
 	{
-		int ret = open(file_full_path, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-		if (ret == -1 && errno == EEXIST)
-			sprintf(ptr, "(%d)%s", ++i, (ptr2 ? ptr2 : ""));
-		else if (ret == -1)
-			return ERR_IO_CREATE;
-		else
-		{
-			close(ret);
-			break;
-		}
+		close(fd);
+		return ERR_IO_CREATE;
 	}
-	if (ptr = strrchr(file_full_path, '/'))
-		strcpy(pfile->filename, ++ptr);
+	memset(&d_task->extract_sink, 0, sizeof(d_sink_t));
+	d_task->extract_sink.type = D_SINK_FD;
+	d_task->extract_sink.fd   = fd;
+	d_task->sink              = &d_task->extract_sink;
+	d_task->sink_seekable     = 1;
+	d_task->extract_punched   = 0;
 	return 0;
 }
 
+static int _extract_close(d_task_t *d_task, int status)
+{
+	char hex[SHA256_HEX_LEN + 1];
+	int ret = untar_close(d_task->untar, hex);
+
+	d_task->untar = NULL;
+	close(d_task->extract_sink.fd);
+	if (status != 0)
+		return status;
+	if (ret == 0 && d_task->stream_off != d_task->sink->length)
+		ret = ERR_IO_READ;
+	if (ret == 0 && d_task->expected_sha256[0] && strcasecmp(hex, d_task->expected_sha256) != 0)
+	{
+		LOG_ERROR("sha256 mismatch, expected %s but got %s", d_task->expected_sha256, hex);
+		ret = ERR_DIGEST;
+	}
+	if (ret == 0)
+		LOG_DEBUG("unpacked into %s", d_task->extract_dir);
+	return ret;
+}
+
+// serve the task from the cache, without transfer; blob_fd is closed
+static int _download_cached(d_task_t *d_task, file_info_t *file, int blob_fd)
+{
+	char file_full_path[PATH_MAX];
+	struct stat sb;
+
+	if (d_task->sink)
+	{
+		if (fstat(blob_fd, &sb) == 0)
+			d_task->sink->length = sb.st_size;
+		d_task->status = sink_copy_fd(d_task, blob_fd);
+		close(blob_fd);
+		return d_task->status;
+	}
+	if (_create_unique_file(d_task, file) != 0)
+	{
+		close(blob_fd);
+		return ERR_IO_CREATE;
+	}
+	snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file->filename);
+	if ((d_task->status = materialize_fd(blob_fd, file_full_path)) != 0)
+		unlink(file_full_path);
+	else
+		_stream_finish(d_task, file_full_path);
+	close(blob_fd);
+	LOG_DEBUG("cache hit: %s", file_full_path);
+	return d_task->status;
+}
+
+// the task url's info, a small file's body comes on the same connection
+static int _request_task_info(d_task_t *d_task, file_info_t *file, char *real_url)
+{
+	int ret;
+
+	if (d_task->request_file_info != http_request_file_info || small_file_size <= 1 ||
+			d_task->sink || d_task->extract_dir[0] ||
+			!(d_task->small_body = (char *)malloc(small_file_size - 1)))
+		return d_task->request_file_info(d_task->url, file, real_url);
+	ret = http_request_small_file(d_task->url, file, real_url, d_task->small_body,
+			small_file_size - 1, &d_task->small_body_len);
+	if (d_task->small_body_len < 0)
+	{
+		free(d_task->small_body);
+		d_task->small_body = NULL;
+	}
+	return ret;
+}
 
 static void *download_entry(void *arg)
 {
 	d_task_t *d_task = (d_task_t *)arg;
+	d_manager_t *dm = d_task->dm;
 	file_info_t file;
-	char sql_buf[1024];
 	char real_url[MAX_URL_LEN];
-	char tmp_file_name_fmt[PATH_MAX];
+	int blob_fd, ret;
 
+	d_task->progress_thread = pthread_self();
+	log_context(d_task->log_id, -1);
+	// the content is known by its digest, no request at all
+	if (dm->cache_budget > 0 && d_task->expected_sha256[0] && !d_task->extract_dir[0] &&
+			cache_find_digest(dm, d_task->expected_sha256, &blob_fd) == 0)
+	{
+		if (parse_url(d_task->url, &file.d_url) != 0)
+			close(blob_fd);
+		else if (_download_cached(d_task, &file, blob_fd) == 0)
+			return NULL;
+	}
 
-	int ret, i;
-	char *ptr;
-
-	if (d_task->request_file_info(d_task->url, &file, real_url) == 0)
+	if ((ret = _request_task_info(d_task, &file, real_url)) != 0)
 	{
-		int i = 0;
-		int parts = 0, per_part_len = 0, last_part_len = 0;
-		if (MIN_PART_SIZE * MAX_PART_NUMBER >= file.length)
-		{
-			per_part_len = MIN_PART_SIZE;
-			parts = file.length / MIN_PART_SIZE;
-			last_part_len = file.length - parts * MIN_PART_SIZE;
-			if (last_part_len > 0)
-				parts++;
-		}
-		else
-		{
-			parts = MAX_PART_NUMBER;
-			per_part_len = file.length / parts;
-			last_part_len = file.length - parts * per_part_len;
-			if (last_part_len > 0)
-				last_part_len += per_part_len;
-		}
-		DEBUG_OUTPUT("parts is %d\n", parts);
+		if (ret == ERR_RES_NOT_FOUND)
+			LOG_ERROR("%s not found", d_task->url);
+		return ERR_RET_VAL;
+	}
+	strcpy(d_task->mirrors[0].url, real_url);
 
-		// create unique downloading file
-		if (_create_unique_file(d_task, &file) != 0)
-		{
-			fprintf(stderr, "error when create download file\n");
-			return ERR_RET_VAL;
-		}
-		// create unique tmp file dir
-		strcpy(tmp_file_name_fmt, file.filename);
-		ptr = tmp_file_name_fmt + strlen(tmp_file_name_fmt);
-		i = 0;
-		while (1)
-		{
-			ret = mkdir(tmp_file_name_fmt, S_IRWXU);
-			if (ret != 0 && errno == EEXIST)
-				sprintf(ptr, "(%d)", ++i);
-			else if (ret != 0)
-				return ERR_RET_VAL;
-			else
-				break;
-		}
-		snprintf(d_task->tmp_file_name_fmt, PATH_MAX, "%s/%s", tmp_file_name_fmt, TMP_FILE_SUFFIX_FMT); // filename.ext(n)/._tmp_%d
+	// an archive to unpack is not kept, there is nothing to cache
+	if (d_task->extract_dir[0])
+	{
+		if ((d_task->status = _extract_open(d_task)) == 0)
+			d_task->status = _extract_close(d_task, _download_to_sink(d_task, &file));
+		return NULL;
+	}
 
-		// save this task to db file
-		snprintf(sql_buf, sizeof(sql_buf), SQL_INSERT_VALUES, file.filename, 
-				real_url, d_task->file_saved_path, file.length, d_task->tmp_file_name_fmt, parts,
-				per_part_len, last_part_len);
+	// the url with the same validators was fetched before
+	if (dm->cache_budget > 0 && cache_find_url(dm, real_url, &file, d_task->expected_sha256, &blob_fd) == 0 &&
+			_download_cached(d_task, &file, blob_fd) == 0)
+		return NULL;
 
-		db_execute(d_task->dm->db_key, sql_buf, NULL);
+	// the caller's sink takes the bytes, there is no file to share or patch
+	if (d_task->sink)
+	{
+		d_task->status = _download_to_sink(d_task, &file);
+		return NULL;
+	}
 
-		dispatch_part_download(d_task, &file, per_part_len, last_part_len, parts);
+	// create unique downloading file
+	if (_create_unique_file(d_task, &file) != 0)
+	{
+		LOG_ERROR("error when create download file");
+		return ERR_RET_VAL;
 	}
 
+	// the same object is already on its way, the leader delivers it
+	if (_flight_join(d_task, &file, real_url))
+		return NULL;
+	// an old copy with most of the blocks, else the whole file
+	if ((d_task->status = _download_delta(d_task, &file, real_url)) != 0)
+		d_task->status = _download_file(d_task, &file, real_url);
+	if (d_task->status == 0)
+	{
+		char file_full_path[PATH_MAX];
+		snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file.filename);
+		_stream_finish(d_task, file_full_path);
+		if (dm->cache_budget > 0)
+			cache_store(dm, real_url, &file, d_task->sha256, file_full_path);
+	}
+	_flight_land(d_task);
+	return NULL;
 }
 
 static void *recover_entry(void *arg)
@@ -343,34 +2091,36 @@ static void *recover_entry(void *arg)
 	char **results;
 	int row,col;
 	char *err_msg;
-	char sql_buf[256];
+	char sql_buf[PATH_MAX + 256];
 	int ret, i, parts;
 	int per_part_len, last_part_len;
 
+	d_task->progress_thread = pthread_self();
+	log_context(d_task->log_id, -1);
 	snprintf(sql_buf, sizeof(sql_buf), SQL_QUERY_TABLE, d_task->file_saved_path);
 	ret = sqlite3_get_table(d_task->dm->db_key, sql_buf, &results, &row, &col, &err_msg);
 	if (ret != SQLITE_OK)
 	{
-		fprintf(stderr, "SQL error: %s\n", err_msg);
+		LOG_ERROR("SQL error: %s", err_msg);
 		sqlite3_free(err_msg);
 		return ERR_RET_VAL;
 	}
-	if (row != 1 || col != 8)
+	if (row != 1 || col != 13)
 		return ERR_RET_VAL;
-	i = col + 1;
+	i = col;
+
+	// file_name, the file created when the task was added
+	strncpy(file.filename, results[i++], PATH_MAX);
+	file.filename[PATH_MAX - 1] = '\0';
 
 	// file_url
+	strncpy(d_task->url, results[i], MAX_URL_LEN);
+	d_task->url[MAX_URL_LEN - 1] = '\0';
 	if (parse_url(results[i++], &file.d_url) < 0)
 		return ERR_RET_VAL;
-	switch(file.d_url.proto)
-	{
-		case HTTP:
-			d_task->request_part_file = http_request_part_file;
-			break;
-		case FTP:
-			d_task->request_part_file = ftp_request_part_file;
-			break;
-	}
+	strcpy(d_task->mirrors[0].url, d_task->url);
+	_set_mirror_protocol(&d_task->mirrors[0]);
+	d_task->request_file_info = d_task->mirrors[0].request_file_info;
 
 	// file_saved_path
 	strncpy(d_task->file_saved_path, results[i++], PATH_MAX);
@@ -389,45 +2139,108 @@ static void *recover_entry(void *arg)
 
 	// last_part_len
 	sscanf(results[i++], "%d", &last_part_len);
-	
+
+	// etag, last_modified, NULL for rows written before they were stored
+	strncpy(file.etag, results[i] ? results[i] : "", MAX_VALIDATOR_LEN);
+	file.etag[MAX_VALIDATOR_LEN - 1] = '\0';
+	i++;
+	strncpy(file.last_modified, results[i] ? results[i] : "", MAX_VALIDATOR_LEN);
+	file.last_modified[MAX_VALIDATOR_LEN - 1] = '\0';
+	i++;
+
+	// expected_sha256, expected_crc32c
+	strncpy(d_task->expected_sha256, results[i] ? results[i] : "", SHA256_HEX_LEN);
+	d_task->expected_sha256[SHA256_HEX_LEN] = '\0';
+	i++;
+	strncpy(d_task->expected_crc32c, results[i] ? results[i] : "", CRC32C_HEX_LEN);
+	d_task->expected_crc32c[CRC32C_HEX_LEN] = '\0';
+	i++;
+
+	// mirrors, the saved validators are checked again by If-Range / MDTM
+	_mirrors_from_str(d_task, &file, results[i++]);
+
 	sqlite3_free_table(results);
 
-	// create unique downloading file
-	if (_create_unique_file(d_task, &file) != 0)
+	// the db row is keyed by the saved file, keep using it
 	{
-		fprintf(stderr, "error when create download file\n");
-		return ERR_RET_VAL;
+		char file_full_path[PATH_MAX];
+		snprintf(file_full_path, PATH_MAX, "%s/%s", d_task->file_saved_path, file.filename);
+		if ((ret = open(file_full_path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+		{
+			LOG_ERROR("error when create download file");
+			return ERR_RET_VAL;
+		}
+		close(ret);
 	}
-	dispatch_part_download(d_task, &file, per_part_len, last_part_len, parts);
+	d_task->status = _download_parts(d_task, &file, per_part_len, last_part_len, parts);
 }
 
 static void download_task_free(void *arg)
 {
 	task_desc *desc = (task_desc *)arg;
 	d_task_t *d_task = (d_task_t *)desc->arg;
-	pthread_mutex_destroy(d_task->len_mutex);
-	pthread_mutex_destroy(d_task->part_mutex);
-	pthread_cond_destroy(d_task->part_cond);
-	free(d_task->len_mutex);
-	free(d_task->part_cond);
-	free(d_task->part_mutex);
-	free(desc->arg);
 	free(desc);
-
-	if (d_task->finished_callback)
-		d_task->finished_callback(NULL);
+	_download_task_put(d_task);
 }
 
 static void download_task_init(d_task_t *d_task, d_callback finished, d_callback progress)
 {
-	d_task->len_mutex             = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
 	d_task->part_mutex            = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
 	d_task->part_cond             = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-	pthread_mutex_init(d_task->len_mutex, NULL);
+	d_task->mirror_mutex          = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	d_task->stream_mutex          = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	d_task->stream_cond           = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
 	pthread_mutex_init(d_task->part_mutex, NULL);
+	pthread_mutex_init(d_task->mirror_mutex, NULL);
 	pthread_cond_init(d_task->part_cond, NULL);
+	pthread_mutex_init(d_task->stream_mutex, NULL);
+	pthread_cond_init(d_task->stream_cond, NULL);
 	d_task->len_downloaded    = 0;
+	d_task->progress_thread   = pthread_self();    // the entry takes it over
+	d_task->progress_parts    = NULL;
+	d_task->progress_nparts   = 0;
+	d_task->progress_total    = 0;
+	d_task->progress_sent     = 0;
+	d_task->progress_time     = now_seconds();
+	d_task->progress_speed    = 0;
+	d_task->status_slot       = -1;
+	d_task->log_id            = __sync_add_and_fetch(&task_ids, 1);
+	d_task->small_body        = NULL;
+	d_task->small_body_len    = -1;
 	d_task->parts_exit        = 0;
+	d_task->res_changed       = 0;
+	d_task->expected_sha256[0] = '\0';
+	d_task->expected_crc32c[0] = '\0';
+	d_task->nmirrors          = 1;
+	d_task->mirrors[0].probe  = MIRROR_PROBED;
+	d_task->overwrite         = 0;
+	d_task->overwrite_path[0] = '\0';
+	d_task->status            = ERR_FALSE;
+	d_task->file_done         = NULL;
+	d_task->file_done_ctx     = NULL;
+	d_task->sha256[0]         = '\0';
+	d_task->delta_base[0]     = '\0';
+	d_task->stream_cb         = NULL;
+	d_task->stream_ctx        = NULL;
+	d_task->stream_fd         = 0;
+	d_task->stream_parts      = NULL;
+	d_task->stream_nparts     = 0;
+	d_task->stream_head       = 0;
+	d_task->stream_off        = 0;
+	d_task->stream_stalled    = 0;
+	d_task->stream_busy       = 0;
+	d_task->stream_again      = 0;
+	d_task->stream_err        = 0;
+	d_task->sink              = NULL;
+	d_task->sink_seekable     = 0;
+	d_task->accept_encoding   = 0;
+	d_task->extract_dir[0]    = '\0';
+	d_task->extract_special   = 0;
+	d_task->untar             = NULL;
+	d_task->extract_punched   = 0;
+	d_task->flight            = NULL;
+	d_task->flight_next       = NULL;
+	d_task->refs              = 1;
 	d_task->finished_callback = finished;
 	d_task->progress_callback = progress;
 }
@@ -435,21 +2248,57 @@ static void download_task_init(d_task_t *d_task, d_callback finished, d_callback
 downloader *easy_downloader_init()
 {
 	int ret;
+	const char *trace;
+	char status_file[PATH_MAX];
 
 	sqlite3 *db_key;	
 	snprintf(download_tmp_path, PATH_MAX, "%s/%s/", getenv("HOME"), TMP_DIR);
 
+	// a relative trace file is taken from where the process started
+	if ((trace = getenv(TRACE_ENV)) && trace[0])
+	{
+		if (trace[0] == '/' || !getcwd(trace_file, PATH_MAX - strlen(trace) - 1))
+			snprintf(trace_file, PATH_MAX, "%s", trace);
+		else
+			snprintf(trace_file + strlen(trace_file), PATH_MAX - strlen(trace_file), "/%s", trace);
+		trace_start();
+	}
+
+	log_start();
 	ret = mkdir(download_tmp_path, S_IRWXU);
 	if (ret != 0 && errno != EEXIST)
+	{
+		log_stop();
 		return NULL;
+	}
 	chdir(download_tmp_path);
 
 	if ((ret = db_connect(DB_FILE_NAME, &db_key, SQL_CREATE_TABLE)) != 0)
+	{
+		log_stop();
+		return NULL;
+	}
+	if (conn_tls_init() != 0)
+	{
+		db_close(db_key);
+		log_stop();
 		return NULL;
+	}
+	// breakpoints saved by older versions have no validators
+	db_ensure_column(db_key, "d_breakpoints", "etag", "varchar(255)");
+	db_ensure_column(db_key, "d_breakpoints", "last_modified", "varchar(255)");
+	db_ensure_column(db_key, "d_breakpoints", "expected_sha256", "varchar(64)");
+	db_ensure_column(db_key, "d_breakpoints", "expected_crc32c", "varchar(8)");
+	db_ensure_column(db_key, "d_breakpoints", "mirrors", "text");
+
+	// not fatal, the downloads are only not seen from outside
+	snprintf(status_file, PATH_MAX, "%s%s", download_tmp_path, STATUS_FILE_NAME);
+	status_open(status_file);
 
 	d_manager_t *manager = (d_manager_t *)malloc(sizeof(d_manager_t));
 	manager->tp = easy_thread_pool_init(5, 60);
 	manager->db_key = db_key;
+	manager->cache_budget = 0;
 
 	if (file_saved_def_path[0] == '\0')
 	{
@@ -463,14 +2312,83 @@ downloader *easy_downloader_init()
 void easy_downloader_destroy(downloader *inst)
 {
 	d_manager_t *manager = (d_manager_t *)inst;
+	metrics_stop();
 	easy_thread_pool_free(manager->tp);
+	if (trace_file[0])
+		trace_dump(trace_file);
+	status_close();
 	db_close(manager->db_key);
+	ftp_close_sessions();
+	conn_tls_cleanup();
 	free(manager);
+	log_stop();
+}
+
+void easy_downloader_enable_cache(downloader *inst, long long max_bytes)
+{
+	d_manager_t *manager = (d_manager_t *)inst;
+	if (max_bytes > 0 && cache_init(manager) != 0)
+		return;
+	manager->cache_budget = max_bytes;
+}
+
+int easy_downloader_make_index(const char *file_name, const char *index_name)
+{
+	return delta_write_index(file_name, index_name);
+}
+
+int easy_downloader_get_metrics(downloader *inst, char *buf, int max)
+{
+	return metrics_text(((d_manager_t *)inst)->tp, buf, max);
+}
+
+int easy_downloader_serve_metrics(downloader *inst, const char *socket_path)
+{
+	return metrics_serve(((d_manager_t *)inst)->tp, socket_path);
+}
+
+void easy_downloader_set_trace(downloader *inst, int on)
+{
+	if (on)
+		trace_start();
+	else
+		trace_stop();
+}
+
+int easy_downloader_dump_trace(downloader *inst, const char *file_name)
+{
+	return trace_dump(file_name);
+}
+
+void easy_downloader_set_log_level(downloader *inst, int level)
+{
+	log_set_level(level);
+}
+
+void easy_downloader_set_small_file_size(downloader *inst, int size)
+{
+	small_file_size = size;
+}
+
+void easy_downloader_set_progress_rate(downloader *inst, int interval_ms, int bytes)
+{
+	progress_interval = interval_ms;
+	progress_bytes    = bytes;
+}
+
+void easy_downloader_set_max_parts(downloader *inst, int parts)
+{
+	max_parts = parts < 1 ? 1 : (parts > MAX_PART_NUMBER ? MAX_PART_NUMBER : parts);
+}
+
+void easy_downloader_set_ftp_logins(downloader *inst, int max_logins)
+{
+	ftp_set_max_logins(max_logins);
 }
 
 
 void easy_downloader_add_task(downloader *inst, const char *url, const char *file_saved_path/*last char is '/'*/,
-		d_callback finished, d_callback progress)
+		const d_task_opts_t *opts, d_callback finished, d_callback progress)
 {
 	d_manager_t *manager = (d_manager_t *)inst;
 
@@ -484,17 +2402,61 @@ void easy_downloader_add_task(downloader *inst, const char *url, const char *fil
 	strncpy(d_task->file_saved_path, file_saved_path ? file_saved_path : file_saved_def_path, PATH_MAX);
 	d_task->file_saved_path[PATH_MAX - 1] = '\0';
 
-	switch(protocol(url))
+	if (opts && opts->sha256)
 	{
-		case HTTP:
-			d_task->request_file_info = http_request_file_info;
-			d_task->request_part_file = http_request_part_file;
-			break;
-		case FTP:
-			d_task->request_file_info = ftp_request_file_info;
-			d_task->request_part_file = ftp_request_part_file;
-			break;
+		strncpy(d_task->expected_sha256, opts->sha256, SHA256_HEX_LEN);
+		d_task->expected_sha256[SHA256_HEX_LEN] = '\0';
+	}
+	if (opts && opts->crc32c)
+	{
+		strncpy(d_task->expected_crc32c, opts->crc32c, CRC32C_HEX_LEN);
+		d_task->expected_crc32c[CRC32C_HEX_LEN] = '\0';
+	}
+
+	if (opts && opts->sink)
+	{
+		d_task->sink          = opts->sink;
+		d_task->sink->length  = 0;
+		d_task->sink->status  = ERR_FALSE;
+		d_task->sink_seekable = opts->sink->type == D_SINK_FD && lseek(opts->sink->fd, 0, SEEK_CUR) >= 0;
+	}
+	if (opts)
+	{
+		d_task->stream_cb  = opts->stream_cb;
+		d_task->stream_ctx = opts->stream_ctx;
+		d_task->stream_fd  = opts->stream_fd;
+		d_task->accept_encoding = opts->accept_encoding;
+	}
+	if (opts && opts->extract_dir)
+	{
+		strncpy(d_task->extract_dir, opts->extract_dir, PATH_MAX);
+		d_task->extract_dir[PATH_MAX - 1] = '\0';
+		d_task->extract_special = opts->extract_special_bits;
+	}
+	if (opts && opts->delta_base)
+	{
+		strncpy(d_task->delta_base, opts->delta_base, PATH_MAX);
+		d_task->delta_base[PATH_MAX - 1] = '\0';
+	}
+
+	strcpy(d_task->mirrors[0].url, d_task->url);
+	if (opts && opts->mirrors)
+	{
+		int i;
+		for (i = 0; i < opts->mirror_count && d_task->nmirrors < MAX_MIRROR_NUMBER; i++)
+		{
+			strncpy(d_task->mirrors[d_task->nmirrors].url, opts->mirrors[i], MAX_URL_LEN);
+			d_task->mirrors[d_task->nmirrors].url[MAX_URL_LEN - 1] = '\0';
+			d_task->mirrors[d_task->nmirrors].probe = MIRROR_UNPROBED;
+			d_task->nmirrors++;
+		}
 	}
+	{
+		int i;
+		for (i = 0; i < d_task->nmirrors; i++)
+			_set_mirror_protocol(&d_task->mirrors[i]);
+	}
+	d_task->request_file_info = d_task->mirrors[0].request_file_info;
 
 	task_desc *desc = (task_desc *)malloc(sizeof(task_desc));
 	desc->arg = d_task;
@@ -502,6 +2464,31 @@ void easy_downloader_add_task(downloader *inst, const char *url, const char *fil
 	easy_thread_pool_add_task(manager->tp, download_entry, desc);
 }
 
+void download_add_file(d_manager_t *dm, const char *url, const char *file_saved_path,
+		void (*done)(void *ctx, int status), void *ctx)
+{
+	d_task_t *d_task = (d_task_t *)malloc(sizeof(d_task_t));
+	task_desc *desc;
+
+	download_task_init(d_task, NULL, NULL);
+	d_task->dm            = dm;
+	d_task->overwrite     = 1;
+	d_task->file_done     = done;
+	d_task->file_done_ctx = ctx;
+	strncpy(d_task->url, url, MAX_URL_LEN);
+	d_task->url[MAX_URL_LEN - 1] = '\0';
+	strncpy(d_task->file_saved_path, file_saved_path, PATH_MAX);
+	d_task->file_saved_path[PATH_MAX - 1] = '\0';
+	strcpy(d_task->mirrors[0].url, d_task->url);
+	_set_mirror_protocol(&d_task->mirrors[0]);
+	d_task->request_file_info = d_task->mirrors[0].request_file_info;
+
+	desc = (task_desc *)malloc(sizeof(task_desc));
+	desc->arg = d_task;
+	desc->fire_task_over = download_task_free;
+	easy_thread_pool_add_task(dm->tp, download_entry, desc);
+}
+
 void easy_downloader_recover_task(downloader *inst, const char *file_name, d_callback finished,
 		d_callback progress)
 {
@@ -535,6 +2522,9 @@ static void get_ith_breakpoint(d_breakpoint_t *bp, char **results, int i)
 	// parts
 	sscanf(results[i++], "%d", &parts);
 
+	// a download the status file knows needs no stat of its part files
+	if ((bp->len_downloaded = status_find(tmp_file_name_fmt)) >= 0)
+		return;
 	bp->len_downloaded = 0;
 	for (j = 0; j < parts; j++)
 	{
@@ -546,6 +2536,11 @@ static void get_ith_breakpoint(d_breakpoint_t *bp, char **results, int i)
 	}
 }
 
+int easy_downloader_get_status(downloader *inst, d_status_t *tasks, int max)
+{
+	return status_read(tasks, max);
+}
+
 int easy_downloader_get_breakpoints(downloader *inst, d_breakpoint_t *bps, int max)
 {
 	d_manager_t *manager = (d_manager_t *)inst;
@@ -556,7 +2551,7 @@ int easy_downloader_get_breakpoints(downloader *inst, d_breakpoint_t *bps, int m
 	if (SQLITE_OK != sqlite3_get_table(manager->db_key, SQL_QUERY_ALL, 
 				&result, &row, &col, &err_msg))
 	{
-		fprintf(stderr, "SQL error: %s\n", err_msg);
+		LOG_ERROR("SQL error: %s", err_msg);
 		sqlite3_free(err_msg);
 		return ERR_DB_EXCUTE;
 	}
@@ -570,17 +2565,167 @@ int easy_downloader_get_breakpoints(downloader *inst, d_breakpoint_t *bps, int m
 	return i;
 }
 
+static int _range_cmp(const void *a, const void *b)
+{
+	return (*(d_range_t **)a)->offset - (*(d_range_t **)b)->offset;
+}
+
+int easy_downloader_fetch_ranges(downloader *inst, const char *url, d_range_t *ranges, int n,
+		const char *file_name)
+{
+	file_info_t file;
+	char real_url[MAX_URL_LEN];
+	range_fetch_t rf;
+	int i, ret;
+
+	if (protocol(url) != HTTP && protocol(url) != HTTPS)
+	{
+		LOG_ERROR("range fetch needs an http url");
+		return ERR_URL;
+	}
+	if (n <= 0)
+		return 0;
+	if ((ret = http_request_file_info(url, &file, real_url)) != 0)
+	{
+		if (ret == ERR_RES_NOT_FOUND)
+			LOG_ERROR("%s not found", url);
+		return ret;
+	}
+
+	memset(&rf, 0, sizeof(rf));
+	rf.fd      = -1;
+	rf.nranges = n;
+	rf.ranges  = (d_range_t **)malloc(sizeof(d_range_t *) * n);
+	rf.spans   = (range_span_t *)malloc(sizeof(range_span_t) * n);
+	ret = ERR_FALSE;
+	if (!rf.ranges || !rf.spans)
+		goto OUT;
+	for (i = 0; i < n; i++)
+	{
+		if (ranges[i].offset < 0)
+			ranges[i].offset += file.length;
+		if (ranges[i].offset < 0 || ranges[i].length <= 0 || ranges[i].offset > file.length - ranges[i].length)
+		{
+			LOG_ERROR("range %d+%d is out of the file of %d bytes", ranges[i].offset,
+					ranges[i].length, file.length);
+			goto OUT;
+		}
+		rf.ranges[i] = &ranges[i];
+	}
+	qsort(rf.ranges, n, sizeof(d_range_t *), _range_cmp);
+
+	// the bytes in a small gap cost less than another range
+	for (i = 0; i < n; i++)
+	{
+		int beg = rf.ranges[i]->offset, end = beg + rf.ranges[i]->length - 1;
+		range_span_t *last = rf.nspans ? &rf.spans[rf.nspans - 1] : NULL;
+		if (last && beg <= last->end + 1 + RANGE_MERGE_GAP)
+		{
+			if (end > last->end)
+				last->end = end;
+			continue;
+		}
+		rf.spans[rf.nspans].beg  = beg;
+		rf.spans[rf.nspans].end  = end;
+		rf.spans[rf.nspans].next = beg;
+		rf.nspans++;
+	}
+
+	if (file_name && ((rf.fd = open(file_name, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0 ||
+				ftruncate(rf.fd, file.length) != 0))
+	{
+		ret = ERR_IO_CREATE;
+		goto OUT;
+	}
+	LOG_DEBUG("range fetch: %d spans", rf.nspans);
+	ret = http_request_ranges(&file, &rf);
+OUT:
+	if (rf.fd >= 0)
+		close(rf.fd);
+	free(rf.ranges);
+	free(rf.spans);
+	return ret;
+}
+
+int range_deliver(range_fetch_t *rf, int offset, const char *buf, int len)
+{
+	int i, end = offset + len;
+
+	if (rf->fd >= 0 && pwrite(rf->fd, buf, len, offset) != len)
+		return ERR_IO_WRITE;
+	for (i = 0; i < rf->nranges && rf->ranges[i]->offset < end; i++)
+	{
+		d_range_t *r = rf->ranges[i];
+		int beg = r->offset > offset ? r->offset : offset;
+		int stop = r->offset + r->length < end ? r->offset + r->length : end;
+		if (r->buf && beg < stop)
+			memcpy(r->buf + beg - r->offset, buf + beg - offset, stop - beg);
+	}
+	// the bytes of a span come in order
+	for (i = 0; i < rf->nspans && rf->spans[i].beg < end; i++)
+	{
+		range_span_t *span = &rf->spans[i];
+		if (span->next >= offset && span->next < end)
+			span->next = end > span->end + 1 ? span->end + 1 : end;
+	}
+	return 0;
+}
+
 void download_progress(d_task_t *d_task, int bytes_recv, int bytes_total)
 {
-	pthread_mutex_lock(d_task->len_mutex);
-	d_task->len_downloaded += bytes_recv;
-	pthread_mutex_unlock(d_task->len_mutex);
+	int len = __sync_add_and_fetch(&d_task->len_downloaded, bytes_recv);
 
-	if (d_task->progress_callback)
+	// the task's thread reports itself, a part thread wakes it for a byte step
+	if (pthread_equal(pthread_self(), d_task->progress_thread))
 	{
-		d_progress_t pt = { d_task->len_downloaded, bytes_total };
-		d_task->progress_callback(&pt);
+		d_task->progress_total = bytes_total;
+		_progress_emit(d_task, 0);
+	}
+	else if (progress_bytes > 0 && _progress_wanted(d_task) &&
+			(len - bytes_recv) / progress_bytes != len / progress_bytes)
+	{
+		pthread_mutex_lock(d_task->part_mutex);
+		pthread_cond_signal(d_task->part_cond);
+		pthread_mutex_unlock(d_task->part_mutex);
 	}
 }
 
+// save n bytes of a part, all protocols write through here
+int part_write(part_info_t *part, part_sink_t *sink, const char *buf, int n)
+{
+	d_task_t *d_task = part->d_task;
 
+	if (sink->write(sink, part->beg_pos, buf, n) != 0)
+		return ERR_IO_WRITE;
+	if (part->crc_len == part->attempt_len)
+	{
+		metrics_observe(HIST_FIRST_BYTE, now_seconds() - part->attempt_start);
+		TRACE_MARK("first byte", part->beg_pos);
+	}
+	TRACE_MARK("read", n);
+	metrics_host_bytes(part->metric_host, n);
+	part->crc      = crc32c_update(part->crc, buf, n);
+	part->crc_len += n;
+	part->beg_pos += n;
+	if (d_task->stream_parts && _stream_part(part, sink, buf, n, part->beg_pos - n) != 0)
+		return ERR_IO_WRITE;
+	download_progress(part->d_task, n, part->file->length);
+
+	// another part found the file changed, these bytes are dropped with the rest
+	if (__atomic_load_n(&d_task->res_changed, __ATOMIC_ACQUIRE))
+		return ERR_RES_CHANGED;
+	if (part->crc_len - part->saved_len >= PART_CHECKPOINT_LEN && !part->file_name && !d_task->sink &&
+			sink->flush(sink) == 0)
+	{
+		_save_part_digest(part);
+		if (d_task->stream_parts)
+			_stream_publish(part);
+	}
+	if (part->mirror && part->d_task->nmirrors > 1)
+	{
+		double now = now_seconds();
+		if (now - part->report_time >= MIRROR_REPORT_INTERVAL)
+			return _mirror_report(part, now);
+	}
+	return 0;
+}
@@ -9,10 +9,22 @@ typedef struct _downloader
 	int unused;
 }downloader;
 
-typedef struct _download_progress
+typedef struct _download_part_progress
 {
+	int offset;         // where the part starts in the file
+	int length;
 	int bytes_recv;
-	int bytes_total;
+}d_part_progress_t;
+
+// what a progress callback gets, the parts are only valid during the call
+typedef struct _download_progress
+{
+	int    bytes_recv;
+	int    bytes_total;
+	double speed;       // bytes per second, smoothed
+	double eta;         // seconds left at speed, < 0 if not known yet
+	int    nparts;      // 0 if the bytes do not come in parts
+	const d_part_progress_t *parts;
 }d_progress_t;
 
 typedef struct _download_breakpoint
@@ -22,18 +34,186 @@ typedef struct _download_breakpoint
 	int  len_downloaded;
 }d_breakpoint_t;
 
+// what easy_downloader_get_status tells of a download, of any process
+typedef struct _download_part_status
+{
+	int    offset;
+	int    length;
+	int    bytes_recv;
+	int    error;       // of its last attempt, 0 if that went well
+	double speed;       // bytes per second since the last update
+}d_part_status_t;
+
+#define D_MAX_PARTS        15
+
+typedef struct _download_status
+{
+	char   file_name[PATH_MAX];
+	int    pid;         // of the process downloading it
+	int    running;     // 0 once it stopped, with error
+	int    error;
+	int    file_length;
+	int    len_downloaded;
+	double speed;
+	int    nparts;
+	d_part_status_t parts[D_MAX_PARTS];
+}d_status_t;
+
 typedef void *(*d_callback)(void *);
 
+// a byte range of a remote file, offset < 0 counts from its end and is
+// replaced by the real offset once the length is known
+typedef struct _download_range
+{
+	int  offset;
+	int  length;
+	char *buf;      // gets the bytes, if not NULL
+}d_range_t;
+
+#define D_SINK_MEMORY      1
+#define D_SINK_FD          2
+#define D_SINK_CALLBACK    3
+
+// a destination other than a file in file_saved_path, it must outlive the
+// task. Parts arrive out of order, at their file offsets, from several
+// threads at once; such a download is not resumable
+typedef struct _download_sink
+{
+	int  type;
+	char *buf;          // D_SINK_MEMORY, of buf_len bytes
+	int  buf_len;
+	int  fd;            // D_SINK_FD, written at the file offsets, in order if it can't seek
+	int  (*write)(void *ctx, int offset, const char *buf, int len);   // D_SINK_CALLBACK, < 0 fails
+	void *ctx;
+
+	int  length;        // set to the file length once known
+	int  status;        // set when the task ends, 0 if every byte was written
+}d_sink_t;
+
+typedef struct _download_task_opts
+{
+	// expected digests of the whole file in hex, NULL if not checked
+	const char *sha256;
+	const char *crc32c;
+
+	// other urls serving the same file, http and ftp may be mixed
+	const char **mirrors;
+	int         mirror_count;
+
+	// an older copy of the file; if the url has a URL.edidx block index,
+	// only the blocks missing from it are fetched
+	const char *delta_base;
+
+	// deliver the file in order while it downloads, to stream_cb, or to
+	// stream_fd if that is > 0 (1 for stdout). It is still saved as usual.
+	// stream_cb returns < 0 to stop the stream, not the download
+	int  (*stream_cb)(void *ctx, const char *buf, int len);
+	void *stream_ctx;
+	int  stream_fd;
+
+	// where the file goes, NULL for a file in file_saved_path
+	d_sink_t    *sink;
+
+	// ask http servers for a gzip (or zstd) body, decoded as it arrives.
+	// An encoded body can only be taken from its start, the file comes
+	// over one connection instead of parts
+	int         accept_encoding;
+
+	// the file is a tar archive, plain, gzip or zstd compressed, to unpack
+	// into extract_dir as it arrives, instead of saving it. The archive
+	// passes through a spool which only keeps the bytes not unpacked yet.
+	// sink, stream_cb and stream_fd are not used then. An absolute path,
+	// init moves the process into ~/.easy_downloader
+	const char  *extract_dir;
+	// keep the setuid, setgid and sticky bits of the entries, which the
+	// archive may not be trusted with, off by default
+	int         extract_special_bits;
+}d_task_opts_t;
+
 downloader *easy_downloader_init();
 
-void easy_downloader_add_task(downloader *inst, const char *url, const char *file_saved_path, 
-		d_callback finished, d_callback progress);
+void easy_downloader_add_task(downloader *inst, const char *url, const char *file_saved_path,
+		const d_task_opts_t *opts, d_callback finished, d_callback progress);
 
 void easy_downloader_recover_task(downloader *inst, const char *file_name, d_callback finished,
 		d_callback progress);
 
+// mirror an ftp directory tree into dir_saved_path/<directory name>, files unchanged
+// since the last run are skipped, finished is called once the whole tree is done
+void easy_downloader_mirror_dir(downloader *inst, const char *url, const char *dir_saved_path,
+		d_callback finished, d_callback progress);
+
+// the downloads not finished yet, len_downloaded is taken from the status
+// file when it knows the file, else from the sizes of its part files. It is
+// approximate for a download still running, as of its last progress update
 int easy_downloader_get_breakpoints(downloader *inst, d_breakpoint_t *bps, int max);
 
+// every download running, or stopped by an error, in any process using
+// ~/.easy_downloader, from the status file they all map, without the database.
+// Other programs may map it themselves, status.h has its layout
+int easy_downloader_get_status(downloader *inst, d_status_t *tasks, int max);
+
+// files smaller than size are fetched on one connection straight to their
+// destination, without tmp files or a breakpoint, 64K by default, 0 disables it
+void easy_downloader_set_small_file_size(downloader *inst, int size);
+
+// progress callbacks come from the task's own thread, every interval_ms
+// while bytes arrive and each time another bytes arrived, the last one once
+// the transfer ends. <= 0 turns either off, 200 and 0 by default
+void easy_downloader_set_progress_rate(downloader *inst, int interval_ms, int bytes);
+
+// most parts a file is split into, 1 to 15, 15 by default
+void easy_downloader_set_max_parts(downloader *inst, int parts);
+
+// keep finished downloads in a cache of at most max_bytes, least recently used
+// files are evicted first; a repeated url with the same validators, or a task
+// whose sha256 is cached, is served from it. 0 disables it, the default
+void easy_downloader_enable_cache(downloader *inst, long long max_bytes);
+
+// fetch some byte ranges of an http url and wait for them. Besides the range
+// bufs, the bytes go to the same offsets of file_name if not NULL, a sparse
+// file of the remote length. Nearby ranges are fetched together, batched into
+// multipart/byteranges requests when the server supports them
+int easy_downloader_fetch_ranges(downloader *inst, const char *url, d_range_t *ranges, int n,
+		const char *file_name);
+
+// write the block index of file_name to index_name, publish it as URL.edidx
+int easy_downloader_make_index(const char *file_name, const char *index_name);
+
+// what every downloader of the process did so far as prometheus text: bytes
+// per host, retries by cause, finished tasks, the thread pool queue, and
+// histograms of connect time, time to first byte, part throughput, part
+// bytes and merge time. Its length, or the length it needs if that is max or more
+int easy_downloader_get_metrics(downloader *inst, char *buf, int max);
+
+// serve the metrics over http on a unix socket at socket_path, an absolute
+// path, until the downloader is destroyed, for a scrape through the socket
+int easy_downloader_serve_metrics(downloader *inst, const char *socket_path);
+
+// record connects, requests, first bytes, reads, part attempts, retries,
+// merges and database writes of every part into per-thread rings, or stop.
+// EDL_TRACE=FILE turns it on from init and dumps to FILE at destroy
+void easy_downloader_set_trace(downloader *inst, int on);
+
+// write the events still in the rings as chrome trace json, for
+// ui.perfetto.dev or chrome://tracing, one row per thread, args.part tells
+// the part. The last 16K events of each thread are kept
+int easy_downloader_dump_trace(downloader *inst, const char *file_name);
+
+#define D_LOG_ERROR        0
+#define D_LOG_WARN         1
+#define D_LOG_INFO         2
+#define D_LOG_DEBUG        3
+
+// records above level are dropped before they are formatted, D_LOG_INFO by
+// default. They go to stderr from a writer thread, one line each with the
+// time, the thread, and the task, part and host it worked on.
+// EDL_LOG_LEVEL=error|warn|info|debug sets it from init
+void easy_downloader_set_log_level(downloader *inst, int level);
+
+// cap of concurrent logins to one ftp server, 4 by default
+void easy_downloader_set_ftp_logins(downloader *inst, int max_logins);
+
 void easy_downloader_destroy(downloader *inst);
 
 
@@ -5,26 +5,81 @@
 #include "utils.h"
 #include <pthread.h>
 #include "threadpool.h"
+#include "digest.h"
+#include "metrics.h"
+#include "status.h"
 
 typedef struct _downloader_task d_task_t;
 
+#define MAX_VALIDATOR_LEN  128
+
 typedef struct _file_info
 {
 	d_url_t       d_url;
 	int           length;
 	char          filename[PATH_MAX];
+
+	// validators of the remote object, empty if the server gave none
+	char          etag[MAX_VALIDATOR_LEN];
+	char          last_modified[MAX_VALIDATOR_LEN];   // Last-Modified or MDTM
 }file_info_t;
 
-typedef struct _part_info
+typedef struct _part_info part_info_t;
+typedef struct _d_flight d_flight_t;
+typedef struct _untar untar_t;
+
+#define MAX_MIRROR_NUMBER  8
+
+// a mirror's info is requested the first time a part picks it
+#define MIRROR_UNPROBED    0
+#define MIRROR_PROBING     1
+#define MIRROR_PROBED      2
+#define MAX_PART_NUMBER    D_MAX_PARTS
+
+// one of the equivalent sources of a task, the task url is mirrors[0]
+typedef struct _mirror_info
+{
+	char           url[MAX_URL_LEN];
+	file_info_t    info;          // d_url and validators of this source
+	int (*request_file_info)(const char*, file_info_t *, char *);
+	int (*request_part_file)(part_info_t *part);
+
+	// guarded by the task's mirror_mutex
+	int            probe;         // MIRROR_*, info is only valid once probed
+	double         rate;          // bytes per second of one connection, averaged
+	int            active;        // parts transferring from it
+	int            failures;      // consecutive failed attempts
+	int            dropped;
+}mirror_info_t;
+
+struct _part_info
 {
 	file_info_t    *file;
+	file_info_t    *src;          // the mirror info the current attempt reads from
+	mirror_info_t  *mirror;
 	int            beg_pos;
 	int            end_pos;
 	d_task_t       *d_task;
 
 	int            id;
 	int            finished;
-}part_info_t;
+	const char     *file_name;   // the destination when the file is one part, else NULL
+
+	unsigned int   crc;          // crc32c of the bytes saved in the part file
+	int            crc_len;      // length of the part file covered by crc
+	int            saved_len;    // crc_len when the digest was last saved
+
+	double         attempt_start;
+	int            attempt_len;  // crc_len when the attempt started
+	double         report_time;  // last time the mirror rate was updated
+	int            report_len;   // crc_len at report_time
+	int            metric_host;  // byte counter of the attempt's host
+	int            progress_offset;    // where the part started, crc_len bytes ago
+	int            progress_len;
+	int            last_error;   // of the last attempt, 0 if it went well
+	int            stream_start; // where the part started, for the stream
+	int            stream_len;   // of crc_len, flushed where the stream can read it back
+};
 
 
 typedef struct _downloader_manager
@@ -32,6 +87,7 @@ typedef struct _downloader_manager
 	downloader            inst;
 	easy_thread_pool      *tp;
 	sqlite3               *db_key;
+	long long             cache_budget;    // bytes the download cache may keep, 0 if disabled
 }d_manager_t;
 
 typedef struct _downloader_task
@@ -45,23 +101,187 @@ typedef struct _downloader_task
 	d_callback         finished_callback;
 	d_callback         progress_callback;
 
-	pthread_mutex_t    *len_mutex;
+	// the parts add to len_downloaded atomically, only the task's thread
+	// calls progress_callback, the parts wake it for a byte step
 	int                len_downloaded;
+	pthread_t          progress_thread;
+	part_info_t        *progress_parts;   // reported in detail, NULL if none
+	int                progress_nparts;
+	int                progress_total;
+	int                progress_sent;     // len_downloaded at the last event
+	double             progress_time;     // of the last event
+	double             progress_speed;
+	int                status_slot;       // in the status file, -1 if none
+	int                log_id;            // the task of its log records
+	char               *small_body;       // a small file's body, come with its info, NULL if none
+	int                small_body_len;
 
 	pthread_mutex_t    *part_mutex;
 	pthread_cond_t     *part_cond;
 	int                parts_exit;
+	int                res_changed;    // a part found the remote object changed
+
+	char               expected_sha256[SHA256_HEX_LEN + 1];
+	char               expected_crc32c[CRC32C_HEX_LEN + 1];
+
+	pthread_mutex_t    *mirror_mutex;
+	mirror_info_t      mirrors[MAX_MIRROR_NUMBER];
+	int                nmirrors;
 
 	int (*request_file_info)(const char*, file_info_t *, char *);
-	int (*request_part_file)(part_info_t *part);
+
+	int                overwrite;      // replace the saved file instead of picking a new name
+	char               overwrite_path[PATH_MAX];   // the file replaced once complete, empty if none
+	char               overwrite_tmp[PATH_MAX];    // its new content until then
+	int                status;         // 0 once the file is complete
+	void (*file_done)(void *ctx, int status);
+	void               *file_done_ctx;
+
+	// single flight, guarded by the flight mutex in downloader.c
+	d_flight_t         *flight;        // the download this task leads or joined
+	struct _downloader_task *flight_next;
+	char               flight_file[PATH_MAX];   // where a follower gets its copy
+	int                refs;
+
+	char               sha256[SHA256_HEX_LEN + 1];    // of the file saved, if it was computed
+	char               delta_base[PATH_MAX];          // old copy to take unchanged blocks from
+
+	// in order delivery while downloading, guarded by stream_mutex; the
+	// thread delivering moves stream_off and stream_err outside it
+	int (*stream_cb)(void *ctx, const char *buf, int len);
+	void               *stream_ctx;
+	int                stream_fd;
+	pthread_mutex_t    *stream_mutex;
+	pthread_cond_t     *stream_cond;      // the stream moved on
+	part_info_t        *stream_parts;     // the parts delivered live, NULL if none
+	int                stream_nparts;
+	int                stream_head;       // the earliest part not delivered whole
+	int                stream_off;        // bytes of the file delivered
+	int                stream_stalled;    // a part gave up, nothing waits for the head
+	int                stream_err;
+	int                stream_busy;       // a thread is delivering
+	int                stream_again;      // a part published while it was
+
+	d_sink_t           *sink;             // the caller's destination, NULL for a file
+	int                sink_seekable;
+	int                accept_encoding;   // a whole file part is asked for encoded
+
+	// an archive unpacked from the stream, its bytes pass through a spool
+	char               extract_dir[PATH_MAX];
+	int                extract_special;   // the entries keep their setuid, setgid and sticky bits
+	untar_t            *untar;
+	d_sink_t           extract_sink;      // the spool, the task's sink while extracting
+	int                extract_punched;   // spool bytes given back to the disk
 }d_task_t;
 
+// download url into the file of its name in file_saved_path, replacing it, done is called at the end
+void download_add_file(d_manager_t *dm, const char *url, const char *file_saved_path,
+		void (*done)(void *ctx, int status), void *ctx);
 void download_progress(d_task_t *d_task, int bytes_recv, int bytes_total);
 
+// what a part writes through, the bytes of offset on go to its tmp file,
+// to the destination file at offset, or to the task's sink
+typedef struct _part_sink
+{
+	int  (*write)(struct _part_sink *sink, int offset, const char *buf, int len);
+	int  (*flush)(struct _part_sink *sink);    // readable by others once it returns
+	void (*close)(struct _part_sink *sink);
+
+	FILE           *fp;
+	int            fd;
+	d_sink_t       *user;
+	int            seekable;
+}part_sink_t;
+
+int part_open_sink(part_info_t *part, part_sink_t *sink);
+// the part files one after another into dst_file, deleted once copied, sha gets their bytes if not NULL
+int merge_files(const char *dst_file, int dst_len, char src_files[MAX_PART_NUMBER][PATH_MAX], int *src_lens, int nsrcs,
+		sha256_ctx_t *sha);
+int part_write(part_info_t *part, part_sink_t *sink, const char *buf, int n);
+// copy the whole file open at fd to the task's sink
+int sink_copy_fd(d_task_t *d_task, int fd);
+
+// unpack a tar archive, compressed with gzip or zstd or not, from its bytes in order
+// the entries get their mode less the umask, and their special bits only if keep_special
+untar_t *untar_open(const char *dir, int keep_special);
+int untar_write(untar_t *u, const char *buf, int len);
+// 0 if the archive was whole, sha256_hex gets the digest of the bytes written
+int untar_close(untar_t *u, char *sha256_hex);
+
 int http_request_file_info(/*in*/const char *url, /*out*/file_info_t *file, /*out*/char *url_redirect);
+// the info, and the body into body if it is max bytes or less, *body_len is -1 if it is not
+int http_request_small_file(const char *url, file_info_t *file, char *url_redirect,
+		char *body, int max, int *body_len);
 int ftp_request_file_info(/*in*/const char *url, /*out*/file_info_t *file, /*out*/char *url_redirect);
 
 int http_request_part_file(/*in*/part_info_t *part);
+// the value of the header field name, at most max - 1 chars of it, ERR_FALSE if missing
+int http_header_value(const char *header, const char *name, char *value, int max);
+
+// a run of wanted bytes, nearby ranges coalesced, next is the first one not got yet
+typedef struct _range_span
+{
+	int            beg;
+	int            end;
+	int            next;
+}range_span_t;
+
+typedef struct _range_fetch
+{
+	d_range_t      **ranges;      // sorted by offset
+	int            nranges;
+	range_span_t   *spans;        // sorted, not overlapping
+	int            nspans;
+	int            fd;            // the sparse file, -1 if none
+}range_fetch_t;
+
+// hand bytes at offset of the remote file to the ranges and the file they belong to
+int range_deliver(range_fetch_t *rf, int offset, const char *buf, int len);
+// fetch every span of rf, several in one request where the server allows it
+int http_request_ranges(const file_info_t *file, range_fetch_t *rf);
 int ftp_request_part_file(/*in*/part_info_t *part);
 
+// an entry of a remote ftp directory
+typedef struct _ftp_entry
+{
+	char          name[NAME_MAX + 1];
+	int           is_dir;
+	int           size;
+	char          modify[MAX_VALIDATOR_LEN];   // MLSD modify fact, or the LIST date
+}ftp_entry_t;
+
+// list the directory d_url->path, *entries is malloc'ed, returns the count
+int ftp_list_dir(const d_url_t *d_url, ftp_entry_t **entries);
+// fetch a whole file in one transfer over a pooled session
+int ftp_fetch_file(const d_url_t *d_url, const char *file_path);
+
+// content addressed cache of finished downloads under the tmp dir, blob_fd
+// gets the cached file open for reading, an eviction can't take it away then
+int  cache_init(d_manager_t *dm);
+int  cache_find_digest(d_manager_t *dm, const char *sha256, int *blob_fd);
+int  cache_find_url(d_manager_t *dm, const char *url, const file_info_t *file, const char *sha256, int *blob_fd);
+void cache_store(d_manager_t *dm, const char *url, const file_info_t *file, const char *sha256, const char *file_name);
+
+// block index of a file, for fetching only the blocks a local old copy lacks
+typedef struct _delta_index
+{
+	int            length;       // of the indexed file
+	int            block_size;
+	int            strong_len;   // leading bytes of the block sha256 kept
+	int            blocks;       // full blocks, the shorter tail has no entry
+	char           sha256[SHA256_HEX_LEN + 1];    // of the whole file
+	unsigned int   *weak;
+	unsigned char  *strong;
+}delta_index_t;
+
+int  delta_write_index(const char *file_name, const char *index_name);
+int  delta_read_index(const char *index_name, delta_index_t *idx);
+void delta_free_index(delta_index_t *idx);
+// base_off[i] gets the offset of block i in base, -1 if not there, returns the blocks found
+int  delta_match(const delta_index_t *idx, const char *base, int *base_off);
+
+// logged-in ftp control connections shared by all tasks
+void ftp_set_max_logins(int max_logins);
+void ftp_close_sessions(void);
+
 #endif
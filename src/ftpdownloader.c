@@ -1,32 +1,87 @@
 #include "downloader_imp.h"
+#include "conn.h"
+
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #define MAX_BUF_SIZE 256
 #define MAX_LINE_SIZE 1024
 
-static int read_reply_line(int fd, char *reply, int max)
+#define MAX_FTP_SERVERS     16
+#define MAX_FTP_SESSIONS    32
+#define FTP_DEF_MAX_LOGINS  4
+#define FTP_SESSION_IDLE    60     // seconds an idle login is kept
+#define FTP_LOGIN_BACKOFF   2      // seconds to wait after the server refused a login
+#define FTP_REPLY_TIMEOUT   3      // seconds to wait for the replies after ABOR
+#define MAX_SERVER_KEY      (256 + 16)
+#define FTP_DATA_BUF_SIZE   (128 * 1024)
+
+/*
+ * Logged-in control connections are pooled per server and reused by
+ * the following ranges, a part costs PASV/REST/RETR instead of a new
+ * connection and login. Logins per server are capped, a server that
+ * refuses one lowers its cap to what it accepted.
+ */
+typedef struct _ftp_server
+{
+	char           key[MAX_SERVER_KEY];
+	int            logins;        // logged in or logging in
+	int            max_logins;
+	double         retry_after;
+}ftp_server_t;
+
+typedef struct _ftp_session
+{
+	d_conn_t       ctl;
+	ftp_server_t   *server;       // NULL for a free slot
+	int            in_use;
+	int            type_i;        // TYPE I already sent
+	int            rang;          // RANG STREAM, the server stops at the range end
+	int            no_epsv;       // EPSV refused, use PASV
+	int            no_mlsd;       // MLSD refused, use LIST
+	double         idle_since;
+}ftp_session_t;
+
+static pthread_mutex_t ftp_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ftp_pool_cond  = PTHREAD_COND_INITIALIZER;
+static ftp_server_t    ftp_servers[MAX_FTP_SERVERS];
+static ftp_session_t   ftp_sessions[MAX_FTP_SESSIONS];
+static int             ftp_max_logins = FTP_DEF_MAX_LOGINS;
+
+// read one reply line, never consume past its end
+static int read_reply_line(d_conn_t *ctl, char *reply, int max)
 {
 	int cnt = 0;
-	char buf[MAX_BUF_SIZE + 1];
+	char buf[MAX_BUF_SIZE];
 	while(1)
 	{
-		int n = read(fd, buf, MAX_BUF_SIZE);
-		if ( n <= 0)
+		char *eol;
+		int n = conn_peek(ctl, buf, MAX_BUF_SIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		if ((eol = memchr(buf, '\n', n)))
+			n = eol + 1 - buf;
+		if (conn_read(ctl, buf, n) != n)
 			return -1;
 		if (cnt < max)
 		{
 			memcpy(reply + cnt, buf, n > max - cnt ? max - cnt : n);
 			cnt += n;
 		}
-		buf[n] = '\0';
-		if (strstr(buf, "\r\n"))
+		if (eol)
 			break;
 	}
 	return cnt > max ? max : cnt;
 }
 
-static int read_reply_whole(int fd, char *reply_line, int max)
+static int read_reply_whole(d_conn_t *ctl, char *reply_line, int max)
 {
 	char buf[4];
+	char code_str[3];
 	int ret, code;
 
 
@@ -37,22 +92,23 @@ static int read_reply_whole(int fd, char *reply_line, int max)
 		max = 4;
 	}
 	
-	ret = read_reply_line(fd, reply, max);
-	if (ret > 0)
+	ret = read_reply_line(ctl, reply, max);
+	if (ret >= 4 && isdigit(reply[0]) && isdigit(reply[1]) && isdigit(reply[2]))
 	{
 		char flag = reply[3];
-		memcpy(buf, reply, 4);
-		reply[ret] = '\0';
-		buf[3] = '\0';
-		code = atoi(reply);
+		memcpy(code_str, reply, 3);
+		code = (reply[0] - '0') * 100 + (reply[1] - '0') * 10 + reply[2] - '0';
+		if (reply != buf)
+			reply[ret] = '\0';
 		if (flag == '-')
 		{
+			// a multi-line reply ends with the code followed by a space
 			while (1)
 			{
-				ret = read_reply_line(fd, buf, 4);
+				ret = read_reply_line(ctl, buf, 4);
 				if (ret <= 0)
 					return -1;
-				if (buf[3] == '-')
+				if (ret == 4 && buf[3] == ' ' && memcmp(buf, code_str, 3) == 0)
 					break;
 			}
 		}
@@ -60,15 +116,24 @@ static int read_reply_whole(int fd, char *reply_line, int max)
 	}
 	else
 	{
-		strncpy(reply_line, "error reply format\n", max);
-		reply_line[max] = '\0';
+		if (reply_line && max > 0)
+		{
+			strncpy(reply_line, "error reply format\n", max);
+			reply_line[max - 1] = '\0';
+		}
 		return -1;
 	}
 }
 
-static int get_reply_code(int fd)
+// the next reply, -1 if none arrived within timeout seconds
+static int read_reply_timeout(d_conn_t *ctl, int timeout)
 {
-	return read_reply_whole(fd, NULL, 0);
+	struct pollfd pfd;
+	pfd.fd     = ctl->fd;
+	pfd.events = POLLIN;
+	if (!conn_pending(ctl) && poll(&pfd, 1, timeout * 1000) <= 0)
+		return -1;
+	return read_reply_whole(ctl, NULL, 0);
 }
 
 /*
@@ -77,234 +142,855 @@ static void assert_reply_code(int fd, int code)
 	char reply_line[MAX_LINE_SIZE + 1] = {'\0'};
 	if (read_reply_whole(fd, reply_line, MAX_LINE_SIZE) != code)
 	{
-		fprintf(stderr, "%s", reply_line);
+		LOG_ERROR("%s", reply_line);
 	}
 }
 */
 
-#define ASSERT_REPLY_CODE(fd, code)                                               \
-        if (read_reply_whole((fd), reply_line, MAX_LINE_SIZE) != (code))          \
+#define ASSERT_REPLY_CODE(ctl, code)                                              \
+        if (read_reply_whole((ctl), reply_line, MAX_LINE_SIZE) != (code))         \
 		{                                                                         \
-			fprintf(stderr, "%s", reply_line);                                    \
-			return -1;                                                            \
+			LOG_ERROR("%s", reply_line);                                            \
+			goto FAILED;                                                          \
 		}                                                                         \
 
-static int send_cmd(int fd, const char *cmd)
+static int send_cmd(d_conn_t *ctl, const char *cmd)
 {
-	if (write_n_chars(fd, cmd, strlen(cmd)) != strlen(cmd))
+	if (conn_write_n(ctl, cmd, strlen(cmd)) != strlen(cmd))
 		return -1;
 	return 0;
 }
 
-static int do_login(int fd)
+static int do_login(d_conn_t *ctl)
 {
 	char reply_line[MAX_LINE_SIZE + 1] = {'\0'};
-	send_cmd(fd, "USER anonymous\r\n");
-	int code = read_reply_whole(fd, reply_line, MAX_LINE_SIZE);
+	send_cmd(ctl, "USER anonymous\r\n");
+	int code = read_reply_whole(ctl, reply_line, MAX_LINE_SIZE);
 	if (code == 230)
 		return 0;
 	else if (code == 331) // need password
 	{
-		send_cmd(fd, "PASS \r\n");
-		if ((code = read_reply_whole(fd, reply_line, MAX_LINE_SIZE)) == 230)
+		send_cmd(ctl, "PASS \r\n");
+		if ((code = read_reply_whole(ctl, reply_line, MAX_LINE_SIZE)) == 230)
 			return 0;
 	}
 
 	if (code == 332) // need account
 	{
-		send_cmd(fd, "ACCT \r\n");
-		if (read_reply_whole(fd, reply_line, MAX_LINE_SIZE) == 230)
+		send_cmd(ctl, "ACCT \r\n");
+		if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) == 230)
 			return 0;
 	}
-	fprintf(stderr, "login failed: %s\n", reply_line);
+	LOG_ERROR("login failed: %s", reply_line);
 	return -1;
 }
 
-int ftp_request_part_file(/*in*/part_info_t *part)
+// query the modification time of path, it is the validator used to resume
+static int ftp_mdtm(d_conn_t *ctl, const char *path, char *mdtm, int max)
 {
-	int length    = part->end_pos - part->beg_pos + 1;
-	int offset = part->beg_pos;
-	int ctl_fd, data_fd; 
-	int code, nread;
 	char cmd[256 + PATH_MAX];
 	char reply_line[MAX_LINE_SIZE + 1];
-	int a1, a2, a3, a4, p1, p2;
-	int times;
+	int nread;
+
+	mdtm[0] = '\0';
+	snprintf(cmd, sizeof(cmd), "MDTM %s\r\n", path);
+	send_cmd(ctl, cmd);
+	if ((nread = read_reply_line(ctl, reply_line, MAX_LINE_SIZE)) <= 4)
+		return -1;
+	reply_line[nread] = '\0';
+	if (strncmp(reply_line, "213", 3) != 0)
+		return -1;    // MDTM is not supported, resume without validator
+	reply_line[strcspn(reply_line, "\r\n")] = '\0';
+	strncpy(mdtm, reply_line + 4, max);
+	mdtm[max - 1] = '\0';
+	return 0;
+}
+
+/*
+ * Connect and log in. For ftps the control connection is upgraded with
+ * AUTH TLS before the login and data connections are protected too.
+ */
+static int ftp_open_control(d_conn_t *ctl, const d_url_t *d_url)
+{
+	char reply_line[MAX_LINE_SIZE + 1];
+
+	if (conn_open(ctl, d_url) < 0)
+		return ERR_CONNECT;
+	if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) != 220)
+		goto FAILED;
+
+	if (d_url->proto == FTPS)
+	{
+		send_cmd(ctl, "AUTH TLS\r\n");
+		if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) != 234 ||
+				conn_start_tls(ctl, d_url, NULL) != 0)
+			goto FAILED;
+	}
+
+	// >> USER & PASS
+	if (do_login(ctl) < 0)
+	{
+		conn_close(ctl);
+		return ERR_FALSE;
+	}
+
+	if (d_url->proto == FTPS)
+	{
+		send_cmd(ctl, "PBSZ 0\r\n");
+		if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) != 200)
+			goto FAILED;
+		send_cmd(ctl, "PROT P\r\n");
+		if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) != 200)
+			goto FAILED;
+	}
+	return 0;
+FAILED:
+	LOG_ERROR("%s", reply_line);
+	conn_close(ctl);
+	return ERR_FALSE;
+}
+
+// FEAT lists "RANG STREAM" if the server can end a transfer at a given byte
+static int ftp_has_rang(d_conn_t *ctl)
+{
+	char line[MAX_LINE_SIZE + 1];
+	int n, rang = 0;
+
+	send_cmd(ctl, "FEAT\r\n");
+	if ((n = read_reply_line(ctl, line, MAX_LINE_SIZE)) < 4 || strncmp(line, "211-", 4) != 0)
+		return 0;
+	while ((n = read_reply_line(ctl, line, MAX_LINE_SIZE)) > 0)
+	{
+		line[n] = '\0';
+		if (strncmp(line, "211 ", 4) == 0)
+			break;
+		if (strncasecmp(line, " RANG STREAM", strlen(" RANG STREAM")) == 0)
+			rang = 1;
+	}
+	return rang;
+}
+
+/*
+ * Open the passive data connection. EPSV only gives a port, the data
+ * goes to the address of the control peer, which is what makes ipv6
+ * servers work. PASV is the fallback for servers without EPSV.
+ */
+static int ftp_open_data(ftp_session_t *session, d_conn_t *data)
+{
+	d_conn_t *ctl = &session->ctl;
+	char reply_line[MAX_LINE_SIZE + 1];
 	d_url_t data_url;
+	char *ptr;
+	int code;
 
+	data->fd  = -1;
+	data->ssl = NULL;
+	data_url.host = data_url.buffer;
+	data_url.port = data_url.buffer + sizeof(data_url.buffer) - 8;
 
-	while ((ctl_fd = connect_server(&part->file->d_url)) < 0)
+	// >> EPSV, 229 Entering Extended Passive Mode (|||port|)
+	if (!session->no_epsv)
 	{
-		if (times++ > 10)
+		send_cmd(ctl, "EPSV\r\n");
+		code = read_reply_whole(ctl, reply_line, MAX_LINE_SIZE);
+		if (code == 229 && (ptr = strchr(reply_line, '(')) && ptr[1] && ptr[2] == ptr[1] && ptr[3] == ptr[1])
 		{
-			fprintf(stderr, "part %d connet failed\n", part->id);
-			return ctl_fd;
+			struct sockaddr_storage peer;
+			socklen_t peer_len = sizeof(peer);
+			if (getpeername(ctl->fd, (struct sockaddr *)&peer, &peer_len) != 0 ||
+					getnameinfo((struct sockaddr *)&peer, peer_len, data_url.host,
+						data_url.port - data_url.host, NULL, 0, NI_NUMERICHOST) != 0)
+				return -1;
+			snprintf(data_url.port, 8, "%d", atoi(ptr + 4));
+			return (data->fd = connect_server(&data_url)) < 0 ? -1 : 0;
 		}
-		sleep(1);
+		if (code < 500)
+		{
+			LOG_ERROR("cmd EPSV failed: %s", reply_line);
+			return -1;
+		}
+		session->no_epsv = 1;
 	}
 
-	DEBUG_OUTPUT("part %d connect successfully\n", part->id);
-	ASSERT_REPLY_CODE(ctl_fd, 220);
-
-	// >> USER & PASS
-	if (do_login(ctl_fd) < 0)
+	// >> PASV, 227 Entering Passive Mode (a1,a2,a3,a4,p1,p2)
 	{
-		fprintf(stderr, "part %d login failed\n", part->id);
+		int a1, a2, a3, a4, p1, p2;
+		send_cmd(ctl, "PASV\r\n");
+		if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) != 227)
+		{
+			LOG_ERROR("cmd PASV failed: %s", reply_line);
+			return -1;
+		}
+		for (ptr = reply_line + 4; *ptr && !isdigit(*ptr); ptr++)
+			;
+		if (sscanf(ptr, "%d,%d,%d,%d,%d,%d", &a1, &a2, &a3, &a4, &p1, &p2) != 6)
+		{
+			LOG_ERROR("cmd PASV failed: %s", reply_line);
+			return -1;
+		}
+		snprintf(data_url.host, data_url.port - data_url.host, "%d.%d.%d.%d", a1, a2, a3, a4);
+		snprintf(data_url.port, 8, "%d", (p1 << 8) + p2);
+		return (data->fd = connect_server(&data_url)) < 0 ? -1 : 0;
+	}
+}
+
+/*
+ * Send a command answered over the data connection and wait for the
+ * transfer to start. Returns the reply code if the server refused it,
+ * the session can still be used then, -1 if the session is broken.
+ */
+static int ftp_start_transfer(ftp_session_t *session, const d_url_t *d_url, const char *cmd, d_conn_t *data)
+{
+	char reply_line[MAX_LINE_SIZE + 1];
+	int code;
+
+	if (send_cmd(&session->ctl, cmd) < 0)
 		return -1;
+	TRACE_MARK("request", 0);
+	// the server accepts tls on the data connection once the command is taken
+	if (d_url->proto == FTPS && conn_start_tls(data, d_url, &session->ctl) != 0)
+		return -1;
+	code = read_reply_whole(&session->ctl, reply_line, MAX_LINE_SIZE);
+	if (code == 125 || code == 150)
+		return 0;
+	LOG_ERROR("%.*s failed: %s", (int)strcspn(cmd, "\r"), cmd, reply_line);
+	return code >= 400 ? code : -1;
+}
+
+// a session is worth reusing only if the server said nothing while it was idle
+static int _session_alive(ftp_session_t *s)
+{
+	struct pollfd pfd;
+	if (now_seconds() - s->idle_since > FTP_SESSION_IDLE || conn_pending(&s->ctl))
+		return 0;
+	pfd.fd     = s->ctl.fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+// called with ftp_pool_mutex held
+static void _drop_session(ftp_session_t *s)
+{
+	conn_close(&s->ctl);
+	s->server->logins--;
+	s->server = NULL;
+	s->in_use = 0;
+}
+
+static ftp_server_t *_find_server(const char *key)
+{
+	int i;
+	ftp_server_t *unused = NULL;
+	for (i = 0; i < MAX_FTP_SERVERS; i++)
+	{
+		if (ftp_servers[i].key[0] && strcmp(ftp_servers[i].key, key) == 0)
+			return &ftp_servers[i];
+		if (!unused && ftp_servers[i].logins == 0)
+			unused = &ftp_servers[i];
+	}
+	if (unused)
+	{
+		strcpy(unused->key, key);
+		unused->logins      = 0;
+		unused->max_logins  = ftp_max_logins;
+		unused->retry_after = 0;
+	}
+	return unused;
+}
+
+// a free slot, or the oldest idle login of another server
+static ftp_session_t *_free_slot(void)
+{
+	int i;
+	ftp_session_t *victim = NULL;
+	for (i = 0; i < MAX_FTP_SESSIONS; i++)
+	{
+		ftp_session_t *s = &ftp_sessions[i];
+		if (!s->server)
+			return s;
+		if (!s->in_use && (!victim || s->idle_since < victim->idle_since))
+			victim = s;
 	}
+	if (victim)
+		_drop_session(victim);
+	return victim;
+}
 
-	// >> PASV
-	send_cmd(ctl_fd, "PASV \r\n");
-	code = 0;
-	if ((nread = read_reply_line(ctl_fd, reply_line, MAX_LINE_SIZE)) > 4)
+/*
+ * Take an idle login to the server of d_url or log in a new one. Blocks
+ * while the server is at its login cap.
+ */
+static int ftp_session_acquire(const d_url_t *d_url, ftp_session_t **session)
+{
+	char key[MAX_SERVER_KEY];
+	int ret = 0;
+
+	snprintf(key, sizeof(key), "%d://%s:%s", d_url->proto, d_url->host, d_url->port);
+	pthread_mutex_lock(&ftp_pool_mutex);
+	while (1)
 	{
+		ftp_server_t *server = _find_server(key);
+		double now = now_seconds();
 		int i;
-		for (i = 0; i < 3; i++)
-			code = code * 10 + reply_line[i] - '0';
-		while (code == 227)
+
+		if (server)
 		{
-			if (isdigit(reply_line[i]))
-				break;
-			i++;
+			for (i = 0; i < MAX_FTP_SESSIONS; i++)
+			{
+				ftp_session_t *s = &ftp_sessions[i];
+				if (s->server != server || s->in_use)
+					continue;
+				if (!_session_alive(s))
+				{
+					_drop_session(s);
+					continue;
+				}
+				s->in_use = 1;
+				*session  = s;
+				ret       = 0;
+				LOG_DEBUG("ftp session reused: %s", key);
+				goto OUT;
+			}
+
+			if (server->logins < server->max_logins && now >= server->retry_after)
+			{
+				ftp_session_t *s = _free_slot();
+				if (s)
+				{
+					s->server = server;
+					s->in_use  = 1;
+					s->type_i  = 0;
+					s->no_epsv = 0;
+					s->no_mlsd = 0;
+					server->logins++;
+					pthread_mutex_unlock(&ftp_pool_mutex);
+					if ((ret = ftp_open_control(&s->ctl, d_url)) == 0)
+						s->rang = ftp_has_rang(&s->ctl);
+					pthread_mutex_lock(&ftp_pool_mutex);
+					if (ret == 0)
+					{
+						*session = s;
+						LOG_DEBUG("ftp session new: %s", key);
+						goto OUT;
+					}
+					s->ctl.fd  = -1;
+					s->ctl.ssl = NULL;
+					_drop_session(s);
+					pthread_cond_broadcast(&ftp_pool_cond);
+					if (ret == ERR_CONNECT || server->logins == 0)
+						goto OUT;
+					// refused while others are logged in, take that as the limit
+					server->max_logins  = server->logins;
+					server->retry_after = now_seconds() + FTP_LOGIN_BACKOFF;
+					LOG_WARN("ftp server %s refused a login, keep %d", key, server->logins);
+					continue;
+				}
+			}
 		}
-		if (code == 227)
+
+		if (server && now < server->retry_after)
 		{
-			reply_line[nread] = '\0';
-			if (sscanf(reply_line + i, "%d,%d,%d,%d,%d,%d", &a1, &a2, &a3, &a4, &p1, &p2) != 6)
-				code = 0;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += FTP_LOGIN_BACKOFF;
+			pthread_cond_timedwait(&ftp_pool_cond, &ftp_pool_mutex, &ts);
 		}
+		else
+			pthread_cond_wait(&ftp_pool_cond, &ftp_pool_mutex);
 	}
-	if (code != 227)
+OUT:
+	pthread_mutex_unlock(&ftp_pool_mutex);
+	return ret;
+}
+
+// give the login back to the pool, or close it if its state is unknown
+static void ftp_session_release(ftp_session_t *s, int reusable)
+{
+	pthread_mutex_lock(&ftp_pool_mutex);
+	if (reusable)
 	{
-		fprintf(stderr, "cmd PASV failed\n");
-		return -1;
+		s->in_use     = 0;
+		s->idle_since = now_seconds();
 	}
+	else
+		_drop_session(s);
+	pthread_cond_broadcast(&ftp_pool_cond);
+	pthread_mutex_unlock(&ftp_pool_mutex);
+}
 
-	snprintf(data_url.buffer, sizeof(data_url.buffer), "%d.%d.%d.%d", a1, a2, a3, a4);
-	data_url.host = data_url.buffer;
-	data_url.port = data_url.buffer + strlen(data_url.host) + 1;
-	snprintf(data_url.port, 64, "%d", (p1 << 8) + p2);
-	if ((data_fd = connect_server(&data_url)) < 0)
+void ftp_set_max_logins(int max_logins)
+{
+	int i;
+	pthread_mutex_lock(&ftp_pool_mutex);
+	ftp_max_logins = max_logins > 0 ? max_logins : FTP_DEF_MAX_LOGINS;
+	for (i = 0; i < MAX_FTP_SERVERS; i++)
+		ftp_servers[i].max_logins = ftp_max_logins;
+	pthread_cond_broadcast(&ftp_pool_cond);
+	pthread_mutex_unlock(&ftp_pool_mutex);
+}
+
+void ftp_close_sessions(void)
+{
+	int i;
+	pthread_mutex_lock(&ftp_pool_mutex);
+	for (i = 0; i < MAX_FTP_SESSIONS; i++)
+	{
+		ftp_session_t *s = &ftp_sessions[i];
+		if (s->server && !s->in_use)
+		{
+			send_cmd(&s->ctl, "QUIT\r\n");
+			_drop_session(s);
+		}
+	}
+	pthread_mutex_unlock(&ftp_pool_mutex);
+}
+
+/*
+ * The range is complete. Unless the server stops by itself (the range
+ * reaches the end of the file, or RANG bounded it) the transfer is
+ * aborted, and its replies are read so the login can serve the next
+ * range.
+ */
+static int ftp_end_transfer(d_conn_t *ctl, d_conn_t *data, int bounded)
+{
+	int code;
+	if (bounded)
+	{
+		conn_close(data);
+		code = read_reply_timeout(ctl, FTP_REPLY_TIMEOUT);
+		return code == 226 || code == 250 || code == 426 ? 0 : -1;
+	}
+
+	if (send_cmd(ctl, "ABOR\r\n") < 0)
+		return -1;
+	conn_close(data);
+	// 426 for the aborted transfer, or 226 if it completed meanwhile
+	code = read_reply_timeout(ctl, FTP_REPLY_TIMEOUT);
+	if (code != 426 && code != 451 && code != 226 && code != 250)
+		return -1;
+	code = read_reply_timeout(ctl, FTP_REPLY_TIMEOUT);
+	return code == 225 || code == 226 ? 0 : -1;
+}
+
+int ftp_request_part_file(/*in*/part_info_t *part)
+{
+	int length    = part->end_pos - part->beg_pos + 1;
+	int offset = part->beg_pos;
+	ftp_session_t *session;
+	d_conn_t *ctl, data;
+	int code;
+	char cmd[256 + PATH_MAX];
+	char reply_line[MAX_LINE_SIZE + 1];
+	int times = 0;
+	int ret = -1;
+	int bounded, ranged;
+	int reusable = 0;
+
+
+	while ((code = ftp_session_acquire(&part->src->d_url, &session)) == ERR_CONNECT)
+	{
+		if (times++ > 10)
+		{
+			LOG_ERROR("part %d connet failed", part->id);
+			return code;
+		}
+		sleep(1);
+	}
+	if (code < 0)
+	{
+		LOG_ERROR("part %d login failed", part->id);
 		return -1;
+	}
+	ctl = &session->ctl;
+	data.fd  = -1;
+	data.ssl = NULL;
+	LOG_DEBUG("part %d connect successfully", part->id);
+
+	// >> MDTM, make sure the file is the one the other parts got
+	if (part->src->last_modified[0])
+	{
+		char mdtm[MAX_VALIDATOR_LEN];
+		if (ftp_mdtm(ctl, part->src->d_url.path, mdtm, sizeof(mdtm)) == 0 &&
+				strcmp(mdtm, part->src->last_modified) != 0)
+		{
+			LOG_ERROR("part %d: remote file changed since the download started", part->id);
+			ftp_session_release(session, 1);
+			return ERR_RES_CHANGED;
+		}
+	}
+
+	// >> TYPE I, once per login
+	if (!session->type_i)
+	{
+		send_cmd(ctl, "TYPE I\r\n");
+		ASSERT_REPLY_CODE(ctl, 200);
+		session->type_i = 1;
+	}
 
-	// >> TYPE I
-	send_cmd(ctl_fd, "TYPE I\r\n");
-	ASSERT_REPLY_CODE(ctl_fd, 200);
+	// >> EPSV or PASV
+	if (ftp_open_data(session, &data) < 0)
+		goto FAILED;
 
-	// >> REST offset
-	snprintf(cmd, sizeof(cmd), "REST %d\r\n", offset);
-	send_cmd(ctl_fd, cmd);
-	ASSERT_REPLY_CODE(ctl_fd, 350);
+	// >> RANG first last, or REST offset and ABOR at the end of the range
+	bounded = part->end_pos + 1 >= part->src->length;
+	ranged  = 0;
+	if (session->rang && !bounded)
+	{
+		snprintf(cmd, sizeof(cmd), "RANG %d %d\r\n", offset, part->end_pos);
+		send_cmd(ctl, cmd);
+		if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) == 350)
+			bounded = ranged = 1;
+		else
+			session->rang = 0;
+	}
+	if (!ranged)
+	{
+		snprintf(cmd, sizeof(cmd), "REST %d\r\n", offset);
+		send_cmd(ctl, cmd);
+		ASSERT_REPLY_CODE(ctl, 350);
+	}
 
 	// >> RETR filename
-	snprintf(cmd, sizeof(cmd), "RETR %s\r\n", part->file->d_url.path);
-	send_cmd(ctl_fd, cmd);
+	snprintf(cmd, sizeof(cmd), "RETR %s\r\n", part->src->d_url.path);
+	if ((code = ftp_start_transfer(session, &part->src->d_url, cmd, &data)) != 0)
+	{
+		reusable = code > 0;
+		goto FAILED;
+	}
 
-	// transfer file
+	// transfer file, only the data connection is read until the range is in
 	{
-		FILE *fp;
-		char tmp_file_name[PATH_MAX];
-		fd_set rfds;
-		int max_fd;
-		int ret;
+		part_sink_t sink;
+		char *buf;
+		int nread;
 
-		snprintf(tmp_file_name, PATH_MAX, part->d_task->tmp_file_name_fmt, part->id);
-		if (!(fp = fopen(tmp_file_name, "a")))
+		if (part_open_sink(part, &sink) != 0)
 		{
-			fprintf(stderr, "part %s file can't open\n", tmp_file_name);
-			close(ctl_fd);
-			close(data_fd);
-			return -1;
+			LOG_ERROR("part %d file can't open", part->id);
+			goto FAILED;
+		}
+		if (!(buf = (char *)malloc(FTP_DATA_BUF_SIZE)))
+		{
+			sink.close(&sink);
+			goto FAILED;
 		}
-
-		FD_ZERO(&rfds);
-		FD_SET(data_fd, &rfds);
-		FD_SET(ctl_fd, &rfds);
-		max_fd = data_fd > ctl_fd ? data_fd : ctl_fd;
 
 		ret = 0;
-		while(1)
+		while (length > 0)
 		{
-			fd_set active_fds = rfds;
-			int ret = select(max_fd + 1, &active_fds, NULL, NULL, NULL);
-			if (ret == -1 && errno != EINTR)
+			nread = conn_read(&data, buf, length < FTP_DATA_BUF_SIZE ? length : FTP_DATA_BUF_SIZE);
+			if (nread < 0 && errno == EINTR)
+				continue;
+			if (nread <= 0)
 			{
-				perror("select failed:");
-				ret = -2;
+				LOG_ERROR("read file data failed: %s", strerror(errno));
+				ret = ERR_IO_READ;
 				break;
 			}
-			if (FD_ISSET(ctl_fd, &active_fds))
-			{
-				int code = get_reply_code(ctl_fd);
-				if (code >= 300) // only 125, 150, 226, 250 allowed
-				{
-					fprintf(stderr, "cmd RETR failed with code %d\n", code);
-					ret = -2;
-					break;
-				}
-			}
-			else if (FD_ISSET(data_fd, &active_fds))
-			{
-				char buf[256];
-				nread = read(data_fd, buf, 256);
-				if (nread <= 0)
-				{
-					perror("read file data failed");
-					ret = -2;
-					break;
-				}
-				nread = nread > length ? length : nread;
-				fwrite(buf, 1, nread, fp);
-				part->beg_pos += nread;
-				download_progress(part->d_task, nread, part->file->length);
-				if ((length -= nread) <= 0)
-					break;
-			}
+			if ((ret = part_write(part, &sink, buf, nread)) != 0)
+				break;
+			length -= nread;
 		}
-		fclose(fp);
-		close(ctl_fd);
-		close(data_fd);
+		free(buf);
+		sink.close(&sink);
+		if (ret == 0)
+			reusable = ftp_end_transfer(ctl, &data, bounded) == 0;
+		conn_close(&data);
+		ftp_session_release(session, reusable);
 		return ret;
 	}
+
+FAILED:
+	conn_close(&data);
+	ftp_session_release(session, reusable);
+	return -1;
 }
 
 int ftp_request_file_info(/*in*/const char *url, /*out*/file_info_t *file, /*out*/char *url_redirect)
 {
-	int ctl_fd;
-	int ret, code;
-	int nread, nwritten;
+	ftp_session_t *session;
+	d_conn_t *ctl;
+	int ret;
 	char cmd[PATH_MAX + 256];
 	char reply_line[MAX_LINE_SIZE + 1];
 
 
 	if (ret = parse_url(url, &file->d_url))
 	{
-		fprintf(stderr, "wrong url rquest\n");
+		LOG_ERROR("wrong url rquest");
 		return ret;
 	}
 	if (url_redirect)
 		strcpy(url_redirect, url);
-	if ((ctl_fd = connect_server(&file->d_url)) < 0)
-		return ctl_fd;
+	if ((ret = ftp_session_acquire(&file->d_url, &session)) < 0)
+		return ret;
+	ctl = &session->ctl;
+	LOG_DEBUG("connect server successfully");
 
-	ASSERT_REPLY_CODE(ctl_fd, 220);
-	DEBUG_OUTPUT("%s", "connect server successfully\n");
+	// SIZE counts bytes only in binary mode
+	if (!session->type_i)
+	{
+		send_cmd(ctl, "TYPE I\r\n");
+		ASSERT_REPLY_CODE(ctl, 200);
+		session->type_i = 1;
+	}
 
-	if (do_login(ctl_fd) < 0)
-		return -1;
+	snprintf(cmd, sizeof(cmd), "SIZE %s\r\n", file->d_url.path);
+	send_cmd(ctl, cmd);
+	if (read_reply_whole(ctl, reply_line, MAX_LINE_SIZE) != 213)
+	{
+		LOG_ERROR("%s", reply_line);
+		ftp_session_release(session, 1);
+		return ERR_RES_NOT_FOUND;
+	}
+	sscanf(reply_line + 4, "%d\r\n", &file->length);
+	LOG_DEBUG("file size is %d", file->length);
+
+	file->etag[0] = '\0';
+	ftp_mdtm(ctl, file->d_url.path, file->last_modified, MAX_VALIDATOR_LEN);
+	
+	ftp_session_release(session, 1);
+	return 0;
 
-	send_cmd(ctl_fd, "TYPE I\r\n");
-	ASSERT_REPLY_CODE(ctl_fd, 200);
+FAILED:
+	ftp_session_release(session, 0);
+	return -1;
+}
 
-	snprintf(cmd, sizeof(cmd), "SIZE %s\r\n", file->d_url.path);
-	send_cmd(ctl_fd, cmd);
+// one MLSD line, "type=file;size=1234;modify=20140101120000; name"
+static int parse_mlsd_line(char *line, ftp_entry_t *entry)
+{
+	char *name = strchr(line, ' ');
+	char *fact;
 
-	if ((ret = read_reply_line(ctl_fd, reply_line, MAX_LINE_SIZE)) < 5)
+	if (!name || !name[1])
 		return -1;
-	reply_line[ret] = '\0';
-	sscanf(reply_line + 4, "%d\r\n", &file->length);
-	DEBUG_OUTPUT("file size is %d\n", file->length);
-	
-	close(ctl_fd);
+	*name++ = '\0';
+	entry->is_dir    = -1;
+	entry->size      = 0;
+	entry->modify[0] = '\0';
+	for (fact = strtok(line, ";"); fact; fact = strtok(NULL, ";"))
+	{
+		if (strcasecmp(fact, "type=file") == 0)
+			entry->is_dir = 0;
+		else if (strcasecmp(fact, "type=dir") == 0)
+			entry->is_dir = 1;
+		else if (strncasecmp(fact, "size=", 5) == 0)
+			entry->size = atoi(fact + 5);
+		else if (strncasecmp(fact, "modify=", 7) == 0)
+		{
+			strncpy(entry->modify, fact + 7, MAX_VALIDATOR_LEN);
+			entry->modify[MAX_VALIDATOR_LEN - 1] = '\0';
+		}
+	}
+	if (entry->is_dir < 0)    // cdir, pdir and links
+		return -1;
+	strncpy(entry->name, name, NAME_MAX);
+	entry->name[NAME_MAX] = '\0';
 	return 0;
 }
+
+// one unix style LIST line, "-rw-r--r-- 1 owner group 1234 Jan  1 12:00 name"
+static int parse_list_line(char *line, ftp_entry_t *entry)
+{
+	char perms[16], month[8], day[8], clock[8];
+	int size, name_pos = 0;
+
+	if (sscanf(line, "%15s %*s %*s %*s %d %7s %7s %7s %n", perms, &size, month, day, clock, &name_pos) != 5 ||
+			!name_pos || !line[name_pos])
+		return -1;
+	if (perms[0] != '-' && perms[0] != 'd')
+		return -1;
+	if (strcmp(line + name_pos, ".") == 0 || strcmp(line + name_pos, "..") == 0)
+		return -1;
+	entry->is_dir = perms[0] == 'd';
+	entry->size   = size;
+	snprintf(entry->modify, MAX_VALIDATOR_LEN, "%s %s %s", month, day, clock);
+	strncpy(entry->name, line + name_pos, NAME_MAX);
+	entry->name[NAME_MAX] = '\0';
+	return 0;
+}
+
+int ftp_list_dir(const d_url_t *d_url, ftp_entry_t **entries)
+{
+	ftp_session_t *session;
+	d_conn_t *ctl, data;
+	char cmd[256 + PATH_MAX];
+	char *listing = NULL, *line, *next;
+	int len = 0, cap = 0, mlsd, count, nread;
+	int ret, reusable = 0;
+
+	*entries = NULL;
+	if ((ret = ftp_session_acquire(d_url, &session)) < 0)
+		return ret;
+	ctl = &session->ctl;
+	data.fd  = -1;
+	data.ssl = NULL;
+	ret = ERR_REQUEST_FILE;
+
+	// >> MLSD gives machine readable facts, LIST whatever the server likes
+	while (1)
+	{
+		if (ftp_open_data(session, &data) < 0)
+			goto FAILED;
+		mlsd = !session->no_mlsd;
+		snprintf(cmd, sizeof(cmd), "%s %s\r\n", mlsd ? "MLSD" : "LIST", d_url->path);
+		if ((ret = ftp_start_transfer(session, d_url, cmd, &data)) == 0)
+			break;
+		conn_close(&data);
+		if (ret < 0 || !mlsd || ret < 500)
+		{
+			reusable = ret > 0;
+			ret = ERR_REQUEST_FILE;
+			goto FAILED;
+		}
+		session->no_mlsd = 1;
+	}
+
+	while (1)
+	{
+		if (cap - len < MAX_LINE_SIZE)
+		{
+			char *tmp = (char *)realloc(listing, cap += FTP_DATA_BUF_SIZE);
+			if (!tmp)
+				goto FAILED;
+			listing = tmp;
+		}
+		nread = conn_read(&data, listing + len, cap - len - 1);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread < 0)
+		{
+			ret = ERR_IO_READ;
+			goto FAILED;
+		}
+		if (nread == 0)
+			break;
+		len += nread;
+	}
+	listing[len] = '\0';
+	if (ftp_end_transfer(ctl, &data, 1) != 0)
+	{
+		ret = ERR_IO_READ;
+		goto FAILED;
+	}
+	ftp_session_release(session, 1);
+
+	count = 1;
+	for (line = listing; (line = strchr(line, '\n')); line++)
+		count++;
+	if (!(*entries = (ftp_entry_t *)malloc(count * sizeof(ftp_entry_t))))
+	{
+		free(listing);
+		return ERR_FALSE;
+	}
+	count = 0;
+	for (line = listing; *line; line = next)
+	{
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+		line[strcspn(line, "\r")] = '\0';
+		if ((mlsd ? parse_mlsd_line(line, *entries + count) : parse_list_line(line, *entries + count)) == 0)
+			count++;
+	}
+	free(listing);
+	return count;
+
+FAILED:
+	free(listing);
+	conn_close(&data);
+	ftp_session_release(session, reusable);
+	return ret < 0 ? ret : ERR_FALSE;
+}
+
+int ftp_fetch_file(const d_url_t *d_url, const char *file_path)
+{
+	ftp_session_t *session;
+	d_conn_t *ctl, data;
+	char cmd[256 + PATH_MAX];
+	char reply_line[MAX_LINE_SIZE + 1];
+	char tmp_path[PATH_MAX];
+	char *buf = NULL;
+	FILE *fp = NULL;
+	int nread, ret, reusable = 0;
+
+	if ((ret = ftp_session_acquire(d_url, &session)) < 0)
+		return ret;
+	ctl = &session->ctl;
+	data.fd  = -1;
+	data.ssl = NULL;
+	ret = ERR_REQUEST_FILE;
+
+	if (!session->type_i)
+	{
+		send_cmd(ctl, "TYPE I\r\n");
+		ASSERT_REPLY_CODE(ctl, 200);
+		session->type_i = 1;
+	}
+	if (ftp_open_data(session, &data) < 0)
+		goto FAILED;
+	snprintf(cmd, sizeof(cmd), "RETR %s\r\n", d_url->path);
+	if ((ret = ftp_start_transfer(session, d_url, cmd, &data)) != 0)
+	{
+		reusable = ret > 0;
+		ret = ERR_REQUEST_FILE;
+		goto FAILED;
+	}
+
+	// the file shows up under its name only once complete
+	snprintf(tmp_path, PATH_MAX, "%s.part", file_path);
+	if (!(fp = fopen(tmp_path, "w")) || !(buf = (char *)malloc(FTP_DATA_BUF_SIZE)))
+	{
+		ret = ERR_IO_CREATE;
+		goto FAILED;
+	}
+	while ((nread = conn_read(&data, buf, FTP_DATA_BUF_SIZE)) != 0)
+	{
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread < 0)
+		{
+			ret = ERR_IO_READ;
+			goto FAILED;
+		}
+		if (fwrite(buf, 1, nread, fp) != nread)
+		{
+			ret = ERR_IO_WRITE;
+			goto FAILED;
+		}
+	}
+	free(buf);
+	buf = NULL;
+	if (fclose(fp) != 0)
+	{
+		fp = NULL;
+		ret = ERR_IO_WRITE;
+		goto FAILED;
+	}
+	fp = NULL;
+	if (ftp_end_transfer(ctl, &data, 1) != 0)
+	{
+		ret = ERR_IO_READ;
+		goto FAILED;
+	}
+	ftp_session_release(session, 1);
+	if (rename(tmp_path, file_path) != 0)
+	{
+		unlink(tmp_path);
+		return ERR_IO_CREATE;
+	}
+	return 0;
+
+FAILED:
+	free(buf);
+	if (fp)
+	{
+		fclose(fp);
+		unlink(tmp_path);
+	}
+	conn_close(&data);
+	ftp_session_release(session, reusable);
+	return ret < 0 ? ret : ERR_FALSE;
+}
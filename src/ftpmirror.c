@@ -0,0 +1,454 @@
+#include "threadpool.h"
+#include "downloader_imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#define MIRROR_SMALL_FILE   (1024 * 1024)    // smaller files are fetched in one transfer
+#define MIRROR_SMALL_JOBS   8                // small files in flight
+#define MIRROR_LARGE_JOBS   2                // ranged downloads in flight
+
+#define SQL_QUERY_LISTING  "select size, modify from d_listings where dir_url='%q' and name='%q'"
+#define SQL_QUERY_ENTRIES  "select name, size from d_listings where dir_url='%q'"
+#define SQL_SAVE_LISTING   "insert or replace into d_listings values ('%q', '%q', %d, '%q')"
+
+#define DIR_SIZE           -1               // the size a directory is saved with
+
+extern char file_saved_def_path[PATH_MAX];
+
+// a directory listed, with the modify fact its parent's listing gave
+typedef struct _mirror_dir_seen
+{
+	char               parent_url[MAX_URL_LEN];
+	char               name[NAME_MAX + 1];
+	char               modify[MAX_VALIDATOR_LEN];
+}mirror_dir_seen_t;
+
+typedef struct _mirror_job
+{
+	d_manager_t        *dm;
+	char               url[MAX_URL_LEN];     // remote directory, ends with '/'
+	char               dir[PATH_MAX];        // local copy of it
+
+	pthread_mutex_t    mutex;
+	pthread_cond_t     cond;
+	int                small_jobs;
+	int                large_jobs;
+
+	int                files_failed;
+	int                bytes_total;
+	int                bytes_done;
+
+	// saved once the whole tree synced, only the walking thread adds to it
+	mirror_dir_seen_t  *dirs_seen;
+	int                ndirs_seen;
+	int                max_dirs_seen;
+
+	d_callback         finished_callback;
+	d_callback         progress_callback;
+}d_mirror_t;
+
+typedef struct _mirror_file
+{
+	d_mirror_t         *mirror;
+	char               dir_url[MAX_URL_LEN];
+	char               url[MAX_URL_LEN];
+	char               path[PATH_MAX];
+	ftp_entry_t        entry;
+}mirror_file_t;
+
+// append a listed name to a url, '%' is the only character parse_url decodes
+static int _url_append(char *url, int max, const char *name, int is_dir)
+{
+	int len = strlen(url);
+	for (; *name; name++)
+	{
+		if (len + 4 >= max)
+			return ERR_URL;
+		if (*name == '%')
+			len += sprintf(url + len, "%%25");
+		else
+			url[len++] = *name;
+	}
+	if (is_dir)
+		url[len++] = '/';
+	url[len] = '\0';
+	return 0;
+}
+
+// the listing cache says the local copy is the file listed now
+static int _file_unchanged(d_mirror_t *m, mirror_file_t *f)
+{
+	char sql_buf[MAX_URL_LEN + NAME_MAX + 256];
+	char **results;
+	int row, col, unchanged = 0;
+	struct stat st;
+
+	if (stat(f->path, &st) != 0 || st.st_size != f->entry.size)
+		return 0;
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_QUERY_LISTING, f->dir_url, f->entry.name);
+	if (sqlite3_get_table(m->dm->db_key, sql_buf, &results, &row, &col, NULL) != SQLITE_OK)
+		return 0;
+	if (row == 1 && results[2] && atoi(results[2]) == f->entry.size &&
+			strcmp(results[3] ? results[3] : "", f->entry.modify) == 0)
+		unchanged = 1;
+	sqlite3_free_table(results);
+	return unchanged;
+}
+
+/*
+ * A directory whose modify fact is the one of its last complete sync has
+ * the same entries, and a file rewritten in place is written under a new
+ * name and renamed by most uploaders, which changes it too. Its files are
+ * not listed again if the local copies are all there; its subdirectories
+ * are, their facts are in its listing.
+ */
+static int _dir_unchanged(d_mirror_t *m, const char *parent_url, const ftp_entry_t *e,
+		const char *dir_url, const char *local_dir)
+{
+	char sql_buf[MAX_URL_LEN + NAME_MAX + 256];
+	char path[PATH_MAX];
+	char **results;
+	int i, row, col, unchanged = 0;
+	struct stat st;
+
+	if (!e->modify[0])
+		return 0;
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_QUERY_LISTING, parent_url, e->name);
+	if (sqlite3_get_table(m->dm->db_key, sql_buf, &results, &row, &col, NULL) != SQLITE_OK)
+		return 0;
+	if (row == 1 && results[2] && atoi(results[2]) == DIR_SIZE && results[3] && strcmp(results[3], e->modify) == 0)
+		unchanged = 1;
+	sqlite3_free_table(results);
+	if (!unchanged)
+		return 0;
+
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_QUERY_ENTRIES, dir_url);
+	if (sqlite3_get_table(m->dm->db_key, sql_buf, &results, &row, &col, NULL) != SQLITE_OK)
+		return 0;
+	for (i = 1; i <= row && unchanged; i++)
+	{
+		if (!results[i * 2] || !results[i * 2 + 1] || atoi(results[i * 2 + 1]) == DIR_SIZE)
+			continue;
+		if (snprintf(path, PATH_MAX, "%s/%s", local_dir, results[i * 2]) >= PATH_MAX ||
+				stat(path, &st) != 0 || st.st_size != atoi(results[i * 2 + 1]))
+			unchanged = 0;
+	}
+	sqlite3_free_table(results);
+	return unchanged;
+}
+
+static void _dir_seen(d_mirror_t *m, const char *parent_url, const ftp_entry_t *e)
+{
+	mirror_dir_seen_t *d;
+
+	if (!e->modify[0])
+		return;
+	if (m->ndirs_seen == m->max_dirs_seen)
+	{
+		int max = m->max_dirs_seen ? m->max_dirs_seen * 2 : 16;
+		if (!(d = (mirror_dir_seen_t *)realloc(m->dirs_seen, max * sizeof(mirror_dir_seen_t))))
+			return;
+		m->dirs_seen     = d;
+		m->max_dirs_seen = max;
+	}
+	d = &m->dirs_seen[m->ndirs_seen++];
+	snprintf(d->parent_url, MAX_URL_LEN, "%s", parent_url);
+	snprintf(d->name, NAME_MAX + 1, "%s", e->name);
+	snprintf(d->modify, MAX_VALIDATOR_LEN, "%s", e->modify);
+}
+
+static void _save_dirs_seen(d_mirror_t *m)
+{
+	char sql_buf[MAX_URL_LEN + NAME_MAX + MAX_VALIDATOR_LEN + 256];
+	int i;
+
+	for (i = 0; i < m->ndirs_seen; i++)
+	{
+		mirror_dir_seen_t *d = &m->dirs_seen[i];
+		sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_SAVE_LISTING, d->parent_url, d->name, DIR_SIZE, d->modify);
+		db_execute(m->dm->db_key, sql_buf, NULL);
+	}
+}
+
+static void _mirror_file_done(mirror_file_t *f, int ret)
+{
+	d_mirror_t *m = f->mirror;
+	d_progress_t pt;
+
+	if (ret == 0)
+	{
+		char sql_buf[MAX_URL_LEN + NAME_MAX + MAX_VALIDATOR_LEN + 256];
+		sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_SAVE_LISTING, f->dir_url, f->entry.name,
+				f->entry.size, f->entry.modify);
+		db_execute(m->dm->db_key, sql_buf, NULL);
+	}
+	else
+		LOG_ERROR("mirror: %s failed (%d)", f->url, ret);
+
+	memset(&pt, 0, sizeof(pt));
+	pt.eta = -1;
+	pthread_mutex_lock(&m->mutex);
+	if (ret == 0)
+		m->bytes_done += f->entry.size;
+	else
+		m->files_failed++;
+	pt.bytes_recv  = m->bytes_done;
+	pt.bytes_total = m->bytes_total;
+	pthread_mutex_unlock(&m->mutex);
+	if (m->progress_callback)
+		m->progress_callback(&pt);
+
+	// the job may be freed as soon as the count drops
+	pthread_mutex_lock(&m->mutex);
+	if (f->entry.size < MIRROR_SMALL_FILE)
+		m->small_jobs--;
+	else
+		m->large_jobs--;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+static void *mirror_small_entry(void *arg)
+{
+	mirror_file_t *f = (mirror_file_t *)arg;
+	d_url_t d_url;
+	int ret;
+
+	log_context(0, -1);
+	if ((ret = parse_url(f->url, &d_url)) == 0)
+		ret = ftp_fetch_file(&d_url, f->path);
+	_mirror_file_done(f, ret);
+	return NULL;
+}
+
+static void mirror_small_free(void *arg)
+{
+	task_desc *desc = (task_desc *)arg;
+	free(desc->arg);
+	free(desc);
+}
+
+static void mirror_large_done(void *ctx, int status)
+{
+	_mirror_file_done((mirror_file_t *)ctx, status);
+	free(ctx);
+}
+
+/*
+ * Small files go over the pooled ftp sessions in one transfer each,
+ * large ones through the ranged task path. Both are bounded so a huge
+ * directory does not flood the thread pool.
+ */
+static void _mirror_file(d_mirror_t *m, mirror_file_t *f)
+{
+	int small = f->entry.size < MIRROR_SMALL_FILE;
+
+	pthread_mutex_lock(&m->mutex);
+	while (small ? m->small_jobs >= MIRROR_SMALL_JOBS : m->large_jobs >= MIRROR_LARGE_JOBS)
+		pthread_cond_wait(&m->cond, &m->mutex);
+	if (small)
+		m->small_jobs++;
+	else
+		m->large_jobs++;
+	m->bytes_total += f->entry.size;
+	pthread_mutex_unlock(&m->mutex);
+
+	if (small)
+	{
+		task_desc *desc = (task_desc *)malloc(sizeof(task_desc));
+		desc->arg = f;
+		desc->fire_task_over = mirror_small_free;
+		easy_thread_pool_add_task(m->dm->tp, mirror_small_entry, desc);
+	}
+	else
+	{
+		char dir[PATH_MAX];
+		strcpy(dir, f->path);
+		*strrchr(dir, '/') = '\0';
+		download_add_file(m->dm, f->url, dir, mirror_large_done, f);
+	}
+}
+
+static int _mirror_dir(d_mirror_t *m, const char *dir_url, const char *local_dir);
+
+// the subdirectories of an unchanged directory, as its last sync saw them
+static int _mirror_subdirs(d_mirror_t *m, const char *dir_url, const char *local_dir)
+{
+	char sql_buf[MAX_URL_LEN + 256];
+	char url[MAX_URL_LEN];
+	char path[PATH_MAX];
+	char **results;
+	int i, row, col, ret = 0;
+
+	LOG_DEBUG("mirror: %s unchanged", dir_url);
+	sqlite3_snprintf(sizeof(sql_buf), sql_buf, SQL_QUERY_ENTRIES, dir_url);
+	if (sqlite3_get_table(m->dm->db_key, sql_buf, &results, &row, &col, NULL) != SQLITE_OK)
+		return ERR_DB_EXCUTE;
+	for (i = 1; i <= row; i++)
+	{
+		if (!results[i * 2] || !results[i * 2 + 1] || atoi(results[i * 2 + 1]) != DIR_SIZE)
+			continue;
+		strcpy(url, dir_url);
+		if (_url_append(url, MAX_URL_LEN, results[i * 2], 1) != 0 ||
+				snprintf(path, PATH_MAX, "%s/%s", local_dir, results[i * 2]) >= PATH_MAX ||
+				_mirror_dir(m, url, path) != 0)
+			ret = ERR_FALSE;
+	}
+	sqlite3_free_table(results);
+	return ret;
+}
+
+static int _mirror_dir(d_mirror_t *m, const char *dir_url, const char *local_dir)
+{
+	d_url_t d_url;
+	ftp_entry_t *entries;
+	int i, n, ret = 0;
+
+	if (parse_url(dir_url, &d_url) != 0)
+		return ERR_URL;
+	if ((n = ftp_list_dir(&d_url, &entries)) < 0)
+	{
+		LOG_ERROR("mirror: can't list %s", dir_url);
+		return n;
+	}
+	if (mkdir(local_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+	{
+		free(entries);
+		return ERR_IO_CREATE;
+	}
+	LOG_DEBUG("mirror: %s", dir_url);
+
+	for (i = 0; i < n; i++)
+	{
+		ftp_entry_t *e = &entries[i];
+		char url[MAX_URL_LEN];
+		char path[PATH_MAX];
+
+		strcpy(url, dir_url);
+		if (_url_append(url, MAX_URL_LEN, e->name, e->is_dir) != 0 ||
+				snprintf(path, PATH_MAX, "%s/%s", local_dir, e->name) >= PATH_MAX)
+		{
+			LOG_ERROR("mirror: %s%s is too long, skipped", dir_url, e->name);
+			ret = ERR_URL;
+			continue;
+		}
+
+		if (e->is_dir)
+		{
+			if (_dir_unchanged(m, dir_url, e, url, path))
+			{
+				if (_mirror_subdirs(m, url, path) != 0)
+					ret = ERR_FALSE;
+			}
+			else if (_mirror_dir(m, url, path) != 0)
+				ret = ERR_FALSE;
+			else
+				_dir_seen(m, dir_url, e);
+		}
+		else
+		{
+			mirror_file_t *f = (mirror_file_t *)malloc(sizeof(mirror_file_t));
+			f->mirror = m;
+			f->entry  = *e;
+			strcpy(f->dir_url, dir_url);
+			strcpy(f->url, url);
+			strcpy(f->path, path);
+			if (_file_unchanged(m, f))
+				free(f);
+			else
+				_mirror_file(m, f);
+		}
+	}
+	free(entries);
+	return ret;
+}
+
+static void *mirror_dir_entry(void *arg)
+{
+	d_mirror_t *m = (d_mirror_t *)arg;
+	int ret;
+
+	log_context(0, -1);
+	ret = _mirror_dir(m, m->url, m->dir);
+
+	// wait for the files still in flight
+	pthread_mutex_lock(&m->mutex);
+	while (m->small_jobs || m->large_jobs)
+		pthread_cond_wait(&m->cond, &m->mutex);
+	pthread_mutex_unlock(&m->mutex);
+
+	if (ret != 0 || m->files_failed)
+		LOG_ERROR("mirror: %s incomplete, %d files failed", m->url, m->files_failed);
+	else
+		_save_dirs_seen(m);
+	return NULL;
+}
+
+static void mirror_dir_free(void *arg)
+{
+	task_desc *desc = (task_desc *)arg;
+	d_mirror_t *m = (d_mirror_t *)desc->arg;
+	d_callback finished = m->finished_callback;
+
+	pthread_mutex_destroy(&m->mutex);
+	pthread_cond_destroy(&m->cond);
+	free(m->dirs_seen);
+	free(m);
+	free(desc);
+
+	if (finished)
+		finished(NULL);
+}
+
+void easy_downloader_mirror_dir(downloader *inst, const char *url, const char *dir_saved_path,
+		d_callback finished, d_callback progress)
+{
+	d_manager_t *manager = (d_manager_t *)inst;
+	d_mirror_t *m;
+	task_desc *desc;
+	const char *name, *end;
+	d_url_t d_url;
+
+	if (parse_url(url, &d_url) != 0 || (d_url.proto != FTP && d_url.proto != FTPS))
+	{
+		LOG_ERROR("mirror needs an ftp directory url");
+		if (finished)
+			finished(NULL);
+		return;
+	}
+
+	m = (d_mirror_t *)calloc(1, sizeof(d_mirror_t));
+	m->dm = manager;
+	pthread_mutex_init(&m->mutex, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	m->finished_callback = finished;
+	m->progress_callback = progress;
+
+	snprintf(m->url, MAX_URL_LEN - 1, "%s", url);
+	if (m->url[strlen(m->url) - 1] != '/')
+		strcat(m->url, "/");
+
+	// the tree goes to PATH/<remote directory name>, the host for the root
+	end = m->url + strlen(m->url) - 1;
+	for (name = end; name > m->url && name[-1] != '/'; name--)
+		;
+	if (name == end || name[-2] == '/')
+		snprintf(m->dir, PATH_MAX, "%s/%s", dir_saved_path ? dir_saved_path : file_saved_def_path, d_url.host);
+	else
+		snprintf(m->dir, PATH_MAX, "%s/%.*s", dir_saved_path ? dir_saved_path : file_saved_def_path,
+				(int)(end - name), name);
+
+	desc = (task_desc *)malloc(sizeof(task_desc));
+	desc->arg = m;
+	desc->fire_task_over = mirror_dir_free;
+	easy_thread_pool_add_task(manager->tp, mirror_dir_entry, desc);
+}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "downloader_imp.h"
+#include "conn.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,9 +10,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <fcntl.h>
 
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #define MAX_BUFFER_LEN     1024
 #define MAX_REDIRECT_TIMES 5
 
@@ -27,25 +35,103 @@
 						  "User-Agent: Mozilla/5.0 (X11; Linux i686)\r\n"           \
 						  "Accept: */*\r\n"       \
 						  "Range: bytes=%d-%d\r\n"\
+						  "%s"                    \
 						  "Pragma: no-cache\r\n"  \
 						  "Cache-control: no-cache\r\n"       \
 						  "Connection: close\r\n\r\n"   \
 
+#define CONNECT_STR_FMT_3 "GET %s HTTP/1.1\r\n"   \
+                          "Host: %s\r\n"          \
+						  "User-Agent: Mozilla/5.0 (X11; Linux i686)\r\n"           \
+						  "Accept: */*\r\n"       \
+						  "Range: bytes=%s\r\n"  \
+						  "%s"                    \
+						  "Connection: close\r\n\r\n"   \
 
-int http_request_file_info(const char *url, file_info_t *file, char *url_redirect)
+#define CONNECT_STR_FMT_4 "GET %s HTTP/1.1\r\n"   \
+                          "Host: %s\r\n"          \
+						  "User-Agent: Mozilla/5.0 (X11; Linux i686)\r\n"           \
+						  "Accept: */*\r\n"       \
+						  "Accept-Encoding: %s\r\n" \
+						  "Pragma: no-cache\r\n"  \
+						  "Cache-control: no-cache\r\n"       \
+						  "Connection: close\r\n\r\n"   \
+
+#define IF_RANGE_STR_FMT  "If-Range: %s\r\n"
+
+#ifdef HAVE_ZSTD
+#define ACCEPT_ENCODINGS  "zstd, gzip"
+#else
+#define ACCEPT_ENCODINGS  "gzip"
+#endif
+
+#define MAX_RANGES_PER_REQUEST  32
+#define RANGE_BUFFER_LEN        (1024 * 64)
+#define DECODE_BUFFER_LEN       (1024 * 64)
+
+static int _request_part_encoded(part_info_t *part);
+
+// copy the value of header field `name' into value, return 0 if found
+int http_header_value(const char *header, const char *name, char *value, int max)
+{
+	int name_len = strlen(name);
+	const char *line = header;
+	while (line && *line)
+	{
+		if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+		{
+			const char *beg = line + name_len + 1;
+			const char *end;
+			int len;
+			while (*beg == ' ' || *beg == '\t')
+				beg++;
+			if (!(end = strstr(beg, "\r\n")))
+				end = beg + strlen(beg);
+			len = end - beg;
+			if (len >= max)
+				len = max - 1;
+			memcpy(value, beg, len);
+			value[len] = '\0';
+			return 0;
+		}
+		if ((line = strstr(line, "\r\n")))
+			line += 2;
+	}
+	return ERR_FALSE;
+}
+
+// If-Range only accepts a strong entity tag, else fall back to the date
+static void http_if_range(const file_info_t *file, char *if_range, int max)
+{
+	if_range[0] = '\0';
+	if (file->etag[0] && strncmp(file->etag, "W/", 2) != 0)
+		snprintf(if_range, max, IF_RANGE_STR_FMT, file->etag);
+	else if (file->last_modified[0])
+		snprintf(if_range, max, IF_RANGE_STR_FMT, file->last_modified);
+}
+
+/*
+ * The info of url from the head of a whole GET. A body of max bytes or
+ * less is read on the same connection into body, *body_len tells its
+ * length then, else -1; body NULL wants none.
+ */
+static int _request_file_info(const char *url, file_info_t *file, char *url_redirect,
+		char *body, int max, int *body_len)
 {
-	int connfd;
+	d_conn_t conn;
 	d_url_t *d_url = &file->d_url;
 	int ret = parse_url(url, d_url);
 	static int redirect_times = 0;
 
+	if (body_len)
+		*body_len = -1;
 	if (ret < 0)
 	{
-		fprintf(stderr, "wrong url request\n");
+		LOG_ERROR("wrong url request");
 		return ret;
 	}
-	if ((connfd = connect_server(d_url)) < 0)
-		return connfd;
+	if ((ret = conn_open(&conn, d_url)) < 0)
+		return ret;
 
 	{
 		char request[MAX_BUFFER_LEN];
@@ -55,9 +141,9 @@ int http_request_file_info(const char *url, file_info_t *file, char *url_redirec
 		//#if debug
 		/*printf("request is %s", request);*/
 		//#endif
-		if (write_n_chars(connfd, request, strlen(request)) != strlen(request))
+		if (conn_write_n(&conn, request, strlen(request)) != strlen(request))
 		{	
-			close(connfd);
+			conn_close(&conn);
 			return ERR_IO_WRITE;
 		}
 	}
@@ -66,22 +152,39 @@ int http_request_file_info(const char *url, file_info_t *file, char *url_redirec
 		char *ptr = NULL;
 		char response[MAX_BUFFER_LEN + 1];
 		char status[4] = {0};
-		int nread = read(connfd, response, MAX_BUFFER_LEN); 
-		close(connfd);
+		int head_len = 0;
+		int nread = conn_read(&conn, response, MAX_BUFFER_LEN); 
 		if (nread < 0)
-			return ERR_IO_READ;
+		{
+			ret = ERR_IO_READ;
+			goto OUT;
+		}
 		response[nread] = '\0';
 		//#if debug
 		/*printf("response is %s", response);*/
 		//#endif
+		if ((ptr = strstr(response, "\r\n\r\n")))
+		{
+			head_len = ptr + 4 - response;
+			ptr[2] = '\0';   // only look at the header
+		}
+		ret = ERR_FALSE;
 		if (!(ptr = strstr(response, "HTTP/1.")))
-			return ERR_FALSE;
+			goto OUT;
 		memcpy(status, ptr + strlen("HTTP/1.x "), 3);
 		status[3] = '\0';
+		if (strcmp(status, "404") == 0)
+		{
+			// the caller tells whether a missing url is an error
+			LOG_DEBUG("%s not found", url);
+			ret = ERR_RES_NOT_FOUND;
+			goto OUT;
+		}
 		if (strcmp(status, "200") != 0)
 		{
-			fprintf(stderr, "downloader recieved http response with failed status code %s\n", status);
-			return ERR_REQUEST_FILE;
+			LOG_ERROR("downloader recieved http response with failed status code %s", status);
+			ret = ERR_REQUEST_FILE;
+			goto OUT;
 		}
 
 		// redirect
@@ -90,48 +193,84 @@ int http_request_file_info(const char *url, file_info_t *file, char *url_redirec
 		{
 			char url[MAX_URL_LEN];
 			sscanf(ptr, "Location: %s", url);
-			return http_request_file_info(url, file, url_redirect);
+			conn_close(&conn);
+			return _request_file_info(url, file, url_redirect, body, max, body_len);
 		}
 
 		// file size
+		ret = ERR_RES_NOT_FOUND;
 		ptr = strstr(response, "Content-Length:");
 		if (ptr)
 		{
 			int length;
 			ptr += strlen("Content-Length:");
 			sscanf(ptr, "%d", &length);
-			//#if debug
-			printf("file length is %d\n", length);
-			//#endif
+			LOG_DEBUG("file length is %d", length);
 
 			// check file length
+			ret = ERR_REQUEST_FILE;
 			if (length < 0)
-				return ERR_REQUEST_FILE;
+				goto OUT;
 
 			if (url_redirect)
 				strcpy(url_redirect, url);
 			file->length = length;
-			return 0;
+
+			if (http_header_value(response, "ETag", file->etag, MAX_VALIDATOR_LEN) != 0)
+				file->etag[0] = '\0';
+			if (http_header_value(response, "Last-Modified", file->last_modified, MAX_VALIDATOR_LEN) != 0)
+				file->last_modified[0] = '\0';
+			ret = 0;
+
+			// the rest of a small body follows on this connection
+			if (body && head_len > 0 && length <= max && nread - head_len <= length)
+			{
+				int n = nread - head_len, m;
+				memcpy(body, response + head_len, n);
+				while (n < length && (m = conn_read(&conn, body + n, length - n)) > 0)
+					n += m;
+				if (n == length)
+					*body_len = length;
+			}
 		}
-		return ERR_RES_NOT_FOUND;
 	}
+OUT:
+	conn_close(&conn);
+	return ret;
+}
+
+int http_request_file_info(const char *url, file_info_t *file, char *url_redirect)
+{
+	return _request_file_info(url, file, url_redirect, NULL, 0, NULL);
+}
+
+int http_request_small_file(const char *url, file_info_t *file, char *url_redirect,
+		char *body, int max, int *body_len)
+{
+	return _request_file_info(url, file, url_redirect, body, max, body_len);
 }
 
 
 int http_request_part_file(part_info_t *part)
 {	
-	int connfd = connect_server(&part->file->d_url);
-	int ret = ERR_FALSE;
+	d_conn_t conn;
+	int ret;
+
+	LOG_DEBUG("range %d-%d", part->beg_pos, part->end_pos);
+
+	// the whole file from its start may come encoded
+	if (part->d_task->accept_encoding && part->crc_len == 0 && part->beg_pos == 0 &&
+			part->end_pos == part->src->length - 1)
+		return _request_part_encoded(part);
 
-	// #if debug
-	printf("download part id %d :  %d-%d \n", part->id, part->beg_pos, part->end_pos);
-	// #endif
+	ret = conn_open(&conn, &part->src->d_url);
 
-	if (connfd < 0)
+	if (ret < 0)
 	{
-		fprintf(stderr, "download part %d-%d connect to srv failed\n", part->beg_pos, part->end_pos);
-		return ret;
+		LOG_ERROR("download part %d-%d connect to srv failed", part->beg_pos, part->end_pos);
+		return ERR_FALSE;
 	}
+	ret = ERR_FALSE;
 
 	{
 		char request[MAX_BUFFER_LEN + 1];
@@ -139,31 +278,41 @@ int http_request_part_file(part_info_t *part)
 		int  nread;
 		char *ptr;
 		char status[4];
-		snprintf(request,MAX_BUFFER_LEN, CONNECT_STR_FMT_2, part->file->d_url.path,part->file->d_url.host,
-				part->beg_pos, part->end_pos);
-		if (strlen(request) != write_n_chars(connfd, request, strlen(request)))
+		char if_range[MAX_VALIDATOR_LEN + 16];
+		http_if_range(part->src, if_range, sizeof(if_range));
+		snprintf(request,MAX_BUFFER_LEN, CONNECT_STR_FMT_2, part->src->d_url.path,part->src->d_url.host,
+				part->beg_pos, part->end_pos, if_range);
+		if (strlen(request) != conn_write_n(&conn, request, strlen(request)))
 		{
-			close(connfd);
+			conn_close(&conn);
 			return ERR_FALSE;
 		}
-		if ((nread = read(connfd, response, MAX_BUFFER_LEN)) < 0)
+		TRACE_MARK("request", part->beg_pos);
+		if ((nread = conn_read(&conn, response, MAX_BUFFER_LEN)) < 0)
 		{
-			close(connfd);
+			conn_close(&conn);
 			return ERR_FALSE;
 		}
 		response[nread] = '\0';
 		if (!(ptr = strstr(response, "HTTP/1.")))
 		{
-			close(connfd);
+			conn_close(&conn);
 			return ERR_FALSE;
 		}
 			
 		memcpy(status, ptr + strlen("HTTP/1.x "), 3);
 		status[3] = '\0';
+		if (strcmp(status, "200") == 0 && if_range[0])
+		{
+			// If-Range did not match, the server is sending the new entity
+			conn_close(&conn);
+			LOG_ERROR("part %d: remote file changed since the download started", part->id);
+			return ERR_RES_CHANGED;
+		}
 		if (strcmp(status, "206") != 0)
 		{
-			close(connfd);
-			fprintf(stderr, "request range content failed with bad status code %s\n", status);
+			conn_close(&conn);
+			LOG_ERROR("request range content failed with bad status code %s", status);
 			return ERR_FALSE;
 		}
 
@@ -171,8 +320,7 @@ int http_request_part_file(part_info_t *part)
 		{
 			int range_len, nbody_read, nleft;
 			int flags;
-			char tmp_file_name[PATH_MAX];
-			FILE *fp;
+			part_sink_t sink;
 			int start_read_body;
 			char *body;
 
@@ -182,16 +330,14 @@ int http_request_part_file(part_info_t *part)
 			sscanf(ptr, "%d", &range_len);
 			if ((range_len-1) != (part->end_pos - part->beg_pos))
 			{
-				fprintf(stderr, "response content-length is not suitable value %d", range_len);
-				close(connfd);
+				LOG_ERROR("response content-length is not suitable value %d", range_len);
+				conn_close(&conn);
 				return ERR_FALSE;
 			}
 
-			snprintf(tmp_file_name, PATH_MAX, part->d_task->tmp_file_name_fmt, part->id);
-			printf("tmp file name is %s\n", tmp_file_name);
-			if (!(fp = fopen(tmp_file_name, "a")))
+			if (part_open_sink(part, &sink) != 0)
 			{
-				close(connfd);
+				conn_close(&conn);
 				return ERR_FALSE;
 			}
 
@@ -200,10 +346,10 @@ int http_request_part_file(part_info_t *part)
 			nleft           = range_len - nbody_read;
 			start_read_body = 0;
 
-			flags = fcntl(connfd, F_GETFL, 0);
-			fcntl(connfd, F_SETFL, flags |= O_NONBLOCK);
+			flags = fcntl(conn.fd, F_GETFL, 0);
+			fcntl(conn.fd, F_SETFL, flags |= O_NONBLOCK);
 			FD_ZERO(&rfds);
-			FD_SET(connfd, &rfds);
+			FD_SET(conn.fd, &rfds);
 
 			while (1)
 			{	
@@ -229,32 +375,36 @@ int http_request_part_file(part_info_t *part)
 
 				if (start_read_body)
 				{
-					fwrite(body, 1, nbody_read, fp);
-					download_progress(part->d_task, nbody_read, part->file->length);
-					part->beg_pos += nbody_read;
+					if ((ret = part_write(part, &sink, body, nbody_read)) != 0)
+						break;
 					if ((nleft -= nbody_read) <= 0)
+					{
+						ret = 0;
 						break;
+					}
 				}
 
 				fd_set active_fds = rfds;
-				int retval = select(connfd + 1, &active_fds, NULL, NULL, NULL);
+				// a tls record may already be decrypted and buffered
+				int retval = conn_pending(&conn) ? 1 : select(conn.fd + 1, &active_fds, NULL, NULL, NULL);
 				if (retval == -1 && errno != EINTR)
 				{
-					perror("select failed:");
+					LOG_ERROR("select failed: %s", strerror(errno));
 					ret = -2;
 					break;
 				}
 
-				nread = read(connfd, response, MAX_BUFFER_LEN);
+				nread = conn_read(&conn, response, MAX_BUFFER_LEN);
 				if (nread < 0 && errno != EWOULDBLOCK)
 				{
-					perror("read failed:");
-					ret = -2;
+					// a broken connection, the part goes on from here on the next one
+					LOG_ERROR("read failed: %s", strerror(errno));
+					ret = ERR_IO_READ;
 					break;
 				}
 				else if (nread == 0)
 				{
-					fprintf(stderr, "only %d body read, left %d bytes to recieve, but srv close, is anything wrong about srv?\n", range_len - nleft, nleft);
+					LOG_ERROR("only %d body read, left %d bytes to recieve, but srv close, is anything wrong about srv?", range_len - nleft, nleft);
 					// printf("http header is %s\n", http_header);
 					ret = 0;
 					break;
@@ -263,10 +413,498 @@ int http_request_part_file(part_info_t *part)
 				nread = nread < 0? 0 : nread;
 				response[nread] = '\0';
 			}
-			close(connfd);
-			fclose(fp);
+			conn_close(&conn);
+			sink.close(&sink);
+			return ret;
+		}
+		return ERR_FALSE;
+	}
+}
+
+// buffered reading of a response which is parsed as it comes
+typedef struct _http_reader
+{
+	d_conn_t       *conn;
+	char           buf[RANGE_BUFFER_LEN];
+	int            beg;
+	int            end;
+}http_reader_t;
+
+static int _reader_fill(http_reader_t *r)
+{
+	int n;
+	if (r->beg == r->end)
+		r->beg = r->end = 0;
+	else if (r->end == RANGE_BUFFER_LEN)
+	{
+		memmove(r->buf, r->buf + r->beg, r->end - r->beg);
+		r->end -= r->beg;
+		r->beg  = 0;
+	}
+	if ((n = conn_read(r->conn, r->buf + r->end, RANGE_BUFFER_LEN - r->end)) > 0)
+		r->end += n;
+	return n;
+}
+
+// the next line without its CRLF, cut to max - 1 chars
+static int _reader_line(http_reader_t *r, char *line, int max)
+{
+	char *eol;
+	int len;
+
+	while (!(eol = memmem(r->buf + r->beg, r->end - r->beg, "\r\n", 2)))
+	{
+		if ((r->beg == 0 && r->end == RANGE_BUFFER_LEN) || _reader_fill(r) <= 0)
+			return ERR_IO_READ;
+	}
+	len = eol - (r->buf + r->beg);
+	memcpy(line, r->buf + r->beg, len < max ? len : max - 1);
+	line[len < max ? len : max - 1] = '\0';
+	r->beg += len + 2;
+	return len;
+}
+
+// header lines up to the empty one, kept with their CRLF
+static int _reader_header_lines(http_reader_t *r, char *header, int max)
+{
+	char line[MAX_BUFFER_LEN];
+	int len = 0, n;
+
+	header[0] = '\0';
+	while ((n = _reader_line(r, line, sizeof(line))) > 0)
+	{
+		if (len < max)
+			len += snprintf(header + len, max - len, "%s\r\n", line);
+	}
+	return n;
+}
+
+// the status code, and the header lines in header
+static int _reader_header(http_reader_t *r, char *header, int max)
+{
+	char line[MAX_BUFFER_LEN];
+	int status = 0;
+
+	if (_reader_line(r, line, sizeof(line)) < 0 || sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+		return ERR_FALSE;
+	return _reader_header_lines(r, header, max) < 0 ? ERR_IO_READ : status;
+}
+
+// len bytes of body belonging at offset of the file
+static int _reader_body(http_reader_t *r, range_fetch_t *rf, int offset, int len)
+{
+	int n, ret;
+	while (len > 0)
+	{
+		if (r->beg == r->end && _reader_fill(r) <= 0)
+			return ERR_IO_READ;
+		n = r->end - r->beg < len ? r->end - r->beg : len;
+		if ((ret = range_deliver(rf, offset, r->buf + r->beg, n)) != 0)
+			return ret;
+		r->beg += n;
+		offset += n;
+		len    -= n;
+	}
+	return 0;
+}
+
+/*
+ * Each part of a multipart/byteranges body is a boundary line, a header
+ * with its Content-Range, and the bytes:
+ *     --B\r\n Content-Range: bytes a-b/len\r\n \r\n <data> \r\n ... --B--
+ */
+static int _reader_multipart(http_reader_t *r, range_fetch_t *rf, const char *boundary)
+{
+	char line[MAX_BUFFER_LEN];
+	char header[MAX_BUFFER_LEN * 2];
+	char value[MAX_BUFFER_LEN];
+	int blen = strlen(boundary), beg, end, ret;
+
+	while (1)
+	{
+		if (_reader_line(r, line, sizeof(line)) < 0)
+			return ERR_IO_READ;
+		if (strncmp(line, "--", 2) != 0 || strncmp(line + 2, boundary, blen) != 0)
+			continue;    // the preamble, or the CRLF after the data
+		if (strcmp(line + 2 + blen, "--") == 0)
+			return 0;
+		if (_reader_header_lines(r, header, sizeof(header)) < 0 ||
+				http_header_value(header, "Content-Range", value, sizeof(value)) != 0 ||
+				sscanf(value, "bytes %d-%d", &beg, &end) != 2 || end < beg)
+			return ERR_FALSE;
+		if ((ret = _reader_body(r, rf, beg, end - beg + 1)) != 0)
+			return ret;
+	}
+}
+
+static int _request_ranges_once(const file_info_t *file, range_fetch_t *rf, int max_ranges)
+{
+	d_conn_t conn;
+	http_reader_t *r;
+	char ranges[MAX_RANGES_PER_REQUEST * 24];
+	char request[MAX_BUFFER_LEN * 2];
+	char header[MAX_BUFFER_LEN * 4];
+	char value[MAX_BUFFER_LEN];
+	char if_range[MAX_VALIDATOR_LEN + 16];
+	int i, n, len = 0, last = 0, beg, end, status, ret;
+
+	for (i = 0, n = 0; i < rf->nspans && n < max_ranges; i++)
+	{
+		range_span_t *span = &rf->spans[i];
+		if (span->next > span->end)
+			continue;
+		len += sprintf(ranges + len, "%s%d-%d", n ? "," : "", span->next, span->end);
+		last = span->end;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+
+	http_if_range(file, if_range, sizeof(if_range));
+	snprintf(request, sizeof(request), CONNECT_STR_FMT_3, file->d_url.path, file->d_url.host, ranges, if_range);
+	if ((ret = conn_open(&conn, &file->d_url)) < 0)
+		return ERR_CONNECT;
+	if (conn_write_n(&conn, request, strlen(request)) != strlen(request) ||
+			!(r = (http_reader_t *)malloc(sizeof(http_reader_t))))
+	{
+		conn_close(&conn);
+		return ERR_IO_WRITE;
+	}
+	r->conn = &conn;
+	r->beg  = r->end = 0;
+
+	status = _reader_header(r, header, sizeof(header));
+	if (status == 206 && http_header_value(header, "Content-Type", value, sizeof(value)) == 0 &&
+			strncasecmp(value, "multipart/byteranges", strlen("multipart/byteranges")) == 0)
+	{
+		char *boundary = strstr(value, "boundary=");
+		if (!boundary)
+			ret = ERR_FALSE;
+		else
+		{
+			boundary += strlen("boundary=");
+			if (*boundary == '"')
+				*strchrnul(++boundary, '"') = '\0';
+			ret = _reader_multipart(r, rf, boundary);
+		}
+	}
+	else if (status == 206)
+	{
+		// one range, or the server merged them, the rest is asked for again
+		if (http_header_value(header, "Content-Range", value, sizeof(value)) != 0 ||
+				sscanf(value, "bytes %d-%d", &beg, &end) != 2 || end < beg)
+			ret = ERR_FALSE;
+		else
+			ret = _reader_body(r, rf, beg, end - beg + 1);
+	}
+	else if (status == 200 && if_range[0])
+	{
+		// If-Range did not match, or the server does not take a list of ranges
+		if (n > 1)
+			LOG_DEBUG("request ranges: a list of %d ranges got the whole file", n);
+		else
+			LOG_ERROR("remote file changed since its info was requested");
+		ret = ERR_RES_CHANGED;
+	}
+	else if (status == 200)
+	{
+		// ranges are not supported, the whole file comes from its start
+		if (http_header_value(header, "Content-Length", value, sizeof(value)) != 0)
+		{
+			LOG_ERROR("request ranges: a whole file reply without its length");
+			ret = ERR_FALSE;
+		}
+		else if (atoi(value) != file->length)
+		{
+			LOG_ERROR("remote file changed since its info was requested");
+			ret = ERR_RES_CHANGED;
+		}
+		else
+			ret = _reader_body(r, rf, 0, last + 1);
+	}
+	else
+	{
+		LOG_ERROR("request ranges failed with bad status code %d", status);
+		ret = ERR_REQUEST_FILE;
+	}
+	free(r);
+	conn_close(&conn);
+	return ret;
+}
+
+int http_request_ranges(const file_info_t *file, range_fetch_t *rf)
+{
+	int max_ranges = MAX_RANGES_PER_REQUEST;
+	int i, left, before = -1, ret;
+
+	while (1)
+	{
+		for (i = 0, left = 0; i < rf->nspans; i++)
+			left += rf->spans[i].end + 1 - rf->spans[i].next;
+		if (left == 0)
+			return 0;
+		if (left == before)
+		{
+			if (max_ranges == 1)
+			{
+				LOG_ERROR("server sends none of the ranges asked for");
+				return ERR_FALSE;
+			}
+			max_ranges = 1;    // a server may get a single range right
+		}
+		before = left;
+		ret = _request_ranges_once(file, rf, max_ranges);
+		if (ret == ERR_RES_CHANGED && max_ranges > 1)
+		{
+			// only a single range tells a changed file from a server that takes no lists
+			max_ranges = 1;
+			before     = -1;
+		}
+		else if (ret != 0)
 			return ret;
+	}
+}
+
+#define DECODE_IDENTITY    0
+#define DECODE_GZIP        1
+#define DECODE_ZSTD        2
+
+// a Content-Encoding undone as the body arrives, before the part is written
+typedef struct _http_decoder
+{
+	int            type;
+	int            done;        // the encoded stream ended
+	z_stream       zs;
+#ifdef HAVE_ZSTD
+	ZSTD_DStream   *zds;
+#endif
+	char           out[DECODE_BUFFER_LEN];
+}http_decoder_t;
+
+static int _decoder_init(http_decoder_t *d, const char *encoding)
+{
+	d->done = 0;
+	if (!encoding[0] || strcasecmp(encoding, "identity") == 0)
+		d->type = DECODE_IDENTITY;
+	else if (strcasecmp(encoding, "gzip") == 0 || strcasecmp(encoding, "x-gzip") == 0 ||
+			strcasecmp(encoding, "deflate") == 0)
+	{
+		// 32 more window bits take a gzip or a zlib header alike
+		memset(&d->zs, 0, sizeof(d->zs));
+		if (inflateInit2(&d->zs, 15 + 32) != Z_OK)
+			return ERR_FALSE;
+		d->type = DECODE_GZIP;
+	}
+#ifdef HAVE_ZSTD
+	else if (strcasecmp(encoding, "zstd") == 0)
+	{
+		if (!(d->zds = ZSTD_createDStream()) || ZSTD_isError(ZSTD_initDStream(d->zds)))
+		{
+			ZSTD_freeDStream(d->zds);
+			return ERR_FALSE;
 		}
+		d->type = DECODE_ZSTD;
+	}
+#endif
+	else
+	{
+		LOG_ERROR("unsupported content encoding %s", encoding);
+		return ERR_FALSE;
+	}
+	return 0;
+}
+
+static void _decoder_end(http_decoder_t *d)
+{
+	if (d->type == DECODE_GZIP)
+		inflateEnd(&d->zs);
+#ifdef HAVE_ZSTD
+	else if (d->type == DECODE_ZSTD)
+		ZSTD_freeDStream(d->zds);
+#endif
+}
+
+// decoded bytes go at the part's offset, they must not run past its end
+static int _decoded_write(part_info_t *part, part_sink_t *sink, const char *buf, int n)
+{
+	if (n > part->end_pos - part->beg_pos + 1)
+	{
+		LOG_ERROR("part %d: the decoded body is longer than the file", part->id);
+		return ERR_FALSE;
+	}
+	return n > 0 ? part_write(part, sink, buf, n) : 0;
+}
+
+static int _decoder_write(http_decoder_t *d, part_info_t *part, part_sink_t *sink, const char *buf, int len)
+{
+	int ret, full;
+
+	if (d->type == DECODE_IDENTITY)
+		return _decoded_write(part, sink, buf, len);
+	if (d->type == DECODE_GZIP)
+	{
+		d->zs.next_in  = (Bytef *)buf;
+		d->zs.avail_in = len;
+		do
+		{
+			d->zs.next_out  = (Bytef *)d->out;
+			d->zs.avail_out = DECODE_BUFFER_LEN;
+			ret = inflate(&d->zs, Z_NO_FLUSH);
+			// the output filled up last time, but that was all of it
+			if (ret == Z_BUF_ERROR && d->zs.avail_in == 0)
+				break;
+			if (ret != Z_OK && ret != Z_STREAM_END)
+			{
+				LOG_ERROR("part %d: bad gzip body, %s", part->id, d->zs.msg ? d->zs.msg : "inflate failed");
+				return ERR_FALSE;
+			}
+			full = d->zs.avail_out == 0;
+			d->done = ret == Z_STREAM_END;
+			if ((ret = _decoded_write(part, sink, d->out, DECODE_BUFFER_LEN - d->zs.avail_out)) != 0)
+				return ret;
+		} while (!d->done && (d->zs.avail_in > 0 || full));
+		return 0;
+	}
+#ifdef HAVE_ZSTD
+	{
+		ZSTD_inBuffer in = { buf, len, 0 };
+		do
+		{
+			ZSTD_outBuffer out = { d->out, DECODE_BUFFER_LEN, 0 };
+			size_t r = ZSTD_decompressStream(d->zds, &out, &in);
+			if (ZSTD_isError(r))
+			{
+				LOG_ERROR("part %d: bad zstd body, %s", part->id, ZSTD_getErrorName(r));
+				return ERR_FALSE;
+			}
+			full = out.pos == out.size;
+			d->done = r == 0;
+			if ((ret = _decoded_write(part, sink, d->out, out.pos)) != 0)
+				return ret;
+		} while (in.pos < in.size || full);
+	}
+#endif
+	return 0;
+}
+
+// len bytes of body through the decoder, all of it until the server closes if len < 0
+static int _reader_decode(http_reader_t *r, http_decoder_t *d, part_info_t *part, part_sink_t *sink, int len)
+{
+	int n, ret;
+	while (len != 0)
+	{
+		if (r->beg == r->end && (n = _reader_fill(r)) <= 0)
+			return (len < 0 && n == 0) ? 0 : ERR_IO_READ;
+		n = r->end - r->beg;
+		if (len > 0 && n > len)
+			n = len;
+		if ((ret = _decoder_write(d, part, sink, r->buf + r->beg, n)) != 0)
+			return ret;
+		r->beg += n;
+		if (len > 0)
+			len -= n;
+	}
+	return 0;
+}
+
+// a chunked body: a hex size line, the bytes and a CRLF per chunk, size 0 ends
+static int _reader_decode_chunked(http_reader_t *r, http_decoder_t *d, part_info_t *part, part_sink_t *sink)
+{
+	char line[MAX_BUFFER_LEN];
+	unsigned int size;
+	int ret;
+
+	while (1)
+	{
+		if (_reader_line(r, line, sizeof(line)) < 0 || sscanf(line, "%x", &size) != 1 || size > INT_MAX)
+			return ERR_IO_READ;
+		if (size == 0)
+			return 0;    // the trailer is of no interest
+		if ((ret = _reader_decode(r, d, part, sink, size)) != 0)
+			return ret;
+		if (_reader_line(r, line, sizeof(line)) != 0)
+			return ERR_IO_READ;
+	}
+}
+
+/*
+ * The whole file asked for with Accept-Encoding, the body is decoded before
+ * the part writes it. Ranges of an encoded body can't be mapped to the file,
+ * so a transfer broken off is resumed by the caller as a plain range from
+ * where the decoded bytes stopped.
+ */
+static int _request_part_encoded(part_info_t *part)
+{
+	d_conn_t conn;
+	http_reader_t *r;
+	http_decoder_t *d;
+	part_sink_t sink;
+	char request[MAX_BUFFER_LEN * 2];
+	char header[MAX_BUFFER_LEN * 4];
+	char value[MAX_BUFFER_LEN];
+	int status, len, ret;
+
+	snprintf(request, sizeof(request), CONNECT_STR_FMT_4, part->src->d_url.path, part->src->d_url.host,
+			ACCEPT_ENCODINGS);
+	if (conn_open(&conn, &part->src->d_url) < 0)
+	{
+		LOG_ERROR("download part %d-%d connect to srv failed", part->beg_pos, part->end_pos);
 		return ERR_FALSE;
 	}
+	r = (http_reader_t *)malloc(sizeof(http_reader_t));
+	d = (http_decoder_t *)malloc(sizeof(http_decoder_t));
+	if (!r || !d || conn_write_n(&conn, request, strlen(request)) != strlen(request))
+	{
+		free(r);
+		free(d);
+		conn_close(&conn);
+		return ERR_FALSE;
+	}
+	TRACE_MARK("request", 0);
+	r->conn = &conn;
+	r->beg  = r->end = 0;
+
+	if ((status = _reader_header(r, header, sizeof(header))) != 200)
+	{
+		LOG_ERROR("request encoded content failed with bad status code %d", status);
+		ret = ERR_FALSE;
+		goto OUT;
+	}
+	// an encoded representation has an etag of its own, the date is the same
+	if (part->src->last_modified[0] && http_header_value(header, "Last-Modified", value, sizeof(value)) == 0 &&
+			strcmp(value, part->src->last_modified) != 0)
+	{
+		LOG_ERROR("part %d: remote file changed since the download started", part->id);
+		ret = ERR_RES_CHANGED;
+		goto OUT;
+	}
+	if (http_header_value(header, "Content-Encoding", value, sizeof(value)) != 0)
+		value[0] = '\0';
+	LOG_DEBUG("content encoding: %s", value[0] ? value : "identity");
+	if ((ret = _decoder_init(d, value)) != 0)
+		goto OUT;
+	if ((ret = part_open_sink(part, &sink)) != 0)
+	{
+		_decoder_end(d);
+		goto OUT;
+	}
+
+	if (http_header_value(header, "Transfer-Encoding", value, sizeof(value)) == 0 && strcasestr(value, "chunked"))
+		ret = _reader_decode_chunked(r, d, part, &sink);
+	else if (http_header_value(header, "Content-Length", value, sizeof(value)) == 0 && sscanf(value, "%d", &len) == 1)
+		ret = _reader_decode(r, d, part, &sink, len);
+	else
+		ret = _reader_decode(r, d, part, &sink, -1);
+	if (ret == 0 && part->end_pos - part->beg_pos + 1 > 0)
+	{
+		LOG_ERROR("part %d: the decoded body is %d bytes short", part->id, part->end_pos - part->beg_pos + 1);
+		ret = ERR_FALSE;
+	}
+	_decoder_end(d);
+	sink.close(&sink);
+OUT:
+	free(r);
+	free(d);
+	conn_close(&conn);
+	return ret;
 }
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define LOG_RING           128           // records per thread, a power of 2
+#define LOG_MSG_LEN        256
+#define LOG_HOST_LEN       64
+#define LOG_LINE_LEN       (LOG_MSG_LEN + LOG_HOST_LEN + 96)
+#define LOG_OUT_LEN        (1024 * 64)   // lines written at once
+#define LOG_FLUSH_MS       100           // the writer's sleep, a ring half full wakes it sooner
+
+typedef struct _log_record
+{
+	struct timespec ts;         // wall clock
+	int  level;
+	int  task;
+	int  part;
+	int  tid;
+	char host[LOG_HOST_LEN];
+	char msg[LOG_MSG_LEN];
+}log_record_t;
+
+typedef struct _log_ring
+{
+	thread_ring_t link;
+	int          tid;           // of the thread writing it
+	unsigned int head;          // records written, only the owner moves it
+	unsigned int tail;          // records written out, only a drain moves it
+	unsigned int dropped;       // records the ring had no room for
+	unsigned int dropped_told;  // of them, reported by a drain
+	log_record_t rec[LOG_RING];
+}log_ring_t;
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static __thread log_ring_t *ring;
+static __thread int ctx_task;
+static __thread int ctx_part = -1;
+static __thread char ctx_host[LOG_HOST_LEN];
+
+static thread_rings_t rings = THREAD_RINGS_INITIALIZER(log_ring_t);
+
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;   // one drain at a time, guards batch
+static log_record_t *batch;
+static int batch_max;
+
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_tid;
+static int writer_users;            // downloaders alive
+static int writer_running;          // records go to the rings
+static int writer_exit;
+
+static log_ring_t *_ring_take(void)
+{
+	log_ring_t *r = (log_ring_t *)thread_ring_take(&rings);
+
+	if (!r)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+	return ring = r;
+}
+
+static int _format(const log_record_t *rec, char *line)
+{
+	struct tm tm;
+	int len;
+
+	localtime_r(&rec->ts.tv_sec, &tm);
+	len  = strftime(line, LOG_LINE_LEN, "%Y-%m-%d %H:%M:%S", &tm);
+	len += snprintf(line + len, LOG_LINE_LEN - len, ".%03ld %-5s [%d", rec->ts.tv_nsec / 1000000,
+			level_names[rec->level], rec->tid);
+	if (rec->task > 0)
+		len += snprintf(line + len, LOG_LINE_LEN - len, " task %d", rec->task);
+	if (rec->part >= 0)
+		len += snprintf(line + len, LOG_LINE_LEN - len, " part %d", rec->part);
+	if (rec->host[0])
+		len += snprintf(line + len, LOG_LINE_LEN - len, " host %s", rec->host);
+	len += snprintf(line + len, LOG_LINE_LEN - len, "] %s\n", rec->msg);
+	return len < LOG_LINE_LEN ? len : LOG_LINE_LEN - 1;
+}
+
+static void _write_records(const log_record_t *recs, int n)
+{
+	static char out[LOG_OUT_LEN];     // only used under drain_mutex
+	char line[LOG_LINE_LEN];
+	int i, len, used = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		len = _format(&recs[i], line);
+		if (used + len > LOG_OUT_LEN)
+		{
+			write_n_chars(STDERR_FILENO, out, used);
+			used = 0;
+		}
+		memcpy(out + used, line, len);
+		used += len;
+	}
+	if (used)
+		write_n_chars(STDERR_FILENO, out, used);
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+	log_ring_t *r = NULL;
+	log_record_t *rec, one;
+	unsigned int head = 0, tail;
+	va_list ap;
+	int len;
+
+	if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE) && (r = ring ? ring : _ring_take()))
+	{
+		head = r->head;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head - tail >= LOG_RING)
+		{
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		rec = &r->rec[head & (LOG_RING - 1)];
+		rec->tid = r->tid;
+	}
+	else
+	{
+		rec = &one;
+		rec->tid = syscall(SYS_gettid);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &rec->ts);
+	rec->level = level < LOG_LEVEL_ERROR ? LOG_LEVEL_ERROR : (level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level);
+	rec->task  = ctx_task;
+	rec->part  = ctx_part;
+	memcpy(rec->host, ctx_host, LOG_HOST_LEN);
+	va_start(ap, fmt);
+	len = vsnprintf(rec->msg, LOG_MSG_LEN, fmt, ap);
+	va_end(ap);
+	for (len = len < LOG_MSG_LEN ? len : LOG_MSG_LEN - 1; len > 0 &&
+			(rec->msg[len - 1] == '\n' || rec->msg[len - 1] == '\r'); len--)
+		rec->msg[len - 1] = '\0';
+
+	if (!r)
+	{
+		pthread_mutex_lock(&drain_mutex);
+		_write_records(rec, 1);
+		pthread_mutex_unlock(&drain_mutex);
+		return;
+	}
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	// log_stop cleared it meanwhile, its last drain may have missed the record
+	if (!__atomic_load_n(&writer_running, __ATOMIC_SEQ_CST))
+		log_flush();
+	else if (head + 1 - tail == LOG_RING / 2)
+		pthread_cond_signal(&writer_cond);
+}
+
+void log_context(int task, int part)
+{
+	ctx_task    = task;
+	ctx_part    = part;
+	ctx_host[0] = '\0';
+}
+
+void log_host(const char *host)
+{
+	snprintf(ctx_host, LOG_HOST_LEN, "%s", host ? host : "");
+}
+
+void log_set_level(int level)
+{
+	log_level = level < LOG_LEVEL_ERROR ? LOG_LEVEL_ERROR : (level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level);
+}
+
+int log_parse_level(const char *name)
+{
+	int i;
+
+	if (name[0] >= '0' && name[0] <= '0' + LOG_LEVEL_DEBUG && name[1] == '\0')
+		return name[0] - '0';
+	for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+	{
+		if (strcasecmp(name, level_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int _by_time(const void *a, const void *b)
+{
+	const struct timespec *x = &((const log_record_t *)a)->ts, *y = &((const log_record_t *)b)->ts;
+
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? -1 : 1;
+	return x->tv_nsec < y->tv_nsec ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+
+// room in batch for n more records after used
+static int _batch_room(int used, int n)
+{
+	log_record_t *p;
+	int max = batch_max;
+
+	while (used + n > max)
+		max = max ? max * 2 : LOG_RING * 8;
+	if (max == batch_max)
+		return 1;
+	if (!(p = (log_record_t *)realloc(batch, max * sizeof(log_record_t))))
+		return 0;
+	batch     = p;
+	batch_max = max;
+	return 1;
+}
+
+void log_flush(void)
+{
+	log_ring_t *r;
+	log_record_t *rec;
+	unsigned int head, tail, dropped;
+	int n = 0;
+
+	pthread_mutex_lock(&drain_mutex);
+	for (r = (log_ring_t *)thread_rings_first(&rings); r; r = (log_ring_t *)r->link.next)
+	{
+		head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+		tail = r->tail;
+		// the rest waits for the next drain
+		if (!_batch_room(n, head - tail + 1))
+			break;
+		for (; tail != head; tail++)
+			batch[n++] = r->rec[tail & (LOG_RING - 1)];
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if (dropped != r->dropped_told)
+		{
+			rec = &batch[n++];
+			memset(rec, 0, sizeof(log_record_t));
+			clock_gettime(CLOCK_REALTIME, &rec->ts);
+			rec->level = LOG_LEVEL_WARN;
+			rec->part  = -1;
+			rec->tid   = r->tid;
+			snprintf(rec->msg, LOG_MSG_LEN, "%u records lost, the log ring was full", dropped - r->dropped_told);
+			r->dropped_told = dropped;
+		}
+	}
+	qsort(batch, n, sizeof(log_record_t), _by_time);
+	_write_records(batch, n);
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+static void *_writer_entry(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&writer_mutex);
+	while (!writer_exit)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		ts.tv_sec  += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&writer_cond, &writer_mutex, &ts);
+		pthread_mutex_unlock(&writer_mutex);
+		log_flush();
+		pthread_mutex_lock(&writer_mutex);
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return NULL;
+}
+
+int log_start(void)
+{
+	const char *env;
+	int ret = 0, level;
+
+	if ((env = getenv(LOG_ENV)) && (level = log_parse_level(env)) >= 0)
+		log_set_level(level);
+	pthread_mutex_lock(&writer_mutex);
+	if (writer_users++ == 0)
+	{
+		writer_exit = 0;
+		if (pthread_create(&writer_tid, NULL, _writer_entry, NULL) != 0)
+		{
+			writer_users--;
+			ret = ERR_FALSE;
+		}
+		else
+			__atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return ret;
+}
+
+void log_stop(void)
+{
+	pthread_t tid;
+
+	pthread_mutex_lock(&writer_mutex);
+	if (writer_users == 0 || --writer_users > 0)
+	{
+		pthread_mutex_unlock(&writer_mutex);
+		return;
+	}
+	// a record published after this is drained by its own thread
+	__atomic_store_n(&writer_running, 0, __ATOMIC_SEQ_CST);
+	writer_exit = 1;
+	tid = writer_tid;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+	pthread_join(tid, NULL);
+	log_flush();
+}
@@ -0,0 +1,47 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+// leveled log records of the transfer threads. A thread formats a record
+// into a ring of its own without a lock, a writer thread drains the rings
+// to stderr in whole lines, so records of different threads never mix and
+// a slow terminal never holds a transfer back. A record above the level
+// costs a compare. Without the writer, before init or after destroy, a
+// record is written at once. Each one carries the task, the part and the
+// host its thread works on. A process killed loses what its rings still hold
+
+// error, warn, info or debug; the level from easy_downloader_init on
+#define LOG_ENV            "EDL_LOG_LEVEL"
+
+// the same values as D_LOG_* of downloader.h
+#define LOG_LEVEL_ERROR    0
+#define LOG_LEVEL_WARN     1
+#define LOG_LEVEL_INFO     2
+#define LOG_LEVEL_DEBUG    3
+
+extern int log_level;
+
+#define LOG(level, ...)    do { if ((level) <= log_level) log_write(level, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...)     LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)      LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)      LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)     LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// a trailing newline of fmt is dropped, the record is one line
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// the task and part of the thread's records from now on, 0 and -1 for
+// none; the host is cleared, log_host sets it, it is copied
+void log_context(int task, int part);
+void log_host(const char *host);
+
+void log_set_level(int level);
+// the level of a name of LOG_ENV or a digit, -1 if it is neither
+int  log_parse_level(const char *name);
+
+// the writer runs while a downloader is alive, stop drains the rings first
+int  log_start(void);
+void log_stop(void);
+// write out what the rings hold now
+void log_flush(void);
+
+#endif
@@ -3,12 +3,23 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
 
 #include "downloader.h"
 
-#define USAGE_STR "Usage: edownloader [-d|r] URL [PATH]\n"                  \
+#define USAGE_STR "Usage: edownloader [-d|r|m|s|z|x] URL [PATH]\n"              \
+                  "       edownloader -i FILE\n"                             \
+                  "       edownloader -D BASE URL [PATH]\n"                  \
                   "-d                Download file to PATH from URL\n"      \
 				  "-r                Recover Last terminate downloads\n"    \
+				  "-m                Mirror the ftp directory URL to PATH\n" \
+				  "-s                Download file to PATH and stream it to stdout meanwhile\n" \
+				  "-i                Write the block index FILE.edidx, for delta downloads\n" \
+				  "-z                Download file to PATH, compressed on the wire if the server can\n" \
+				  "-x                Unpack the tar archive URL into PATH while it downloads\n" \
+				  "-D BASE           Download file to PATH, taking unchanged blocks from the older copy BASE\n" \
 
 int check_url(const char *url)
 {
@@ -32,6 +43,18 @@ int parse_opt(const char *str)
 			return 1;
 		case 'd':
 			return 2;
+		case 'm':
+			return 3;
+		case 'i':
+			return 4;
+		case 's':
+			return 5;
+		case 'z':
+			return 6;
+		case 'x':
+			return 7;
+		case 'D':
+			return 8;
 		default:
 			return -1;
 	}
@@ -58,6 +81,8 @@ int main(int argc, char *argv[])
 	int index = 1;
 	char *file_name = NULL;
 	char *saved_path = NULL;
+	char *delta_base = NULL;
+	char abs_path[PATH_MAX], abs_base[PATH_MAX];
 
 	if (argc < 2)
 		goto PARSE_ARGV_FAILED;
@@ -71,8 +96,27 @@ int main(int argc, char *argv[])
 			else if (index < argc - 1)
 				goto PARSE_ARGV_FAILED;
 		}
-		else if (opt == 2)
+		else if (opt == 4)  // index
 		{
+			char index_name[PATH_MAX];
+			if (index != argc - 1)
+				goto PARSE_ARGV_FAILED;
+			snprintf(index_name, PATH_MAX, "%s.edidx", argv[index]);
+			if (easy_downloader_make_index(argv[index], index_name) != 0)
+			{
+				fprintf(stderr, "can't index %s\n", argv[index]);
+				exit(EXIT_FAILURE);
+			}
+			return 0;
+		}
+		else if (opt == 2 || opt == 3 || opt == 5 || opt == 6 || opt == 7 || opt == 8)
+		{
+			if (opt == 8)  // the older copy comes first
+			{
+				if (index >= argc - 1)
+					goto PARSE_ARGV_FAILED;
+				delta_base = argv[index++];
+			}
 			if (index == argc - 1 && check_url(argv[index]))
 				p_url = argv[index];
 			else if (index == argc - 2 && check_url(argv[index]) && check_path(argv[++index]))
@@ -97,6 +141,22 @@ int main(int argc, char *argv[])
 	else
 		goto PARSE_ARGV_FAILED;
 
+	// init moves into ~/.easy_downloader, a relative PATH is the user's
+	if (saved_path && saved_path[0] != '/' && getcwd(abs_path, PATH_MAX) &&
+			strlen(abs_path) + strlen(saved_path) + 1 < PATH_MAX)
+	{
+		strcat(abs_path, "/");
+		strcat(abs_path, saved_path);
+		saved_path = abs_path;
+	}
+	if (delta_base && delta_base[0] != '/' && getcwd(abs_base, PATH_MAX) &&
+			strlen(abs_base) + strlen(delta_base) + 1 < PATH_MAX)
+	{
+		strcat(abs_base, "/");
+		strcat(abs_base, delta_base);
+		delta_base = abs_base;
+	}
+
 	der = easy_downloader_init();
 	if (!der)
 		exit(EXIT_FAILURE);
@@ -122,8 +182,35 @@ int main(int argc, char *argv[])
 		}
 		break;
 		case 2:
+		case 6:
+		case 8:
+		{
+			d_task_opts_t opts = {0};
+			opts.delta_base      = delta_base;
+			opts.accept_encoding = (opt == 6);
+			easy_downloader_add_task(der, p_url, saved_path, &opts, download_finished, NULL);
+		}
+		break;
+		case 5:
+		{
+			// stdout carries the file, the messages go to stderr
+			d_task_opts_t opts = {0};
+			signal(SIGPIPE, SIG_IGN);
+			opts.stream_fd = dup(STDOUT_FILENO);
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+			easy_downloader_add_task(der, p_url, saved_path, &opts, download_finished, NULL);
+		}
+		break;
+		case 7:
+		{
+			d_task_opts_t opts = {0};
+			opts.extract_dir = saved_path ? saved_path : getenv("HOME");
+			easy_downloader_add_task(der, p_url, saved_path, &opts, download_finished, NULL);
+		}
+		break;
+		case 3:
 		{
-			easy_downloader_add_task(der, p_url, saved_path, download_finished, NULL);
+			easy_downloader_mirror_dir(der, p_url, saved_path, download_finished, NULL);
 		}
 		break;
 		default:
@@ -0,0 +1,257 @@
+#include "metrics.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define MAX_METRIC_HOSTS   64        // the last one counts every host after them
+#define MAX_HOST_LEN       256
+#define HIST_BUCKETS       16        // doubling from the first bound, then +Inf
+#define METRICS_TEXT_LEN   (1024 * 32)
+
+typedef struct _histogram
+{
+	const char *name;
+	const char *help;
+	double     first;               // upper bound of the first bucket
+	double     scale;               // sum is kept in units of 1 / scale
+	long long  counts[HIST_BUCKETS + 1];
+	long long  sum;
+}histogram_t;
+
+static histogram_t hists[HISTOGRAMS] = {
+	{ "edl_connect_seconds", "Time to connect a socket.", 0.001, 1e6 },
+	{ "edl_first_byte_seconds", "Time from the start of a part attempt to its first byte, connect included.", 0.001, 1e6 },
+	{ "edl_range_bytes_per_second", "Throughput of a part attempt.", 1024 * 64, 1 },
+	{ "edl_part_bytes", "Bytes a part attempt got.", 1024 * 64, 1 },
+	{ "edl_merge_seconds", "Time to merge the part files of a download.", 0.001, 1e6 },
+};
+
+static const char *retry_names[RETRY_CAUSES] = { "connect", "read", "changed", "slow", "other" };
+static long long retries[RETRY_CAUSES];
+static long long tasks_ok, tasks_failed;
+
+static pthread_mutex_t host_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char hosts[MAX_METRIC_HOSTS][MAX_HOST_LEN];
+static long long host_bytes[MAX_METRIC_HOSTS];
+static int nhosts;
+
+static int serve_fd = -1;
+static pthread_t serve_tid;
+static char serve_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static easy_thread_pool *serve_tp;
+
+void metrics_observe(int hist, double value)
+{
+	histogram_t *h = &hists[hist];
+	double bound = h->first;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS && value > bound; i++)
+		bound *= 2;
+	__sync_add_and_fetch(&h->counts[i], 1);
+	__sync_add_and_fetch(&h->sum, (long long)(value * h->scale));
+}
+
+void metrics_retry(int cause)
+{
+	__sync_add_and_fetch(&retries[cause], 1);
+}
+
+int metrics_host(const char *host)
+{
+	int i, n = __sync_add_and_fetch(&nhosts, 0);
+
+	for (i = 0; i < n; i++)
+	{
+		if (strcmp(hosts[i], host) == 0)
+			return i;
+	}
+	pthread_mutex_lock(&host_mutex);
+	for (i = 0; i < nhosts && strcmp(hosts[i], host) != 0; i++)
+		;
+	if (i == nhosts && nhosts < MAX_METRIC_HOSTS)
+	{
+		snprintf(hosts[i], MAX_HOST_LEN, "%s", nhosts < MAX_METRIC_HOSTS - 1 ? host : "other");
+		__sync_synchronize();
+		nhosts++;
+	}
+	pthread_mutex_unlock(&host_mutex);
+	return i < MAX_METRIC_HOSTS ? i : MAX_METRIC_HOSTS - 1;
+}
+
+void metrics_host_bytes(int host, int n)
+{
+	__sync_add_and_fetch(&host_bytes[host], n);
+}
+
+void metrics_task_done(int status)
+{
+	__sync_add_and_fetch(status == 0 ? &tasks_ok : &tasks_failed, 1);
+}
+
+// appends like snprintf, len keeps counting past max
+static void _append(char *buf, int max, int *len, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(*len < max ? buf + *len : NULL, *len < max ? max - *len : 0, fmt, ap);
+	va_end(ap);
+	*len += n;
+}
+
+int metrics_text(easy_thread_pool *tp, char *buf, int max)
+{
+	int i, j, n, len = 0;
+	long long count;
+	double bound;
+	char host[MAX_HOST_LEN], *p;
+
+	if (max > 0)
+		buf[0] = '\0';
+	_append(buf, max, &len, "# HELP edl_host_bytes_total Body bytes received from a host.\n"
+			"# TYPE edl_host_bytes_total counter\n");
+	n = __sync_add_and_fetch(&nhosts, 0);
+	for (i = 0; i < n; i++)
+	{
+		// a label value must not end early
+		snprintf(host, sizeof(host), "%s", hosts[i]);
+		for (p = host; *p; p++)
+		{
+			if (*p == '"' || *p == '\\' || *p == '\n')
+				*p = '_';
+		}
+		_append(buf, max, &len, "edl_host_bytes_total{host=\"%s\"} %lld\n", host,
+				__sync_add_and_fetch(&host_bytes[i], 0));
+	}
+
+	_append(buf, max, &len, "# HELP edl_retries_total Part attempts made again, by the cause.\n"
+			"# TYPE edl_retries_total counter\n");
+	for (i = 0; i < RETRY_CAUSES; i++)
+		_append(buf, max, &len, "edl_retries_total{cause=\"%s\"} %lld\n", retry_names[i],
+				__sync_add_and_fetch(&retries[i], 0));
+
+	_append(buf, max, &len, "# HELP edl_tasks_total Downloads finished, by the result.\n"
+			"# TYPE edl_tasks_total counter\n"
+			"edl_tasks_total{result=\"ok\"} %lld\nedl_tasks_total{result=\"failed\"} %lld\n",
+			__sync_add_and_fetch(&tasks_ok, 0), __sync_add_and_fetch(&tasks_failed, 0));
+
+	_append(buf, max, &len, "# HELP edl_pool_queue_depth Tasks waiting for a thread of the pool.\n"
+			"# TYPE edl_pool_queue_depth gauge\nedl_pool_queue_depth %d\n", tp ? easy_thread_pool_queue_depth(tp) : 0);
+
+	for (i = 0; i < HISTOGRAMS; i++)
+	{
+		histogram_t *h = &hists[i];
+		_append(buf, max, &len, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+		count = 0;
+		bound = h->first;
+		for (j = 0; j <= HIST_BUCKETS; j++, bound *= 2)
+		{
+			count += __sync_add_and_fetch(&h->counts[j], 0);
+			if (j < HIST_BUCKETS)
+				_append(buf, max, &len, "%s_bucket{le=\"%g\"} %lld\n", h->name, bound, count);
+			else
+				_append(buf, max, &len, "%s_bucket{le=\"+Inf\"} %lld\n", h->name, count);
+		}
+		_append(buf, max, &len, "%s_sum %g\n%s_count %lld\n", h->name,
+				__sync_add_and_fetch(&h->sum, 0) / h->scale, h->name, count);
+	}
+	return len;
+}
+
+static void *_serve_entry(void *arg)
+{
+	char req[1024], *text = NULL, *p, head[128];
+	int fd, len, cap = 0, n, ok;
+	struct timeval tv = { 1, 0 };
+
+	while ((fd = accept(serve_fd, NULL, NULL)) >= 0 || errno == EINTR)
+	{
+		if (fd < 0)
+			continue;
+		// the request is read and ignored, whatever it asks it gets the text
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		len = 0;
+		while (len < sizeof(req) - 1 && (n = read(fd, req + len, sizeof(req) - 1 - len)) > 0)
+		{
+			len += n;
+			req[len] = '\0';
+			if (strstr(req, "\r\n\r\n"))
+				break;
+		}
+		// a buffer which can't grow is kept for the next scrape, this one gets nothing
+		ok = 1;
+		while ((len = metrics_text(serve_tp, text, cap)) >= cap)
+		{
+			if (!(p = (char *)realloc(text, len + METRICS_TEXT_LEN)))
+			{
+				ok = 0;
+				break;
+			}
+			text = p;
+			cap  = len + METRICS_TEXT_LEN;
+		}
+		if (ok)
+		{
+			n = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %d\r\n\r\n", len);
+			write_n_chars(fd, head, n);
+			write_n_chars(fd, text, len);
+		}
+		close(fd);
+	}
+	free(text);
+	return NULL;
+}
+
+int metrics_serve(easy_thread_pool *tp, const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (serve_fd >= 0 || strlen(path) >= sizeof(addr.sun_path))
+		return ERR_FALSE;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if ((serve_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return ERR_CONNECT;
+	if (bind(serve_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(serve_fd, 16) != 0)
+	{
+		LOG_ERROR("metrics socket: %s", strerror(errno));
+		close(serve_fd);
+		serve_fd = -1;
+		return ERR_CONNECT;
+	}
+	strcpy(serve_path, path);
+	serve_tp = tp;
+	if (pthread_create(&serve_tid, NULL, _serve_entry, NULL) != 0)
+	{
+		close(serve_fd);
+		serve_fd = -1;
+		unlink(path);
+		return ERR_FALSE;
+	}
+	return 0;
+}
+
+void metrics_stop(void)
+{
+	if (serve_fd < 0)
+		return;
+	// wakes the accept up with an error
+	shutdown(serve_fd, SHUT_RDWR);
+	pthread_join(serve_tid, NULL);
+	close(serve_fd);
+	serve_fd = -1;
+	unlink(serve_path);
+}
@@ -0,0 +1,37 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "threadpool.h"
+
+// counters and histograms of the whole process, kept with atomic adds so
+// the transfer threads never wait on them, read as prometheus text
+
+// why a part attempt is made again
+#define RETRY_CONNECT      0
+#define RETRY_READ         1
+#define RETRY_CHANGED      2     // the mirror's copy changed
+#define RETRY_SLOW         3     // the mirror was too slow, the part moved on
+#define RETRY_OTHER        4
+#define RETRY_CAUSES       5
+
+#define HIST_CONNECT       0     // seconds to connect a socket
+#define HIST_FIRST_BYTE    1     // seconds from the start of a part attempt to its first byte
+#define HIST_RANGE_RATE    2     // bytes per second of a part attempt
+#define HIST_PART_BYTES    3     // bytes a part attempt got
+#define HIST_MERGE         4     // seconds to merge the part files
+#define HISTOGRAMS         5
+
+void metrics_observe(int hist, double value);
+void metrics_retry(int cause);
+// the index of host's byte counter, taken once per attempt
+int  metrics_host(const char *host);
+void metrics_host_bytes(int host, int n);
+void metrics_task_done(int status);
+
+// the text, its length or the length it needs if that is max or more
+int  metrics_text(easy_thread_pool *tp, char *buf, int max);
+// answer every connection to the unix socket at path with the text, over http
+int  metrics_serve(easy_thread_pool *tp, const char *path);
+void metrics_stop(void);
+
+#endif
@@ -0,0 +1,119 @@
+#include "downloader_imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// a part's tmp file, appended to, the offset is implied
+static int _tmp_write(part_sink_t *sink, int offset, const char *buf, int len)
+{
+	return fwrite(buf, 1, len, sink->fp) == len ? 0 : ERR_IO_WRITE;
+}
+
+static int _tmp_flush(part_sink_t *sink)
+{
+	return fflush(sink->fp) == 0 ? 0 : ERR_IO_WRITE;
+}
+
+static void _tmp_close(part_sink_t *sink)
+{
+	fclose(sink->fp);
+}
+
+// the destination file, written at the offsets of the part
+static int _file_write(part_sink_t *sink, int offset, const char *buf, int len)
+{
+	return pwrite(sink->fd, buf, len, offset) == len ? 0 : ERR_IO_WRITE;
+}
+
+static int _no_flush(part_sink_t *sink)
+{
+	return 0;
+}
+
+static void _file_close(part_sink_t *sink)
+{
+	close(sink->fd);
+}
+
+static int _user_write(part_sink_t *sink, int offset, const char *buf, int len)
+{
+	d_sink_t *user = sink->user;
+
+	switch (user->type)
+	{
+		case D_SINK_MEMORY:
+			if (offset < 0 || offset > user->buf_len - len)
+				return ERR_IO_WRITE;
+			memcpy(user->buf + offset, buf, len);
+			return 0;
+		case D_SINK_FD:
+			if (sink->seekable)
+				return pwrite(user->fd, buf, len, offset) == len ? 0 : ERR_IO_WRITE;
+			return write_n_chars(user->fd, buf, len) == len ? 0 : ERR_IO_WRITE;
+		case D_SINK_CALLBACK:
+			return user->write(user->ctx, offset, buf, len) < 0 ? ERR_IO_WRITE : 0;
+	}
+	return ERR_IO_WRITE;
+}
+
+static void _no_close(part_sink_t *sink)
+{
+}
+
+int part_open_sink(part_info_t *part, part_sink_t *sink)
+{
+	d_task_t *d_task = part->d_task;
+	char tmp_file_name[PATH_MAX];
+
+	memset(sink, 0, sizeof(part_sink_t));
+	if (d_task->sink)
+	{
+		sink->user     = d_task->sink;
+		sink->seekable = d_task->sink_seekable;
+		sink->write    = _user_write;
+		sink->flush    = _no_flush;
+		sink->close    = _no_close;
+		return 0;
+	}
+	if (part->file_name)
+	{
+		if ((sink->fd = open(part->file_name, O_WRONLY)) < 0)
+			return ERR_OPEN_TMP_FILE;
+		sink->write = _file_write;
+		sink->flush = _no_flush;
+		sink->close = _file_close;
+		return 0;
+	}
+	snprintf(tmp_file_name, PATH_MAX, d_task->tmp_file_name_fmt, part->id);
+	if (!(sink->fp = fopen(tmp_file_name, "a")))
+		return ERR_OPEN_TMP_FILE;
+	sink->write = _tmp_write;
+	sink->flush = _tmp_flush;
+	sink->close = _tmp_close;
+	return 0;
+}
+
+int sink_copy_fd(d_task_t *d_task, int fd)
+{
+	part_sink_t sink;
+	part_info_t part;
+	char buf[1024 * 64];
+	int n, offset = 0, ret = 0;
+
+	memset(&part, 0, sizeof(part));
+	part.d_task = d_task;
+	part_open_sink(&part, &sink);
+	while (ret == 0 && (n = pread(fd, buf, sizeof(buf), offset)) > 0)
+	{
+		ret = sink.write(&sink, offset, buf, n);
+		offset += n;
+	}
+	if (ret == 0 && n < 0)
+		ret = ERR_IO_READ;
+	sink.close(&sink);
+	return ret;
+}
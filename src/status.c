@@ -0,0 +1,241 @@
+#include "status.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define STATUS_READ_TRIES  1000     // a writer killed inside its slot leaves seq odd
+
+static status_file_t *status;
+
+int status_open(const char *file_name)
+{
+	struct stat sb;
+	void *p = MAP_FAILED;
+	int fd;
+
+	if (status)
+		return 0;
+	if ((fd = open(file_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+	{
+		LOG_ERROR("open status file: %s", strerror(errno));
+		return ERR_IO_CREATE;
+	}
+	// the first process to get here lays the file out, the others wait for it
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &sb) != 0 || (sb.st_size != sizeof(status_file_t) && ftruncate(fd, sizeof(status_file_t)) != 0) ||
+			(p = mmap(NULL, sizeof(status_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		LOG_ERROR("map status file: %s", strerror(errno));
+		flock(fd, LOCK_UN);
+		close(fd);
+		return ERR_IO_CREATE;
+	}
+	status = (status_file_t *)p;
+	if (status->magic != STATUS_MAGIC || status->version != STATUS_VERSION ||
+			status->slot_size != sizeof(status_slot_t) || status->nslots != MAX_STATUS_TASKS)
+	{
+		memset(status, 0, sizeof(status_file_t));
+		status->magic     = STATUS_MAGIC;
+		status->version   = STATUS_VERSION;
+		status->slot_size = sizeof(status_slot_t);
+		status->nslots    = MAX_STATUS_TASKS;
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+	return 0;
+}
+
+void status_close(void)
+{
+	if (!status)
+		return;
+	munmap(status, sizeof(status_file_t));
+	status = NULL;
+}
+
+static int _alive(int pid)
+{
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// a killed download, it transfers nothing any more
+static void _stop(d_status_t *st)
+{
+	int i;
+
+	st->running = 0;
+	st->speed   = 0;
+	for (i = 0; i < st->nparts; i++)
+		st->parts[i].speed = 0;
+}
+
+// a slot left odd by a killed writer is taken over as it is
+static void _write_begin(status_slot_t *s)
+{
+	__atomic_store_n(&s->seq, s->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void _write_end(status_slot_t *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+// key, if not NULL, gets the slot's key
+static int _read_slot(status_slot_t *s, d_status_t *st, char *key)
+{
+	unsigned int seq;
+	int i;
+
+	for (i = 0; i < STATUS_READ_TRIES; i++)
+	{
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(st, &s->st, sizeof(d_status_t));
+		if (key)
+			memcpy(key, s->key, PATH_MAX);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+		{
+			if (st->running && !_alive(st->pid))
+				_stop(st);
+			return 0;
+		}
+	}
+	return ERR_FALSE;
+}
+
+// stopped, or its process is gone; only its writer moves running
+static int _stopped(status_slot_t *s)
+{
+	return !__atomic_load_n(&s->st.running, __ATOMIC_ACQUIRE) || !_alive(s->pid);
+}
+
+int status_begin(const char *key, const char *file_name, int file_length)
+{
+	status_slot_t *s;
+	int i, pass, owner, slot = -1, pid = getpid();
+
+	if (!status)
+		return -1;
+	// the record of an earlier try at the file, a free slot, any stopped one
+	for (pass = 0; pass < 3 && slot < 0; pass++)
+	{
+		for (i = 0; i < MAX_STATUS_TASKS && slot < 0; i++)
+		{
+			s = &status->slots[i];
+			owner = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+			if ((pass == 0 && owner != 0 && _stopped(s) && strcmp(s->key, key) == 0) ||
+					(pass == 1 && owner == 0) || (pass == 2 && _stopped(s)))
+			{
+				if (__sync_bool_compare_and_swap(&s->pid, owner, pid))
+					slot = i;
+			}
+		}
+	}
+	if (slot < 0)
+		return -1;
+
+	s = &status->slots[slot];
+	_write_begin(s);
+	memset(&s->st, 0, sizeof(d_status_t));
+	snprintf(s->key, PATH_MAX, "%s", key);
+	snprintf(s->st.file_name, PATH_MAX, "%s", file_name);
+	s->st.pid         = pid;
+	s->st.running     = 1;
+	s->st.file_length = file_length;
+	s->updated        = now_seconds();
+	_write_end(s);
+	return slot;
+}
+
+void status_update(int slot, const d_progress_t *pt, const int *errors)
+{
+	status_slot_t *s;
+	double now = now_seconds(), dt;
+	int i, n;
+
+	if (!status || slot < 0)
+		return;
+	s  = &status->slots[slot];
+	dt = now - s->updated;
+	_write_begin(s);
+	s->st.file_length    = pt->bytes_total;
+	s->st.len_downloaded = pt->bytes_recv;
+	s->st.speed          = pt->speed;
+	// the parts are the same ones as last time, unless their number changed
+	n = s->st.nparts == pt->nparts;
+	s->st.nparts = pt->nparts < D_MAX_PARTS ? pt->nparts : D_MAX_PARTS;
+	for (i = 0; i < s->st.nparts; i++)
+	{
+		d_part_status_t *part = &s->st.parts[i];
+		part->speed      = n && dt > 0 && pt->parts[i].bytes_recv > part->bytes_recv ?
+			(pt->parts[i].bytes_recv - part->bytes_recv) / dt : 0;
+		part->offset     = pt->parts[i].offset;
+		part->length     = pt->parts[i].length;
+		part->bytes_recv = pt->parts[i].bytes_recv;
+		part->error      = errors[i];
+	}
+	s->updated = now;
+	_write_end(s);
+}
+
+void status_end(int slot, int error)
+{
+	status_slot_t *s;
+
+	if (!status || slot < 0)
+		return;
+	s = &status->slots[slot];
+	_write_begin(s);
+	s->st.error = error;
+	_stop(&s->st);
+	s->updated = now_seconds();
+	_write_end(s);
+	if (error == 0)
+		__atomic_store_n(&s->pid, 0, __ATOMIC_RELEASE);
+}
+
+int status_read(d_status_t *tasks, int max)
+{
+	int i, n = 0;
+
+	if (!status)
+		return 0;
+	for (i = 0; i < MAX_STATUS_TASKS && n < max; i++)
+	{
+		if (__atomic_load_n(&status->slots[i].pid, __ATOMIC_ACQUIRE) != 0 &&
+				_read_slot(&status->slots[i], &tasks[n], NULL) == 0)
+			n++;
+	}
+	return n;
+}
+
+int status_find(const char *key)
+{
+	d_status_t st;
+	char slot_key[PATH_MAX];
+	int i;
+
+	if (!status)
+		return -1;
+	for (i = 0; i < MAX_STATUS_TASKS; i++)
+	{
+		if (__atomic_load_n(&status->slots[i].pid, __ATOMIC_ACQUIRE) == 0 ||
+				_read_slot(&status->slots[i], &st, slot_key) != 0 || strcmp(slot_key, key) != 0)
+			continue;
+		// killed mid transfer, its last update is behind its part files
+		if (__atomic_load_n(&status->slots[i].st.running, __ATOMIC_ACQUIRE) && !_alive(st.pid))
+			return -1;
+		return st.len_downloaded;
+	}
+	return -1;
+}
@@ -0,0 +1,52 @@
+#ifndef __STATUS_H__
+#define __STATUS_H__
+
+#include "downloader.h"
+
+/*
+ * The live state of the downloads of every process sharing the tmp dir, in
+ * a file they all map: a status_file_t of MAX_STATUS_TASKS slots. A slot is
+ * written by its task's thread only, inside a seqlock; a reader copies it
+ * and copies again while seq is odd or moved meanwhile. A slot whose pid is
+ * gone is a download killed before it could stop.
+ */
+#define STATUS_FILE_NAME   "status"
+#define STATUS_MAGIC       0x53444c45    // "ELDS"
+#define STATUS_VERSION     1
+#define MAX_STATUS_TASKS   64
+
+typedef struct _status_slot
+{
+	unsigned int  seq;          // odd while the writer is in the slot
+	int           pid;          // 0 if the slot is free
+	double        updated;      // monotonic seconds of the last write
+	char          key[PATH_MAX];  // the task's part file format, unique to it
+	d_status_t    st;
+}status_slot_t;
+
+typedef struct _status_file
+{
+	unsigned int  magic;
+	unsigned int  version;
+	unsigned int  slot_size;
+	unsigned int  nslots;
+	status_slot_t slots[MAX_STATUS_TASKS];
+}status_file_t;
+
+int  status_open(const char *file_name);
+void status_close(void);
+
+// a slot for the task of key, its stopped record if it has one, -1 if none is left
+int  status_begin(const char *key, const char *file_name, int file_length);
+// errors has one entry for each of the parts of pt
+void status_update(int slot, const d_progress_t *pt, const int *errors);
+// the slot stays as a stopped record if error != 0, else it is freed
+void status_end(int slot, int error);
+
+int  status_read(d_status_t *tasks, int max);
+// bytes of the download of key the status knows of, -1 if none or if its
+// process was killed mid transfer. A running download's figure is as old
+// as its last progress update
+int  status_find(const char *key);
+
+#endif
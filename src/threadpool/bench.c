@@ -0,0 +1,288 @@
+/*
+ * Benchmark of a thread pool behind threadpool.h: how long an added task
+ * waits to start, how many empty tasks go through a second, what happens
+ * once there are more tasks than max_pool_size, how threads come and go
+ * around THREAD_TIMED_OUT, and how cpu bound tasks scale with the cores.
+ * make bench POOL=other.c runs it on another implementation of the api.
+ */
+#define _GNU_SOURCE
+#include "threadpool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#define USAGE_STR "Usage: pool_bench [-n TASKS] [-c CPUS]\n"                        \
+                  "-n TASKS       empty tasks of the throughput case, 200000 by default\n" \
+                  "-c CPUS        most cores of the scaling case, all by default\n"
+
+#define THREAD_TIMED_OUT   1        // seconds, as the pool has it
+#define IDLE_ROUNDS        2000
+#define OVER_TASKS         256
+#define CHURN_BURSTS       5
+#define CHURN_TASKS        16
+#define SCALE_TASKS        256
+#define MAX_TIDS           4096
+
+typedef struct _slot
+{
+	double  added;
+	double  started;
+	int     work;           // what the task does, one of the TASK_ values
+	int     arg;
+}slot_t;
+
+#define TASK_EMPTY         0
+#define TASK_SLEEP         1        // sleeps arg microseconds
+#define TASK_SPIN          2        // burns arg rounds of cpu
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond   = PTHREAD_COND_INITIALIZER;
+static volatile int done;
+static int target;          // done once done gets to it
+
+static pthread_mutex_t tid_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pid_t tids[MAX_TIDS];
+static int ntids;
+
+static volatile unsigned int spin_sink;
+
+static double _now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int _double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void _spin(int rounds)
+{
+	unsigned int x = rounds;
+	int i;
+	for (i = 0; i < rounds; i++)
+		x = x * 1103515245 + 12345;
+	spin_sink += x;
+}
+
+// every worker thread that ran a task, to count the ones created
+static void _note_tid()
+{
+	pid_t tid = syscall(SYS_gettid);
+	int i;
+
+	pthread_mutex_lock(&tid_mutex);
+	for (i = 0; i < ntids && tids[i] != tid; i++)
+		;
+	if (i == ntids && ntids < MAX_TIDS)
+		tids[ntids++] = tid;
+	pthread_mutex_unlock(&tid_mutex);
+}
+
+static void *_task_entry(void *arg)
+{
+	slot_t *slot = (slot_t *)arg;
+
+	slot->started = _now();
+	if (slot->work == TASK_SLEEP)
+	{
+		_note_tid();
+		usleep(slot->arg);
+	}
+	else if (slot->work == TASK_SPIN)
+		_spin(slot->arg);
+	if (__sync_add_and_fetch(&done, 1) == target)
+	{
+		pthread_mutex_lock(&done_mutex);
+		pthread_cond_signal(&done_cond);
+		pthread_mutex_unlock(&done_mutex);
+	}
+	return NULL;
+}
+
+static void _wait_done()
+{
+	pthread_mutex_lock(&done_mutex);
+	while (done < target)
+		pthread_cond_wait(&done_cond, &done_mutex);
+	pthread_mutex_unlock(&done_mutex);
+}
+
+// add the tasks of slots back to back, the wall time until they are all done
+static double _run_tasks(easy_thread_pool *tp, slot_t *slots, task_desc *descs, int n)
+{
+	double start = _now();
+	int i;
+
+	done   = 0;
+	target = n;
+	for (i = 0; i < n; i++)
+	{
+		descs[i].arg = &slots[i];
+		descs[i].fire_task_over = NULL;
+		slots[i].added = _now();
+		easy_thread_pool_add_task(tp, _task_entry, &descs[i]);
+	}
+	_wait_done();
+	return _now() - start;
+}
+
+// add to start latencies of slots, in microseconds, sorted into lat
+static void _latencies(const slot_t *slots, int n, double *lat)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		lat[i] = (slots[i].started - slots[i].added) * 1e6;
+	qsort(lat, n, sizeof(double), _double_cmp);
+}
+
+// threads < 0 when they were not counted
+static void _report(const char *name, const char *param, int n, double wall, const double *lat, int nlat, int threads)
+{
+	char threads_str[16] = "-";
+
+	if (threads >= 0)
+		snprintf(threads_str, sizeof(threads_str), "%d", threads);
+	printf("%-12s %-14s %7d %9.3f %11.0f %9.1f %9.1f %10.1f %7s\n", name, param, n, wall, n / wall,
+			nlat ? lat[(nlat - 1) / 2] : 0, nlat ? lat[(nlat * 99 + 99) / 100 - 1] : 0, nlat ? lat[nlat - 1] : 0,
+			threads_str);
+	fflush(stdout);
+}
+
+// rounds of _spin that take about a millisecond here
+static int _spin_per_ms()
+{
+	int rounds = 1 << 16;
+	double t;
+
+	for (;;)
+	{
+		t = _now();
+		_spin(rounds);
+		t = _now() - t;
+		if (t > 0.01)
+			return rounds / (t * 1000);
+		rounds *= 2;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int tasks = 200000, cpus = sysconf(_SC_NPROCESSORS_ONLN), opt, i, k, n;
+	slot_t *slots;
+	task_desc *descs;
+	double *lat, wall, base = 0, gaps[] = { 0.5, 0.9, 1.1, 2.0 };
+	easy_thread_pool *tp;
+	char param[32];
+
+	while ((opt = getopt(argc, argv, "n:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': tasks = atoi(optarg); break;
+			case 'c': cpus  = atoi(optarg); break;
+			default:
+				fprintf(stderr, USAGE_STR);
+				return EXIT_FAILURE;
+		}
+	}
+	if (tasks < IDLE_ROUNDS || cpus < 1)
+	{
+		fprintf(stderr, USAGE_STR);
+		return EXIT_FAILURE;
+	}
+	slots = (slot_t *)calloc(tasks, sizeof(slot_t));
+	descs = (task_desc *)calloc(tasks, sizeof(task_desc));
+	lat   = (double *)malloc(sizeof(double) * tasks);
+
+	printf("%-12s %-14s %7s %9s %11s %9s %9s %10s %7s\n", "case", "param", "tasks", "wall_s", "tasks/s",
+			"p50_us", "p99_us", "max_us", "threads");
+
+	// one task at a time to a warm pool, the hand-off alone
+	tp = easy_thread_pool_init(4, 64);
+	wall = 0;
+	for (i = 0; i < IDLE_ROUNDS; i++)
+		wall += _run_tasks(tp, &slots[i], &descs[i], 1);
+	_latencies(slots, IDLE_ROUNDS, lat);
+	_report("idle", "4/64", IDLE_ROUNDS, wall, lat, IDLE_ROUNDS, -1);
+	easy_thread_pool_free(tp);
+
+	// empty tasks as fast as they can be added
+	snprintf(param, sizeof(param), "%d/%d", cpus, cpus);
+	tp = easy_thread_pool_init(cpus, cpus);
+	memset(slots, 0, sizeof(slot_t) * tasks);
+	wall = _run_tasks(tp, slots, descs, tasks);
+	_latencies(slots, tasks, lat);
+	_report("throughput", param, tasks, wall, lat, tasks, -1);
+	easy_thread_pool_free(tp);
+
+	// more sleeping tasks than threads, they queue behind max_pool_size
+	tp = easy_thread_pool_init(2, 8);
+	ntids = 0;
+	for (i = 0; i < OVER_TASKS; i++)
+	{
+		slots[i].work = TASK_SLEEP;
+		slots[i].arg  = 1000;
+	}
+	wall = _run_tasks(tp, slots, descs, OVER_TASKS);
+	_latencies(slots, OVER_TASKS, lat);
+	snprintf(param, sizeof(param), "2/8 ideal %.3f", OVER_TASKS * 0.001 / 8);
+	_report("oversub", param, OVER_TASKS, wall, lat, OVER_TASKS, ntids);
+	easy_thread_pool_free(tp);
+
+	// bursts apart by less and more than THREAD_TIMED_OUT, the first
+	// task of a burst after the threads timed out waits for a new one
+	for (k = 0; k < sizeof(gaps) / sizeof(gaps[0]); k++)
+	{
+		tp = easy_thread_pool_init(2, CHURN_TASKS);
+		ntids = 0;
+		wall = 0;
+		for (i = 0; i < CHURN_BURSTS; i++)
+		{
+			int j;
+			usleep(gaps[k] * THREAD_TIMED_OUT * 1e6);
+			for (j = 0; j < CHURN_TASKS; j++)
+			{
+				slots[i * CHURN_TASKS + j].work = TASK_SLEEP;
+				slots[i * CHURN_TASKS + j].arg  = 1000;
+			}
+			wall += _run_tasks(tp, &slots[i * CHURN_TASKS], &descs[i * CHURN_TASKS], CHURN_TASKS);
+		}
+		n = CHURN_BURSTS * CHURN_TASKS;
+		_latencies(slots, n, lat);
+		snprintf(param, sizeof(param), "gap %.1fs", gaps[k] * THREAD_TIMED_OUT);
+		_report("churn", param, n, wall, lat, n, ntids);
+		easy_thread_pool_free(tp);
+	}
+
+	// the same cpu bound work on 1 to cpus threads
+	n = _spin_per_ms();
+	for (k = 1; k <= cpus; k = k < cpus && k * 2 > cpus ? cpus : k * 2)
+	{
+		tp = easy_thread_pool_init(k, k);
+		for (i = 0; i < SCALE_TASKS; i++)
+		{
+			slots[i].work = TASK_SPIN;
+			slots[i].arg  = n;
+		}
+		wall = _run_tasks(tp, slots, descs, SCALE_TASKS);
+		if (k == 1)
+			base = wall;
+		_latencies(slots, SCALE_TASKS, lat);
+		snprintf(param, sizeof(param), "%d cpus x%.2f", k, base / wall);
+		_report("scaling", param, SCALE_TASKS, wall, lat, SCALE_TASKS, -1);
+		easy_thread_pool_free(tp);
+	}
+
+	free(lat);
+	free(descs);
+	free(slots);
+	return 0;
+}
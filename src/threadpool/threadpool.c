@@ -25,6 +25,7 @@ typedef struct _task_list
 {
 	task_node         *head;
 	task_node         *tail;
+	int               size;
 	pthread_mutex_t   *mutex;
 	pthread_cond_t    *cond;
 }task_list;
@@ -203,7 +204,10 @@ static void *thread_manager_entry(void *arg)
 			pthread_cond_wait(manager->all_tasks.cond, manager->all_tasks.mutex);
 		task = manager->all_tasks.head;
 		if (task->func != exit_task_entry)
+		{
 			manager->all_tasks.head = manager->all_tasks.head->next;
+			manager->all_tasks.size--;
+		}
 		pthread_mutex_unlock(manager->all_tasks.mutex);
 
 		// it is a exit task?
@@ -332,6 +336,7 @@ easy_thread_pool *easy_thread_pool_init(int init_pool_size, int max_pool_size)
     
 	// init all tasks
 	manager->all_tasks.head = manager->all_tasks.tail = NULL;
+	manager->all_tasks.size = 0;
 	manager->all_tasks.mutex = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
 	pthread_mutex_init(manager->all_tasks.mutex, NULL);
 	manager->all_tasks.cond = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
@@ -371,6 +376,8 @@ void easy_thread_pool_add_task(easy_thread_pool *easy_tp, task_func func, task_d
 	}
 	else
 		hasFree = 1;
+	if (!hasFree && func != exit_task_entry)
+		manager->all_tasks.size++;
 	pthread_mutex_unlock(manager->all_tasks.mutex);
 	if (!hasFree)
 		pthread_cond_signal(manager->all_tasks.cond);
@@ -378,6 +385,16 @@ void easy_thread_pool_add_task(easy_thread_pool *easy_tp, task_func func, task_d
 		free(task);
 }
 
+int easy_thread_pool_queue_depth(easy_thread_pool *easy_tp)
+{
+	easy_tp_man *manager = (easy_tp_man *)easy_tp;
+	int size;
+	pthread_mutex_lock(manager->all_tasks.mutex);
+	size = manager->all_tasks.size;
+	pthread_mutex_unlock(manager->all_tasks.mutex);
+	return size;
+}
+
 void easy_thread_pool_free(easy_thread_pool *easy_tp)
 {
 	easy_thread_pool_add_task(easy_tp, exit_task_entry, NULL);
@@ -26,4 +26,8 @@ easy_thread_pool_add_task(easy_thread_pool *easy_tp, task_func func, task_desc *
 void
 easy_thread_pool_free(easy_thread_pool *easy_tp);
 
+// tasks added but not handed to a thread yet
+int
+easy_thread_pool_queue_depth(easy_thread_pool *easy_tp);
+
 #endif
@@ -0,0 +1,167 @@
+/*
+ * The threadpool.h api without a manager thread: the workers take tasks
+ * off the shared list themselves, add_task only starts a new thread when
+ * more tasks are queued than threads wait for them. Threads still exit
+ * after THREAD_TIMED_OUT idle. It is here to be compared with
+ * threadpool.c, make bench POOL=threadpool_queue.c
+ */
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#define THREAD_TIMED_OUT     1
+
+typedef struct _task_node
+{
+	task_func                func;
+	task_desc                *desc;
+	struct _task_node        *next;
+}task_node;
+
+typedef struct _queue_pool
+{
+	easy_thread_pool  easy_tp;
+
+	task_node         *head;
+	task_node         *tail;
+	int               queued;
+	int               threads;      // alive
+	int               idle;         // waiting for a task
+	int               exiting;
+
+	pthread_mutex_t   mutex;
+	pthread_cond_t    task_cond;    // a task is queued, or the pool exits
+	pthread_cond_t    exit_cond;    // the last thread is gone
+}queue_pool;
+
+static void *queue_thread_entry(void *arg)
+{
+	queue_pool *pool = (queue_pool *)arg;
+	struct timespec ts;
+	task_node *task;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;)
+	{
+		if (pool->head)
+		{
+			task = pool->head;
+			if (!(pool->head = task->next))
+				pool->tail = NULL;
+			pool->queued--;
+			pthread_mutex_unlock(&pool->mutex);
+
+			task->desc->ret = task->func(task->desc->arg);
+			if (task->desc->fire_task_over)
+				task->desc->fire_task_over(task->desc);
+			free(task);
+
+			pthread_mutex_lock(&pool->mutex);
+			continue;
+		}
+		// the list is empty, so an exiting pool is done
+		if (pool->exiting || ret == ETIMEDOUT)
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += THREAD_TIMED_OUT;
+		pool->idle++;
+		while (!pool->head && !pool->exiting && ret == 0)
+			ret = pthread_cond_timedwait(&pool->task_cond, &pool->mutex, &ts);
+		pool->idle--;
+		if (pool->head)
+			ret = 0;
+	}
+	if (--pool->threads == 0)
+		pthread_cond_signal(&pool->exit_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+// with the mutex held
+static int start_thread(queue_pool *pool)
+{
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, queue_thread_entry, pool) != 0)
+		return -1;
+	pthread_detach(tid);
+	pool->threads++;
+	return 0;
+}
+
+easy_thread_pool *easy_thread_pool_init(int init_pool_size, int max_pool_size)
+{
+	queue_pool *pool = (queue_pool *)calloc(1, sizeof(queue_pool));
+	int i;
+
+	pool->easy_tp.init_pool_size = init_pool_size;
+	pool->easy_tp.max_pool_size  = max_pool_size;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->task_cond, NULL);
+	pthread_cond_init(&pool->exit_cond, NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < init_pool_size; i++)
+		start_thread(pool);
+	pthread_mutex_unlock(&pool->mutex);
+	return (easy_thread_pool *)pool;
+}
+
+void easy_thread_pool_add_task(easy_thread_pool *easy_tp, task_func func, task_desc *task_info)
+{
+	queue_pool *pool = (queue_pool *)easy_tp;
+	task_node *task = (task_node *)malloc(sizeof(task_node));
+
+	task->func = func;
+	task->desc = task_info;
+	task->next = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->exiting)
+	{
+		pthread_mutex_unlock(&pool->mutex);
+		free(task);
+		return;
+	}
+	if (pool->tail)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+	pool->tail = task;
+	pool->queued++;
+	if (pool->queued > pool->idle && pool->threads < pool->easy_tp.max_pool_size)
+		start_thread(pool);
+	if (pool->idle > 0)
+		pthread_cond_signal(&pool->task_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+int easy_thread_pool_queue_depth(easy_thread_pool *easy_tp)
+{
+	queue_pool *pool = (queue_pool *)easy_tp;
+	int queued;
+	pthread_mutex_lock(&pool->mutex);
+	queued = pool->queued;
+	pthread_mutex_unlock(&pool->mutex);
+	return queued;
+}
+
+// the queued tasks still run, then every thread exits
+void easy_thread_pool_free(easy_thread_pool *easy_tp)
+{
+	queue_pool *pool = (queue_pool *)easy_tp;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->exiting = 1;
+	pthread_cond_broadcast(&pool->task_cond);
+	while (pool->threads > 0)
+		pthread_cond_wait(&pool->exit_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->task_cond);
+	pthread_cond_destroy(&pool->exit_cond);
+	free(pool);
+}
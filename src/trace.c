@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING         (1 << 14)     // events per thread, a power of 2
+#define TRACE_SLACK        64            // oldest slots of a full ring left out, its thread may be writing them
+
+typedef struct _trace_event
+{
+	long long  ts;          // ns
+	long long  dur;         // ns, of a span
+	const char *name;
+	long long  arg;
+	int        part;
+	int        tid;         // a ring outlives its thread, the next one writes on
+	char       ph;          // 'X' a span, 'i' an instant
+}trace_event_t;
+
+typedef struct _trace_ring
+{
+	thread_ring_t link;
+	unsigned int  head;         // events written, only the owner moves it
+	trace_event_t ev[TRACE_RING];
+}trace_ring_t;
+
+int trace_enabled;
+__thread int trace_part_id = -1;
+
+static __thread trace_ring_t *ring;
+static __thread int ring_tid;
+static thread_rings_t rings = THREAD_RINGS_INITIALIZER(trace_ring_t);
+
+long long trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static trace_ring_t *_ring_take(void)
+{
+	trace_ring_t *r = (trace_ring_t *)thread_ring_take(&rings);
+
+	if (!r)
+		return NULL;
+	ring_tid = syscall(SYS_gettid);
+	return ring = r;
+}
+
+void trace_event(const char *name, char ph, long long start, long long arg)
+{
+	trace_ring_t *r = ring ? ring : _ring_take();
+	trace_event_t *e;
+	long long now = trace_now();
+
+	if (!r)
+		return;
+	e = &r->ev[r->head & (TRACE_RING - 1)];
+	e->ts   = ph == 'X' ? start : now;
+	e->dur  = ph == 'X' ? now - start : 0;
+	e->name = name;
+	e->arg  = arg;
+	e->part = trace_part_id;
+	e->tid  = ring_tid;
+	e->ph   = ph;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_start(void)
+{
+	trace_enabled = 1;
+}
+
+void trace_stop(void)
+{
+	trace_enabled = 0;
+}
+
+int trace_dump(const char *file_name)
+{
+	FILE *fp;
+	trace_ring_t *r;
+	trace_event_t e;
+	unsigned int head, i, from;
+	int first = 1, pid = getpid();
+
+	if (!(fp = fopen(file_name, "w")))
+	{
+		LOG_ERROR("open trace file: %s", strerror(errno));
+		return ERR_IO_CREATE;
+	}
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (r = (trace_ring_t *)thread_rings_first(&rings); r; r = (trace_ring_t *)r->link.next)
+	{
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		from = head > TRACE_RING ? head - TRACE_RING + TRACE_SLACK : 0;
+		for (i = from; i != head; i++)
+		{
+			e = r->ev[i & (TRACE_RING - 1)];
+			if (!e.name)
+				continue;
+			// chrome wants microseconds
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", first ? "" : ",\n", e.name, e.ph, e.ts / 1e3);
+			if (e.ph == 'X')
+				fprintf(fp, "\"dur\":%.3f,", e.dur / 1e3);
+			else
+				fprintf(fp, "\"s\":\"t\",");
+			fprintf(fp, "\"pid\":%d,\"tid\":%d,\"args\":{\"part\":%d,\"n\":%lld}}", pid, e.tid, e.part, e.arg);
+			first = 0;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	if (fclose(fp) != 0)
+	{
+		LOG_ERROR("write trace file: %s", strerror(errno));
+		return ERR_IO_WRITE;
+	}
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// timed events of the transfer threads, each thread writes into a ring of
+// its own without a lock, the rings are dumped as chrome trace json (open
+// it in ui.perfetto.dev or chrome://tracing). Off until trace_start, an
+// event costs a clock read and a few stores then. Built with -DNO_TRACE
+// the events are compiled out
+
+// a file name: tracing from easy_downloader_init, dumped there at destroy
+#define TRACE_ENV          "EDL_TRACE"
+
+#ifndef NO_TRACE
+extern int trace_enabled;
+extern __thread int trace_part_id;
+
+// the part the thread works on, every event it makes is tagged with it
+#define TRACE_PART(id)                 (trace_part_id = (id))
+// the start of a span, 0 if tracing is off
+#define TRACE_START()                  (trace_enabled ? trace_now() : 0)
+#define TRACE_SPAN(name, start, arg)   do { if (start) trace_event(name, 'X', start, arg); } while (0)
+#define TRACE_MARK(name, arg)          do { if (trace_enabled) trace_event(name, 'i', 0, arg); } while (0)
+#else
+#define TRACE_PART(id)                 ((void)(id))
+#define TRACE_START()                  0LL
+#define TRACE_SPAN(name, start, arg)   ((void)(start))
+#define TRACE_MARK(name, arg)
+#endif
+
+// monotonic nanoseconds
+long long trace_now(void);
+// name must be a literal, the ring keeps only the pointer
+void trace_event(const char *name, char ph, long long start, long long arg);
+
+void trace_start(void);
+void trace_stop(void);
+// the events still in the rings, as chrome trace json
+int  trace_dump(const char *file_name);
+
+#endif
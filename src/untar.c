@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+#include "downloader_imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * A tar archive unpacked from its bytes in order, as they are downloaded.
+ * Every entry is a 512 byte header and its data padded to 512 bytes, two
+ * zero blocks end the archive. ustar prefixes, GNU long names (L, K) and
+ * the path, linkpath and size of pax headers (x) are understood. The
+ * archive may be gzip or zstd compressed, it is told by its first bytes.
+ */
+#define TAR_BLOCK          512
+#define UNTAR_BATCH_LEN    (1024 * 1024)    // file data gathered for one write
+#define UNTAR_OUT_LEN      (1024 * 256)     // decompressed bytes per step
+#define UNTAR_META_LEN     (PATH_MAX * 4)   // long names and pax records
+
+#define COMP_UNKNOWN       0
+#define COMP_NONE          1
+#define COMP_GZIP          2
+#define COMP_ZSTD          3
+
+// what the data of the current entry is
+#define DATA_SKIP          0
+#define DATA_FILE          1
+#define DATA_LONG_NAME     2
+#define DATA_LONG_LINK     3
+#define DATA_PAX           4
+
+struct _untar
+{
+	char           dir[PATH_MAX];
+	int            comp;
+	unsigned char  magic[4];     // first bytes, kept until the compression is known
+	int            magic_len;
+	z_stream       zs;
+	int            zs_end;       // the last gzip member ended
+#ifdef HAVE_ZSTD
+	ZSTD_DStream   *zds;
+#endif
+	char           *out;
+	sha256_ctx_t   sha;          // of the archive as it came
+
+	char           header[TAR_BLOCK];
+	int            header_len;
+	int            data;         // DATA_*
+	long long      left;         // data bytes of the entry still to come
+	int            pad;
+	int            ended;
+
+	int            fd;           // the file being written
+	char           path[PATH_MAX];
+	int            mode;
+	int            umask;        // of the process, the entries' modes go through it
+	int            keep_special; // setuid, setgid and sticky bits
+	long long      mtime;
+	char           *batch;
+	int            batch_len;
+
+	char           meta[UNTAR_META_LEN];
+	int            meta_len;
+	char           long_name[PATH_MAX];    // for the next entry, empty if none
+	char           long_link[PATH_MAX];
+	long long      pax_size;     // -1 if none
+
+	int            err;
+};
+
+// octal, or base 256 when the high bit of the first byte is set (GNU)
+static long long _tar_number(const char *p, int len)
+{
+	long long v = 0;
+	int i;
+
+	if ((unsigned char)p[0] & 0x80)
+	{
+		v = (unsigned char)p[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			v = (v << 8) | (unsigned char)p[i];
+		return v;
+	}
+	for (i = 0; i < len && (p[i] == ' ' || p[i] == '\0'); i++)
+		;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		v = v * 8 + (p[i] - '0');
+	return v;
+}
+
+static int _tar_checksum_ok(const char *h)
+{
+	unsigned int sum = 0;
+	int i;
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+	return sum == _tar_number(h + 148, 8);
+}
+
+// no absolute names and no way up out of the directory
+static int _tar_name_ok(const char *name)
+{
+	const char *p = name;
+
+	if (name[0] == '/' || name[0] == '\0')
+		return 0;
+	while (p)
+	{
+		if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+			return 0;
+		if ((p = strchr(p, '/')))
+			p++;
+	}
+	return 1;
+}
+
+/*
+ * dir/name into path, making the directories on the way. A directory on
+ * the way must not be a symlink, an entry could be written through it to
+ * anywhere.
+ */
+static int _untar_path(untar_t *u, const char *name, char *path)
+{
+	struct stat sb;
+	char *p;
+	int len;
+
+	while (strncmp(name, "./", 2) == 0)
+		name += 2;
+	if (!_tar_name_ok(name))
+	{
+		LOG_ERROR("untar: unsafe entry name %s", name);
+		return ERR_FALSE;
+	}
+	len = snprintf(path, PATH_MAX, "%s/%s", u->dir, name);
+	if (len >= PATH_MAX)
+		return ERR_FALSE;
+	while (len > 0 && path[len - 1] == '/')
+		path[--len] = '\0';
+
+	for (p = path + strlen(u->dir) + 1; (p = strchr(p, '/')); p++)
+	{
+		*p = '\0';
+		if (lstat(path, &sb) != 0)
+		{
+			if (mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+			{
+				LOG_ERROR("untar: can't create %s", path);
+				*p = '/';
+				return ERR_IO_CREATE;
+			}
+		}
+		else if (!S_ISDIR(sb.st_mode))
+		{
+			LOG_ERROR("untar: %s is not a directory", path);
+			*p = '/';
+			return ERR_FALSE;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+static int _untar_flush(untar_t *u)
+{
+	if (u->batch_len > 0 && write_n_chars(u->fd, u->batch, u->batch_len) != u->batch_len)
+	{
+		LOG_ERROR("untar: write %s failed", u->path);
+		return ERR_IO_WRITE;
+	}
+	u->batch_len = 0;
+	return 0;
+}
+
+// the archive's mode as a new file of the process would get it
+static int _untar_mode(untar_t *u, int mode)
+{
+	return (mode & 0777 & ~u->umask) | (u->keep_special ? mode & 07000 : 0);
+}
+
+static int _untar_close_file(untar_t *u)
+{
+	struct timespec ts[2];
+	int ret = _untar_flush(u);
+
+	fchmod(u->fd, _untar_mode(u, u->mode));
+	ts[0].tv_sec  = ts[1].tv_sec  = u->mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	futimens(u->fd, ts);
+	if (close(u->fd) != 0 && ret == 0)
+		ret = ERR_IO_WRITE;
+	u->fd = -1;
+	return ret;
+}
+
+// records of "len key=value\n", only what locates the next entry is kept
+static void _untar_pax(untar_t *u)
+{
+	char *p = u->meta, *end = u->meta + u->meta_len;
+
+	while (p < end)
+	{
+		char *key, *eq, *rec_end;
+		long len = strtol(p, &key, 10);
+		if (len <= 0 || len > end - p || *key != ' ')
+			break;
+		rec_end = p + len - 1;    // the newline
+		key++;
+		if ((eq = memchr(key, '=', rec_end - key)))
+		{
+			int vlen = rec_end - eq - 1;
+			if (strncmp(key, "path=", 5) == 0 && vlen < PATH_MAX)
+			{
+				memcpy(u->long_name, eq + 1, vlen);
+				u->long_name[vlen] = '\0';
+			}
+			else if (strncmp(key, "linkpath=", 9) == 0 && vlen < PATH_MAX)
+			{
+				memcpy(u->long_link, eq + 1, vlen);
+				u->long_link[vlen] = '\0';
+			}
+			else if (strncmp(key, "size=", 5) == 0)
+				u->pax_size = atoll(eq + 1);
+		}
+		p += len;
+	}
+}
+
+// all data of the entry is in
+static int _untar_entry_done(untar_t *u)
+{
+	int len = u->meta_len < PATH_MAX ? u->meta_len : PATH_MAX - 1;
+
+	switch (u->data)
+	{
+		case DATA_FILE:
+			return _untar_close_file(u);
+		case DATA_LONG_NAME:
+			memcpy(u->long_name, u->meta, len);
+			u->long_name[len] = '\0';
+			break;
+		case DATA_LONG_LINK:
+			memcpy(u->long_link, u->meta, len);
+			u->long_link[len] = '\0';
+			break;
+		case DATA_PAX:
+			_untar_pax(u);
+			break;
+	}
+	return 0;
+}
+
+static int _untar_header(untar_t *u)
+{
+	const char *h = u->header;
+	char name[PATH_MAX], link_name[PATH_MAX];
+	char type = h[156];
+	int i, ret = 0;
+
+	for (i = 0; i < TAR_BLOCK && h[i] == '\0'; i++)
+		;
+	if (i == TAR_BLOCK)
+	{
+		u->ended = 1;
+		return 0;
+	}
+	if (!_tar_checksum_ok(h))
+	{
+		LOG_ERROR("untar: bad header checksum");
+		return ERR_FALSE;
+	}
+
+	u->left = u->pax_size >= 0 ? u->pax_size : _tar_number(h + 124, 12);
+	u->pad  = (TAR_BLOCK - u->left % TAR_BLOCK) % TAR_BLOCK;
+	u->data = DATA_SKIP;
+	u->meta_len = 0;
+	if (type == 'L' || type == 'K' || type == 'x')
+	{
+		if (u->left >= UNTAR_META_LEN)
+		{
+			LOG_ERROR("untar: extended header of %lld bytes", u->left);
+			return ERR_FALSE;
+		}
+		u->data = type == 'L' ? DATA_LONG_NAME : (type == 'K' ? DATA_LONG_LINK : DATA_PAX);
+		return u->left == 0 ? _untar_entry_done(u) : 0;
+	}
+
+	// the name, and what a long name or pax header said about it
+	if (u->long_name[0])
+		strcpy(name, u->long_name);
+	else if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+		snprintf(name, PATH_MAX, "%.155s/%.100s", h + 345, h);
+	else
+		snprintf(name, PATH_MAX, "%.100s", h);
+	if (u->long_link[0])
+		strcpy(link_name, u->long_link);
+	else
+		snprintf(link_name, PATH_MAX, "%.100s", h + 157);
+	u->long_name[0] = u->long_link[0] = '\0';
+	u->pax_size = -1;
+
+	if (type == 'g' || strcmp(name, ".") == 0 || strcmp(name, "./") == 0)
+		return 0;
+	if ((ret = _untar_path(u, name, u->path)) != 0)
+		return ret;
+	u->mode  = _tar_number(h + 100, 8);
+	u->mtime = _tar_number(h + 136, 12);
+
+	switch (type)
+	{
+		case '0':
+		case '\0':
+		case '7':
+			unlink(u->path);
+			if ((u->fd = open(u->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR)) < 0)
+			{
+				LOG_ERROR("untar: can't create %s", u->path);
+				return ERR_IO_CREATE;
+			}
+			u->data = DATA_FILE;
+			return u->left == 0 ? _untar_entry_done(u) : 0;
+		case '5':
+			if (mkdir(u->path, (u->mode & 0777) | S_IRWXU) != 0 && errno != EEXIST)
+				ret = ERR_IO_CREATE;
+			else if (u->keep_special && (u->mode & 07000))
+				chmod(u->path, _untar_mode(u, u->mode | S_IRWXU));
+			break;
+		case '2':
+			unlink(u->path);
+			if (symlink(link_name, u->path) != 0)
+				ret = ERR_IO_CREATE;
+			break;
+		case '1':
+		{
+			char target[PATH_MAX];
+			if ((ret = _untar_path(u, link_name, target)) != 0)
+				return ret;
+			unlink(u->path);
+			if (link(target, u->path) != 0)
+				ret = ERR_IO_CREATE;
+			break;
+		}
+		default:
+			LOG_DEBUG("untar: skip entry of type %c", type);
+			break;
+	}
+	if (ret != 0)
+		LOG_ERROR("untar: can't create %s", u->path);
+	return ret;
+}
+
+// file data, gathered so the disk sees large writes
+static int _untar_file_data(untar_t *u, const char *buf, int len)
+{
+	int n, ret;
+
+	if (u->batch_len == 0 && len >= UNTAR_BATCH_LEN)
+		return write_n_chars(u->fd, buf, len) == len ? 0 : ERR_IO_WRITE;
+	while (len > 0)
+	{
+		n = UNTAR_BATCH_LEN - u->batch_len < len ? UNTAR_BATCH_LEN - u->batch_len : len;
+		memcpy(u->batch + u->batch_len, buf, n);
+		u->batch_len += n;
+		buf += n;
+		len -= n;
+		if (u->batch_len == UNTAR_BATCH_LEN && (ret = _untar_flush(u)) != 0)
+			return ret;
+	}
+	return 0;
+}
+
+// tar bytes, decompressed
+static int _untar_feed(untar_t *u, const char *buf, int len)
+{
+	int n, ret;
+
+	while (len > 0 && !u->ended)
+	{
+		if (u->left > 0)
+		{
+			n = u->left < len ? u->left : len;
+			if (u->data == DATA_FILE)
+				ret = _untar_file_data(u, buf, n);
+			else
+			{
+				if (u->data != DATA_SKIP)
+				{
+					memcpy(u->meta + u->meta_len, buf, n);
+					u->meta_len += n;
+				}
+				ret = 0;
+			}
+			if (ret != 0)
+				return ret;
+			u->left -= n;
+			if (u->left == 0 && (ret = _untar_entry_done(u)) != 0)
+				return ret;
+		}
+		else if (u->pad > 0)
+		{
+			n = u->pad < len ? u->pad : len;
+			u->pad -= n;
+		}
+		else
+		{
+			n = TAR_BLOCK - u->header_len < len ? TAR_BLOCK - u->header_len : len;
+			memcpy(u->header + u->header_len, buf, n);
+			if ((u->header_len += n) == TAR_BLOCK)
+			{
+				u->header_len = 0;
+				if ((ret = _untar_header(u)) != 0)
+					return ret;
+			}
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int _untar_decode(untar_t *u, const char *buf, int len)
+{
+	int ret, full;
+
+	if (u->comp == COMP_NONE)
+		return _untar_feed(u, buf, len);
+	if (u->comp == COMP_GZIP)
+	{
+		u->zs.next_in  = (Bytef *)buf;
+		u->zs.avail_in = len;
+		do
+		{
+			// gzip members may follow each other
+			if (u->zs_end && u->zs.avail_in > 0)
+			{
+				if (u->ended)
+					return 0;
+				inflateReset(&u->zs);
+				u->zs_end = 0;
+			}
+			u->zs.next_out  = (Bytef *)u->out;
+			u->zs.avail_out = UNTAR_OUT_LEN;
+			ret = inflate(&u->zs, Z_NO_FLUSH);
+			// the output filled up last time, but that was all of it
+			if (ret == Z_BUF_ERROR && u->zs.avail_in == 0)
+				break;
+			if (ret != Z_OK && ret != Z_STREAM_END)
+			{
+				LOG_ERROR("untar: bad gzip data, %s", u->zs.msg ? u->zs.msg : "inflate failed");
+				return ERR_FALSE;
+			}
+			u->zs_end = ret == Z_STREAM_END;
+			full = u->zs.avail_out == 0;
+			if ((ret = _untar_feed(u, u->out, UNTAR_OUT_LEN - u->zs.avail_out)) != 0)
+				return ret;
+		} while (u->zs.avail_in > 0 || full);
+		return 0;
+	}
+#ifdef HAVE_ZSTD
+	{
+		ZSTD_inBuffer in = { buf, len, 0 };
+		do
+		{
+			ZSTD_outBuffer out = { u->out, UNTAR_OUT_LEN, 0 };
+			size_t r = ZSTD_decompressStream(u->zds, &out, &in);
+			if (ZSTD_isError(r))
+			{
+				LOG_ERROR("untar: bad zstd data, %s", ZSTD_getErrorName(r));
+				return ERR_FALSE;
+			}
+			full = out.pos == out.size;
+			if ((ret = _untar_feed(u, u->out, out.pos)) != 0)
+				return ret;
+		} while (in.pos < in.size || full);
+	}
+#endif
+	return 0;
+}
+
+static int _untar_detect(untar_t *u)
+{
+	if (u->magic_len >= 2 && u->magic[0] == 0x1f && u->magic[1] == 0x8b)
+	{
+		memset(&u->zs, 0, sizeof(u->zs));
+		if (inflateInit2(&u->zs, 15 + 16) != Z_OK)
+			return ERR_FALSE;
+		u->comp = COMP_GZIP;
+	}
+	else if (u->magic_len == 4 && memcmp(u->magic, "\x28\xb5\x2f\xfd", 4) == 0)
+	{
+#ifdef HAVE_ZSTD
+		if (!(u->zds = ZSTD_createDStream()) || ZSTD_isError(ZSTD_initDStream(u->zds)))
+			return ERR_FALSE;
+		u->comp = COMP_ZSTD;
+#else
+		LOG_ERROR("untar: a zstd archive, but zstd support is not built in");
+		return ERR_FALSE;
+#endif
+	}
+	else
+		u->comp = COMP_NONE;
+	return _untar_decode(u, (const char *)u->magic, u->magic_len);
+}
+
+// read, not set and put back, umask(2) is process wide and other threads create files
+static int _process_umask(void)
+{
+	char line[128];
+	unsigned int mask = 022;
+	FILE *fp;
+
+	if (!(fp = fopen("/proc/self/status", "r")))
+		return mask;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "Umask: %o", &mask) == 1)
+			break;
+	}
+	fclose(fp);
+	return mask;
+}
+
+untar_t *untar_open(const char *dir, int keep_special)
+{
+	untar_t *u;
+
+	if (mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+	{
+		LOG_ERROR("untar: can't create %s", dir);
+		return NULL;
+	}
+	if (!(u = (untar_t *)calloc(1, sizeof(untar_t))))
+		return NULL;
+	u->out   = (char *)malloc(UNTAR_OUT_LEN);
+	u->batch = (char *)malloc(UNTAR_BATCH_LEN);
+	if (!u->out || !u->batch || sha256_init(&u->sha) != 0)
+	{
+		free(u->out);
+		free(u->batch);
+		free(u);
+		return NULL;
+	}
+	snprintf(u->dir, PATH_MAX, "%s", dir);
+	u->fd           = -1;
+	u->pax_size     = -1;
+	u->umask        = _process_umask();
+	u->keep_special = keep_special;
+	return u;
+}
+
+int untar_write(untar_t *u, const char *buf, int len)
+{
+	int n;
+
+	if (u->err)
+		return u->err;
+	sha256_update(&u->sha, buf, len);
+	if (u->comp == COMP_UNKNOWN)
+	{
+		n = 4 - u->magic_len < len ? 4 - u->magic_len : len;
+		memcpy(u->magic + u->magic_len, buf, n);
+		u->magic_len += n;
+		buf += n;
+		len -= n;
+		if (u->magic_len < 4)
+			return 0;
+		if ((u->err = _untar_detect(u)) != 0)
+			return u->err;
+	}
+	return u->err = _untar_decode(u, buf, len);
+}
+
+int untar_close(untar_t *u, char *sha256_hex)
+{
+	char hex[SHA256_HEX_LEN + 1];
+	int ret;
+
+	if (u->comp == COMP_UNKNOWN && !u->err)
+		u->err = _untar_detect(u);
+	ret = u->err;
+	if (u->fd >= 0 && _untar_close_file(u) != 0 && ret == 0)
+		ret = ERR_IO_WRITE;
+	// the end blocks may be missing, not the end of an entry
+	if (ret == 0 && (u->left > 0 || u->header_len > 0 || (u->comp == COMP_GZIP && !u->zs_end)))
+	{
+		LOG_ERROR("untar: the archive is cut short");
+		ret = ERR_FALSE;
+	}
+	if (u->comp == COMP_GZIP)
+		inflateEnd(&u->zs);
+#ifdef HAVE_ZSTD
+	if (u->comp == COMP_ZSTD)
+		ZSTD_freeDStream(u->zds);
+#endif
+	sha256_final_hex(&u->sha, sha256_hex ? sha256_hex : hex);
+	free(u->out);
+	free(u->batch);
+	free(u);
+	return ret;
+}
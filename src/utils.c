@@ -1,8 +1,15 @@
+#define _GNU_SOURCE
 #include "utils.h"
+#include "metrics.h"
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 int db_connect(const char *db_file_name, sqlite3 **pkey, const char *sql_create_table)
 {
@@ -10,14 +17,14 @@ int db_connect(const char *db_file_name, sqlite3 **pkey, const char *sql_create_
 	int rc = sqlite3_open(db_file_name, pkey);
 	if (rc)
 	{
-		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(*pkey));
+		LOG_ERROR("Can't open database: %s", sqlite3_errmsg(*pkey));
 		sqlite3_close(*pkey);
 		return ERR_DB_CONNECT;
 	}
 	rc = sqlite3_exec(*pkey, sql_create_table, NULL, 0, &err_msg);
 	if (rc != SQLITE_OK)
 	{
-		fprintf(stderr, "SQL error: %s\n", err_msg);
+		LOG_ERROR("SQL error: %s", err_msg);
 		sqlite3_free(err_msg);
 		sqlite3_close(*pkey);
 		return ERR_DB_CONNECT;
@@ -28,21 +35,77 @@ int db_connect(const char *db_file_name, sqlite3 **pkey, const char *sql_create_
 int db_execute(sqlite3 *db_key, const char *sql_str, int (*callback)(void*, int, char**, char**))
 {
 	char *err_msg;
+	long long start = TRACE_START();
 	int rc = sqlite3_exec(db_key, sql_str, callback, 0, &err_msg);
+	TRACE_SPAN("db", start, rc);
 	if (rc != SQLITE_OK)
 	{
-		fprintf(stderr, "SQL error: %s\n", err_msg);
+		LOG_ERROR("SQL error: %s", err_msg);
 		sqlite3_free(err_msg);
 		return ERR_DB_EXCUTE;
 	}
 	return 0;
 }
 
+// add a column to a table created by an older version, if it is missing
+int db_ensure_column(sqlite3 *db_key, const char *table, const char *column, const char *type)
+{
+	char sql_buf[256];
+	snprintf(sql_buf, sizeof(sql_buf), "select %s from %s limit 0", column, table);
+	if (sqlite3_exec(db_key, sql_buf, NULL, 0, NULL) == SQLITE_OK)
+		return 0;
+	snprintf(sql_buf, sizeof(sql_buf), "alter table %s add column %s %s", table, column, type);
+	return db_execute(db_key, sql_buf, NULL);
+}
+
 void db_close(sqlite3 *db_key)
 {
 	sqlite3_close(db_key);
 }
 
+static void _thread_ring_release(void *arg)
+{
+	__atomic_store_n(&((thread_ring_t *)arg)->idle, 1, __ATOMIC_RELEASE);
+}
+
+// an idle ring, else a new one, for the calling thread
+void *thread_ring_take(thread_rings_t *rings)
+{
+	thread_ring_t *r;
+
+	if (!__atomic_load_n(&rings->key_made, __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_lock(&rings->mutex);
+		if (!rings->key_made && pthread_key_create(&rings->key, _thread_ring_release) == 0)
+			__atomic_store_n(&rings->key_made, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&rings->mutex);
+		if (!rings->key_made)
+			return NULL;
+	}
+	for (r = thread_rings_first(rings); r; r = r->next)
+	{
+		if (r->idle && __sync_bool_compare_and_swap(&r->idle, 1, 0))
+			break;
+	}
+	if (!r)
+	{
+		if (!(r = (thread_ring_t *)calloc(1, rings->size)))
+			return NULL;
+		pthread_mutex_lock(&rings->mutex);
+		r->next = rings->head;
+		__sync_synchronize();
+		rings->head = r;
+		pthread_mutex_unlock(&rings->mutex);
+	}
+	pthread_setspecific(rings->key, r);
+	return r;
+}
+
+void *thread_rings_first(thread_rings_t *rings)
+{
+	return __sync_add_and_fetch(&rings->head, 0);
+}
+
 static int hex2int(char hex)
 {
 	int t = hex - '0';
@@ -69,8 +132,14 @@ int parse_url(const char *url, d_url_t *d_url)
 	d_url->path = d_url->host + (end - begin);
 	*(d_url->path)++ = '\0';
 
-	d_url->port = strstr(d_url->host, ":");
-	if (d_url->port)
+	// an ipv6 literal is bracketed, [addr]:port
+	if (d_url->host[0] == '[' && (d_url->port = strchr(d_url->host, ']')))
+	{
+		*d_url->port++ = '\0';
+		d_url->host++;
+		d_url->port = *d_url->port == ':' ? d_url->port + 1 : NULL;
+	}
+	else if ((d_url->port = strstr(d_url->host, ":")))
 		*d_url->port++ = '\0';
 
 	// path
@@ -100,7 +169,11 @@ int parse_url(const char *url, d_url_t *d_url)
 			case HTTP:
 				strcpy(d_url->port, "80");
 				break;
+			case HTTPS:
+				strcpy(d_url->port, "443");
+				break;
 			case FTP:
+			case FTPS:
 			    strcpy(d_url->port, "21");
 				break;
 		}
@@ -121,6 +194,10 @@ protocol_t protocol(const char *url)
 			return HTTP;
 		else if (strncasecmp(url, "ftp:", strlen("ftp:")) == 0)
 			return FTP;
+		else if (strncasecmp(url, "https:", strlen("https:")) == 0)
+			return HTTPS;
+		else if (strncasecmp(url, "ftps:", strlen("ftps:")) == 0)
+			return FTPS;
 	}
 	// HTTP is default
 	return HTTP;
@@ -160,7 +237,10 @@ int connect_server(const d_url_t *d_url)
 	struct addrinfo *result, *rp;
 	int ret;
 	int sockfd;
+	double start;
+	long long span = TRACE_START();
 
+	log_host(d_url->host);
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family   = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
@@ -170,10 +250,13 @@ int connect_server(const d_url_t *d_url)
 	ret = getaddrinfo(d_url->host, d_url->port, &hints, &result);
 	if (ret != 0)
 	{
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		LOG_ERROR("getaddrinfo: %s", gai_strerror(ret));
 		return ERR_CONNECT;
 	}
+	TRACE_SPAN("resolve", span, 0);
 
+	span  = TRACE_START();
+	start = now_seconds();
 	for (rp = result; rp != NULL; rp = rp->ai_next)
 	{
 		sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
@@ -183,14 +266,89 @@ int connect_server(const d_url_t *d_url)
 			break;
 		close(sockfd);
 	}
+	if (rp != NULL)
+		metrics_observe(HIST_CONNECT, now_seconds() - start);
+	TRACE_SPAN("connect", span, rp != NULL);
 
 	if (rp == NULL)
 	{
-		fprintf(stderr, "could not connect %s, %s\n", d_url->host, d_url->port);
-		perror("error");
+		LOG_ERROR("could not connect %s, %s: %s", d_url->host, d_url->port, strerror(errno));
 		return ERR_CONNECT;
 	}
 	return sockfd;
 }
 
+// monotonic clock, for measuring durations only
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int copy_fd(int in, int out)
+{
+	char buf[64 * 1024];
+	struct stat sb;
+	off_t left;
+	int n;
+
+	if (fstat(in, &sb) != 0)
+		return ERR_IO_READ;
+	for (left = sb.st_size; left > 0; left -= n)
+	{
+		if ((n = copy_file_range(in, NULL, out, NULL, left, 0)) > 0)
+			continue;
+		if (n == 0)
+			return ERR_IO_READ;
+		if (errno != ENOSYS && errno != EXDEV && errno != EINVAL)
+			return ERR_IO_WRITE;
+		break;    // no kernel copy between these files
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+	{
+		if (write_n_chars(out, buf, n) != n)
+			return ERR_IO_WRITE;
+	}
+	return n < 0 ? ERR_IO_READ : 0;
+}
 
+// make dst hold the content of the file open at in, from its offset: a
+// reflink, else a copy. Never a hard link, a change to one would show in both
+int materialize_fd(int in, const char *dst)
+{
+	int out, ret;
+
+	if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+		return ERR_IO_CREATE;
+	ret = ioctl(out, FICLONE, in) == 0 ? 0 : copy_fd(in, out);
+	close(out);
+	return ret;
+}
+
+int materialize_file(const char *src, const char *dst)
+{
+	int in, ret;
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return ERR_IO_READ;
+	ret = materialize_fd(in, dst);
+	close(in);
+	return ret;
+}
+
+#ifdef CRASH_POINTS
+#include <signal.h>
+
+void crash_point(const char *name)
+{
+	static int hits;
+	const char *at = getenv(CRASH_POINT_ENV);
+	int len = strlen(name);
+
+	if (!at || strncmp(at, name, len) != 0 || (at[len] != '\0' && at[len] != ':'))
+		return;
+	if (__sync_add_and_fetch(&hits, 1) >= (at[len] == ':' ? atoi(at + len + 1) : 1))
+		kill(getpid(), SIGKILL);
+}
+#endif
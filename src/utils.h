@@ -9,7 +9,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include "trace.h"
+#include "log.h"
 
 #define MAX_URL_LEN        256 + 32
 
@@ -29,15 +32,21 @@
 #define ERR_REQUEST_FILE   -9
 #define ERR_DB_CONNECT     -10
 #define ERR_DB_EXCUTE      -11
+#define ERR_RES_CHANGED    -13
+#define ERR_DIGEST         -14
+#define ERR_SLOW_SOURCE    -15
 
-#ifdef DEBUG
-#include <stdio.h>
-#define DEBUG_OUTPUT(fmt, str) fprintf(stderr, fmt, str)
+// built with -DCRASH_POINTS, the process is killed by SIGKILL the nth time it
+// passes the point named by EDL_CRASH_AT=name:n, to test resuming after it
+#ifdef CRASH_POINTS
+#define CRASH_POINT_ENV    "EDL_CRASH_AT"
+void crash_point(const char *name);
+#define CRASH_POINT(name)  crash_point(name)
 #else
-#define DEBUG_OUTPUT(fmt, str)
+#define CRASH_POINT(name)
 #endif
 
-typedef enum {HTTP, FTP, UNDEF} protocol_t;
+typedef enum {HTTP, FTP, HTTPS, FTPS, UNDEF} protocol_t;   // FTPS is explicit, AUTH TLS on port 21
 
 typedef struct _download_url
 {
@@ -53,10 +62,40 @@ typedef struct _download_url
 int db_connect(const char *db_file_name, sqlite3 **pkey, const char *sql_create_table);
 void db_close(sqlite3 *db_key);
 int db_execute(sqlite3 *db_key, const char *sql_str, int (*callback)(void*, int, char**, char**));
+int db_ensure_column(sqlite3 *db_key, const char *table, const char *column, const char *type);
+
+/*
+ * Per thread rings of a module, a thread claims one on its first record.
+ * The pool retires idle threads, their rings go to the next new ones, so
+ * the list only ever grows, at its head, and is walked without a lock.
+ * A ring type starts with its thread_ring_t.
+ */
+typedef struct _thread_ring
+{
+	struct _thread_ring *next;
+	int                 idle;       // its thread exited, another may take it
+}thread_ring_t;
+
+typedef struct _thread_rings
+{
+	thread_ring_t   *head;
+	int             size;           // of a ring, zeroed when first made
+	int             key_made;
+	pthread_key_t   key;
+	pthread_mutex_t mutex;
+}thread_rings_t;
+
+#define THREAD_RINGS_INITIALIZER(type)    {NULL, sizeof(type), 0, 0, PTHREAD_MUTEX_INITIALIZER}
+
+void *thread_ring_take(thread_rings_t *rings);
+void *thread_rings_first(thread_rings_t *rings);
 
 int parse_url(const char *url, d_url_t *d_url);
 protocol_t protocol(const char *url);
 int write_n_chars(int fd, const char *buf, int n);
 int read_n_chars(int fd, char *buf, int n);
 int connect_server(const d_url_t *d_url);
+double now_seconds(void);
+int materialize_file(const char *src, const char *dst);
+int materialize_fd(int in, const char *dst);
 #endif